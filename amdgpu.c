@@ -11,6 +11,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -29,30 +30,64 @@
 // clang-format on
 
 #define TILE_TYPE_LINEAR 0
-/* We decide a modifier and then use DRI to manage allocation */
-#define TILE_TYPE_DRI_MODIFIER 1
 /* DRI backend decides tiling in this case. */
 #define TILE_TYPE_DRI 2
 
 /* Height alignement for Encoder/Decoder buffers */
 #define CHROME_HEIGHT_ALIGN 16
 
+/* Number of GTT staging buffers kept around for SDMA readback and writeback of mappings. */
+#define AMDGPU_NUM_STAGING_BOS 16
+/* Staging memory kept around while idle, anything above is freed once released. */
+#define AMDGPU_STAGING_POOL_SIZE (64ull << 20)
+/*
+ * Half of the GPU VA window of a staging slot, and the largest BO copied through staging. The
+ * staging BO stays mapped at the start of the window and the BO being copied is mapped right
+ * after it until the copy is known to be done. The windows are allocated from the VA manager of
+ * libdrm_amdgpu, which other users of the fd such as Mesa allocate from as well.
+ */
+#define AMDGPU_STAGING_VA_SIZE (128ull << 20)
+
+struct amdgpu_staging_bo {
+	uint32_t handle;
+	uint64_t size;
+	void *map;
+	/* Last SDMA submission using this buffer, 0 if known to be idle. */
+	uint64_t fence;
+	/* BO left mapped in the second half of the window by the last copy, 0 if none. */
+	uint32_t copy_handle;
+	uint64_t copy_size;
+	bool in_use;
+};
+
 struct amdgpu_priv {
 	struct dri_driver dri;
 	int drm_version;
 
 	/* sdma */
 	struct drm_amdgpu_info_device dev_info;
+	amdgpu_device_handle sdma_dev;
+	amdgpu_va_handle sdma_va;
 	uint32_t sdma_ctx;
 	uint32_t sdma_cmdbuf_bo;
 	uint64_t sdma_cmdbuf_addr;
 	uint64_t sdma_cmdbuf_size;
 	uint32_t *sdma_cmdbuf_map;
+
+	/* Protects the command buffer ring and the staging buffer pool. */
+	pthread_mutex_t sdma_lock;
+	/* Next free dword in the command buffer, which is used as a ring. */
+	uint32_t sdma_cmdbuf_offset;
+	uint64_t sdma_last_fence;
+	uint64_t staging_va_base;
+	struct amdgpu_staging_bo staging[AMDGPU_NUM_STAGING_BOS];
 };
 
 struct amdgpu_linear_vma_priv {
-	uint32_t handle;
+	struct amdgpu_staging_bo *staging;
 	uint32_t map_flags;
+	/* The staging buffer is yet to be filled, by the deferred invalidate. */
+	bool fetch_pending;
 };
 
 const static uint32_t render_target_formats[] = {
@@ -85,6 +120,8 @@ static int sdma_init(struct amdgpu_priv *priv, int fd)
 	struct drm_amdgpu_gem_va va_args = { 0 };
 	union drm_amdgpu_gem_mmap gem_map = { { 0 } };
 	struct drm_gem_close gem_close = { 0 };
+	uint32_t major, minor;
+	uint64_t va_size;
 	int ret;
 
 	/* Ensure we can make a submission without BO lists. */
@@ -103,20 +140,30 @@ static int sdma_init(struct amdgpu_priv *priv, int fd)
 
 	priv->sdma_ctx = ctx_args.out.alloc.ctx_id;
 
-	priv->sdma_cmdbuf_size = ALIGN(4096, priv->dev_info.virtual_address_alignment);
+	priv->sdma_cmdbuf_size = ALIGN(16384, priv->dev_info.virtual_address_alignment);
+
+	/* The command buffer and the staging windows, away from anything Mesa maps on the fd. */
+	ret = amdgpu_device_initialize(fd, &major, &minor, &priv->sdma_dev);
+	if (ret)
+		goto fail_ctx;
+
+	va_size = priv->sdma_cmdbuf_size + AMDGPU_NUM_STAGING_BOS * 2 * AMDGPU_STAGING_VA_SIZE;
+	ret = amdgpu_va_range_alloc(priv->sdma_dev, amdgpu_gpu_va_range_general, va_size,
+				    priv->dev_info.virtual_address_alignment, 0,
+				    &priv->sdma_cmdbuf_addr, &priv->sdma_va, 0);
+	if (ret)
+		goto fail_dev;
+
 	gem_create.in.bo_size = priv->sdma_cmdbuf_size;
 	gem_create.in.alignment = 4096;
 	gem_create.in.domains = AMDGPU_GEM_DOMAIN_GTT;
 
 	ret = drmCommandWriteRead(fd, DRM_AMDGPU_GEM_CREATE, &gem_create, sizeof(gem_create));
 	if (ret < 0)
-		goto fail_ctx;
+		goto fail_va_range;
 
 	priv->sdma_cmdbuf_bo = gem_create.out.handle;
 
-	priv->sdma_cmdbuf_addr =
-	    ALIGN(priv->dev_info.virtual_address_offset, priv->dev_info.virtual_address_alignment);
-
 	/* Map the buffer into the GPU address space so we can use it from the GPU */
 	va_args.handle = priv->sdma_cmdbuf_bo;
 	va_args.operation = AMDGPU_VA_OP_MAP;
@@ -142,6 +189,9 @@ static int sdma_init(struct amdgpu_priv *priv, int fd)
 		goto fail_va;
 	}
 
+	priv->staging_va_base = priv->sdma_cmdbuf_addr + priv->sdma_cmdbuf_size;
+	pthread_mutex_init(&priv->sdma_lock, NULL);
+
 	return 0;
 fail_va:
 	va_args.operation = AMDGPU_VA_OP_UNMAP;
@@ -150,6 +200,10 @@ fail_va:
 fail_bo:
 	gem_close.handle = priv->sdma_cmdbuf_bo;
 	drmIoctl(fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+fail_va_range:
+	amdgpu_va_range_free(priv->sdma_va);
+fail_dev:
+	amdgpu_device_deinitialize(priv->sdma_dev);
 fail_ctx:
 	memset(&ctx_args, 0, sizeof(ctx_args));
 	ctx_args.in.op = AMDGPU_CTX_OP_FREE_CTX;
@@ -158,6 +212,259 @@ fail_ctx:
 	return ret;
 }
 
+static int sdma_wait(struct amdgpu_priv *priv, int fd, uint64_t fence)
+{
+	union drm_amdgpu_wait_cs wait_cs = { { 0 } };
+	int ret;
+
+	if (!fence)
+		return 0;
+
+	wait_cs.in.handle = fence;
+	wait_cs.in.ip_type = AMDGPU_HW_IP_DMA;
+	wait_cs.in.ctx_id = priv->sdma_ctx;
+	wait_cs.in.timeout = INT64_MAX;
+
+	ret = drmCommandWriteRead(fd, DRM_AMDGPU_WAIT_CS, &wait_cs, sizeof(wait_cs));
+	if (ret) {
+		drv_loge("Could not wait for CS to finish\n");
+		return ret;
+	}
+
+	if (wait_cs.out.status) {
+		drv_loge("Infinite wait timed out, likely GPU hang.\n");
+		return -ENODEV;
+	}
+
+	return 0;
+}
+
+static uint64_t sdma_staging_addr(struct amdgpu_priv *priv, struct amdgpu_staging_bo *staging)
+{
+	return priv->staging_va_base + (staging - priv->staging) * 2 * AMDGPU_STAGING_VA_SIZE;
+}
+
+/*
+ * Unmaps the BO the last copy through staging left in its window, once that copy is done. A BO
+ * closed in the meantime has lost the mapping already, in which case the unmap just fails.
+ */
+static int sdma_staging_unmap_copy(struct amdgpu_priv *priv, int fd,
+				   struct amdgpu_staging_bo *staging)
+{
+	struct drm_amdgpu_gem_va va_args = { 0 };
+	int ret;
+
+	if (!staging->copy_handle)
+		return 0;
+
+	ret = sdma_wait(priv, fd, staging->fence);
+	if (ret)
+		return ret;
+	staging->fence = 0;
+
+	va_args.handle = staging->copy_handle;
+	va_args.operation = AMDGPU_VA_OP_UNMAP;
+	va_args.flags = AMDGPU_VM_DELAY_UPDATE;
+	va_args.va_address = sdma_staging_addr(priv, staging) + AMDGPU_STAGING_VA_SIZE;
+	va_args.map_size = staging->copy_size;
+	drmCommandWrite(fd, DRM_AMDGPU_GEM_VA, &va_args, sizeof(va_args));
+
+	staging->copy_handle = 0;
+	staging->copy_size = 0;
+	return 0;
+}
+
+static void sdma_staging_destroy(struct amdgpu_priv *priv, int fd,
+				 struct amdgpu_staging_bo *staging)
+{
+	struct drm_amdgpu_gem_va va_args = { 0 };
+	struct drm_gem_close gem_close = { 0 };
+
+	if (!staging->handle)
+		return;
+
+	/* Copies still in flight read or write through the window. */
+	sdma_wait(priv, fd, staging->fence);
+	sdma_staging_unmap_copy(priv, fd, staging);
+	munmap(staging->map, staging->size);
+
+	va_args.handle = staging->handle;
+	va_args.operation = AMDGPU_VA_OP_UNMAP;
+	va_args.va_address = sdma_staging_addr(priv, staging);
+	va_args.map_size = staging->size;
+	drmCommandWrite(fd, DRM_AMDGPU_GEM_VA, &va_args, sizeof(va_args));
+
+	gem_close.handle = staging->handle;
+	drmIoctl(fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+
+	staging->handle = 0;
+	staging->size = 0;
+	staging->map = NULL;
+	staging->fence = 0;
+}
+
+static int sdma_staging_create(struct amdgpu_priv *priv, int fd, struct amdgpu_staging_bo *staging,
+			       uint64_t size, uint32_t page_size)
+{
+	union drm_amdgpu_gem_create gem_create = { { 0 } };
+	struct drm_amdgpu_gem_va va_args = { 0 };
+	union drm_amdgpu_gem_mmap gem_map = { { 0 } };
+	struct drm_gem_close gem_close = { 0 };
+	void *addr;
+	int ret;
+
+	size = ALIGN(size, (uint64_t)MAX(priv->dev_info.virtual_address_alignment, page_size));
+	if (size > AMDGPU_STAGING_VA_SIZE)
+		return -ENOMEM;
+
+	gem_create.in.bo_size = size;
+	gem_create.in.alignment = page_size ? page_size : 4096;
+	gem_create.in.domains = AMDGPU_GEM_DOMAIN_GTT;
+
+	ret = drmCommandWriteRead(fd, DRM_AMDGPU_GEM_CREATE, &gem_create, sizeof(gem_create));
+	if (ret < 0) {
+		drv_loge("GEM create failed\n");
+		return ret;
+	}
+
+	va_args.handle = gem_create.out.handle;
+	va_args.operation = AMDGPU_VA_OP_MAP;
+	va_args.flags = AMDGPU_VM_PAGE_READABLE | AMDGPU_VM_PAGE_WRITEABLE;
+	va_args.va_address = sdma_staging_addr(priv, staging);
+	va_args.map_size = size;
+
+	ret = drmCommandWrite(fd, DRM_AMDGPU_GEM_VA, &va_args, sizeof(va_args));
+	if (ret)
+		goto fail_bo;
+
+	gem_map.in.handle = gem_create.out.handle;
+	ret = drmIoctl(fd, DRM_IOCTL_AMDGPU_GEM_MMAP, &gem_map);
+	if (ret)
+		goto fail_va;
+
+	addr = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, gem_map.out.addr_ptr);
+	if (addr == MAP_FAILED) {
+		ret = -ENOMEM;
+		goto fail_va;
+	}
+
+	staging->handle = gem_create.out.handle;
+	staging->size = size;
+	staging->map = addr;
+	staging->fence = 0;
+	return 0;
+
+fail_va:
+	va_args.operation = AMDGPU_VA_OP_UNMAP;
+	va_args.flags = 0;
+	drmCommandWrite(fd, DRM_AMDGPU_GEM_VA, &va_args, sizeof(va_args));
+fail_bo:
+	gem_close.handle = gem_create.out.handle;
+	drmIoctl(fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+	return ret;
+}
+
+/*
+ * Takes an idle staging buffer of at least |size| bytes out of the pool, growing one if
+ * needed, to |page_size| pages if not 0. Returns NULL when every slot is busy, in which case
+ * the caller maps the BO directly.
+ */
+static struct amdgpu_staging_bo *sdma_get_staging(struct amdgpu_priv *priv, int fd,
+						  uint64_t size, uint32_t page_size)
+{
+	struct amdgpu_staging_bo *fit = NULL;
+	struct amdgpu_staging_bo *spare = NULL;
+	struct amdgpu_staging_bo *staging;
+
+	pthread_mutex_lock(&priv->sdma_lock);
+	for (uint32_t i = 0; i < AMDGPU_NUM_STAGING_BOS; i++) {
+		struct amdgpu_staging_bo *cur = &priv->staging[i];
+
+		if (cur->in_use)
+			continue;
+
+		if (cur->size >= size) {
+			if (!fit || cur->size < fit->size)
+				fit = cur;
+		} else if (!spare || cur->size < spare->size) {
+			spare = cur;
+		}
+	}
+
+	staging = fit ? fit : spare;
+	if (staging)
+		staging->in_use = true;
+	pthread_mutex_unlock(&priv->sdma_lock);
+
+	if (!staging)
+		return NULL;
+
+	/* A writeback from a previous mapping may still be reading from the buffer. */
+	if (sdma_wait(priv, fd, staging->fence))
+		goto fail;
+	staging->fence = 0;
+
+	if (staging->size < size) {
+		sdma_staging_destroy(priv, fd, staging);
+		if (sdma_staging_create(priv, fd, staging, size, page_size))
+			goto fail;
+	}
+
+	return staging;
+
+fail:
+	pthread_mutex_lock(&priv->sdma_lock);
+	staging->in_use = false;
+	pthread_mutex_unlock(&priv->sdma_lock);
+	return NULL;
+}
+
+static void sdma_put_staging(struct amdgpu_priv *priv, int fd, struct amdgpu_staging_bo *staging)
+{
+	uint64_t idle_size = staging->size;
+
+	pthread_mutex_lock(&priv->sdma_lock);
+	for (uint32_t i = 0; i < AMDGPU_NUM_STAGING_BOS; i++) {
+		if (!priv->staging[i].in_use)
+			idle_size += priv->staging[i].size;
+	}
+
+	if (idle_size <= AMDGPU_STAGING_POOL_SIZE) {
+		staging->in_use = false;
+		pthread_mutex_unlock(&priv->sdma_lock);
+		return;
+	}
+	pthread_mutex_unlock(&priv->sdma_lock);
+
+	sdma_staging_destroy(priv, fd, staging);
+
+	pthread_mutex_lock(&priv->sdma_lock);
+	staging->in_use = false;
+	pthread_mutex_unlock(&priv->sdma_lock);
+}
+
+/* Frees the idle staging buffers. */
+static void sdma_trim_staging(struct amdgpu_priv *priv, int fd)
+{
+	for (uint32_t i = 0; i < AMDGPU_NUM_STAGING_BOS; i++) {
+		struct amdgpu_staging_bo *staging = &priv->staging[i];
+
+		pthread_mutex_lock(&priv->sdma_lock);
+		if (staging->in_use || !staging->handle) {
+			pthread_mutex_unlock(&priv->sdma_lock);
+			continue;
+		}
+		staging->in_use = true;
+		pthread_mutex_unlock(&priv->sdma_lock);
+
+		sdma_staging_destroy(priv, fd, staging);
+
+		pthread_mutex_lock(&priv->sdma_lock);
+		staging->in_use = false;
+		pthread_mutex_unlock(&priv->sdma_lock);
+	}
+}
+
 static void sdma_finish(struct amdgpu_priv *priv, int fd)
 {
 	union drm_amdgpu_ctx ctx_args = { { 0 } };
@@ -167,6 +474,11 @@ static void sdma_finish(struct amdgpu_priv *priv, int fd)
 	if (!priv->sdma_cmdbuf_map)
 		return;
 
+	sdma_wait(priv, fd, priv->sdma_last_fence);
+	for (uint32_t i = 0; i < AMDGPU_NUM_STAGING_BOS; i++)
+		sdma_staging_destroy(priv, fd, &priv->staging[i]);
+	pthread_mutex_destroy(&priv->sdma_lock);
+
 	va_args.handle = priv->sdma_cmdbuf_bo;
 	va_args.operation = AMDGPU_VA_OP_UNMAP;
 	va_args.flags = 0;
@@ -178,76 +490,111 @@ static void sdma_finish(struct amdgpu_priv *priv, int fd)
 	gem_close.handle = priv->sdma_cmdbuf_bo;
 	drmIoctl(fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
 
+	amdgpu_va_range_free(priv->sdma_va);
+	amdgpu_device_deinitialize(priv->sdma_dev);
+
 	ctx_args.in.op = AMDGPU_CTX_OP_FREE_CTX;
 	ctx_args.in.ctx_id = priv->sdma_ctx;
 	drmCommandWriteRead(fd, DRM_AMDGPU_CTX, &ctx_args, sizeof(ctx_args));
 }
 
-static int sdma_copy(struct amdgpu_priv *priv, int fd, uint32_t src_handle, uint32_t dst_handle,
-		     uint64_t size)
+/*
+ * Copies |ranges| of the |size| byte BO |bo_handle| from or to the same offsets in |staging|,
+ * using at least one SDMA command per range. Copies are appended to the command
+ * buffer ring and submitted without waiting; only readbacks wait for their submission, since
+ * the CPU is about to look at the data. Writebacks are ordered against later users of the BO
+ * by the kernel's implicit synchronization.
+ */
+static int sdma_copy(struct amdgpu_priv *priv, int fd, struct amdgpu_staging_bo *staging,
+		     uint32_t bo_handle, uint64_t size, const struct drv_range *ranges,
+		     uint32_t num_ranges, bool readback)
 {
 	const uint64_t max_size_per_cmd = 0x3fff00;
-	const uint32_t cmd_size = 7 * sizeof(uint32_t); /* 7 dwords, see loop below. */
-	const uint64_t max_commands = priv->sdma_cmdbuf_size / cmd_size;
-	uint64_t src_addr = priv->sdma_cmdbuf_addr + priv->sdma_cmdbuf_size;
-	uint64_t dst_addr = src_addr + size;
+	const uint32_t cmd_dwords = 7; /* 7 dwords, see loop below. */
+	const uint32_t cmdbuf_dwords = priv->sdma_cmdbuf_size / sizeof(uint32_t);
+	uint64_t staging_addr = sdma_staging_addr(priv, staging);
+	uint64_t bo_addr = staging_addr + AMDGPU_STAGING_VA_SIZE;
+	uint64_t src_addr = readback ? bo_addr : staging_addr;
+	uint64_t dst_addr = readback ? staging_addr : bo_addr;
 	struct drm_amdgpu_gem_va va_args = { 0 };
+	uint32_t *cmdbuf;
 	unsigned cmd = 0;
-	uint64_t remaining_size = size;
-	uint64_t cur_src_addr = src_addr;
-	uint64_t cur_dst_addr = dst_addr;
 	struct drm_amdgpu_cs_chunk_ib ib = { 0 };
 	struct drm_amdgpu_cs_chunk chunks[2] = { { 0 } };
 	uint64_t chunk_ptrs[2];
 	union drm_amdgpu_cs cs = { { 0 } };
 	struct drm_amdgpu_bo_list_in bo_list = { 0 };
 	struct drm_amdgpu_bo_list_entry bo_list_entries[3] = { { 0 } };
-	union drm_amdgpu_wait_cs wait_cs = { { 0 } };
+	uint64_t num_dwords = 0;
+	uint64_t fence = 0;
 	int ret = 0;
 
-	if (size > UINT64_MAX - max_size_per_cmd ||
-	    DIV_ROUND_UP(size, max_size_per_cmd) > max_commands)
+	if (size > staging->size)
 		return -ENOMEM;
 
-	/* Map both buffers into the GPU address space so we can access them from the GPU. */
-	va_args.handle = src_handle;
-	va_args.operation = AMDGPU_VA_OP_MAP;
-	va_args.flags = AMDGPU_VM_PAGE_READABLE | AMDGPU_VM_DELAY_UPDATE;
-	va_args.va_address = src_addr;
-	va_args.map_size = size;
+	for (uint32_t i = 0; i < num_ranges; i++)
+		num_dwords += DIV_ROUND_UP(ranges[i].size, max_size_per_cmd) * cmd_dwords;
 
-	ret = drmCommandWrite(fd, DRM_AMDGPU_GEM_VA, &va_args, sizeof(va_args));
+	if (!num_dwords)
+		return 0;
+	if (num_dwords > cmdbuf_dwords || size > AMDGPU_STAGING_VA_SIZE)
+		return -ENOMEM;
+
+	/* The slot is ours, so the previous BO in its window can be waited for without the lock. */
+	ret = sdma_staging_unmap_copy(priv, fd, staging);
 	if (ret)
 		return ret;
 
-	va_args.handle = dst_handle;
-	va_args.flags = AMDGPU_VM_PAGE_READABLE | AMDGPU_VM_PAGE_WRITEABLE | AMDGPU_VM_DELAY_UPDATE;
-	va_args.va_address = dst_addr;
-
-	ret = drmCommandWrite(fd, DRM_AMDGPU_GEM_VA, &va_args, sizeof(va_args));
-	if (ret)
-		goto unmap_src;
+	pthread_mutex_lock(&priv->sdma_lock);
 
-	while (remaining_size) {
-		uint64_t cur_size = remaining_size;
-		if (cur_size > max_size_per_cmd)
-			cur_size = max_size_per_cmd;
+	/* Wrap around once every copy still referencing the start of the ring has retired. */
+	if (priv->sdma_cmdbuf_offset + num_dwords > cmdbuf_dwords) {
+		ret = sdma_wait(priv, fd, priv->sdma_last_fence);
+		if (ret)
+			goto unlock;
+		priv->sdma_cmdbuf_offset = 0;
+	}
 
-		priv->sdma_cmdbuf_map[cmd++] = 0x01; /* linear copy */
-		priv->sdma_cmdbuf_map[cmd++] =
-		    priv->dev_info.family >= AMDGPU_FAMILY_AI ? (cur_size - 1) : cur_size;
-		priv->sdma_cmdbuf_map[cmd++] = 0;
-		priv->sdma_cmdbuf_map[cmd++] = cur_src_addr;
-		priv->sdma_cmdbuf_map[cmd++] = cur_src_addr >> 32;
-		priv->sdma_cmdbuf_map[cmd++] = cur_dst_addr;
-		priv->sdma_cmdbuf_map[cmd++] = cur_dst_addr >> 32;
+	/* Map the BO into its slot's VA window so we can access it from the GPU. */
+	va_args.handle = bo_handle;
+	va_args.operation = AMDGPU_VA_OP_MAP;
+	va_args.flags = AMDGPU_VM_PAGE_READABLE | AMDGPU_VM_DELAY_UPDATE;
+	if (!readback)
+		va_args.flags |= AMDGPU_VM_PAGE_WRITEABLE;
+	va_args.va_address = bo_addr;
+	va_args.map_size = size;
 
-		remaining_size -= cur_size;
-		cur_src_addr += cur_size;
-		cur_dst_addr += cur_size;
+	ret = drmCommandWrite(fd, DRM_AMDGPU_GEM_VA, &va_args, sizeof(va_args));
+	if (ret)
+		goto unlock;
+
+	cmdbuf = priv->sdma_cmdbuf_map + priv->sdma_cmdbuf_offset;
+	for (uint32_t i = 0; i < num_ranges; i++) {
+		uint64_t remaining_size = ranges[i].size;
+		uint64_t cur_src_addr = src_addr + ranges[i].offset;
+		uint64_t cur_dst_addr = dst_addr + ranges[i].offset;
+
+		while (remaining_size) {
+			uint64_t cur_size = remaining_size;
+			if (cur_size > max_size_per_cmd)
+				cur_size = max_size_per_cmd;
+
+			cmdbuf[cmd++] = 0x01; /* linear copy */
+			cmdbuf[cmd++] =
+			    priv->dev_info.family >= AMDGPU_FAMILY_AI ? (cur_size - 1) : cur_size;
+			cmdbuf[cmd++] = 0;
+			cmdbuf[cmd++] = cur_src_addr;
+			cmdbuf[cmd++] = cur_src_addr >> 32;
+			cmdbuf[cmd++] = cur_dst_addr;
+			cmdbuf[cmd++] = cur_dst_addr >> 32;
+
+			remaining_size -= cur_size;
+			cur_src_addr += cur_size;
+			cur_dst_addr += cur_size;
+		}
 	}
 
-	ib.va_start = priv->sdma_cmdbuf_addr;
+	ib.va_start = priv->sdma_cmdbuf_addr + priv->sdma_cmdbuf_offset * sizeof(uint32_t);
 	ib.ib_bytes = cmd * 4;
 	ib.ip_type = AMDGPU_HW_IP_DMA;
 
@@ -257,9 +604,9 @@ static int sdma_copy(struct amdgpu_priv *priv, int fd, uint32_t src_handle, uint
 
 	bo_list_entries[0].bo_handle = priv->sdma_cmdbuf_bo;
 	bo_list_entries[0].bo_priority = 8; /* Middle of range, like RADV. */
-	bo_list_entries[1].bo_handle = src_handle;
+	bo_list_entries[1].bo_handle = staging->handle;
 	bo_list_entries[1].bo_priority = 8;
-	bo_list_entries[2].bo_handle = dst_handle;
+	bo_list_entries[2].bo_handle = bo_handle;
 	bo_list_entries[2].bo_priority = 8;
 
 	bo_list.bo_number = 3;
@@ -280,35 +627,32 @@ static int sdma_copy(struct amdgpu_priv *priv, int fd, uint32_t src_handle, uint
 	ret = drmCommandWriteRead(fd, DRM_AMDGPU_CS, &cs, sizeof(cs));
 	if (ret) {
 		drv_loge("SDMA copy command buffer submission failed %d\n", ret);
-		goto unmap_dst;
+		goto unmap;
 	}
 
-	wait_cs.in.handle = cs.out.handle;
-	wait_cs.in.ip_type = AMDGPU_HW_IP_DMA;
-	wait_cs.in.ctx_id = priv->sdma_ctx;
-	wait_cs.in.timeout = INT64_MAX;
+	fence = cs.out.handle;
+	staging->fence = fence;
+	priv->sdma_last_fence = fence;
+	/* SDMA IBs have to start on a 32 byte boundary. */
+	priv->sdma_cmdbuf_offset = ALIGN(priv->sdma_cmdbuf_offset + cmd, 8);
 
-	ret = drmCommandWriteRead(fd, DRM_AMDGPU_WAIT_CS, &wait_cs, sizeof(wait_cs));
-	if (ret) {
-		drv_loge("Could not wait for CS to finish\n");
-	} else if (wait_cs.out.status) {
-		drv_loge("Infinite wait timed out, likely GPU hang.\n");
-		ret = -ENODEV;
-	}
+	/* The copy may still be running, the BO is unmapped once it is known to be done. */
+	staging->copy_handle = bo_handle;
+	staging->copy_size = size;
+	goto unlock;
 
-unmap_dst:
-	va_args.handle = dst_handle;
+unmap:
 	va_args.operation = AMDGPU_VA_OP_UNMAP;
 	va_args.flags = AMDGPU_VM_DELAY_UPDATE;
-	va_args.va_address = dst_addr;
 	drmCommandWrite(fd, DRM_AMDGPU_GEM_VA, &va_args, sizeof(va_args));
+unlock:
+	pthread_mutex_unlock(&priv->sdma_lock);
 
-unmap_src:
-	va_args.handle = src_handle;
-	va_args.operation = AMDGPU_VA_OP_UNMAP;
-	va_args.flags = AMDGPU_VM_DELAY_UPDATE;
-	va_args.va_address = src_addr;
-	drmCommandWrite(fd, DRM_AMDGPU_GEM_VA, &va_args, sizeof(va_args));
+	if (!ret && readback) {
+		ret = sdma_wait(priv, fd, fence);
+		if (!ret)
+			staging->fence = 0;
+	}
 
 	return ret;
 }
@@ -346,15 +690,16 @@ static bool is_modifier_scanout_capable(struct amdgpu_priv *priv, uint32_t forma
 	return true;
 }
 
+/* Set in long-lived allocator services, which pay for the DRI driver once at startup. */
+static void *amdgpu_preload_handle;
+
 static void amdgpu_preload(bool load)
 {
-	static void *handle;
-
-	if (load && !handle)
-		handle = dri_dlopen(DRI_PATH);
-	else if (!load && handle) {
-		dri_dlclose(handle);
-		handle = NULL;
+	if (load && !amdgpu_preload_handle)
+		amdgpu_preload_handle = dri_dlopen(DRI_PATH);
+	else if (!load && amdgpu_preload_handle) {
+		dri_dlclose(amdgpu_preload_handle);
+		amdgpu_preload_handle = NULL;
 	}
 }
 
@@ -364,6 +709,7 @@ static int amdgpu_init(struct driver *drv)
 	drmVersionPtr drm_version;
 	struct format_metadata metadata;
 	uint64_t use_flags = BO_USE_RENDER_MASK;
+	int ret;
 
 	priv = calloc(1, sizeof(struct amdgpu_priv));
 	if (!priv)
@@ -385,7 +731,18 @@ static int amdgpu_init(struct driver *drv)
 		drv->priv = NULL;
 		return -ENODEV;
 	}
-	if (dri_init(drv, DRI_PATH, "radeonsi")) {
+
+	/*
+	 * Creating the radeonsi screen costs tens of milliseconds and several MB, which processes
+	 * that only import or allocate linear buffers shouldn't pay. Unless the driver was
+	 * preloaded, the screen is created by the first DRI allocation or import instead.
+	 */
+	if (amdgpu_preload_handle)
+		ret = dri_init(drv, DRI_PATH, "radeonsi");
+	else
+		ret = dri_init_lazy(drv, DRI_PATH, "radeonsi");
+
+	if (ret) {
 		free(priv);
 		drv->priv = NULL;
 		return -ENODEV;
@@ -457,51 +814,33 @@ static int amdgpu_init(struct driver *drv)
 
 	metadata.priority = 2;
 
+	/*
+	 * The table doesn't depend on whether DRI is loaded yet: the tiled modifiers are only
+	 * asked for by the first allocation, see amdgpu_create_bo_dri().
+	 */
+	metadata.tiling = TILE_TYPE_DRI;
+	metadata.modifier = DRM_FORMAT_MOD_INVALID;
 	for (unsigned f = 0; f < ARRAY_SIZE(render_target_formats); ++f) {
 		uint32_t format = render_target_formats[f];
-		int mod_cnt;
-		if (dri_query_modifiers(drv, format, 0, NULL, &mod_cnt) && mod_cnt) {
-			uint64_t *modifiers = calloc(mod_cnt, sizeof(uint64_t));
-			dri_query_modifiers(drv, format, mod_cnt, modifiers, &mod_cnt);
-			metadata.tiling = TILE_TYPE_DRI_MODIFIER;
-			for (int i = 0; i < mod_cnt; ++i) {
-				bool scanout =
-				    is_modifier_scanout_capable(drv->priv, format, modifiers[i]);
-
-				/* LINEAR will be handled using the LINEAR metadata. */
-				if (modifiers[i] == DRM_FORMAT_MOD_LINEAR)
-					continue;
-
-				/* The virtgpu minigbm can't handle auxiliary planes in the host. */
-				if (dri_num_planes_from_modifier(drv, format, modifiers[i]) !=
-				    drv_num_planes_from_format(format))
-					continue;
-
-				metadata.modifier = modifiers[i];
-				drv_add_combination(drv, format, &metadata,
-						    use_flags | (scanout ? BO_USE_SCANOUT : 0));
-			}
-			free(modifiers);
-		} else {
-			bool scanout = false;
-			switch (format) {
-			case DRM_FORMAT_ARGB8888:
-			case DRM_FORMAT_XRGB8888:
-			case DRM_FORMAT_ABGR8888:
-			case DRM_FORMAT_XBGR8888:
-			case DRM_FORMAT_ABGR2101010:
-			case DRM_FORMAT_ARGB2101010:
-			case DRM_FORMAT_XBGR2101010:
-			case DRM_FORMAT_XRGB2101010:
-				scanout = true;
-				break;
-			default:
-				break;
-			}
-			metadata.tiling = TILE_TYPE_DRI;
-			drv_add_combination(drv, format, &metadata,
-					    use_flags | (scanout ? BO_USE_SCANOUT : 0));
+		bool scanout = false;
+
+		switch (format) {
+		case DRM_FORMAT_ARGB8888:
+		case DRM_FORMAT_XRGB8888:
+		case DRM_FORMAT_ABGR8888:
+		case DRM_FORMAT_XBGR8888:
+		case DRM_FORMAT_ABGR2101010:
+		case DRM_FORMAT_ARGB2101010:
+		case DRM_FORMAT_XBGR2101010:
+		case DRM_FORMAT_XRGB2101010:
+			scanout = true;
+			break;
+		default:
+			break;
 		}
+
+		drv_add_combination(drv, format, &metadata,
+				    use_flags | (scanout ? BO_USE_SCANOUT : 0));
 	}
 	return 0;
 }
@@ -514,6 +853,28 @@ static void amdgpu_close(struct driver *drv)
 	drv->priv = NULL;
 }
 
+static void amdgpu_get_memory_info(struct driver *drv, struct drv_memory_info *info)
+{
+	struct amdgpu_priv *priv = drv->priv;
+
+	if (!priv->sdma_cmdbuf_map)
+		return;
+
+	pthread_mutex_lock(&priv->sdma_lock);
+	for (uint32_t i = 0; i < AMDGPU_NUM_STAGING_BOS; i++)
+		info->bytes[DRV_MEMORY_STAGING] += priv->staging[i].size;
+	pthread_mutex_unlock(&priv->sdma_lock);
+}
+
+static void amdgpu_trim(struct driver *drv, enum drv_trim_level level)
+{
+	struct amdgpu_priv *priv = drv->priv;
+
+	/* The staging buffers are reallocated on the next mapping, only give them up for good. */
+	if (level == DRV_TRIM_COMPLETE && priv->sdma_cmdbuf_map)
+		sdma_trim_staging(priv, drv_get_fd(drv));
+}
+
 static int amdgpu_create_bo_linear(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
 				   uint64_t use_flags)
 {
@@ -521,6 +882,7 @@ static int amdgpu_create_bo_linear(struct bo *bo, uint32_t width, uint32_t heigh
 	bool need_align = false;
 	uint32_t stride_align = 1;
 	uint32_t stride;
+	uint64_t page_size, va_alignment;
 	union drm_amdgpu_gem_create gem_create = { { 0 } };
 	struct amdgpu_priv *priv = bo->drv->priv;
 
@@ -583,9 +945,12 @@ static int amdgpu_create_bo_linear(struct bo *bo, uint32_t width, uint32_t heigh
 
 	drv_bo_from_format(bo, stride, stride_align, height, format);
 
-	gem_create.in.bo_size =
-	    ALIGN(bo->meta.total_size, priv->dev_info.virtual_address_alignment);
-	gem_create.in.alignment = 256;
+	/* The placement alignment is what lets the kernel back the BO with large pages. */
+	page_size = drv_large_page_size(bo->drv, bo->meta.total_size);
+	va_alignment = priv->dev_info.virtual_address_alignment;
+	gem_create.in.bo_size = ALIGN(bo->meta.total_size, MAX(va_alignment, page_size));
+	gem_create.in.alignment = page_size ? page_size : 256;
+	bo->large_page_padding = gem_create.in.bo_size - ALIGN(bo->meta.total_size, va_alignment);
 	gem_create.in.domain_flags = 0;
 
 	if (use_flags & (BO_USE_LINEAR | BO_USE_SW_MASK))
@@ -616,28 +981,115 @@ static int amdgpu_create_bo_linear(struct bo *bo, uint32_t width, uint32_t heigh
 	return 0;
 }
 
+/*
+ * The DRI driver picks the modifier itself, so it is only handed the ones the modifier policy
+ * scores best, if that leaves any.
+ */
+static int amdgpu_create_bo_with_policy(struct bo *bo, uint32_t width, uint32_t height,
+					uint32_t format, uint64_t use_flags,
+					const uint64_t *modifiers, uint32_t count)
+{
+	uint64_t *best;
+	uint32_t num_best = 0;
+	int64_t best_score = 0, score;
+	int ret;
+
+	best = malloc(count * sizeof(*best));
+	if (!best)
+		return -ENOMEM;
+
+	for (uint32_t i = 0; i < count; i++) {
+		if (!drv_modifier_policy_score(bo->drv, format, use_flags, modifiers[i], &score))
+			continue;
+
+		if (num_best && score > best_score)
+			continue;
+
+		if (!num_best || score < best_score)
+			num_best = 0;
+
+		best[num_best++] = modifiers[i];
+		best_score = score;
+	}
+
+	if (num_best)
+		ret = dri_bo_create_with_modifiers(bo, width, height, format, best, num_best);
+	else
+		ret = dri_bo_create_with_modifiers(bo, width, height, format, modifiers, count);
+
+	free(best);
+	return ret;
+}
+
+/*
+ * Allocates a tiled BO, from the modifiers DRI offers for the format less linear, those with
+ * auxiliary planes, which the virtgpu host can't handle, and for scanout those the display can't
+ * scan out. Without any, DRI picks the layout from the use flags.
+ */
+static int amdgpu_create_bo_dri(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
+				uint64_t use_flags)
+{
+	struct amdgpu_priv *priv = bo->drv->priv;
+	uint64_t *modifiers = NULL;
+	uint32_t count = 0;
+	int mod_cnt = 0;
+	int ret;
+
+	if (dri_query_modifiers(bo->drv, format, 0, NULL, &mod_cnt) && mod_cnt) {
+		modifiers = calloc(mod_cnt, sizeof(*modifiers));
+		if (!modifiers)
+			return -ENOMEM;
+
+		dri_query_modifiers(bo->drv, format, mod_cnt, modifiers, &mod_cnt);
+		for (int i = 0; i < mod_cnt; i++) {
+			if (modifiers[i] == DRM_FORMAT_MOD_LINEAR)
+				continue;
+
+			if (dri_num_planes_from_modifier(bo->drv, format, modifiers[i]) !=
+			    drv_num_planes_from_format(format))
+				continue;
+
+			if ((use_flags & BO_USE_SCANOUT) &&
+			    !is_modifier_scanout_capable(priv, format, modifiers[i]))
+				continue;
+
+			modifiers[count++] = modifiers[i];
+		}
+	}
+
+	if (count) {
+		if (bo->drv->modifier_rules)
+			ret = amdgpu_create_bo_with_policy(bo, width, height, format, use_flags,
+							   modifiers, count);
+		else
+			ret = dri_bo_create_with_modifiers(bo, width, height, format, modifiers,
+							   count);
+		free(modifiers);
+		return ret;
+	}
+
+	free(modifiers);
+
+	// See b/122049612
+	if (use_flags & (BO_USE_SCANOUT) && priv->dev_info.family == AMDGPU_FAMILY_CZ) {
+		uint32_t bytes_per_pixel = drv_bytes_per_pixel_from_format(format, 0);
+		width = ALIGN(width, 256 / bytes_per_pixel);
+	}
+
+	return dri_bo_create(bo, width, height, format, use_flags);
+}
+
 static int amdgpu_create_bo(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
 			    uint64_t use_flags)
 {
 	struct combination *combo;
-	struct amdgpu_priv *priv = bo->drv->priv;
 
 	combo = drv_get_combination(bo->drv, format, use_flags);
 	if (!combo)
 		return -EINVAL;
 
-	if (combo->metadata.tiling == TILE_TYPE_DRI) {
-		// See b/122049612
-		if (use_flags & (BO_USE_SCANOUT) && priv->dev_info.family == AMDGPU_FAMILY_CZ) {
-			uint32_t bytes_per_pixel = drv_bytes_per_pixel_from_format(format, 0);
-			width = ALIGN(width, 256 / bytes_per_pixel);
-		}
-
-		return dri_bo_create(bo, width, height, format, use_flags);
-	} else if (combo->metadata.tiling == TILE_TYPE_DRI_MODIFIER) {
-		return dri_bo_create_with_modifiers(bo, width, height, format,
-						    &combo->metadata.modifier, 1);
-	}
+	if (combo->metadata.tiling == TILE_TYPE_DRI)
+		return amdgpu_create_bo_dri(bo, width, height, format, use_flags);
 
 	return amdgpu_create_bo_linear(bo, width, height, format, use_flags);
 }
@@ -655,6 +1107,10 @@ static int amdgpu_create_bo_with_modifiers(struct bo *bo, uint32_t width, uint32
 	if (only_use_linear)
 		return amdgpu_create_bo_linear(bo, width, height, format, BO_USE_SCANOUT);
 
+	if (bo->drv->modifier_rules)
+		return amdgpu_create_bo_with_policy(bo, width, height, format, bo->meta.use_flags,
+						    modifiers, count);
+
 	return dri_bo_create_with_modifiers(bo, width, height, format, modifiers, count);
 }
 
@@ -697,7 +1153,6 @@ static int amdgpu_destroy_bo(struct bo *bo)
 
 static void *amdgpu_map_bo(struct bo *bo, struct vma *vma, uint32_t map_flags)
 {
-	void *addr = MAP_FAILED;
 	int ret;
 	union drm_amdgpu_gem_mmap gem_map = { { 0 } };
 	struct drm_amdgpu_gem_create_in bo_info = { 0 };
@@ -722,86 +1177,109 @@ static void *amdgpu_map_bo(struct bo *bo, struct vma *vma, uint32_t map_flags)
 
 	if (((bo_info.domains & AMDGPU_GEM_DOMAIN_VRAM) ||
 	     (bo_info.domain_flags & AMDGPU_GEM_CREATE_CPU_GTT_USWC)) &&
-	    drv_priv->sdma_cmdbuf_map) {
-		union drm_amdgpu_gem_create gem_create = { { 0 } };
-
-		priv = calloc(1, sizeof(struct amdgpu_linear_vma_priv));
-		if (!priv)
-			return MAP_FAILED;
+	    drv_priv->sdma_cmdbuf_map && bo_info.bo_size <= AMDGPU_STAGING_VA_SIZE) {
+		struct amdgpu_staging_bo *staging;
+
+		/* With every staging buffer busy, fall back to mapping the BO directly. */
+		staging = sdma_get_staging(drv_priv, bo->drv->fd, bo_info.bo_size,
+					   drv_large_page_size(bo->drv, bo_info.bo_size));
+		if (staging) {
+			priv = calloc(1, sizeof(struct amdgpu_linear_vma_priv));
+			if (!priv) {
+				sdma_put_staging(drv_priv, bo->drv->fd, staging);
+				return MAP_FAILED;
+			}
 
-		gem_create.in.bo_size = bo_info.bo_size;
-		gem_create.in.alignment = 4096;
-		gem_create.in.domains = AMDGPU_GEM_DOMAIN_GTT;
+			priv->staging = staging;
+			priv->map_flags = map_flags;
+			/* Only the rows of the mapped rectangle are copied in either direction. */
+			vma->partial = true;
+
+			/*
+			 * The writeback copies whole rows, so the pixels beside a narrower
+			 * rectangle have to be fetched even when its own contents are discarded.
+			 */
+			if (vma->rect.x || vma->rect.width < bo->meta.width)
+				map_flags &= ~BO_MAP_DISCARD;
+
+			if (map_flags & BO_MAP_DEFER_INVALIDATE) {
+				priv->fetch_pending = !(map_flags & BO_MAP_DISCARD);
+			} else if (!(map_flags & BO_MAP_DISCARD)) {
+				struct drv_range ranges[DRV_MAX_PLANES];
+				uint32_t num_ranges = drv_bo_rect_ranges(bo, &vma->rect, ranges);
+
+				drv_trace_begin("amdgpu sdma_copy", bo);
+				ret = sdma_copy(drv_priv, bo->drv->fd, staging, bo->handle.u32,
+						bo_info.bo_size, ranges, num_ranges, true);
+				drv_trace_end();
+				drv_stats_add(bo->drv, DRV_STATS_SDMA_COPIES, 1);
+			}
+			if (ret) {
+				drv_loge("SDMA copy for read failed\n");
+				sdma_put_staging(drv_priv, bo->drv->fd, staging);
+				free(priv);
+				return MAP_FAILED;
+			}
 
-		ret = drmCommandWriteRead(bo->drv->fd, DRM_AMDGPU_GEM_CREATE, &gem_create,
-					  sizeof(gem_create));
-		if (ret < 0) {
-			drv_loge("GEM create failed\n");
-			free(priv);
-			return MAP_FAILED;
+			vma->priv = priv;
+			return staging->map;
 		}
+	}
 
-		priv->map_flags = map_flags;
-		handle = priv->handle = gem_create.out.handle;
+	/* A writeback through staging may still be in flight, CPU maps don't wait for it. */
+	if (drv_priv->sdma_cmdbuf_map) {
+		uint64_t fence;
 
-		ret = sdma_copy(bo->drv->priv, bo->drv->fd, bo->handle.u32, priv->handle,
-				bo_info.bo_size);
-		if (ret) {
-			drv_loge("SDMA copy for read failed\n");
-			goto fail;
-		}
+		pthread_mutex_lock(&drv_priv->sdma_lock);
+		fence = drv_priv->sdma_last_fence;
+		pthread_mutex_unlock(&drv_priv->sdma_lock);
+
+		ret = sdma_wait(drv_priv, bo->drv->fd, fence);
+		if (ret)
+			return MAP_FAILED;
 	}
 
 	gem_map.in.handle = handle;
 	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_AMDGPU_GEM_MMAP, &gem_map);
 	if (ret) {
 		drv_loge("DRM_IOCTL_AMDGPU_GEM_MMAP failed\n");
-		goto fail;
+		return MAP_FAILED;
 	}
 
-	addr = mmap(0, bo->meta.total_size, drv_get_prot(map_flags), MAP_SHARED, bo->drv->fd,
-		    gem_map.out.addr_ptr);
-	if (addr == MAP_FAILED)
-		goto fail;
-
-	vma->priv = priv;
-	return addr;
-
-fail:
-	if (priv) {
-		struct drm_gem_close gem_close = { 0 };
-		gem_close.handle = priv->handle;
-		drmIoctl(bo->drv->fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
-		free(priv);
-	}
-	return MAP_FAILED;
+	return mmap(0, bo->meta.total_size, drv_get_prot(map_flags),
+		    drv_get_mmap_flags(map_flags), bo->drv->fd, gem_map.out.addr_ptr);
 }
 
 static int amdgpu_unmap_bo(struct bo *bo, struct vma *vma)
 {
 	if (bo->priv) {
 		return dri_bo_unmap(bo, vma);
-	} else {
-		int r = munmap(vma->addr, vma->length);
-		if (r)
-			return r;
-
-		if (vma->priv) {
-			struct amdgpu_linear_vma_priv *priv = vma->priv;
-			struct drm_gem_close gem_close = { 0 };
-
-			if (BO_MAP_WRITE & priv->map_flags) {
-				r = sdma_copy(bo->drv->priv, bo->drv->fd, priv->handle,
-					      bo->handle.u32, vma->length);
-				if (r)
-					return r;
-			}
-
-			gem_close.handle = priv->handle;
-			r = drmIoctl(bo->drv->fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+	} else if (vma->priv) {
+		struct amdgpu_linear_vma_priv *priv = vma->priv;
+		int r = 0;
+
+		/*
+		 * The staging buffer stays mapped, only the writeback is left to do. A mapping
+		 * whose deferred fetch never ran (its acquire fence wait failed) holds no contents
+		 * of the BO, copying it back would overwrite the BO with stale staging memory.
+		 */
+		if ((BO_MAP_WRITE & priv->map_flags) && !priv->fetch_pending) {
+			struct drv_range ranges[DRV_MAX_PLANES];
+			uint32_t num_ranges = drv_bo_rect_ranges(bo, &vma->rect, ranges);
+
+			drv_trace_begin("amdgpu sdma_copy", bo);
+			r = sdma_copy(bo->drv->priv, bo->drv->fd, priv->staging, bo->handle.u32,
+				      vma->length, ranges, num_ranges, false);
+			drv_trace_end();
+			drv_stats_add(bo->drv, DRV_STATS_SDMA_COPIES, 1);
 		}
 
-		return 0;
+		sdma_put_staging(bo->drv->priv, bo->drv->fd, priv->staging);
+		free(priv);
+		vma->priv = NULL;
+		return r;
+	} else {
+		return munmap(vma->addr, vma->length);
 	}
 }
 
@@ -827,6 +1305,29 @@ static int amdgpu_bo_invalidate(struct bo *bo, struct mapping *mapping)
 	if (ret == 0 && wait_idle.out.status)
 		drv_loge("DRM_AMDGPU_GEM_WAIT_IDLE BO is busy\n");
 
+	if (mapping->vma->priv) {
+		struct amdgpu_linear_vma_priv *priv = mapping->vma->priv;
+		struct amdgpu_priv *drv_priv = bo->drv->priv;
+		struct drv_range ranges[DRV_MAX_PLANES];
+		uint32_t num_ranges;
+
+		if (!priv->fetch_pending)
+			return 0;
+
+		num_ranges = drv_bo_rect_ranges(bo, &mapping->vma->rect, ranges);
+		drv_trace_begin("amdgpu sdma_copy", bo);
+		ret = sdma_copy(drv_priv, bo->drv->fd, priv->staging, bo->handle.u32,
+				mapping->vma->length, ranges, num_ranges, true);
+		drv_trace_end();
+		drv_stats_add(bo->drv, DRV_STATS_SDMA_COPIES, 1);
+		if (ret) {
+			drv_loge("SDMA copy for read failed\n");
+			return ret;
+		}
+
+		priv->fetch_pending = false;
+	}
+
 	return 0;
 }
 
@@ -845,6 +1346,8 @@ const struct backend backend_amdgpu = {
 	.bo_invalidate = amdgpu_bo_invalidate,
 	.resolve_format_and_use_flags = drv_resolve_format_and_use_flags_helper,
 	.num_planes_from_modifier = dri_num_planes_from_modifier,
+	.get_memory_info = amdgpu_get_memory_info,
+	.trim = amdgpu_trim,
 };
 
 #endif
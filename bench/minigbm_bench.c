@@ -0,0 +1,410 @@
+/*
+ * Copyright 2026 The ChromiumOS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Please run clang-format on this file after making changes:
+ *
+ * clang-format -style=file -i minigbm_bench.c
+ *
+ */
+
+/*
+ * Measures allocation, import and CPU access throughput of a gbm device across a matrix of
+ * formats, sizes, modifiers and use flags, and prints the results as JSON on stdout.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <gbm.h>
+
+#define ARRAY_SIZE(A) (sizeof(A) / sizeof(*(A)))
+
+#ifndef DRM_FORMAT_MOD_LINEAR
+#define DRM_FORMAT_MOD_LINEAR 0
+#endif
+#define DRM_FORMAT_MOD_INVALID 0x00ffffffffffffffULL
+
+#define MAX_THREADS 64
+
+struct bench_format {
+	const char *name;
+	uint32_t format;
+};
+
+struct bench_size {
+	uint32_t width;
+	uint32_t height;
+};
+
+struct bench_usage {
+	const char *name;
+	uint32_t flags;
+};
+
+static const struct bench_format formats[] = {
+	{ "XR24", GBM_FORMAT_XRGB8888 },
+	{ "AR24", GBM_FORMAT_ARGB8888 },
+	{ "AB24", GBM_FORMAT_ABGR8888 },
+	{ "RG16", GBM_FORMAT_RGB565 },
+	{ "NV12", GBM_FORMAT_NV12 },
+	{ "R8", GBM_FORMAT_R8 },
+};
+
+static const struct bench_size sizes[] = {
+	{ 64, 64 },
+	{ 256, 256 },
+	{ 1920, 1080 },
+	{ 3840, 2160 },
+};
+
+static const struct bench_usage usages[] = {
+	{ "scanout", GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING },
+	{ "texture", GBM_BO_USE_RENDERING | GBM_BO_USE_TEXTURING },
+	{ "linear_sw", GBM_BO_USE_LINEAR | GBM_BO_USE_SW_READ_OFTEN | GBM_BO_USE_SW_WRITE_OFTEN },
+	{ "camera", GBM_BO_USE_CAMERA_WRITE | GBM_BO_USE_SW_READ_OFTEN },
+};
+
+/* "implicit" allocates with the use flags, "linear" asks for the linear modifier explicitly. */
+static const uint64_t modifiers[] = { DRM_FORMAT_MOD_INVALID, DRM_FORMAT_MOD_LINEAR };
+
+struct bench_config {
+	const struct bench_format *format;
+	const struct bench_size *size;
+	const struct bench_usage *usage;
+	uint64_t modifier;
+};
+
+struct bench_options {
+	const char *device;
+	uint32_t iterations;
+	uint32_t max_threads;
+};
+
+static struct gbm_device *gbm;
+static struct bench_options options = {
+	.iterations = 500,
+	.max_threads = 8,
+};
+
+static double now_seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static struct gbm_bo *bench_create(const struct bench_config *config)
+{
+	if (config->modifier == DRM_FORMAT_MOD_INVALID)
+		return gbm_bo_create(gbm, config->size->width, config->size->height,
+				     config->format->format, config->usage->flags);
+
+	return gbm_bo_create_with_modifiers(gbm, config->size->width, config->size->height,
+					    config->format->format, &config->modifier, 1);
+}
+
+static size_t bench_bo_size(struct gbm_bo *bo)
+{
+	size_t size = 0;
+
+	for (int plane = 0; plane < gbm_bo_get_plane_count(bo); plane++)
+		size += gbm_bo_get_plane_size(bo, plane);
+
+	return size;
+}
+
+/* Returns creations per second, or a negative value if the configuration is not supported. */
+static double bench_alloc(const struct bench_config *config, uint32_t iterations)
+{
+	double start = now_seconds();
+
+	for (uint32_t i = 0; i < iterations; i++) {
+		struct gbm_bo *bo = bench_create(config);
+		if (!bo)
+			return -1;
+
+		gbm_bo_destroy(bo);
+	}
+
+	return iterations / (now_seconds() - start);
+}
+
+static double bench_import(const struct bench_config *config, struct gbm_bo *bo)
+{
+	struct gbm_import_fd_modifier_data data = { 0 };
+	int fd = gbm_bo_get_fd(bo);
+	double start, rate = -1;
+
+	if (fd < 0)
+		return -1;
+
+	data.width = gbm_bo_get_width(bo);
+	data.height = gbm_bo_get_height(bo);
+	data.format = gbm_bo_get_format(bo);
+	data.modifier = gbm_bo_get_modifier(bo);
+	data.num_fds = gbm_bo_get_plane_count(bo);
+	for (uint32_t plane = 0; plane < data.num_fds; plane++) {
+		data.fds[plane] = fd;
+		data.strides[plane] = gbm_bo_get_stride_for_plane(bo, plane);
+		data.offsets[plane] = gbm_bo_get_offset(bo, plane);
+	}
+
+	start = now_seconds();
+	for (uint32_t i = 0; i < options.iterations; i++) {
+		struct gbm_bo *imported =
+		    gbm_bo_import(gbm, GBM_BO_IMPORT_FD_MODIFIER, &data, config->usage->flags);
+		if (!imported)
+			goto out;
+
+		gbm_bo_destroy(imported);
+	}
+
+	rate = options.iterations / (now_seconds() - start);
+out:
+	close(fd);
+	return rate;
+}
+
+/* Returns map and unmap pairs per second for the given transfer flags. */
+static double bench_map(struct gbm_bo *bo, uint32_t flags)
+{
+	double start = now_seconds();
+
+	for (uint32_t i = 0; i < options.iterations; i++) {
+		void *map_data = NULL;
+		uint32_t stride;
+
+		if (!gbm_bo_map(bo, 0, 0, gbm_bo_get_width(bo), gbm_bo_get_height(bo), flags,
+				&stride, &map_data))
+			return -1;
+
+		gbm_bo_unmap(bo, map_data);
+	}
+
+	return options.iterations / (now_seconds() - start);
+}
+
+struct bench_thread {
+	pthread_t thread;
+	pthread_barrier_t *barrier;
+	const struct bench_config *config;
+	double rate;
+};
+
+static void *bench_alloc_thread(void *arg)
+{
+	struct bench_thread *thread = arg;
+
+	pthread_barrier_wait(thread->barrier);
+	thread->rate = bench_alloc(thread->config, options.iterations);
+	return NULL;
+}
+
+/* Returns the combined creations per second of num_threads threads allocating at once. */
+static double bench_alloc_threads(const struct bench_config *config, uint32_t num_threads)
+{
+	struct bench_thread threads[MAX_THREADS];
+	pthread_barrier_t barrier;
+	double rate = 0;
+	uint32_t i;
+
+	pthread_barrier_init(&barrier, NULL, num_threads);
+	for (i = 0; i < num_threads; i++) {
+		threads[i].barrier = &barrier;
+		threads[i].config = config;
+		pthread_create(&threads[i].thread, NULL, bench_alloc_thread, &threads[i]);
+	}
+
+	for (i = 0; i < num_threads; i++) {
+		pthread_join(threads[i].thread, NULL);
+		if (threads[i].rate < 0)
+			rate = -1;
+		else if (rate >= 0)
+			rate += threads[i].rate;
+	}
+	pthread_barrier_destroy(&barrier);
+
+	return rate;
+}
+
+static void print_rate(const char *name, double rate)
+{
+	if (rate < 0)
+		printf(", \"%s\": null", name);
+	else
+		printf(", \"%s\": %.1f", name, rate);
+}
+
+static bool bench_run(const struct bench_config *config, bool first)
+{
+	struct gbm_bo *bo;
+	double size_mb;
+
+	if (!gbm_device_is_format_supported(gbm, config->format->format, config->usage->flags))
+		return false;
+
+	bo = bench_create(config);
+	if (!bo)
+		return false;
+
+	size_mb = bench_bo_size(bo) / (1024.0 * 1024.0);
+
+	printf("%s\n    { \"format\": \"%s\", \"width\": %u, \"height\": %u, \"usage\": \"%s\"",
+	       first ? "" : ",", config->format->name, config->size->width, config->size->height,
+	       config->usage->name);
+	printf(", \"modifier\": \"%s\", \"allocated_modifier\": \"0x%016llx\", \"size\": %zu",
+	       config->modifier == DRM_FORMAT_MOD_INVALID ? "implicit" : "linear",
+	       (unsigned long long)gbm_bo_get_modifier(bo), bench_bo_size(bo));
+
+	print_rate("alloc_per_sec", bench_alloc(config, options.iterations));
+	print_rate("import_per_sec", bench_import(config, bo));
+	print_rate("map_unmap_per_sec", bench_map(bo, GBM_BO_TRANSFER_READ_WRITE));
+
+	/* A read map invalidates the whole buffer and a write unmap flushes it. */
+	double rate = bench_map(bo, GBM_BO_TRANSFER_READ);
+	print_rate("invalidate_mb_per_sec", rate < 0 ? rate : rate * size_mb);
+	rate = bench_map(bo, GBM_BO_TRANSFER_WRITE);
+	print_rate("flush_mb_per_sec", rate < 0 ? rate : rate * size_mb);
+
+	gbm_bo_destroy(bo);
+
+	printf(", \"alloc_scaling\": [");
+	for (uint32_t threads = 1; threads <= options.max_threads; threads *= 2) {
+		double scaled = bench_alloc_threads(config, threads);
+
+		printf("%s{ \"threads\": %u", threads == 1 ? "" : ", ", threads);
+		print_rate("alloc_per_sec", scaled);
+		printf(" }");
+	}
+	printf("] }");
+	fflush(stdout);
+
+	return true;
+}
+
+static int open_device(void)
+{
+	char path[64];
+	int fd;
+
+	if (options.device)
+		return open(options.device, O_RDWR | O_CLOEXEC);
+
+	for (int minor = 128; minor < 192; minor++) {
+		snprintf(path, sizeof(path), "/dev/dri/renderD%d", minor);
+		fd = open(path, O_RDWR | O_CLOEXEC);
+		if (fd < 0)
+			continue;
+
+		gbm = gbm_create_device(fd);
+		if (gbm) {
+			gbm_device_destroy(gbm);
+			gbm = NULL;
+			return fd;
+		}
+
+		close(fd);
+	}
+
+	return -ENODEV;
+}
+
+static void print_help(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [options]\n", argv0);
+	fprintf(stderr, "  -d, --device <path>      DRM device to open (default: first usable)\n");
+	fprintf(stderr, "  -i, --iterations <n>     iterations per measurement (default: %u)\n",
+		options.iterations);
+	fprintf(stderr, "  -t, --max-threads <n>    thread count limit for scaling (default: %u)\n",
+		options.max_threads);
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "device", required_argument, NULL, 'd' },
+		{ "iterations", required_argument, NULL, 'i' },
+		{ "max-threads", required_argument, NULL, 't' },
+		{ "help", no_argument, NULL, 'h' },
+		{ 0, 0, 0, 0 },
+	};
+	bool first = true;
+	int fd, c;
+
+	while ((c = getopt_long(argc, argv, "d:i:t:h", longopts, NULL)) != -1) {
+		switch (c) {
+		case 'd':
+			options.device = optarg;
+			break;
+		case 'i':
+			options.iterations = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			options.max_threads = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			print_help(argv[0]);
+			return c == 'h' ? 0 : 1;
+		}
+	}
+
+	if (!options.iterations || !options.max_threads || options.max_threads > MAX_THREADS) {
+		print_help(argv[0]);
+		return 1;
+	}
+
+	fd = open_device();
+	if (fd < 0) {
+		fprintf(stderr, "failed to open a DRM device\n");
+		return 1;
+	}
+
+	gbm = gbm_create_device(fd);
+	if (!gbm) {
+		fprintf(stderr, "failed to create a gbm device\n");
+		close(fd);
+		return 1;
+	}
+
+	printf("{ \"backend\": \"%s\", \"iterations\": %u, \"results\": [",
+	       gbm_device_get_backend_name(gbm), options.iterations);
+
+	for (size_t f = 0; f < ARRAY_SIZE(formats); f++) {
+		for (size_t s = 0; s < ARRAY_SIZE(sizes); s++) {
+			for (size_t u = 0; u < ARRAY_SIZE(usages); u++) {
+				for (size_t m = 0; m < ARRAY_SIZE(modifiers); m++) {
+					struct bench_config config = {
+						.format = &formats[f],
+						.size = &sizes[s],
+						.usage = &usages[u],
+						.modifier = modifiers[m],
+					};
+
+					if (bench_run(&config, first))
+						first = false;
+				}
+			}
+		}
+	}
+
+	printf("\n] }\n");
+
+	gbm_device_destroy(gbm);
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,529 @@
+/*
+ * Copyright 2026 The ChromiumOS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Please run clang-format on this file after making changes:
+ *
+ * clang-format -style=file -i minigbm_stress.c
+ *
+ */
+
+/*
+ * Drives drv_bo_create(), drv_bo_import(), drv_bo_map() and drv_bo_destroy() from many threads
+ * at once with a configurable mix, and reports throughput, tail latency and the time spent
+ * waiting for the driver locks as JSON on stdout. A run fails if any operation fails.
+ *
+ * Lock hold times aren't measured: the counters only add up how long threads were blocked on a
+ * contended lock, which is what grows when a lock becomes a bottleneck.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "drv.h"
+
+#define ARRAY_SIZE(A) (sizeof(A) / sizeof(*(A)))
+
+#define MAX_THREADS 256
+/* Buffers each thread keeps alive at most; creating beyond this destroys the oldest one. */
+#define MAX_LIVE_BOS 16
+/* Bucket i counts operations taking [2^i, 2^(i+1)) ns. */
+#define NUM_BUCKETS 40
+
+enum stress_op {
+	STRESS_CREATE,
+	STRESS_IMPORT,
+	STRESS_MAP,
+	STRESS_DESTROY,
+	STRESS_NUM_OPS,
+};
+
+static const char *const op_names[STRESS_NUM_OPS] = { "create", "import", "map", "destroy" };
+
+struct stress_histogram {
+	uint64_t buckets[NUM_BUCKETS];
+	uint64_t count;
+	uint64_t total_ns;
+	uint64_t max_ns;
+};
+
+struct stress_thread {
+	pthread_t thread;
+	uint32_t index;
+	unsigned int seed;
+	struct bo *bos[MAX_LIVE_BOS];
+	uint32_t num_bos;
+	uint32_t oldest;
+	struct stress_histogram histograms[STRESS_NUM_OPS];
+	uint64_t failures;
+};
+
+struct stress_options {
+	const char *device;
+	uint32_t threads;
+	uint32_t ops;
+	uint32_t width;
+	uint32_t height;
+	uint32_t format;
+	uint64_t use_flags;
+	/* Relative weights of the operations, indexed by enum stress_op. */
+	uint32_t mix[STRESS_NUM_OPS];
+};
+
+static struct driver *drv;
+static pthread_barrier_t start_barrier;
+static struct stress_options options = {
+	.threads = 8,
+	.ops = 10000,
+	.width = 1920,
+	.height = 1080,
+	.format = DRM_FORMAT_XRGB8888,
+	.use_flags = BO_USE_RENDERING | BO_USE_TEXTURE | BO_USE_SW_READ_OFTEN |
+		     BO_USE_SW_WRITE_OFTEN,
+	.mix = { 30, 20, 40, 10 },
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void histogram_add(struct stress_histogram *histogram, uint64_t ns)
+{
+	uint32_t bucket = 0;
+
+	while (bucket < NUM_BUCKETS - 1 && (ns >> (bucket + 1)))
+		bucket++;
+
+	histogram->buckets[bucket]++;
+	histogram->count++;
+	histogram->total_ns += ns;
+	if (ns > histogram->max_ns)
+		histogram->max_ns = ns;
+}
+
+static void histogram_merge(struct stress_histogram *dst, const struct stress_histogram *src)
+{
+	for (uint32_t i = 0; i < NUM_BUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+
+	dst->count += src->count;
+	dst->total_ns += src->total_ns;
+	if (src->max_ns > dst->max_ns)
+		dst->max_ns = src->max_ns;
+}
+
+/* Returns the upper bound of the bucket holding the given percentile. */
+static uint64_t histogram_percentile_ns(const struct stress_histogram *histogram, double fraction)
+{
+	uint64_t seen = 0;
+
+	for (uint32_t i = 0; i < NUM_BUCKETS; i++) {
+		seen += histogram->buckets[i];
+		if (seen >= histogram->count * fraction)
+			return 2ull << i;
+	}
+
+	return histogram->max_ns;
+}
+
+static int stress_create(struct stress_thread *thread)
+{
+	struct bo *bo = drv_bo_create(drv, options.width, options.height, options.format,
+				      options.use_flags);
+	if (!bo)
+		return -ENOMEM;
+
+	if (thread->num_bos == MAX_LIVE_BOS) {
+		drv_bo_destroy(thread->bos[thread->oldest]);
+		thread->bos[thread->oldest] = bo;
+		thread->oldest = (thread->oldest + 1) % MAX_LIVE_BOS;
+	} else {
+		thread->bos[thread->num_bos++] = bo;
+	}
+
+	return 0;
+}
+
+static struct bo *stress_pick(struct stress_thread *thread)
+{
+	if (!thread->num_bos)
+		return NULL;
+
+	return thread->bos[rand_r(&thread->seed) % thread->num_bos];
+}
+
+static int stress_import(struct bo *bo)
+{
+	struct drv_import_fd_data data = { 0 };
+	size_t num_planes = drv_bo_get_num_planes(bo);
+	struct bo *imported;
+	size_t plane;
+	int ret = 0;
+
+	for (plane = 0; plane < DRV_MAX_PLANES; plane++)
+		data.fds[plane] = -1;
+
+	for (plane = 0; plane < num_planes; plane++) {
+		data.fds[plane] = drv_bo_get_plane_fd(bo, plane);
+		if (data.fds[plane] < 0) {
+			ret = data.fds[plane];
+			goto out;
+		}
+
+		data.strides[plane] = drv_bo_get_plane_stride(bo, plane);
+		data.offsets[plane] = drv_bo_get_plane_offset(bo, plane);
+	}
+
+	data.format_modifier = drv_bo_get_format_modifier(bo);
+	data.width = drv_bo_get_width(bo);
+	data.height = drv_bo_get_height(bo);
+	data.format = drv_bo_get_format(bo);
+	data.use_flags = options.use_flags;
+
+	imported = drv_bo_import(drv, &data);
+	if (!imported) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	drv_bo_destroy(imported);
+
+out:
+	for (plane = 0; plane < num_planes; plane++) {
+		if (data.fds[plane] >= 0)
+			close(data.fds[plane]);
+	}
+
+	return ret;
+}
+
+static int stress_map(struct bo *bo)
+{
+	struct rectangle rect = { 0, 0, drv_bo_get_width(bo), drv_bo_get_height(bo) };
+	struct mapping *mapping;
+	void *addr;
+	int ret;
+
+	addr = drv_bo_map(bo, &rect, BO_MAP_READ_WRITE, &mapping, 0);
+	if (addr == MAP_FAILED)
+		return -EINVAL;
+
+	/* Touch the first line so that the mapping is actually faulted in. */
+	memset(addr, 0, drv_bo_get_plane_stride(bo, 0));
+
+	ret = drv_bo_invalidate(bo, mapping);
+	if (!ret)
+		ret = drv_bo_flush(bo, mapping);
+
+	drv_bo_unmap(bo, mapping);
+	return ret;
+}
+
+static int stress_destroy(struct stress_thread *thread)
+{
+	uint32_t index;
+
+	if (!thread->num_bos)
+		return 0;
+
+	index = rand_r(&thread->seed) % thread->num_bos;
+	drv_bo_destroy(thread->bos[index]);
+	thread->bos[index] = thread->bos[--thread->num_bos];
+	thread->oldest = 0;
+	return 0;
+}
+
+static enum stress_op stress_pick_op(struct stress_thread *thread, uint32_t total_weight)
+{
+	uint32_t pick = rand_r(&thread->seed) % total_weight;
+	uint32_t op;
+
+	for (op = 0; op < STRESS_NUM_OPS - 1; op++) {
+		if (pick < options.mix[op])
+			break;
+		pick -= options.mix[op];
+	}
+
+	/* Imports and maps need a buffer to work on. */
+	if ((op == STRESS_IMPORT || op == STRESS_MAP) && !thread->num_bos)
+		op = STRESS_CREATE;
+
+	return op;
+}
+
+static void *stress_thread_main(void *arg)
+{
+	struct stress_thread *thread = arg;
+	uint32_t total_weight = 0;
+
+	for (uint32_t op = 0; op < STRESS_NUM_OPS; op++)
+		total_weight += options.mix[op];
+
+	pthread_barrier_wait(&start_barrier);
+
+	for (uint32_t i = 0; i < options.ops; i++) {
+		enum stress_op op = stress_pick_op(thread, total_weight);
+		uint64_t start = now_ns();
+		int ret;
+
+		switch (op) {
+		case STRESS_CREATE:
+			ret = stress_create(thread);
+			break;
+		case STRESS_IMPORT:
+			ret = stress_import(stress_pick(thread));
+			break;
+		case STRESS_MAP:
+			ret = stress_map(stress_pick(thread));
+			break;
+		default:
+			ret = stress_destroy(thread);
+			break;
+		}
+
+		if (ret) {
+			fprintf(stderr, "thread %u: %s failed: %s\n", thread->index, op_names[op],
+				strerror(-ret));
+			thread->failures++;
+			continue;
+		}
+
+		histogram_add(&thread->histograms[op], now_ns() - start);
+	}
+
+	while (thread->num_bos)
+		drv_bo_destroy(thread->bos[--thread->num_bos]);
+
+	return NULL;
+}
+
+static int parse_mix(const char *arg)
+{
+	uint32_t total = 0;
+	char *end;
+
+	for (uint32_t op = 0; op < STRESS_NUM_OPS; op++) {
+		options.mix[op] = strtoul(arg, &end, 0);
+		total += options.mix[op];
+		if (op < STRESS_NUM_OPS - 1 && *end != ',')
+			return -EINVAL;
+		arg = end + 1;
+	}
+
+	return (*end || !total) ? -EINVAL : 0;
+}
+
+static int open_device(void)
+{
+	char path[64];
+	int fd;
+
+	if (options.device)
+		return open(options.device, O_RDWR | O_CLOEXEC);
+
+	for (int minor = 128; minor < 192; minor++) {
+		snprintf(path, sizeof(path), "/dev/dri/renderD%d", minor);
+		fd = open(path, O_RDWR | O_CLOEXEC);
+		if (fd < 0)
+			continue;
+
+		drv = drv_create(fd);
+		if (drv) {
+			drv_destroy(drv);
+			drv = NULL;
+			return fd;
+		}
+
+		close(fd);
+	}
+
+	return -ENODEV;
+}
+
+static void print_help(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [options]\n", argv0);
+	fprintf(stderr, "  -d, --device <path>    DRM device to open (default: first usable)\n");
+	fprintf(stderr, "  -t, --threads <n>      number of threads (default: %u)\n",
+		options.threads);
+	fprintf(stderr, "  -n, --ops <n>          operations per thread (default: %u)\n",
+		options.ops);
+	fprintf(stderr, "  -s, --size <w>x<h>     buffer size (default: %ux%u)\n", options.width,
+		options.height);
+	fprintf(stderr, "  -m, --mix <c>,<i>,<m>,<d>\n");
+	fprintf(stderr, "                         weights of create, import, map and destroy\n");
+	fprintf(stderr, "                         (default: %u,%u,%u,%u)\n", options.mix[0],
+		options.mix[1], options.mix[2], options.mix[3]);
+}
+
+static void print_results(const struct stress_thread *threads, double seconds)
+{
+	static const char *const lock_names[] = { "mapping", "backend" };
+	static const enum drv_stats_counter lock_counters[] = {
+		DRV_STATS_MAPPING_LOCK_WAIT_NS,
+		DRV_STATS_BACKEND_LOCK_WAIT_NS,
+	};
+	struct stress_histogram totals[STRESS_NUM_OPS] = { { { 0 } } };
+	struct drv_stats stats;
+	uint64_t total_ops = 0;
+	uint64_t failures = 0;
+	uint32_t i, op;
+
+	for (i = 0; i < options.threads; i++) {
+		for (op = 0; op < STRESS_NUM_OPS; op++)
+			histogram_merge(&totals[op], &threads[i].histograms[op]);
+		failures += threads[i].failures;
+	}
+
+	printf("{ \"backend\": \"%s\", \"threads\": %u, \"seconds\": %.3f", drv_get_name(drv),
+	       options.threads, seconds);
+
+	printf(", \"ops\": {");
+	for (op = 0; op < STRESS_NUM_OPS; op++) {
+		const struct stress_histogram *histogram = &totals[op];
+
+		total_ops += histogram->count;
+		printf("%s\n    \"%s\": { \"count\": %llu, \"per_sec\": %.1f", op ? "," : "",
+		       op_names[op], (unsigned long long)histogram->count,
+		       histogram->count / seconds);
+		if (histogram->count) {
+			printf(", \"avg_ns\": %llu, \"p50_ns\": %llu, \"p99_ns\": %llu",
+			       (unsigned long long)(histogram->total_ns / histogram->count),
+			       (unsigned long long)histogram_percentile_ns(histogram, 0.5),
+			       (unsigned long long)histogram_percentile_ns(histogram, 0.99));
+			printf(", \"p999_ns\": %llu, \"max_ns\": %llu",
+			       (unsigned long long)histogram_percentile_ns(histogram, 0.999),
+			       (unsigned long long)histogram->max_ns);
+		}
+		printf(" }");
+	}
+	printf("\n  }, \"total_per_sec\": %.1f, \"failures\": %llu", total_ops / seconds,
+	       (unsigned long long)failures);
+
+	drv_get_stats(drv, &stats);
+	printf(", \"lock_wait_ns\": {");
+	for (i = 0; i < ARRAY_SIZE(lock_counters); i++)
+		printf("%s \"%s\": %llu", i ? "," : "", lock_names[i],
+		       (unsigned long long)stats.counters[lock_counters[i]]);
+	printf(" } }\n");
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "device", required_argument, NULL, 'd' },
+		{ "threads", required_argument, NULL, 't' },
+		{ "ops", required_argument, NULL, 'n' },
+		{ "size", required_argument, NULL, 's' },
+		{ "mix", required_argument, NULL, 'm' },
+		{ "help", no_argument, NULL, 'h' },
+		{ 0, 0, 0, 0 },
+	};
+	struct stress_thread *threads;
+	uint64_t start, failures = 0;
+	int fd, c;
+	uint32_t i;
+
+	while ((c = getopt_long(argc, argv, "d:t:n:s:m:h", longopts, NULL)) != -1) {
+		switch (c) {
+		case 'd':
+			options.device = optarg;
+			break;
+		case 't':
+			options.threads = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			options.ops = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			if (sscanf(optarg, "%ux%u", &options.width, &options.height) != 2) {
+				print_help(argv[0]);
+				return 1;
+			}
+			break;
+		case 'm':
+			if (parse_mix(optarg)) {
+				print_help(argv[0]);
+				return 1;
+			}
+			break;
+		default:
+			print_help(argv[0]);
+			return c == 'h' ? 0 : 1;
+		}
+	}
+
+	if (!options.threads || options.threads > MAX_THREADS || !options.width ||
+	    !options.height) {
+		print_help(argv[0]);
+		return 1;
+	}
+
+	fd = open_device();
+	if (fd < 0) {
+		fprintf(stderr, "failed to open a DRM device\n");
+		return 1;
+	}
+
+	drv = drv_create(fd);
+	if (!drv) {
+		fprintf(stderr, "failed to create a driver\n");
+		close(fd);
+		return 1;
+	}
+
+	if (!drv_get_combination(drv, options.format, options.use_flags)) {
+		fprintf(stderr, "%s does not support the buffer description\n", drv_get_name(drv));
+		drv_destroy(drv);
+		close(fd);
+		return 1;
+	}
+
+	threads = calloc(options.threads, sizeof(*threads));
+	if (!threads) {
+		drv_destroy(drv);
+		close(fd);
+		return 1;
+	}
+
+	/* The main thread joins the barrier as well so that it can start the clock. */
+	pthread_barrier_init(&start_barrier, NULL, options.threads + 1);
+	for (i = 0; i < options.threads; i++) {
+		threads[i].index = i;
+		threads[i].seed = i + 1;
+		pthread_create(&threads[i].thread, NULL, stress_thread_main, &threads[i]);
+	}
+
+	pthread_barrier_wait(&start_barrier);
+	start = now_ns();
+	for (i = 0; i < options.threads; i++)
+		pthread_join(threads[i].thread, NULL);
+
+	print_results(threads, (now_ns() - start) / 1e9);
+
+	for (i = 0; i < options.threads; i++)
+		failures += threads[i].failures;
+
+	pthread_barrier_destroy(&start_barrier);
+	free(threads);
+	drv_destroy(drv);
+	close(fd);
+	return failures ? 1 : 0;
+}
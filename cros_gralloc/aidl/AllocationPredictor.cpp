@@ -0,0 +1,116 @@
+/*
+ * Copyright 2026 The ChromiumOS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include "AllocationPredictor.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sched.h>
+
+#include <log/log.h>
+
+namespace aidl::android::hardware::graphics::allocator::impl {
+
+AllocationPredictor::AllocationPredictor(std::shared_ptr<cros_gralloc_driver> driver)
+    : mDriver(std::move(driver)), mThread(&AllocationPredictor::run, this) {}
+
+AllocationPredictor::~AllocationPredictor() {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStopping = true;
+    }
+    mCondition.notify_one();
+    mThread.join();
+}
+
+bool AllocationPredictor::sameDescriptor(const struct cros_gralloc_buffer_descriptor& a,
+                                         const struct cros_gralloc_buffer_descriptor& b) {
+    return a.width == b.width && a.height == b.height && a.drm_format == b.drm_format &&
+           a.droid_format == b.droid_format && a.droid_usage == b.droid_usage &&
+           a.use_flags == b.use_flags;
+}
+
+void AllocationPredictor::recordAllocation(
+        const struct cros_gralloc_buffer_descriptor& descriptor, uint32_t count) {
+    const auto now = Clock::now();
+    uint32_t expected = 0;
+
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        auto it = std::find_if(mPatterns.begin(), mPatterns.end(), [&](const Pattern& pattern) {
+            return sameDescriptor(pattern.descriptor, descriptor);
+        });
+
+        if (it == mPatterns.end()) {
+            if (mPatterns.size() == kMaxPatterns) {
+                it = std::min_element(mPatterns.begin(), mPatterns.end(),
+                                      [](const Pattern& a, const Pattern& b) {
+                                          return a.lastSeen < b.lastSeen;
+                                      });
+                /* Even the oldest burst is still going on; it is not cut short for this one. */
+                if (now - it->lastSeen <= kBurstGap)
+                    return;
+                mPatterns.erase(it);
+            }
+
+            Pattern pattern;
+            pattern.descriptor = descriptor;
+            pattern.lastSeen = now;
+            pattern.burstCount = count;
+            mPatterns.push_back(pattern);
+            return;
+        }
+
+        if (now - it->lastSeen > kBurstGap) {
+            /* A new burst: expect it to be as long as the last one. */
+            it->learnedCount = it->burstCount;
+            it->burstCount = 0;
+            if (it->learnedCount > count)
+                expected = std::min(it->learnedCount - count, kMaxPrefill);
+        }
+
+        it->burstCount += count;
+        it->lastSeen = now;
+
+        if (!expected || mRequests.size() == kMaxPendingRequests)
+            return;
+
+        mRequests.push_back(Request{descriptor, expected});
+    }
+
+    mCondition.notify_one();
+}
+
+void AllocationPredictor::run() {
+    /* Only use the time nobody else wants, allocations on the critical path come first. */
+    struct sched_param param = {0};
+    if (sched_setscheduler(0, SCHED_IDLE, &param) != 0) {
+        ALOGI("%s: failed to set priority: %s", __FUNCTION__, strerror(errno));
+    }
+
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    while (true) {
+        mCondition.wait(lock, [this] { return mStopping || !mRequests.empty(); });
+        if (mStopping)
+            return;
+
+        Request request = std::move(mRequests.front());
+        mRequests.pop_front();
+
+        lock.unlock();
+        int32_t ret = mDriver->prefill(&request.descriptor, request.count);
+        if (ret < 0) {
+            ALOGI("Failed to prefill %u buffers of %ux%u: %d.", request.count,
+                  request.descriptor.width, request.descriptor.height, ret);
+        }
+        lock.lock();
+    }
+}
+
+}  // namespace aidl::android::hardware::graphics::allocator::impl
@@ -0,0 +1,81 @@
+/*
+ * Copyright 2026 The ChromiumOS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef MINIGBM_CROSGRALLOC_AIDL_ALLOCATIONPREDICTOR_H_
+#define MINIGBM_CROSGRALLOC_AIDL_ALLOCATIONPREDICTOR_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "cros_gralloc/cros_gralloc_driver.h"
+
+namespace aidl::android::hardware::graphics::allocator::impl {
+
+/*
+ * Learns how many buffers of a descriptor are allocated in a burst, such as a camera stream or a
+ * window's buffer queue being set up, and when the same descriptor shows up again creates the
+ * rest of the burst into the driver's BO pool on an idle priority thread. The pool size is the
+ * memory cap: BOs are only prefilled while they fit without evicting others, and trimming the
+ * driver frees them like any other pooled BO.
+ *
+ * A burst is only known to be over once the next one starts, so predictions follow the previous
+ * complete burst: a change in burst length takes one burst to be picked up.
+ */
+class AllocationPredictor {
+  public:
+    explicit AllocationPredictor(std::shared_ptr<cros_gralloc_driver> driver);
+    ~AllocationPredictor();
+
+    /* Called after count buffers of descriptor were allocated. */
+    void recordAllocation(const struct cros_gralloc_buffer_descriptor& descriptor,
+                          uint32_t count);
+
+  private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Pattern {
+        struct cros_gralloc_buffer_descriptor descriptor;
+        Clock::time_point lastSeen;
+        /* Buffers allocated in the burst in progress, and in the previous one. */
+        uint32_t burstCount = 0;
+        uint32_t learnedCount = 0;
+    };
+
+    struct Request {
+        struct cros_gralloc_buffer_descriptor descriptor;
+        uint32_t count;
+    };
+
+    static bool sameDescriptor(const struct cros_gralloc_buffer_descriptor& a,
+                               const struct cros_gralloc_buffer_descriptor& b);
+
+    void run();
+
+    /* Allocations further apart than this belong to different bursts. */
+    static constexpr auto kBurstGap = std::chrono::milliseconds(500);
+    /* Bounds on the remembered descriptors, and on the buffers prefilled for one of them. */
+    static constexpr size_t kMaxPatterns = 32;
+    static constexpr uint32_t kMaxPrefill = 16;
+    static constexpr size_t kMaxPendingRequests = 8;
+
+    std::shared_ptr<cros_gralloc_driver> mDriver;
+
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    std::vector<Pattern> mPatterns;
+    std::deque<Request> mRequests;
+    bool mStopping = false;
+    std::thread mThread;
+};
+
+}  // namespace aidl::android::hardware::graphics::allocator::impl
+
+#endif
@@ -9,6 +9,7 @@
 #include <aidl/android/hardware/graphics/allocator/AllocationError.h>
 #include <aidlcommonsupport/NativeHandle.h>
 #include <android-base/logging.h>
+#include <android-base/properties.h>
 #include <android/binder_ibinder_platform.h>
 #include <gralloctypes/Gralloc4.h>
 #include <log/log.h>
@@ -30,26 +31,27 @@ inline ndk::ScopedAStatus ToBinderStatus(AllocationError error) {
 
 bool Allocator::init() {
     mDriver = cros_gralloc_driver::get_instance();
-    return mDriver != nullptr;
+    if (!mDriver)
+        return false;
+
+    if (::android::base::GetBoolProperty("vendor.minigbm.predictive_prealloc", false))
+        mPredictor = std::make_unique<AllocationPredictor>(mDriver);
+
+    return true;
 }
 
 // TODO(natsu): deduplicate with CrosGralloc4Allocator after the T release.
 ndk::ScopedAStatus Allocator::initializeMetadata(
-        cros_gralloc_handle_t crosHandle,
+        cros_gralloc_buffer* crosBuffer,
         const struct cros_gralloc_buffer_descriptor& crosDescriptor) {
-    if (!mDriver) {
-        ALOGE("Failed to initializeMetadata. Driver is uninitialized.\n");
-        return ToBinderStatus(AllocationError::NO_RESOURCES);
-    }
-
-    if (!crosHandle) {
-        ALOGE("Failed to initializeMetadata. Invalid handle.\n");
+    if (!crosBuffer) {
+        ALOGE("Failed to initializeMetadata. Invalid buffer.\n");
         return ToBinderStatus(AllocationError::NO_RESOURCES);
     }
 
     void* addr;
     uint64_t size;
-    int ret = mDriver->get_reserved_region(crosHandle, &addr, &size);
+    int ret = crosBuffer->get_reserved_region(&addr, &size);
     if (ret) {
         ALOGE("Failed to getReservedRegion.\n");
         return ToBinderStatus(AllocationError::NO_RESOURCES);
@@ -89,14 +91,9 @@ ndk::ScopedAStatus Allocator::allocate(const std::vector<uint8_t>& descriptor, i
     std::vector<native_handle_t*> handles;
     handles.resize(count, nullptr);
 
-    for (int32_t i = 0; i < count; i++) {
-        ndk::ScopedAStatus status = allocate(description, &outResult->stride, &handles[i]);
-        if (!status.isOk()) {
-            for (int32_t j = 0; j < i; j++) {
-                releaseBufferAndHandle(handles[j]);
-            }
-            return status;
-        }
+    ndk::ScopedAStatus status = allocate(description, count, &outResult->stride, handles.data());
+    if (!status.isOk()) {
+        return status;
     }
 
     outResult->buffers.resize(count);
@@ -109,8 +106,8 @@ ndk::ScopedAStatus Allocator::allocate(const std::vector<uint8_t>& descriptor, i
     return ndk::ScopedAStatus::ok();
 }
 
-ndk::ScopedAStatus Allocator::allocate(const BufferDescriptorInfoV4& descriptor, int32_t* outStride,
-                                       native_handle_t** outHandle) {
+ndk::ScopedAStatus Allocator::allocate(const BufferDescriptorInfoV4& descriptor, int32_t count,
+                                       int32_t* outStride, native_handle_t** outHandles) {
     if (!mDriver) {
         ALOGE("Failed to allocate. Driver is uninitialized.\n");
         return ToBinderStatus(AllocationError::NO_RESOURCES);
@@ -123,6 +120,10 @@ ndk::ScopedAStatus Allocator::allocate(const BufferDescriptorInfoV4& descriptor,
 
     crosDescriptor.reserved_region_size += sizeof(CrosGralloc4Metadata);
 
+    if (count <= 0) {
+        return ndk::ScopedAStatus::ok();
+    }
+
     if (!mDriver->is_supported(&crosDescriptor)) {
         const std::string drmFormatString = get_drm_format_string(crosDescriptor.drm_format);
         const std::string pixelFormatString = getPixelFormatString(descriptor.format);
@@ -133,23 +134,25 @@ ndk::ScopedAStatus Allocator::allocate(const BufferDescriptorInfoV4& descriptor,
         return ToBinderStatus(AllocationError::UNSUPPORTED);
     }
 
-    native_handle_t* handle;
-    int ret = mDriver->allocate(&crosDescriptor, &handle);
+    // The whole buffer queue is created at once so the layout is only computed one time. The
+    // metadata of each buffer is initialized by the driver's workers as soon as it exists.
+    auto init = [&](cros_gralloc_buffer* crosBuffer) -> int32_t {
+        if (!initializeMetadata(crosBuffer, crosDescriptor).isOk()) {
+            ALOGE("Failed to allocate. Failed to initialize gralloc buffer metadata.");
+            return -EINVAL;
+        }
+        return 0;
+    };
+
+    int ret = mDriver->allocate(&crosDescriptor, static_cast<uint32_t>(count), outHandles, init);
     if (ret) {
         return ToBinderStatus(AllocationError::NO_RESOURCES);
     }
 
-    cros_gralloc_handle_t crosHandle = cros_gralloc_convert_handle(handle);
-
-    auto status = initializeMetadata(crosHandle, crosDescriptor);
-    if (!status.isOk()) {
-        ALOGE("Failed to allocate. Failed to initialize gralloc buffer metadata.");
-        releaseBufferAndHandle(handle);
-        return status;
-    }
+    if (mPredictor)
+        mPredictor->recordAllocation(crosDescriptor, static_cast<uint32_t>(count));
 
-    *outStride = static_cast<int32_t>(crosHandle->pixel_stride);
-    *outHandle = handle;
+    *outStride = static_cast<int32_t>(cros_gralloc_convert_handle(outHandles[0])->pixel_stride);
 
     return ndk::ScopedAStatus::ok();
 }
@@ -182,14 +185,9 @@ ndk::ScopedAStatus Allocator::allocate2(const BufferDescriptorInfo& descriptor,
     std::vector<native_handle_t*> handles;
     handles.resize(count, nullptr);
 
-    for (int32_t i = 0; i < count; i++) {
-        ndk::ScopedAStatus status = allocate(descriptionV4, &outResult->stride, &handles[i]);
-        if (!status.isOk()) {
-            for (int32_t j = 0; j < i; j++) {
-                releaseBufferAndHandle(handles[j]);
-            }
-            return status;
-        }
+    ndk::ScopedAStatus status = allocate(descriptionV4, count, &outResult->stride, handles.data());
+    if (!status.isOk()) {
+        return status;
     }
 
     outResult->buffers.resize(count);
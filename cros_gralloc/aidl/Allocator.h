@@ -11,6 +11,7 @@
 #include <aidl/android/hardware/graphics/allocator/BnAllocator.h>
 #include <android/hardware/graphics/mapper/4.0/IMapper.h>
 
+#include "AllocationPredictor.h"
 #include "cros_gralloc/cros_gralloc_driver.h"
 #include "cros_gralloc/cros_gralloc_helpers.h"
 #include "cros_gralloc/gralloc4/CrosGralloc4Metadata.h"
@@ -41,15 +42,16 @@ class Allocator : public BnAllocator {
     ndk::ScopedAStatus allocate(
             const ::android::hardware::graphics::mapper::V4_0::IMapper::BufferDescriptorInfo&
                     descriptor,
-            int32_t* outStride, native_handle_t** outHandle);
+            int32_t count, int32_t* outStride, native_handle_t** outHandles);
 
     ndk::ScopedAStatus initializeMetadata(
-            cros_gralloc_handle_t crosHandle,
+            cros_gralloc_buffer* crosBuffer,
             const struct cros_gralloc_buffer_descriptor& crosDescriptor);
 
     void releaseBufferAndHandle(native_handle_t* handle);
 
     std::shared_ptr<cros_gralloc_driver> mDriver;
+    std::unique_ptr<AllocationPredictor> mPredictor;
 };
 
 }  // namespace aidl::android::hardware::graphics::allocator::impl
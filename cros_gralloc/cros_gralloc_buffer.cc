@@ -7,10 +7,93 @@
 #include "cros_gralloc_buffer.h"
 
 #include <assert.h>
+#include <list>
+#include <map>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <tuple>
 
 #include <cutils/native_handle.h>
 
+cros_gralloc_lock_stats cros_gralloc_buffer::lock_stats_;
+
+/*
+ * Mappings of reserved region files, shared by the buffers of this process holding the same
+ * file, keyed by its device, inode and the region size. The last few no buffer uses any more are
+ * kept, so that importing a buffer again, as compositors do every frame, doesn't mmap again. A
+ * kept mapping holds on to its file, so the key can't be reused by another one meanwhile.
+ */
+#define RESERVED_REGION_MAX_IDLE_MAPPINGS 32
+
+using reserved_region_key = std::tuple<dev_t, ino_t, uint64_t>;
+
+struct reserved_region_mapping {
+	void *addr;
+	uint32_t refcount;
+	/* Position in reserved_region_idle while refcount is 0. */
+	std::list<reserved_region_key>::iterator idle;
+};
+
+static std::mutex reserved_region_mutex;
+static std::map<reserved_region_key, reserved_region_mapping> reserved_region_mappings;
+/* Keys of the mappings no buffer uses, most recently released first. */
+static std::list<reserved_region_key> reserved_region_idle;
+
+static void *reserved_region_acquire(int fd, uint64_t size, reserved_region_key *key)
+{
+	struct stat st;
+
+	if (fstat(fd, &st)) {
+		ALOGE("Failed to stat reserved region: %s.", strerror(errno));
+		return MAP_FAILED;
+	}
+
+	*key = std::make_tuple(st.st_dev, st.st_ino, size);
+
+	std::lock_guard<std::mutex> lock(reserved_region_mutex);
+	auto it = reserved_region_mappings.find(*key);
+	if (it == reserved_region_mappings.end()) {
+		void *addr = mmap(nullptr, size, PROT_WRITE | PROT_READ, MAP_SHARED, fd, 0);
+		if (addr == MAP_FAILED) {
+			ALOGE("Failed to mmap reserved region: %s.", strerror(errno));
+			return MAP_FAILED;
+		}
+
+		reserved_region_mapping mapping = {};
+		mapping.addr = addr;
+		it = reserved_region_mappings.emplace(*key, mapping).first;
+	} else if (!it->second.refcount) {
+		reserved_region_idle.erase(it->second.idle);
+	}
+
+	it->second.refcount++;
+	return it->second.addr;
+}
+
+static void reserved_region_release(const reserved_region_key &key)
+{
+	std::lock_guard<std::mutex> lock(reserved_region_mutex);
+	auto it = reserved_region_mappings.find(key);
+	if (it == reserved_region_mappings.end() || --it->second.refcount)
+		return;
+
+	reserved_region_idle.push_front(key);
+	it->second.idle = reserved_region_idle.begin();
+
+	if (reserved_region_idle.size() > RESERVED_REGION_MAX_IDLE_MAPPINGS) {
+		auto oldest = reserved_region_mappings.find(reserved_region_idle.back());
+		munmap(oldest->second.addr, std::get<2>(oldest->first));
+		reserved_region_mappings.erase(oldest);
+		reserved_region_idle.pop_back();
+	}
+}
+
+/*static*/
+const cros_gralloc_lock_stats &cros_gralloc_buffer::get_lock_stats()
+{
+	return lock_stats_;
+}
+
 /*static*/
 std::unique_ptr<cros_gralloc_buffer>
 cros_gralloc_buffer::create(struct bo *acquire_bo,
@@ -45,12 +128,19 @@ cros_gralloc_buffer::cros_gralloc_buffer(struct bo *acquire_bo,
 		lock_data_[plane] = nullptr;
 }
 
+std::unique_lock<std::mutex> cros_gralloc_buffer::lock_state() const
+{
+	std::unique_lock<std::mutex> lock(mutex_, std::defer_lock);
+	cros_gralloc_counted_lock(lock, lock_stats_);
+	return lock;
+}
+
 cros_gralloc_buffer::~cros_gralloc_buffer()
 {
 	drv_bo_destroy(bo_);
-	if (reserved_region_addr_) {
-		munmap(reserved_region_addr_, hnd_->reserved_region_size);
-	}
+	if (reserved_region_addr_)
+		reserved_region_release(reserved_region_key_);
+
 	native_handle_close(hnd_);
 	native_handle_delete(hnd_);
 }
@@ -129,14 +219,21 @@ int32_t cros_gralloc_buffer::decrease_refcount()
 int32_t cros_gralloc_buffer::lock(const struct rectangle *rect, uint32_t map_flags,
 				  uint8_t *addr[DRV_MAX_PLANES])
 {
-	void *vaddr = nullptr;
+	void *plane_addrs[DRV_MAX_PLANES] = {};
+	uint32_t plane_strides[DRV_MAX_PLANES];
+	auto lock = lock_state();
 
 	memset(addr, 0, DRV_MAX_PLANES * sizeof(*addr));
 
 	if (map_flags) {
 		if (lock_data_[0]) {
-			drv_bo_invalidate(bo_, lock_data_[0]);
-			vaddr = lock_data_[0]->vma->addr;
+			uint8_t *base = static_cast<uint8_t *>(lock_data_[0]->vma->addr);
+
+			if (!(map_flags & BO_MAP_DEFER_INVALIDATE))
+				drv_bo_invalidate(bo_, lock_data_[0]);
+
+			for (uint32_t plane = 0; plane < hnd_->num_planes; plane++)
+				plane_addrs[plane] = base + drv_bo_get_plane_offset(bo_, plane);
 		} else {
 			struct rectangle r = *rect;
 
@@ -149,24 +246,27 @@ int32_t cros_gralloc_buffer::lock(const struct rectangle *rect, uint32_t map_fla
 				r.height = drv_bo_get_height(bo_);
 			}
 
-			vaddr = drv_bo_map(bo_, &r, map_flags, &lock_data_[0], 0);
-		}
-
-		if (vaddr == MAP_FAILED) {
-			ALOGE("Mapping failed.");
-			return -EFAULT;
+			if (drv_bo_map_planes(bo_, &r, map_flags, &lock_data_[0], plane_addrs,
+					      plane_strides)) {
+				ALOGE("Mapping failed.");
+				return -EFAULT;
+			}
 		}
 	}
 
 	for (uint32_t plane = 0; plane < hnd_->num_planes; plane++)
-		addr[plane] = static_cast<uint8_t *>(vaddr) + drv_bo_get_plane_offset(bo_, plane);
+		addr[plane] = static_cast<uint8_t *>(plane_addrs[plane]);
 
 	lockcount_++;
 	return 0;
 }
 
-int32_t cros_gralloc_buffer::unlock()
+int32_t cros_gralloc_buffer::unlock(int32_t *release_fence)
 {
+	auto lock = lock_state();
+
+	*release_fence = -1;
+
 	if (lockcount_ <= 0) {
 		ALOGE("Buffer was not locked.");
 		return -EINVAL;
@@ -174,7 +274,7 @@ int32_t cros_gralloc_buffer::unlock()
 
 	if (!--lockcount_) {
 		if (lock_data_[0]) {
-			drv_bo_flush_or_unmap(bo_, lock_data_[0]);
+			drv_bo_flush_or_unmap_fenced(bo_, lock_data_[0], release_fence);
 			lock_data_[0] = nullptr;
 		}
 	}
@@ -191,6 +291,8 @@ int32_t cros_gralloc_buffer::resource_info(uint32_t strides[DRV_MAX_PLANES],
 
 int32_t cros_gralloc_buffer::invalidate()
 {
+	auto lock = lock_state();
+
 	if (lockcount_ <= 0) {
 		ALOGE("Buffer was not locked.");
 		return -EINVAL;
@@ -204,6 +306,8 @@ int32_t cros_gralloc_buffer::invalidate()
 
 int32_t cros_gralloc_buffer::flush()
 {
+	auto lock = lock_state();
+
 	if (lockcount_ <= 0) {
 		ALOGE("Buffer was not locked.");
 		return -EINVAL;
@@ -217,23 +321,66 @@ int32_t cros_gralloc_buffer::flush()
 
 int32_t cros_gralloc_buffer::get_reserved_region(void **addr, uint64_t *size) const
 {
-	int32_t reserved_region_fd = hnd_->fds[hnd_->num_planes];
+	int32_t reserved_region_fd = cros_gralloc_handle_reserved_region_fd(hnd_);
 	if (reserved_region_fd < 0) {
 		ALOGE("Buffer does not have reserved region.");
 		return -EINVAL;
 	}
 
+	auto lock = lock_state();
 	if (!reserved_region_addr_) {
-		reserved_region_addr_ =
-		    mmap(nullptr, hnd_->reserved_region_size, PROT_WRITE | PROT_READ, MAP_SHARED,
-			 reserved_region_fd, 0);
-		if (reserved_region_addr_ == MAP_FAILED) {
-			ALOGE("Failed to mmap reserved region: %s.", strerror(errno));
+		void *region_addr = reserved_region_acquire(
+		    reserved_region_fd, hnd_->reserved_region_size, &reserved_region_key_);
+		if (region_addr == MAP_FAILED)
 			return -errno;
-		}
+
+		reserved_region_addr_ = region_addr;
 	}
 
 	*addr = reserved_region_addr_;
 	*size = hnd_->reserved_region_size;
 	return 0;
 }
+
+int64_t cros_gralloc_buffer::get_cached_metadata(uint64_t key, void *out, size_t out_size) const
+{
+	std::lock_guard<std::mutex> lock(metadata_cache_mutex_);
+
+	for (const auto &entry : metadata_cache_) {
+		if (entry.first != key)
+			continue;
+
+		if (entry.second.size() <= out_size)
+			memcpy(out, entry.second.data(), entry.second.size());
+		return entry.second.size();
+	}
+
+	return -1;
+}
+
+bool cros_gralloc_buffer::get_cached_metadata(uint64_t key, std::vector<uint8_t> *out) const
+{
+	std::lock_guard<std::mutex> lock(metadata_cache_mutex_);
+
+	for (const auto &entry : metadata_cache_) {
+		if (entry.first == key) {
+			*out = entry.second;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void cros_gralloc_buffer::set_cached_metadata(uint64_t key, const void *data, size_t size) const
+{
+	const uint8_t *bytes = static_cast<const uint8_t *>(data);
+	std::lock_guard<std::mutex> lock(metadata_cache_mutex_);
+
+	for (const auto &entry : metadata_cache_) {
+		if (entry.first == key)
+			return;
+	}
+
+	metadata_cache_.emplace_back(key, std::vector<uint8_t>(bytes, bytes + size));
+}
@@ -8,6 +8,11 @@
 #define CROS_GRALLOC_BUFFER_H
 
 #include <memory>
+#include <mutex>
+#include <sys/types.h>
+#include <tuple>
+#include <utility>
+#include <vector>
 
 #include "cros_gralloc_helpers.h"
 
@@ -38,7 +43,7 @@ class cros_gralloc_buffer
 
 	int32_t lock(const struct rectangle *rect, uint32_t map_flags,
 		     uint8_t *addr[DRV_MAX_PLANES]);
-	int32_t unlock();
+	int32_t unlock(int32_t *release_fence);
 	int32_t resource_info(uint32_t strides[DRV_MAX_PLANES], uint32_t offsets[DRV_MAX_PLANES],
 			      uint64_t *format_modifier);
 
@@ -48,12 +53,26 @@ class cros_gralloc_buffer
 	int32_t get_reserved_region(void **reserved_region_addr,
 				    uint64_t *reserved_region_size) const;
 
+	/*
+	 * Encoded metadata of types that can't change over the life of the buffer, cached per
+	 * process so repeated mapper queries are a copy. The keys are up to the mapper. The first
+	 * returns the encoded size, copying it out if it fits in out_size, or -1 on a miss.
+	 */
+	int64_t get_cached_metadata(uint64_t key, void *out, size_t out_size) const;
+	bool get_cached_metadata(uint64_t key, std::vector<uint8_t> *out) const;
+	void set_cached_metadata(uint64_t key, const void *data, size_t size) const;
+
+	/* Contention on the per-buffer locks, summed over all buffers in the process. */
+	static const cros_gralloc_lock_stats &get_lock_stats();
+
       private:
 	cros_gralloc_buffer(struct bo *acquire_bo, struct cros_gralloc_handle *acquire_handle);
 
 	cros_gralloc_buffer(cros_gralloc_buffer const &);
 	cros_gralloc_buffer operator=(cros_gralloc_buffer const &);
 
+	std::unique_lock<std::mutex> lock_state() const;
+
 	struct bo *bo_;
 
 	/* Note: this will be nullptr for imported/retained buffers. */
@@ -64,8 +83,24 @@ class cros_gralloc_buffer
 
 	struct mapping *lock_data_[DRV_MAX_PLANES];
 
-	/* Optional additional shared memory region attached to some gralloc buffers. */
+	/*
+	 * Optional additional shared memory region attached to some gralloc buffers. The mapping
+	 * is shared with the other buffers of the process holding the same region file.
+	 */
 	mutable void *reserved_region_addr_ = nullptr;
+	mutable std::tuple<dev_t, ino_t, uint64_t> reserved_region_key_;
+
+	/*
+	 * Protects the lock/unlock state and the reserved region mapping, so threads accessing
+	 * different buffers don't serialize on the driver.
+	 */
+	mutable std::mutex mutex_;
+
+	/* A handful of entries at most, so a vector is searched linearly. */
+	mutable std::vector<std::pair<uint64_t, std::vector<uint8_t>>> metadata_cache_;
+	mutable std::mutex metadata_cache_mutex_;
+
+	static cros_gralloc_lock_stats lock_stats_;
 };
 
 #endif
@@ -6,12 +6,14 @@
 
 #include "cros_gralloc_driver.h"
 
+#include <algorithm>
 #include <cstdlib>
 #include <cutils/properties.h>
 #include <fcntl.h>
 #include <hardware/gralloc.h>
 #include <sys/mman.h>
 #include <syscall.h>
+#include <thread>
 #include <xf86drm.h>
 
 #include "../util.h"
@@ -173,6 +175,44 @@ bool cros_gralloc_driver::is_initialized()
 bool cros_gralloc_driver::get_resolved_format_and_use_flags(
     const struct cros_gralloc_buffer_descriptor *descriptor, uint32_t *out_format,
     uint64_t *out_use_flags)
+{
+	const resolve_key key = { descriptor->drm_format, descriptor->droid_format,
+				  descriptor->droid_usage, descriptor->use_flags };
+	resolve_result result;
+
+	{
+		std::shared_lock<std::shared_timed_mutex> lock(resolve_cache_mutex_);
+		auto it = resolve_cache_.find(key);
+		if (it != resolve_cache_.end()) {
+			resolve_cache_hits_++;
+			result = it->second;
+			goto out;
+		}
+	}
+
+	resolve_cache_misses_++;
+	result.supported = resolve_format_and_use_flags(descriptor, &result.format,
+							&result.use_flags);
+
+	{
+		std::unique_lock<std::shared_timed_mutex> lock(resolve_cache_mutex_);
+		if (resolve_cache_.size() >= kMaxResolveCacheEntries)
+			resolve_cache_.clear();
+		resolve_cache_.emplace(key, result);
+	}
+
+out:
+	if (!result.supported)
+		return false;
+
+	*out_format = result.format;
+	*out_use_flags = result.use_flags;
+	return true;
+}
+
+bool cros_gralloc_driver::resolve_format_and_use_flags(
+    const struct cros_gralloc_buffer_descriptor *descriptor, uint32_t *out_format,
+    uint64_t *out_use_flags)
 {
 	uint32_t resolved_format;
 	uint64_t resolved_use_flags;
@@ -238,34 +278,23 @@ int cros_gralloc_driver::create_reserved_region(const std::string &buffer_name,
 	return -1;
 }
 
-int32_t cros_gralloc_driver::allocate(const struct cros_gralloc_buffer_descriptor *descriptor,
-				      native_handle_t **out_handle)
+int32_t cros_gralloc_driver::create_buffer(const struct cros_gralloc_buffer_descriptor *descriptor,
+					   struct bo *bo,
+					   std::unique_ptr<cros_gralloc_buffer> *out_buffer,
+					   struct cros_gralloc_handle **out_handle)
 {
 	int ret = 0;
 	size_t num_planes;
+	size_t num_plane_fds;
 	size_t num_fds;
 	size_t num_ints;
-	uint32_t resolved_format;
 	uint32_t bytes_per_pixel;
-	uint64_t resolved_use_flags;
-	struct bo *bo;
 	struct cros_gralloc_handle *hnd;
 	std::unique_ptr<cros_gralloc_buffer> buffer;
 
-	if (!get_resolved_format_and_use_flags(descriptor, &resolved_format, &resolved_use_flags)) {
-		ALOGE("Failed to resolve format and use_flags.");
-		return -EINVAL;
-	}
-
-	bo = drv_bo_create(drv_.get(), descriptor->width, descriptor->height, resolved_format,
-			   resolved_use_flags);
-	if (!bo) {
-		ALOGE("Failed to create bo.");
-		return -errno;
-	}
-
 	num_planes = drv_bo_get_num_planes(bo);
-	num_fds = num_planes;
+	num_plane_fds = drv_bo_get_num_fds(bo);
+	num_fds = num_plane_fds;
 
 	if (descriptor->reserved_region_size > 0)
 		num_fds += 1;
@@ -281,11 +310,14 @@ int32_t cros_gralloc_driver::allocate(const struct cros_gralloc_buffer_descripto
 
 	hnd->num_planes = num_planes;
 	for (size_t plane = 0; plane < num_planes; plane++) {
-		ret = drv_bo_get_plane_fd(bo, plane);
-		if (ret < 0)
-			goto destroy_hnd;
+		if (plane < num_plane_fds) {
+			ret = drv_bo_get_plane_fd(bo, plane);
+			if (ret < 0)
+				goto destroy_hnd;
+
+			hnd->fds[plane] = ret;
+		}
 
-		hnd->fds[plane] = ret;
 		hnd->strides[plane] = drv_bo_get_plane_stride(bo, plane);
 		hnd->offsets[plane] = drv_bo_get_plane_offset(bo, plane);
 		hnd->sizes[plane] = drv_bo_get_plane_size(bo, plane);
@@ -297,7 +329,7 @@ int32_t cros_gralloc_driver::allocate(const struct cros_gralloc_buffer_descripto
 		if (ret < 0)
 			goto destroy_hnd;
 
-		hnd->fds[hnd->num_planes] = ret;
+		hnd->fds[num_plane_fds] = ret;
 	}
 
 	static std::atomic<uint32_t> next_buffer_id{ 1 };
@@ -322,31 +354,140 @@ int32_t cros_gralloc_driver::allocate(const struct cros_gralloc_buffer_descripto
 		goto destroy_hnd;
 	}
 
-	{
-		std::lock_guard<std::mutex> lock(mutex_);
-
-		struct cros_gralloc_imported_handle_info hnd_info = {
-			.buffer = buffer.get(),
-			.refcount = 1,
-		};
-		handles_.emplace(hnd, hnd_info);
-		buffers_.emplace(hnd->id, std::move(buffer));
-	}
-
+	*out_buffer = std::move(buffer);
 	*out_handle = hnd;
 	return 0;
 
 destroy_hnd:
 	native_handle_close(hnd);
 	native_handle_delete(hnd);
-
-	drv_bo_destroy(bo);
 	return ret;
 }
 
+int32_t cros_gralloc_driver::allocate(const struct cros_gralloc_buffer_descriptor *descriptor,
+				      native_handle_t **out_handle)
+{
+	return allocate(descriptor, 1, out_handle);
+}
+
+int32_t cros_gralloc_driver::allocate(const struct cros_gralloc_buffer_descriptor *descriptor,
+				      uint32_t count, native_handle_t **out_handles,
+				      const std::function<int32_t(cros_gralloc_buffer *)> &init)
+{
+	uint32_t i;
+	uint32_t num_workers;
+	uint32_t resolved_format;
+	uint64_t resolved_use_flags;
+	struct bo *first;
+	std::vector<struct bo *> bos(count, nullptr);
+	std::vector<std::unique_ptr<cros_gralloc_buffer>> buffers(count);
+	std::vector<struct cros_gralloc_handle *> hnds(count, nullptr);
+	std::vector<std::thread> workers;
+	std::atomic<uint32_t> next_index{ 0 };
+	std::atomic<int32_t> error{ 0 };
+
+	if (!count)
+		return -EINVAL;
+
+	if (!get_resolved_format_and_use_flags(descriptor, &resolved_format, &resolved_use_flags)) {
+		ALOGE("Failed to resolve format and use_flags.");
+		return -EINVAL;
+	}
+
+	/* The first BO computes the layout the others are created from. */
+	first = drv_bo_create(drv_.get(), descriptor->width, descriptor->height, resolved_format,
+			      resolved_use_flags);
+	if (!first && errno == ENOMEM) {
+		/* The pools and caches may be what is in the way. */
+		trim(DRV_TRIM_COMPLETE);
+		first = drv_bo_create(drv_.get(), descriptor->width, descriptor->height,
+				      resolved_format, resolved_use_flags);
+	}
+
+	if (!first) {
+		ALOGE("Failed to create bo.");
+		return errno ? -errno : -ENOMEM;
+	}
+
+	bos[0] = first;
+
+	/*
+	 * Every worker takes the next buffer and carries it from the kernel allocation through
+	 * the exports to init, so that one buffer's metadata is set up while another's BO is
+	 * being created. Workers stop at the first failure.
+	 */
+	auto work = [&]() {
+		uint32_t index;
+
+		while (!error && (index = next_index++) < count) {
+			int32_t ret = 0;
+
+			if (index) {
+				bos[index] = drv_bo_create_like(first);
+				if (!bos[index])
+					ret = errno ? -errno : -ENOMEM;
+			}
+
+			if (!ret)
+				ret = create_buffer(descriptor, bos[index], &buffers[index],
+						    &hnds[index]);
+
+			if (!ret && init)
+				ret = init(buffers[index].get());
+
+			if (ret) {
+				int32_t expected = 0;
+				error.compare_exchange_strong(expected, ret);
+			}
+		}
+	};
+
+	num_workers = std::min({ count, kMaxAllocationWorkers,
+				 std::max(1u, std::thread::hardware_concurrency()) });
+	for (i = 1; i < num_workers; i++)
+		workers.emplace_back(work);
+	work();
+	for (auto &worker : workers)
+		worker.join();
+
+	if (error) {
+		ALOGE("Failed to allocate %u buffers.", count);
+
+		/* Buffers created so far own their BOs, the others are destroyed directly. */
+		for (i = 0; i < count; i++) {
+			if (hnds[i]) {
+				native_handle_close(hnds[i]);
+				native_handle_delete(hnds[i]);
+			} else if (bos[i]) {
+				drv_bo_destroy(bos[i]);
+			}
+		}
+
+		return error;
+	}
+
+	{
+		auto lock = write_lock_registry();
+
+		for (i = 0; i < count; i++) {
+			struct cros_gralloc_imported_handle_info hnd_info = {
+				.buffer = buffers[i].get(),
+				.refcount = 1,
+			};
+			handles_.emplace(hnds[i], hnd_info);
+			buffers_.emplace(hnds[i]->id, std::move(buffers[i]));
+		}
+	}
+
+	for (i = 0; i < count; i++)
+		out_handles[i] = hnds[i];
+
+	return 0;
+}
+
 int32_t cros_gralloc_driver::retain(buffer_handle_t handle)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
+	auto lock = write_lock_registry();
 
 	auto hnd = cros_gralloc_convert_handle(handle);
 	if (!hnd) {
@@ -391,7 +532,10 @@ int32_t cros_gralloc_driver::retain(buffer_handle_t handle)
 			.tiling = hnd->tiling,
 			.use_flags = hnd->use_flags,
 		};
-		memcpy(data.fds, hnd->fds, sizeof(data.fds));
+		for (uint32_t plane = 0; plane < DRV_MAX_PLANES; plane++)
+			data.fds[plane] = plane < hnd->num_planes ?
+					      cros_gralloc_handle_plane_fd(hnd, plane) :
+					      -1;
 		memcpy(data.strides, hnd->strides, sizeof(data.strides));
 		memcpy(data.offsets, hnd->offsets, sizeof(data.offsets));
 
@@ -418,7 +562,7 @@ int32_t cros_gralloc_driver::retain(buffer_handle_t handle)
 
 int32_t cros_gralloc_driver::release(buffer_handle_t handle)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
+	auto lock = write_lock_registry();
 
 	auto hnd = cros_gralloc_convert_handle(handle);
 	if (!hnd) {
@@ -446,30 +590,71 @@ int32_t cros_gralloc_driver::lock(buffer_handle_t handle, int32_t acquire_fence,
 				  bool close_acquire_fence, const struct rectangle *rect,
 				  uint32_t map_flags, uint8_t *addr[DRV_MAX_PLANES])
 {
-	int32_t ret = cros_gralloc_sync_wait(acquire_fence, close_acquire_fence);
-	if (ret)
-		return ret;
+	int32_t ret;
+	cros_gralloc_buffer *buffer = nullptr;
+	int32_t release_fence;
+	/*
+	 * With an acquire fence, the mapping (mmap, staging buffer setup) is done first and only
+	 * the invalidate, which reads the contents, waits for the producer. Neither the registry
+	 * lock nor the buffer lock is held while waiting.
+	 */
+	bool defer = acquire_fence >= 0 && map_flags;
 
-	std::lock_guard<std::mutex> lock(mutex_);
+	if (defer) {
+		map_flags |= BO_MAP_DEFER_INVALIDATE;
+	} else {
+		ret = cros_gralloc_sync_wait(acquire_fence, close_acquire_fence);
+		if (ret)
+			return ret;
+	}
 
 	auto hnd = cros_gralloc_convert_handle(handle);
-	if (!hnd) {
-		ALOGE("Invalid handle.");
-		return -EINVAL;
+	{
+		auto lock = read_lock_registry();
+
+		if (!hnd) {
+			ALOGE("Invalid handle.");
+			ret = -EINVAL;
+		} else if (!(buffer = get_buffer(hnd))) {
+			ALOGE("Invalid reference (lock() called on unregistered handle).");
+			ret = -EINVAL;
+		} else {
+			ret = buffer->lock(rect, map_flags, addr);
+		}
 	}
 
-	auto buffer = get_buffer(hnd);
+	if (!defer)
+		return ret;
+
+	if (ret) {
+		if (close_acquire_fence)
+			close(acquire_fence);
+		return ret;
+	}
+
+	ret = cros_gralloc_sync_wait(acquire_fence, close_acquire_fence);
+
+	auto lock = read_lock_registry();
+
+	/* The buffer can't go away while locked, but look it up again the way other calls do. */
+	buffer = get_buffer(hnd);
 	if (!buffer) {
-		ALOGE("Invalid reference (lock() called on unregistered handle).");
+		ALOGE("Buffer released while being locked.");
 		return -EINVAL;
 	}
 
-	return buffer->lock(rect, map_flags, addr);
+	if (!ret)
+		ret = buffer->invalidate();
+
+	if (ret && !buffer->unlock(&release_fence) && release_fence >= 0)
+		close(release_fence);
+
+	return ret;
 }
 
 int32_t cros_gralloc_driver::unlock(buffer_handle_t handle, int32_t *release_fence)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
+	auto lock = read_lock_registry();
 
 	auto hnd = cros_gralloc_convert_handle(handle);
 	if (!hnd) {
@@ -488,14 +673,15 @@ int32_t cros_gralloc_driver::unlock(buffer_handle_t handle, int32_t *release_fen
 	 *
 	 * "A value of -1 indicates that the caller may access the buffer immediately without
 	 * waiting on a fence."
+	 *
+	 * Backends that can flush asynchronously return a fence for the flush instead.
 	 */
-	*release_fence = -1;
-	return buffer->unlock();
+	return buffer->unlock(release_fence);
 }
 
 int32_t cros_gralloc_driver::invalidate(buffer_handle_t handle)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
+	auto lock = read_lock_registry();
 
 	auto hnd = cros_gralloc_convert_handle(handle);
 	if (!hnd) {
@@ -514,7 +700,7 @@ int32_t cros_gralloc_driver::invalidate(buffer_handle_t handle)
 
 int32_t cros_gralloc_driver::flush(buffer_handle_t handle)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
+	auto lock = read_lock_registry();
 
 	auto hnd = cros_gralloc_convert_handle(handle);
 	if (!hnd) {
@@ -533,7 +719,7 @@ int32_t cros_gralloc_driver::flush(buffer_handle_t handle)
 
 int32_t cros_gralloc_driver::get_backing_store(buffer_handle_t handle, uint64_t *out_store)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
+	auto lock = read_lock_registry();
 
 	auto hnd = cros_gralloc_convert_handle(handle);
 	if (!hnd) {
@@ -555,7 +741,7 @@ int32_t cros_gralloc_driver::resource_info(buffer_handle_t handle, uint32_t stri
 					   uint32_t offsets[DRV_MAX_PLANES],
 					   uint64_t *format_modifier)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
+	auto lock = read_lock_registry();
 
 	auto hnd = cros_gralloc_convert_handle(handle);
 	if (!hnd) {
@@ -576,7 +762,7 @@ int32_t cros_gralloc_driver::get_reserved_region(buffer_handle_t handle,
 						 void **reserved_region_addr,
 						 uint64_t *reserved_region_size)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
+	auto lock = read_lock_registry();
 
 	auto hnd = cros_gralloc_convert_handle(handle);
 	if (!hnd) {
@@ -595,28 +781,59 @@ int32_t cros_gralloc_driver::get_reserved_region(buffer_handle_t handle,
 
 uint32_t cros_gralloc_driver::get_resolved_drm_format(uint32_t drm_format, uint64_t use_flags)
 {
+	const resolve_key key = { drm_format, 0, 0, use_flags };
 	uint32_t resolved_format;
 	uint64_t resolved_use_flags;
 
+	{
+		std::shared_lock<std::shared_timed_mutex> lock(resolve_cache_mutex_);
+		auto it = resolved_drm_format_cache_.find(key);
+		if (it != resolved_drm_format_cache_.end()) {
+			resolve_cache_hits_++;
+			return it->second;
+		}
+	}
+
+	resolve_cache_misses_++;
 	drv_resolve_format_and_use_flags(drv_.get(), drm_format, use_flags, &resolved_format,
 					 &resolved_use_flags);
 
+	std::unique_lock<std::shared_timed_mutex> lock(resolve_cache_mutex_);
+	if (resolved_drm_format_cache_.size() >= kMaxResolveCacheEntries)
+		resolved_drm_format_cache_.clear();
+	resolved_drm_format_cache_.emplace(key, resolved_format);
+
 	return resolved_format;
 }
 
 cros_gralloc_buffer *cros_gralloc_driver::get_buffer(cros_gralloc_handle_t hnd)
 {
-	/* Assumes driver mutex is held. */
-	if (handles_.count(hnd))
-		return handles_[hnd].buffer;
+	/* Assumes driver mutex is held, possibly shared, so the registry must not be modified. */
+	auto hnd_it = handles_.find(hnd);
+	if (hnd_it != handles_.end())
+		return hnd_it->second.buffer;
 
 	return nullptr;
 }
 
+std::shared_lock<std::shared_timed_mutex> cros_gralloc_driver::read_lock_registry()
+{
+	std::shared_lock<std::shared_timed_mutex> lock(mutex_, std::defer_lock);
+	cros_gralloc_counted_lock(lock, registry_lock_stats_);
+	return lock;
+}
+
+std::unique_lock<std::shared_timed_mutex> cros_gralloc_driver::write_lock_registry()
+{
+	std::unique_lock<std::shared_timed_mutex> lock(mutex_, std::defer_lock);
+	cros_gralloc_counted_lock(lock, registry_lock_stats_);
+	return lock;
+}
+
 void cros_gralloc_driver::with_buffer(cros_gralloc_handle_t hnd,
 				      const std::function<void(cros_gralloc_buffer *)> &function)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
+	auto lock = read_lock_registry();
 
 	auto buffer = get_buffer(hnd);
 	if (!buffer) {
@@ -630,8 +847,58 @@ void cros_gralloc_driver::with_buffer(cros_gralloc_handle_t hnd,
 void cros_gralloc_driver::with_each_buffer(
     const std::function<void(cros_gralloc_buffer *)> &function)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
+	auto lock = read_lock_registry();
 
 	for (const auto &pair : buffers_)
 		function(pair.second.get());
 }
+
+void cros_gralloc_driver::get_resolve_cache_stats(uint64_t *hits, uint64_t *misses)
+{
+	*hits = resolve_cache_hits_;
+	*misses = resolve_cache_misses_;
+}
+
+void cros_gralloc_driver::get_stats(struct drv_stats *stats)
+{
+	const cros_gralloc_lock_stats &buffer_stats = cros_gralloc_buffer::get_lock_stats();
+
+	drv_get_stats(drv_.get(), stats);
+	stats->counters[DRV_STATS_LOCK_WAIT_NS] +=
+	    registry_lock_stats_.wait_ns + buffer_stats.wait_ns;
+	stats->counters[DRV_STATS_LOCK_ACQUISITIONS] +=
+	    registry_lock_stats_.acquired + buffer_stats.acquired;
+	stats->counters[DRV_STATS_LOCK_CONTENTIONS] +=
+	    registry_lock_stats_.contended + buffer_stats.contended;
+}
+
+void cros_gralloc_driver::get_memory_info(struct drv_memory_info *info,
+					  std::vector<struct drv_memory_usage> *usage)
+{
+	uint32_t count;
+
+	drv_get_memory_info(drv_.get(), info);
+
+	/* Entries may come and go between the two calls. */
+	usage->resize(drv_get_memory_usage(drv_.get(), nullptr, 0));
+	count = drv_get_memory_usage(drv_.get(), usage->data(), usage->size());
+	usage->resize(std::min<size_t>(count, usage->size()));
+}
+
+int32_t cros_gralloc_driver::prefill(const struct cros_gralloc_buffer_descriptor *descriptor,
+				     uint32_t count)
+{
+	uint32_t resolved_format;
+	uint64_t resolved_use_flags;
+
+	if (!get_resolved_format_and_use_flags(descriptor, &resolved_format, &resolved_use_flags))
+		return -EINVAL;
+
+	return drv_bo_pool_prefill(drv_.get(), descriptor->width, descriptor->height,
+				   resolved_format, resolved_use_flags, count);
+}
+
+void cros_gralloc_driver::trim(enum drv_trim_level level)
+{
+	drv_trim(drv_.get(), level);
+}
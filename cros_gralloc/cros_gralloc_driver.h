@@ -9,11 +9,14 @@
 
 #include "cros_gralloc_buffer.h"
 
+#include <atomic>
 #include <functional>
 #include <memory>
 #include <mutex>
+#include <shared_mutex>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 #if ANDROID_API_LEVEL >= 31 && defined(HAS_DMABUF_SYSTEM_HEAP)
 #include <BufferAllocator/BufferAllocator.h>
@@ -28,6 +31,20 @@ class cros_gralloc_driver
 	bool is_supported(const struct cros_gralloc_buffer_descriptor *descriptor);
 	int32_t allocate(const struct cros_gralloc_buffer_descriptor *descriptor,
 			 native_handle_t **out_handle);
+	/*
+	 * Allocates count buffers sharing a single layout computation, spread over up to
+	 * kMaxAllocationWorkers threads. init, if set, is called on each buffer as soon as it is
+	 * created, before any is registered. All or none are created.
+	 */
+	int32_t allocate(const struct cros_gralloc_buffer_descriptor *descriptor, uint32_t count,
+			 native_handle_t **out_handles,
+			 const std::function<int32_t(cros_gralloc_buffer *)> &init = nullptr);
+
+	/*
+	 * Creates up to count BOs for descriptor into the BO pool ahead of an expected allocation
+	 * burst, see drv_bo_pool_prefill(). Returns the number created or a negative errno.
+	 */
+	int32_t prefill(const struct cros_gralloc_buffer_descriptor *descriptor, uint32_t count);
 
 	int32_t retain(buffer_handle_t handle);
 	int32_t release(buffer_handle_t handle);
@@ -53,15 +70,33 @@ class cros_gralloc_driver
 			 const std::function<void(cros_gralloc_buffer *)> &function);
 	void with_each_buffer(const std::function<void(cros_gralloc_buffer *)> &function);
 
+	/* Lookup counts of the format resolution memo, reported when buffers are dumped. */
+	void get_resolve_cache_stats(uint64_t *hits, uint64_t *misses);
+
+	/* drv_get_stats(), with the acquisitions of and waits on the gralloc locks added in. */
+	void get_stats(struct drv_stats *stats);
+
+	void get_memory_info(struct drv_memory_info *info,
+			     std::vector<struct drv_memory_usage> *usage);
+	/* Gives back the memory the driver holds in pools and caches. */
+	void trim(enum drv_trim_level level);
+
       private:
 	cros_gralloc_driver();
 	bool is_initialized();
 	cros_gralloc_buffer *get_buffer(cros_gralloc_handle_t hnd);
+	std::shared_lock<std::shared_timed_mutex> read_lock_registry();
+	std::unique_lock<std::shared_timed_mutex> write_lock_registry();
 	bool
 	get_resolved_format_and_use_flags(const struct cros_gralloc_buffer_descriptor *descriptor,
 					  uint32_t *out_format, uint64_t *out_use_flags);
+	bool resolve_format_and_use_flags(const struct cros_gralloc_buffer_descriptor *descriptor,
+					  uint32_t *out_format, uint64_t *out_use_flags);
 
 	int create_reserved_region(const std::string &buffer_name, uint64_t reserved_region_size);
+	int32_t create_buffer(const struct cros_gralloc_buffer_descriptor *descriptor,
+			      struct bo *bo, std::unique_ptr<cros_gralloc_buffer> *out_buffer,
+			      struct cros_gralloc_handle **out_handle);
 
 #if ANDROID_API_LEVEL >= 31 && defined(HAS_DMABUF_SYSTEM_HEAP)
 	/* For allocating cros_gralloc_buffer reserved regions for metadata. */
@@ -70,6 +105,9 @@ class cros_gralloc_driver
 
 	std::unique_ptr<struct driver, void (*)(struct driver *)> drv_;
 
+	/* Enough to overlap the kernel work of a buffer queue without flooding the system. */
+	static constexpr uint32_t kMaxAllocationWorkers = 4;
+
 	struct cros_gralloc_imported_handle_info {
 		/*
 		 * The underlying buffer for referred to by this handle (as multiple handles can
@@ -81,9 +119,57 @@ class cros_gralloc_driver
 		int32_t refcount = 1;
 	};
 
-	std::mutex mutex_;
+	/*
+	 * Guards buffers_ and handles_. Lookups (lock, unlock, flush, ...) take it shared and
+	 * rely on the per-buffer lock for the buffer state, so only retain, release and allocate
+	 * are exclusive.
+	 */
+	std::shared_timed_mutex mutex_;
+	cros_gralloc_lock_stats registry_lock_stats_;
 	std::unordered_map<uint32_t, std::unique_ptr<cros_gralloc_buffer>> buffers_;
 	std::unordered_map<cros_gralloc_handle_t, cros_gralloc_imported_handle_info> handles_;
+
+	struct resolve_key {
+		uint32_t drm_format;
+		int32_t droid_format;
+		int64_t droid_usage;
+		uint64_t use_flags;
+
+		bool operator==(const resolve_key &other) const
+		{
+			return drm_format == other.drm_format &&
+			       droid_format == other.droid_format &&
+			       droid_usage == other.droid_usage && use_flags == other.use_flags;
+		}
+	};
+
+	struct resolve_key_hash {
+		size_t operator()(const resolve_key &key) const
+		{
+			size_t h = std::hash<uint64_t>()(key.use_flags);
+			h = h * 31 + std::hash<int64_t>()(key.droid_usage);
+			h = h * 31 + std::hash<uint32_t>()(key.drm_format);
+			return h * 31 + std::hash<int32_t>()(key.droid_format);
+		}
+	};
+
+	struct resolve_result {
+		bool supported;
+		uint32_t format;
+		uint64_t use_flags;
+	};
+
+	/*
+	 * Memoized format resolution. The backend's answers only depend on state set up when
+	 * drv_ is created, so entries stay valid for the lifetime of this driver. The cache is
+	 * cleared instead of growing past kMaxResolveCacheEntries.
+	 */
+	static constexpr size_t kMaxResolveCacheEntries = 256;
+	std::shared_timed_mutex resolve_cache_mutex_;
+	std::unordered_map<resolve_key, resolve_result, resolve_key_hash> resolve_cache_;
+	std::unordered_map<resolve_key, uint32_t, resolve_key_hash> resolved_drm_format_cache_;
+	std::atomic<uint64_t> resolve_cache_hits_{ 0 };
+	std::atomic<uint64_t> resolve_cache_misses_{ 0 };
 };
 
 #endif
@@ -19,8 +19,10 @@ struct cros_gralloc_handle : public native_handle_t {
 	 * descriptors must be packed at the beginning of this array to work with
 	 * native_handle_clone().
 	 *
-	 * This field contains 'num_planes' plane file descriptors followed by an optional metadata
-	 * reserved region file descriptor if 'reserved_region_size' is greater than zero.
+	 * This field contains the plane file descriptors followed by an optional metadata reserved
+	 * region file descriptor if 'reserved_region_size' is greater than zero. Planes backed by
+	 * one buffer object share a single file descriptor and are told apart by 'offsets', so
+	 * there are either 'num_planes' plane file descriptors or just one.
 	 */
 	int32_t fds[DRV_MAX_FDS];
 	uint32_t strides[DRV_MAX_PLANES];
@@ -4,8 +4,12 @@
  * found in the LICENSE file.
  */
 
+#define ATRACE_TAG ATRACE_TAG_GRAPHICS
+
 #include "cros_gralloc_helpers.h"
 
+#include <cinttypes>
+#include <cutils/trace.h>
 #include <hardware/gralloc.h>
 #include <sync/sync.h>
 
@@ -148,6 +152,14 @@ uint32_t cros_gralloc_convert_map_usage(uint64_t usage)
 	if (usage & GRALLOC_USAGE_SW_WRITE_MASK)
 		map_flags |= BO_MAP_WRITE;
 
+	/*
+	 * Frequent CPU access is what camera and screen capture clients ask for, which touch every
+	 * page of the frame in order, so the mapping is faulted in up front.
+	 */
+	if ((usage & GRALLOC_USAGE_SW_READ_MASK) == GRALLOC_USAGE_SW_READ_OFTEN ||
+	    (usage & GRALLOC_USAGE_SW_WRITE_MASK) == GRALLOC_USAGE_SW_WRITE_OFTEN)
+		map_flags |= BO_MAP_POPULATE | BO_MAP_SEQUENTIAL;
+
 	return map_flags;
 }
 
@@ -161,14 +173,32 @@ cros_gralloc_handle_t cros_gralloc_convert_handle(buffer_handle_t handle)
 	if (!hnd || hnd->magic != cros_gralloc_magic)
 		return nullptr;
 
-	// if hnd->reserved_region_size == 0, handle->numFds is hnd->num_planes
-	// if hnd->reserved_region_size > 0, handle->numFds is hnd->num_planes + 1
-	if ((uint32_t)handle->numFds != hnd->num_planes + (hnd->reserved_region_size > 0))
+	// handle->numFds is either 1 or hnd->num_planes, plus 1 if hnd->reserved_region_size > 0
+	uint32_t num_plane_fds = cros_gralloc_handle_num_plane_fds(hnd);
+	if (num_plane_fds != 1 && num_plane_fds != hnd->num_planes)
 		return nullptr;
 
 	return hnd;
 }
 
+uint32_t cros_gralloc_handle_num_plane_fds(cros_gralloc_handle_t hnd)
+{
+	return hnd->numFds - (hnd->reserved_region_size > 0);
+}
+
+int32_t cros_gralloc_handle_plane_fd(cros_gralloc_handle_t hnd, uint32_t plane)
+{
+	return hnd->fds[cros_gralloc_handle_num_plane_fds(hnd) == 1 ? 0 : plane];
+}
+
+int32_t cros_gralloc_handle_reserved_region_fd(cros_gralloc_handle_t hnd)
+{
+	if (hnd->reserved_region_size == 0)
+		return -1;
+
+	return hnd->fds[cros_gralloc_handle_num_plane_fds(hnd)];
+}
+
 int32_t cros_gralloc_sync_wait(int32_t fence, bool close_fence)
 {
 	if (fence < 0)
@@ -205,3 +235,96 @@ std::string get_drm_format_string(uint32_t drm_format)
 	std::string s(sequence, 4);
 	return "DRM_FOURCC_" + s;
 }
+
+cros_gralloc_trace_scope::cros_gralloc_trace_scope(const char *name, cros_gralloc_handle_t hnd)
+    : active_(atrace_is_tag_enabled(ATRACE_TAG))
+{
+	char label[128];
+
+	if (!active_)
+		return;
+
+	snprintf(label, sizeof(label), "%s id=%u %ux%u %s size=%" PRIu64, name, hnd->id, hnd->width,
+		 hnd->height, get_drm_format_string(hnd->format).c_str(), hnd->total_size);
+	atrace_begin(ATRACE_TAG, label);
+}
+
+cros_gralloc_trace_scope::~cros_gralloc_trace_scope()
+{
+	if (active_)
+		atrace_end(ATRACE_TAG);
+}
+
+/* Returns the upper bound in microseconds of the bucket holding the given fraction of calls. */
+static uint64_t stats_percentile_us(const uint64_t *buckets, uint64_t calls, double fraction)
+{
+	uint64_t seen = 0;
+
+	for (uint32_t i = 0; i < DRV_STATS_NUM_BUCKETS; i++) {
+		seen += buckets[i];
+		if (seen >= calls * fraction)
+			return 1ull << i;
+	}
+
+	return 1ull << (DRV_STATS_NUM_BUCKETS - 1);
+}
+
+void cros_gralloc_log_stats(const struct drv_stats *stats)
+{
+	static const char *const op_names[DRV_STATS_NUM_OPS] = {
+		"create", "import", "map", "invalidate", "flush", "unmap",
+	};
+	static const char *const counter_names[DRV_STATS_NUM_COUNTERS] = {
+		"host round trips",	"SDMA copies",		     "clflush bytes",
+		"shadow copy bytes",	"mapping lock wait ns",	     "backend lock wait ns",
+		"gralloc lock wait ns", "gralloc lock acquisitions", "gralloc lock contentions",
+		"metadata cache hits",	"metadata cache misses",     "size class roundings",
+		"size class reuses",	"pool prefills",
+	};
+
+	for (uint32_t op = 0; op < DRV_STATS_NUM_OPS; op++) {
+		uint64_t calls = 0;
+
+		for (uint32_t i = 0; i < DRV_STATS_NUM_BUCKETS; i++)
+			calls += stats->latency[op][i];
+
+		if (!calls)
+			continue;
+
+		ALOGI("Backend %s: %" PRIu64 " calls, %" PRIu64 " us avg, p50 < %" PRIu64
+		      " us, p99 < %" PRIu64 " us.",
+		      op_names[op], calls, stats->total_ns[op] / calls / 1000,
+		      stats_percentile_us(stats->latency[op], calls, 0.5),
+		      stats_percentile_us(stats->latency[op], calls, 0.99));
+	}
+
+	for (uint32_t counter = 0; counter < DRV_STATS_NUM_COUNTERS; counter++)
+		ALOGI("Backend %s: %" PRIu64 ".", counter_names[counter], stats->counters[counter]);
+}
+
+void cros_gralloc_log_memory(const struct drv_memory_info *info,
+			     const struct drv_memory_usage *usage, uint32_t num_usage)
+{
+	static const char *const kind_names[DRV_MEMORY_NUM_KINDS] = {
+		"allocated",	 "imported",	     "mapped",	"BO pool",
+		"pending destroy", "mapping cache", "suballoc slabs", "shadow",
+		"staging",	 "backend caches", "large page padding",
+		"size class padding",
+	};
+
+	for (uint32_t kind = 0; kind < DRV_MEMORY_NUM_KINDS; kind++)
+		ALOGI("Memory %s: %" PRIu64 " bytes.", kind_names[kind], info->bytes[kind]);
+
+	if (info->budget)
+		ALOGI("Memory budget: %" PRIu64 " bytes.", info->budget);
+
+	for (uint32_t i = 0; i < num_usage; i++) {
+		uint32_t format = usage[i].format;
+
+		ALOGI("Memory %c%c%c%c use_flags=0x%" PRIx64 ": %u allocated, %" PRIu64
+		      " bytes, %u imported, %" PRIu64 " bytes.",
+		      format & 0xff, (format >> 8) & 0xff, (format >> 16) & 0xff,
+		      (format >> 24) & 0xff, usage[i].use_flags, usage[i].num_allocated,
+		      usage[i].allocated_bytes, usage[i].num_imported, usage[i].imported_bytes);
+	}
+}
@@ -14,6 +14,8 @@
 #include <system/graphics.h>
 #include <system/window.h>
 
+#include <atomic>
+#include <chrono>
 #include <string>
 
 // Reserve the GRALLOC_USAGE_PRIVATE_0 bit from hardware/gralloc.h for buffers
@@ -35,7 +37,11 @@ struct cros_gralloc_buffer_descriptor {
 	std::string name;
 };
 
-constexpr uint32_t cros_gralloc_magic = 0xABCDDCBA;
+/*
+ * Changes whenever the handle layout does, so that mismatched allocator and mapper builds reject
+ * handles instead of misreading them. 0xABCDDCBA had one fd per plane before the reserved region.
+ */
+constexpr uint32_t cros_gralloc_magic = 0xABCDDCBB;
 constexpr uint32_t handle_data_size =
     ((sizeof(struct cros_gralloc_handle) - offsetof(cros_gralloc_handle, fds[0])) / sizeof(int));
 
@@ -47,8 +53,60 @@ uint32_t cros_gralloc_convert_map_usage(uint64_t usage);
 
 cros_gralloc_handle_t cros_gralloc_convert_handle(buffer_handle_t handle);
 
+uint32_t cros_gralloc_handle_num_plane_fds(cros_gralloc_handle_t hnd);
+
+int32_t cros_gralloc_handle_plane_fd(cros_gralloc_handle_t hnd, uint32_t plane);
+
+int32_t cros_gralloc_handle_reserved_region_fd(cros_gralloc_handle_t hnd);
+
 int32_t cros_gralloc_sync_wait(int32_t fence, bool close_fence);
 
 std::string get_drm_format_string(uint32_t drm_format);
 
+/* Counts lock acquisitions, how many of them had to wait on another thread and for how long. */
+struct cros_gralloc_lock_stats {
+	std::atomic<uint64_t> acquired{ 0 };
+	std::atomic<uint64_t> contended{ 0 };
+	std::atomic<uint64_t> wait_ns{ 0 };
+};
+
+/* Acquires a deferred std::unique_lock or std::shared_lock, recording contention in stats. */
+template <typename Lock> void cros_gralloc_counted_lock(Lock &lock, cros_gralloc_lock_stats &stats)
+{
+	stats.acquired++;
+	if (lock.try_lock())
+		return;
+
+	stats.contended++;
+	auto start = std::chrono::steady_clock::now();
+	lock.lock();
+	stats.wait_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+			     std::chrono::steady_clock::now() - start)
+			     .count();
+}
+
+/*
+ * Android trace span covering the lifetime of the object, tagged with the id, size and format of
+ * the buffer, so that mapper calls line up with the driver spans inside them.
+ */
+class cros_gralloc_trace_scope
+{
+      public:
+	cros_gralloc_trace_scope(const char *name, cros_gralloc_handle_t hnd);
+	~cros_gralloc_trace_scope();
+
+      private:
+	cros_gralloc_trace_scope(cros_gralloc_trace_scope const &);
+	cros_gralloc_trace_scope operator=(cros_gralloc_trace_scope const &);
+
+	bool active_;
+};
+
+/* Logs the latency histograms and counters of stats, for the mapper buffer dumps. */
+void cros_gralloc_log_stats(const struct drv_stats *stats);
+
+/* Logs the memory held by the driver, with usage broken down by format and use flags. */
+void cros_gralloc_log_memory(const struct drv_memory_info *info,
+			     const struct drv_memory_usage *usage, uint32_t num_usage);
+
 #endif
@@ -324,7 +324,7 @@ static int gralloc0_perform(struct gralloc_module_t const *module, int op, ...)
 		info->drm_fourcc = drv_get_standard_fourcc(hnd->format);
 		info->num_fds = hnd->num_planes;
 		for (int i = 0; i < info->num_fds; i++)
-			info->fds[i] = hnd->fds[i];
+			info->fds[i] = cros_gralloc_handle_plane_fd(hnd, i);
 
 		ret = mod->driver->resource_info(handle, strides, offsets, &format_modifier);
 		if (ret)
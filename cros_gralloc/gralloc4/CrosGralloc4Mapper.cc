@@ -12,6 +12,7 @@
 #include <aidl/android/hardware/graphics/common/Rect.h>
 #include <cutils/native_handle.h>
 #include <gralloctypes/Gralloc4.h>
+#include <unistd.h>
 
 #include "cros_gralloc/cros_gralloc_helpers.h"
 #include "cros_gralloc/gralloc4/CrosGralloc4Utils.h"
@@ -225,6 +226,8 @@ Return<void> CrosGralloc4Mapper::lock(void* rawBuffer, uint64_t cpuUsage, const
         return Void();
     }
 
+    cros_gralloc_trace_scope trace("CrosGralloc4Mapper::lock", crosHandle);
+
     if (region.left < 0) {
         ALOGE("Failed to lock. Invalid region: negative left value %d.", region.left);
         hidlCb(Error::BAD_VALUE, nullptr);
@@ -317,6 +320,9 @@ Return<void> CrosGralloc4Mapper::unlock(void* rawHandle, unlock_cb hidlCb) {
 
     NATIVE_HANDLE_DECLARE_STORAGE(releaseFenceHandleStorage, 1, 0);
     hidlCb(Error::NONE, convertToFenceHandle(releaseFenceFd, releaseFenceHandleStorage));
+    if (releaseFenceFd >= 0) {
+        close(releaseFenceFd);
+    }
     return Void();
 }
 
@@ -438,6 +444,23 @@ Return<void> CrosGralloc4Mapper::get(const cros_gralloc_buffer* crosBuffer,
         return Void();
     }
 
+    /* Everything but the types set() can change is fixed at allocation. */
+    const bool cacheable = android::gralloc4::isStandardMetadataType(metadataType) &&
+                           metadataType != android::gralloc4::MetadataType_BlendMode &&
+                           metadataType != android::gralloc4::MetadataType_Cta861_3 &&
+                           metadataType != android::gralloc4::MetadataType_Dataspace &&
+                           metadataType != android::gralloc4::MetadataType_Smpte2086;
+    const uint64_t cacheKey =
+            kMetadataCacheKeyGralloc4 | static_cast<uint32_t>(metadataType.value);
+    if (cacheable) {
+        std::vector<uint8_t> cached;
+        if (crosBuffer->get_cached_metadata(cacheKey, &cached)) {
+            encodedMetadata = cached;
+            hidlCb(Error::NONE, encodedMetadata);
+            return Void();
+        }
+    }
+
     const CrosGralloc4Metadata* crosMetadata = nullptr;
     if (metadataType == android::gralloc4::MetadataType_BlendMode ||
         metadataType == android::gralloc4::MetadataType_Cta861_3 ||
@@ -542,6 +565,9 @@ Return<void> CrosGralloc4Mapper::get(const cros_gralloc_buffer* crosBuffer,
         return Void();
     }
 
+    if (cacheable)
+        crosBuffer->set_cached_metadata(cacheKey, encodedMetadata.data(), encodedMetadata.size());
+
     hidlCb(Error::NONE, encodedMetadata);
     return Void();
 }
@@ -1024,6 +1050,20 @@ Return<void> CrosGralloc4Mapper::dumpBuffers(dumpBuffers_cb hidlCb) {
     mDriver->with_each_buffer(
             [&](cros_gralloc_buffer* crosBuffer) { dumpBuffer(crosBuffer, dumpBufferCallback); });
 
+    uint64_t resolveHits, resolveMisses;
+    mDriver->get_resolve_cache_stats(&resolveHits, &resolveMisses);
+    ALOGI("Format resolution cache: %" PRIu64 " hits, %" PRIu64 " misses.", resolveHits,
+          resolveMisses);
+
+    struct drv_stats stats;
+    mDriver->get_stats(&stats);
+    cros_gralloc_log_stats(&stats);
+
+    struct drv_memory_info memoryInfo;
+    std::vector<struct drv_memory_usage> memoryUsage;
+    mDriver->get_memory_info(&memoryInfo, &memoryUsage);
+    cros_gralloc_log_memory(&memoryInfo, memoryUsage.data(), memoryUsage.size());
+
     hidlCb(error, bufferDumps);
     return Void();
 }
@@ -38,3 +38,10 @@ android::hardware::hidl_handle convertToFenceHandle(int fence_fd, char* native_h
 int getPlaneLayouts(
         uint32_t drm_format,
         std::vector<aidl::android::hardware::graphics::common::PlaneLayout>* out_layouts);
+
+/*
+ * Namespaces of the cros_gralloc_buffer metadata cache keys, one per mapper since the encodings
+ * differ. The low 32 bits hold the StandardMetadataType.
+ */
+constexpr uint64_t kMetadataCacheKeyGralloc4 = 1ull << 32;
+constexpr uint64_t kMetadataCacheKeyStablec = 2ull << 32;
@@ -54,6 +54,12 @@ static bool isStandardMetadata(AIMapper_MetadataType metadataType) {
     return strcmp(STANDARD_METADATA_NAME, metadataType.name) == 0;
 }
 
+// Everything but the types setStandardMetadata() can change is fixed at allocation.
+static bool isCacheableStandardMetadata(StandardMetadataType type) {
+    return type != StandardMetadataType::BLEND_MODE && type != StandardMetadataType::CTA861_3 &&
+           type != StandardMetadataType::DATASPACE && type != StandardMetadataType::SMPTE2086;
+}
+
 class CrosGrallocMapperV5 final : public vendor::mapper::IMapperV5Impl {
   private:
     std::shared_ptr<cros_gralloc_driver> mDriver = cros_gralloc_driver::get_instance();
@@ -210,6 +216,8 @@ AIMapper_Error CrosGrallocMapperV5::lock(buffer_handle_t _Nonnull bufferHandle,
         return AIMAPPER_ERROR_BAD_VALUE;
     }
 
+    cros_gralloc_trace_scope trace("CrosGrallocMapperV5::lock", crosHandle);
+
     struct rectangle rect;
 
     // An access region of all zeros means the entire buffer.
@@ -317,11 +325,25 @@ int32_t CrosGrallocMapperV5::getStandardMetadata(buffer_handle_t _Nonnull buffer
 
     int32_t retValue = -AIMAPPER_ERROR_UNSUPPORTED;
     mDriver->with_buffer(crosHandle, [&](cros_gralloc_buffer* crosBuffer) {
+        const auto type = static_cast<StandardMetadataType>(standardType);
+        const bool cacheable = isCacheableStandardMetadata(type);
+        const uint64_t cacheKey = kMetadataCacheKeyStablec | static_cast<uint32_t>(standardType);
+        if (cacheable) {
+            int64_t cachedSize = crosBuffer->get_cached_metadata(cacheKey, outData, outDataSize);
+            if (cachedSize >= 0) {
+                retValue = static_cast<int32_t>(cachedSize);
+                return;
+            }
+        }
+
         auto provider = [&]<StandardMetadataType T>(auto&& provide) -> int32_t {
             return getStandardMetadata(crosBuffer, provide, StandardMetadata<T>{});
         };
-        retValue = provideStandardMetadata(static_cast<StandardMetadataType>(standardType), outData,
-                                           outDataSize, provider);
+        retValue = provideStandardMetadata(type, outData, outDataSize, provider);
+
+        // Only a complete encoding can be cached; a size query is answered again next time.
+        if (cacheable && retValue > 0 && static_cast<size_t>(retValue) <= outDataSize)
+            crosBuffer->set_cached_metadata(cacheKey, outData, retValue);
     });
     return retValue;
 }
@@ -650,6 +672,15 @@ AIMapper_Error CrosGrallocMapperV5::dumpAllBuffers(
         beginDumpBufferCallback(context);
         dumpBuffer(crosBuffer, callback);
     });
+
+    uint64_t resolveHits, resolveMisses;
+    mDriver->get_resolve_cache_stats(&resolveHits, &resolveMisses);
+    ALOGI("Format resolution cache: %" PRIu64 " hits, %" PRIu64 " misses.", resolveHits,
+          resolveMisses);
+
+    struct drv_stats stats;
+    mDriver->get_stats(&stats);
+    cros_gralloc_log_stats(&stats);
     return AIMAPPER_ERROR_NONE;
 }
 
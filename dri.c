@@ -10,6 +10,7 @@
 #include <dlfcn.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
@@ -68,20 +69,25 @@ static bool lookup_extension(const __DRIextension *const *extensions, const char
 }
 
 /*
- * The DRI GEM namespace may be different from the minigbm's driver GEM namespace. We have
- * to import into minigbm.
+ * The DRI GEM namespace may be different from the minigbm's driver GEM namespace, so the image in
+ * bo->priv has its layout filled in and is imported into minigbm. A modifier other than
+ * DRM_FORMAT_MOD_INVALID is the one the image is known to have been created with. A dma-buf fd
+ * of the whole image the caller already holds is passed as fd to avoid exporting it again; it
+ * is not closed. Otherwise fd is -1.
  */
-static int import_into_minigbm(struct dri_driver *dri, struct bo *bo)
+static int import_into_minigbm(struct dri_driver *dri, struct bo *bo, uint64_t modifier, int fd)
 {
 	uint32_t handle = 0;
-	int ret, modifier_upper, modifier_lower, num_planes, prime_fd;
+	int ret, modifier_upper, modifier_lower, num_planes, prime_fd = fd;
 	off_t dmabuf_size;
 	__DRIimage *plane_image = NULL;
 
-	if (dri->image_extension->queryImage(bo->priv, __DRI_IMAGE_ATTRIB_MODIFIER_UPPER,
-					     &modifier_upper) &&
-	    dri->image_extension->queryImage(bo->priv, __DRI_IMAGE_ATTRIB_MODIFIER_LOWER,
-					     &modifier_lower))
+	if (modifier != DRM_FORMAT_MOD_INVALID)
+		bo->meta.format_modifier = modifier;
+	else if (dri->image_extension->queryImage(bo->priv, __DRI_IMAGE_ATTRIB_MODIFIER_UPPER,
+						  &modifier_upper) &&
+		 dri->image_extension->queryImage(bo->priv, __DRI_IMAGE_ATTRIB_MODIFIER_LOWER,
+						  &modifier_lower))
 		bo->meta.format_modifier =
 		    ((uint64_t)modifier_upper << 32) | (uint32_t)modifier_lower;
 	else
@@ -92,20 +98,27 @@ static int import_into_minigbm(struct dri_driver *dri, struct bo *bo)
 
 	bo->meta.num_planes = num_planes;
 
-	if (!dri->image_extension->queryImage(bo->priv, __DRI_IMAGE_ATTRIB_FD, &prime_fd))
+	if (prime_fd < 0 &&
+	    !dri->image_extension->queryImage(bo->priv, __DRI_IMAGE_ATTRIB_FD, &prime_fd))
 		return -errno;
 
+	/* The file offset of a dma-buf has no effect on anything, so it isn't restored. */
 	dmabuf_size = lseek(prime_fd, 0, SEEK_END);
 	if (dmabuf_size == (off_t)-1) {
-		close(prime_fd);
-		return -errno;
+		ret = -errno;
+		if (prime_fd != fd)
+			close(prime_fd);
+		return ret;
 	}
 
-	lseek(prime_fd, 0, SEEK_SET);
-
+	/*
+	 * The DRI screen has its own file description of the render node, so its GEM handles
+	 * aren't valid on ours and the image has to go through prime.
+	 */
 	ret = drmPrimeFDToHandle(bo->drv->fd, prime_fd, &handle);
 
-	close(prime_fd);
+	if (prime_fd != fd)
+		close(prime_fd);
 
 	if (ret) {
 		drv_loge("drmPrimeFDToHandle failed with %s\n", strerror(errno));
@@ -115,7 +128,8 @@ static int import_into_minigbm(struct dri_driver *dri, struct bo *bo)
 	bo->handle.u32 = handle;
 	for (int i = 0; i < num_planes; ++i) {
 		int stride, offset;
-		plane_image = dri->image_extension->fromPlanar(bo->priv, i, NULL);
+		/* The image itself answers for plane 0, which saves creating a plane image. */
+		plane_image = i ? dri->image_extension->fromPlanar(bo->priv, i, NULL) : NULL;
 		__DRIimage *image = plane_image ? plane_image : bo->priv;
 
 		if (!dri->image_extension->queryImage(image, __DRI_IMAGE_ATTRIB_STRIDE, &stride) ||
@@ -127,8 +141,10 @@ static int import_into_minigbm(struct dri_driver *dri, struct bo *bo)
 		bo->meta.strides[i] = stride;
 		bo->meta.offsets[i] = offset;
 
-		if (plane_image)
+		if (plane_image) {
 			dri->image_extension->destroyImage(plane_image);
+			plane_image = NULL;
+		}
 
 		if (i > 0)
 			bo->meta.sizes[i - 1] = bo->meta.offsets[i] - bo->meta.offsets[i - 1];
@@ -163,16 +179,15 @@ void dri_dlclose(void *dri_so_handle)
 	dlclose(dri_so_handle);
 }
 
-/*
- * The caller is responsible for setting drv->priv to a structure that derives from dri_driver.
- */
-int dri_init(struct driver *drv, const char *dri_so_path, const char *driver_suffix)
+static int dri_load(struct driver *drv)
 {
 	char fname[128];
 	const __DRIextension **(*get_extensions)();
 	const __DRIextension *loader_extensions[] = { &use_invalidate.base, NULL };
 
 	struct dri_driver *dri = drv->priv;
+	const char *dri_so_path = dri->dri_so_path;
+	const char *driver_suffix = dri->driver_suffix;
 	char *node_name = drmGetRenderDeviceNameFromFd(drv_get_fd(drv));
 	if (!node_name)
 		return -ENODEV;
@@ -237,6 +252,72 @@ close_dri_fd:
 	return -ENODEV;
 }
 
+/*
+ * Loads the DRI driver and creates its screen unless that already happened. Failures are sticky
+ * so that every allocation doesn't retry the dlopen.
+ */
+static int dri_ensure_loaded(struct driver *drv)
+{
+	int ret = 0;
+	struct dri_driver *dri = drv->priv;
+
+	if (__atomic_load_n(&dri->loaded, __ATOMIC_ACQUIRE))
+		return 0;
+
+	pthread_mutex_lock(&dri->load_lock);
+	if (dri->load_failed) {
+		ret = -ENODEV;
+	} else if (!dri->loaded) {
+		drv_trace_begin("dri_load", NULL);
+		ret = dri_load(drv);
+		drv_trace_end();
+		if (ret)
+			dri->load_failed = true;
+		else
+			__atomic_store_n(&dri->loaded, true, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&dri->load_lock);
+
+	return ret;
+}
+
+/*
+ * The caller is responsible for setting drv->priv to a structure that derives from dri_driver.
+ * Nothing is loaded until the first DRI allocation or import needs the screen.
+ */
+int dri_init_lazy(struct driver *drv, const char *dri_so_path, const char *driver_suffix)
+{
+	struct dri_driver *dri = drv->priv;
+
+	if (pthread_mutex_init(&dri->load_lock, NULL))
+		return -ENOMEM;
+
+	dri->dri_so_path = dri_so_path;
+	dri->driver_suffix = driver_suffix;
+	dri->loaded = false;
+	dri->load_failed = false;
+	return 0;
+}
+
+/*
+ * The caller is responsible for setting drv->priv to a structure that derives from dri_driver.
+ */
+int dri_init(struct driver *drv, const char *dri_so_path, const char *driver_suffix)
+{
+	struct dri_driver *dri = drv->priv;
+	int ret;
+
+	ret = dri_init_lazy(drv, dri_so_path, driver_suffix);
+	if (ret)
+		return ret;
+
+	ret = dri_ensure_loaded(drv);
+	if (ret)
+		pthread_mutex_destroy(&dri->load_lock);
+
+	return ret;
+}
+
 /*
  * The caller is responsible for freeing drv->priv.
  */
@@ -244,11 +325,16 @@ void dri_close(struct driver *drv)
 {
 	struct dri_driver *dri = drv->priv;
 
-	dri->core_extension->destroyContext(dri->context);
-	dri->core_extension->destroyScreen(dri->device);
-	dri_dlclose(dri->driver_handle);
-	dri->driver_handle = NULL;
-	close(dri->fd);
+	if (dri->loaded) {
+		dri->core_extension->destroyContext(dri->context);
+		dri->core_extension->destroyScreen(dri->device);
+		dri_dlclose(dri->driver_handle);
+		dri->driver_handle = NULL;
+		close(dri->fd);
+		dri->loaded = false;
+	}
+
+	pthread_mutex_destroy(&dri->load_lock);
 }
 
 int dri_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
@@ -258,6 +344,10 @@ int dri_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t forma
 	int ret, dri_format;
 	struct dri_driver *dri = bo->drv->priv;
 
+	ret = dri_ensure_loaded(bo->drv);
+	if (ret)
+		return ret;
+
 	dri_format = drm_format_to_dri_format(format);
 
 	/* Gallium drivers require shared to get the handle and stride. */
@@ -276,7 +366,7 @@ int dri_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t forma
 		return ret;
 	}
 
-	ret = import_into_minigbm(dri, bo);
+	ret = import_into_minigbm(dri, bo, DRM_FORMAT_MOD_INVALID, -1);
 	if (ret)
 		goto free_image;
 
@@ -293,6 +383,10 @@ int dri_bo_create_with_modifiers(struct bo *bo, uint32_t width, uint32_t height,
 	int ret, dri_format;
 	struct dri_driver *dri = bo->drv->priv;
 
+	ret = dri_ensure_loaded(bo->drv);
+	if (ret)
+		return ret;
+
 	if (!dri->image_extension->createImageWithModifiers)
 		return -ENOENT;
 
@@ -305,7 +399,9 @@ int dri_bo_create_with_modifiers(struct bo *bo, uint32_t width, uint32_t height,
 		return ret;
 	}
 
-	ret = import_into_minigbm(dri, bo);
+	/* With a single candidate there is nothing to ask the driver about. */
+	ret = import_into_minigbm(dri, bo,
+				  modifier_count == 1 ? modifiers[0] : DRM_FORMAT_MOD_INVALID, -1);
 	if (ret)
 		goto free_image;
 
@@ -318,9 +414,13 @@ free_image:
 
 int dri_bo_import(struct bo *bo, struct drv_import_fd_data *data)
 {
-	int ret;
+	int ret, fd = data->fds[0];
 	struct dri_driver *dri = bo->drv->priv;
 
+	ret = dri_ensure_loaded(bo->drv);
+	if (ret)
+		return ret;
+
 	if (data->format_modifier != DRM_FORMAT_MOD_INVALID) {
 		unsigned error;
 
@@ -357,7 +457,13 @@ int dri_bo_import(struct bo *bo, struct drv_import_fd_data *data)
 			return -errno;
 	}
 
-	ret = import_into_minigbm(dri, bo);
+	/* Disjoint planes keep going through the export of the image, as before. */
+	for (size_t plane = 1; plane < bo->meta.num_planes; plane++) {
+		if (data->fds[plane] != data->fds[0])
+			fd = -1;
+	}
+
+	ret = import_into_minigbm(dri, bo, data->format_modifier, fd);
 	if (ret) {
 		dri->image_extension->destroyImage(bo->priv);
 		return ret;
@@ -431,6 +537,11 @@ size_t dri_num_planes_from_modifier(struct driver *drv, uint32_t format, uint64_
 	struct dri_driver *dri = drv->priv;
 	uint64_t planes = 0;
 
+	/* Layouts without a modifier have no auxiliary planes, so don't load DRI just for them. */
+	if (modifier == DRM_FORMAT_MOD_LINEAR || modifier == DRM_FORMAT_MOD_INVALID ||
+	    dri_ensure_loaded(drv))
+		return drv_num_planes_from_format(format);
+
 	/* We do not do any modifier checks here. The create will fail later if the modifier is not
 	 * supported.
 	 */
@@ -447,7 +558,7 @@ bool dri_query_modifiers(struct driver *drv, uint32_t format, int max, uint64_t
 			 int *count)
 {
 	struct dri_driver *dri = drv->priv;
-	if (!dri->image_extension->queryDmaBufModifiers)
+	if (dri_ensure_loaded(drv) || !dri->image_extension->queryDmaBufModifiers)
 		return false;
 
 	return dri->image_extension->queryDmaBufModifiers(dri->device, format, max, modifiers, NULL,
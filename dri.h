@@ -11,9 +11,18 @@
 #include "GL/internal/dri_interface.h"
 #undef GL_GLEXT_LEGACY
 
+#include <pthread.h>
+
 #include "drv.h"
 
 struct dri_driver {
+	/* Serializes loading the DRI driver, which happens on first use after dri_init_lazy(). */
+	pthread_mutex_t load_lock;
+	bool loaded;
+	bool load_failed;
+	const char *dri_so_path;
+	const char *driver_suffix;
+
 	int fd;
 	void *driver_handle;
 	__DRIscreen *device;
@@ -30,6 +39,7 @@ void *dri_dlopen(const char *dri_so_path);
 void dri_dlclose(void *dri_so_handle);
 
 int dri_init(struct driver *drv, const char *dri_so_path, const char *driver_suffix);
+int dri_init_lazy(struct driver *drv, const char *dri_so_path, const char *driver_suffix);
 void dri_close(struct driver *drv);
 int dri_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
 		  uint64_t use_flags);
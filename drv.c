@@ -7,12 +7,16 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/vfs.h>
+#include <time.h>
 #include <unistd.h>
 #include <xf86drm.h>
 
@@ -20,8 +24,24 @@
 #include <cutils/log.h>
 #include <libgen.h>
 #define MINIGBM_DEBUG "vendor.minigbm.debug"
+#define MINIGBM_BO_POOL_SIZE "vendor.minigbm.bo_pool_size"
+#define MINIGBM_MAPPING_CACHE_SIZE "vendor.minigbm.mapping_cache_size"
+#define MINIGBM_SUBALLOC "vendor.minigbm.suballoc"
+#define MINIGBM_MEMORY_BUDGET "vendor.minigbm.memory_budget"
+#define MINIGBM_MODIFIER_POLICY "vendor.minigbm.modifier_policy"
+#define MINIGBM_DEFERRED_DESTROY "vendor.minigbm.deferred_destroy"
+#define MINIGBM_LARGE_PAGES "vendor.minigbm.large_pages"
+#define MINIGBM_SIZE_CLASSES "vendor.minigbm.size_classes"
 #else
 #define MINIGBM_DEBUG "MINIGBM_DEBUG"
+#define MINIGBM_BO_POOL_SIZE "MINIGBM_BO_POOL_SIZE"
+#define MINIGBM_MAPPING_CACHE_SIZE "MINIGBM_MAPPING_CACHE_SIZE"
+#define MINIGBM_SUBALLOC "MINIGBM_SUBALLOC"
+#define MINIGBM_MEMORY_BUDGET "MINIGBM_MEMORY_BUDGET"
+#define MINIGBM_MODIFIER_POLICY "MINIGBM_MODIFIER_POLICY"
+#define MINIGBM_DEFERRED_DESTROY "MINIGBM_DEFERRED_DESTROY"
+#define MINIGBM_LARGE_PAGES "MINIGBM_LARGE_PAGES"
+#define MINIGBM_SIZE_CLASSES "MINIGBM_SIZE_CLASSES"
 #endif
 
 #include "drv_helpers.h"
@@ -56,6 +76,9 @@ extern const struct backend backend_virtgpu;
 extern const struct backend backend_udl;
 extern const struct backend backend_vkms;
 
+#ifdef DRV_SINGLE_BACKEND
+static const struct backend *drv_backend_list[] = { &DRV_SINGLE_BACKEND };
+#else
 static const struct backend *drv_backend_list[] = {
 #ifdef DRV_AMDGPU
 	&backend_amdgpu,
@@ -74,6 +97,7 @@ static const struct backend *drv_backend_list[] = {
 	&backend_sun4i_drm, &backend_synaptics, &backend_udl,	  &backend_virtgpu,
 	&backend_vkms
 };
+#endif
 
 void drv_preload(bool load)
 {
@@ -107,6 +131,198 @@ static const struct backend *drv_get_backend(int fd)
 	return NULL;
 }
 
+static void drv_handle_shards_destroy(struct drv_handle_shard *shards, uint32_t count)
+{
+	for (uint32_t i = 0; i < count; i++) {
+		drmHashDestroy(shards[i].table);
+		pthread_mutex_destroy(&shards[i].lock);
+	}
+}
+
+static int drv_handle_shards_init(struct drv_handle_shard *shards)
+{
+	for (uint32_t i = 0; i < DRV_NUM_HANDLE_SHARDS; i++) {
+		if (pthread_mutex_init(&shards[i].lock, NULL)) {
+			drv_handle_shards_destroy(shards, i);
+			return -ENOMEM;
+		}
+
+		shards[i].table = drmHashCreate();
+		if (!shards[i].table) {
+			pthread_mutex_destroy(&shards[i].lock);
+			drv_handle_shards_destroy(shards, i);
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+static struct drv_handle_table *drv_handle_table_create(uint32_t num_slots)
+{
+	struct drv_handle_table *table;
+
+	table = calloc(1, sizeof(*table) + num_slots * sizeof(table->slots[0]));
+	if (table)
+		table->num_slots = num_slots;
+
+	return table;
+}
+
+static void drv_handle_table_destroy(struct drv_handle_table *table)
+{
+	while (table) {
+		struct drv_handle_table *next = table->next;
+
+		free(table);
+		table = next;
+	}
+}
+
+/*
+ * Returns the slot of handle, claiming one if the handle has none yet and claim is set. Two
+ * threads claiming the same handle walk the same probe sequence and stop at the first free slot,
+ * so only one of them wins it and the other finds the handle there. Since slots are never freed,
+ * a free slot in the window also means the handle isn't in any later table. Returns NULL if the
+ * handle has no slot and none was claimed, or if out of memory.
+ */
+static struct drv_handle_slot *drv_handle_table_slot(struct drv_handle_table *table,
+						     uint32_t handle, bool claim)
+{
+	/* Test allocations have no GEM handle, and nothing to count. */
+	if (!handle)
+		return NULL;
+
+	while (table) {
+		struct drv_handle_table *next;
+
+		for (uint32_t probe = 0; probe < DRV_HANDLE_TABLE_PROBES; probe++) {
+			struct drv_handle_slot *slot =
+			    &table->slots[(handle + probe) & (table->num_slots - 1)];
+			uint32_t key = __atomic_load_n(&slot->handle, __ATOMIC_ACQUIRE);
+
+			if (!key && !claim)
+				return NULL;
+
+			if (!key && __atomic_compare_exchange_n(&slot->handle, &key, handle, false,
+								__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+				return slot;
+
+			if (key == handle)
+				return slot;
+		}
+
+		next = __atomic_load_n(&table->next, __ATOMIC_ACQUIRE);
+		if (!next && claim) {
+			struct drv_handle_table *expected = NULL;
+
+			next = drv_handle_table_create(table->num_slots * 2);
+			if (!next)
+				return NULL;
+
+			/* Keep the table of a concurrent caller that got there first. */
+			if (!__atomic_compare_exchange_n(&table->next, &expected, next, false,
+							 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				free(next);
+				next = expected;
+			}
+		}
+
+		table = next;
+	}
+
+	return NULL;
+}
+
+static void drv_import_index_destroy(struct driver *drv)
+{
+	struct drv_import_index *index = &drv->import_index;
+	unsigned long ino;
+	void *entry;
+
+	if (index->table) {
+		while (drmHashFirst(index->table, &ino, &entry) == 1) {
+			drmHashDelete(index->table, ino);
+			free(entry);
+		}
+
+		drmHashDestroy(index->table);
+	}
+
+	if (index->handles)
+		drmHashDestroy(index->handles);
+
+	pthread_mutex_destroy(&index->lock);
+}
+
+static int drv_combination_ref_cmp(const void *a, const void *b)
+{
+	const struct combination_ref *ra = a;
+	const struct combination_ref *rb = b;
+
+	if (ra->format != rb->format)
+		return ra->format < rb->format ? -1 : 1;
+	if (ra->priority != rb->priority)
+		return ra->priority > rb->priority ? -1 : 1;
+	/* Keep registration order between equal priorities, as the linear scan did. */
+	return ra->idx < rb->idx ? -1 : (ra->idx > rb->idx);
+}
+
+static void drv_build_combination_index(struct driver *drv)
+{
+	uint32_t i, num_combos = drv_array_size(drv->combos);
+	struct combination_index *index = &drv->combo_index;
+
+	if (!num_combos)
+		return;
+
+	index->refs = calloc(num_combos, sizeof(*index->refs));
+	index->formats = calloc(num_combos, sizeof(*index->formats));
+	if (!index->refs || !index->formats)
+		goto fail;
+
+	for (i = 0; i < num_combos; i++) {
+		const struct combination *combo = drv_array_at_idx(drv->combos, i);
+
+		index->refs[i].use_flags = combo->use_flags;
+		index->refs[i].format = combo->format;
+		index->refs[i].priority = combo->metadata.priority;
+		index->refs[i].idx = i;
+	}
+
+	qsort(index->refs, num_combos, sizeof(*index->refs), drv_combination_ref_cmp);
+
+	for (i = 0; i < num_combos; i++) {
+		uint32_t format = index->refs[i].format;
+
+		if (!index->num_formats ||
+		    index->formats[index->num_formats - 1].format != format) {
+			index->formats[index->num_formats].format = format;
+			index->formats[index->num_formats].start = i;
+			index->num_formats++;
+		}
+		index->formats[index->num_formats - 1].count++;
+	}
+
+	index->num_combos = num_combos;
+	index->generation = drv->combo_generation;
+	return;
+
+fail:
+	free(index->refs);
+	free(index->formats);
+	memset(index, 0, sizeof(*index));
+}
+
+/* Enough for the configurations of a few swapchains and codec pools. */
+#define DRV_METADATA_CACHE_ENTRIES 64
+
+static void drv_suballoc_destroy(struct driver *drv);
+static struct bo *drv_bo_backing(struct bo *bo);
+static int drv_bo_reaper_start(struct driver *drv);
+static void drv_bo_reaper_stop(struct driver *drv);
+static void drv_bo_reaper_flush(struct driver *drv);
+
 struct driver *drv_create(int fd)
 {
 	struct driver *drv;
@@ -122,65 +338,252 @@ struct driver *drv_create(int fd)
 	drv->compression = (minigbm_debug == NULL) || (strstr(minigbm_debug, "nocompression") == NULL);
 	drv->log_bos = (minigbm_debug && strstr(minigbm_debug, "log_bos") != NULL);
 
+	/* Large pages save TLB misses at the cost of padding, up to a sixteenth of a BO. */
+	const char *large_pages;
+	large_pages = drv_get_os_option(MINIGBM_LARGE_PAGES);
+	drv->large_pages = large_pages && strtol(large_pages, NULL, 0);
+
+	/*
+	 * The number of size classes per doubling of a dimension. Fewer classes make more recycled
+	 * BOs fit, at up to 1 / size_classes of padding per dimension.
+	 */
+	const char *size_classes;
+	size_classes = drv_get_os_option(MINIGBM_SIZE_CLASSES);
+	if (size_classes)
+		drv->size_class_steps =
+		    MIN(strtoul(size_classes, NULL, 0), (unsigned long)DRV_SIZE_CLASS_MAX_STEPS);
+
 	drv->fd = fd;
 	drv->backend = drv_get_backend(fd);
 
 	if (!drv->backend)
 		goto free_driver;
 
-	if (pthread_mutex_init(&drv->buffer_table_lock, NULL))
+	drv->handle_refs = drv_handle_table_create(DRV_HANDLE_TABLE_SLOTS);
+	if (!drv->handle_refs)
 		goto free_driver;
 
-	drv->buffer_table = drmHashCreate();
-	if (!drv->buffer_table)
-		goto free_buffer_table_lock;
+	if (drv_handle_shards_init(drv->mapping_shards))
+		goto free_handle_refs;
+
+	if (pthread_mutex_init(&drv->bo_pool.lock, NULL))
+		goto free_mapping_shards;
+
+	lru_init(&drv->bo_pool.lru, INT_MAX);
+
+	const char *bo_pool_size;
+	bo_pool_size = drv_get_os_option(MINIGBM_BO_POOL_SIZE);
+	if (bo_pool_size)
+		drv->bo_pool.max_size = strtoull(bo_pool_size, NULL, 0);
+
+	if (pthread_mutex_init(&drv->suballoc.lock, NULL))
+		goto free_bo_pool_lock;
+
+	/*
+	 * Sub-allocated BOs are exported as the dma-buf of a GEM object shared with unrelated BOs,
+	 * which every importer has to handle through the plane offsets, so this stays opt-in.
+	 */
+	const char *suballoc;
+	suballoc = drv_get_os_option(MINIGBM_SUBALLOC);
+	drv->suballoc.enabled = suballoc && strtol(suballoc, NULL, 0) &&
+				DRV_BACKEND(drv)->bo_suballoc_alignment &&
+				DRV_BACKEND(drv)->bo_compute_metadata;
+
+	if (pthread_mutex_init(&drv->mapping_cache.lock, NULL))
+		goto free_suballoc_lock;
+
+	lru_init(&drv->mapping_cache.lru, INT_MAX);
+
+	/*
+	 * Only backends for which unmapping is a plain munmap can keep mappings across unlocks;
+	 * the others rely on bo_flush or do cache maintenance in bo_unmap.
+	 */
+	const char *mapping_cache_size;
+	mapping_cache_size = drv_get_os_option(MINIGBM_MAPPING_CACHE_SIZE);
+	if (mapping_cache_size && DRV_BACKEND(drv)->bo_unmap == drv_bo_munmap &&
+	    !DRV_BACKEND(drv)->bo_flush)
+		drv->mapping_cache.max_size = strtoull(mapping_cache_size, NULL, 0);
+
+	if (pthread_mutex_init(&drv->shadow_pool.lock, NULL))
+		goto free_mapping_cache_lock;
+
+	if (pthread_mutex_init(&drv->import_index.lock, NULL))
+		goto free_shadow_pool;
+
+	/*
+	 * Backends with a bo_release hook keep per-BO state that an import taking a reference on
+	 * an already imported GEM handle wouldn't set up. Without the index every import is slow.
+	 */
+	if (!DRV_BACKEND(drv)->bo_release) {
+		drv->import_index.table = drmHashCreate();
+		drv->import_index.handles = drmHashCreate();
+		if (!drv->import_index.table || !drv->import_index.handles) {
+			if (drv->import_index.table)
+				drmHashDestroy(drv->import_index.table);
+			if (drv->import_index.handles)
+				drmHashDestroy(drv->import_index.handles);
+			drv->import_index.table = NULL;
+			drv->import_index.handles = NULL;
+		}
+	}
 
-	if (pthread_mutex_init(&drv->mappings_lock, NULL))
-		goto free_buffer_table;
+	if (drv_stats_init(drv))
+		goto free_import_index;
 
-	drv->mappings = drv_array_init(sizeof(struct mapping));
-	if (!drv->mappings)
-		goto free_mappings_lock;
+	const char *memory_budget;
+	memory_budget = drv_get_os_option(MINIGBM_MEMORY_BUDGET);
+	if (memory_budget)
+		drv->memory.budget = strtoull(memory_budget, NULL, 0);
 
 	drv->combos = drv_array_init(sizeof(struct combination));
 	if (!drv->combos)
-		goto free_mappings;
+		goto free_stats;
 
-	if (drv->backend->init) {
-		ret = drv->backend->init(drv);
+	if (DRV_BACKEND(drv)->init) {
+		ret = DRV_BACKEND(drv)->init(drv);
 		if (ret) {
 			drv_array_destroy(drv->combos);
-			goto free_mappings;
+			goto free_stats;
 		}
 	}
 
+#ifdef DRV_SINGLE_BACKEND
+	/* The calls go to the built-in backend, which must not have handed over to another. */
+	assert(drv->backend == &DRV_SINGLE_BACKEND);
+#endif
+
+	drv_build_combination_index(drv);
+
+	/*
+	 * Layouts only depend on the creation arguments and the device, so swapchains and codec
+	 * pools of the same configuration share one computation. Without the cache every
+	 * allocation computes its own.
+	 */
+	if (DRV_BACKEND(drv)->bo_compute_metadata)
+		drv_layout_cache_init(&drv->metadata_cache, DRV_METADATA_CACHE_ENTRIES);
+
+	/* Without a policy table the backend's choices stand. */
+	const char *modifier_policy;
+	modifier_policy = drv_get_os_option(MINIGBM_MODIFIER_POLICY);
+	if (modifier_policy && drv_modifier_policy_init(drv, modifier_policy))
+		drv_modifier_policy_destroy(drv);
+
+	/*
+	 * Deferring destruction keeps the GEM close and the host-side teardown off the thread
+	 * that frees the buffer, at the cost of the memory staying held for a little while.
+	 */
+	const char *deferred_destroy;
+	deferred_destroy = drv_get_os_option(MINIGBM_DEFERRED_DESTROY);
+	if (deferred_destroy && strtol(deferred_destroy, NULL, 0) && drv_bo_reaper_start(drv))
+		drv_loge("failed to start the reaper thread, destroying BOs synchronously\n");
+
 	return drv;
 
-free_mappings:
-	drv_array_destroy(drv->mappings);
-free_mappings_lock:
-	pthread_mutex_destroy(&drv->mappings_lock);
-free_buffer_table:
-	drmHashDestroy(drv->buffer_table);
-free_buffer_table_lock:
-	pthread_mutex_destroy(&drv->buffer_table_lock);
+free_stats:
+	drv_stats_destroy(drv);
+free_import_index:
+	drv_import_index_destroy(drv);
+free_shadow_pool:
+	drv_shadow_pool_destroy(drv);
+free_mapping_cache_lock:
+	pthread_mutex_destroy(&drv->mapping_cache.lock);
+free_suballoc_lock:
+	pthread_mutex_destroy(&drv->suballoc.lock);
+free_bo_pool_lock:
+	pthread_mutex_destroy(&drv->bo_pool.lock);
+free_mapping_shards:
+	drv_handle_shards_destroy(drv->mapping_shards, DRV_NUM_HANDLE_SHARDS);
+free_handle_refs:
+	drv_handle_table_destroy(drv->handle_refs);
 free_driver:
 	free(drv);
 	return NULL;
 }
 
-void drv_destroy(struct driver *drv)
+static struct drv_handle_shard *drv_mapping_shard(struct driver *drv, uint32_t handle)
 {
-	if (drv->backend->close)
-		drv->backend->close(drv);
+	return &drv->mapping_shards[handle % DRV_NUM_HANDLE_SHARDS];
+}
 
-	drv_array_destroy(drv->combos);
+/*
+ * Returns the array of mappings for the given GEM handle, or NULL if the handle has none.
+ * Assumes the shard lock is held.
+ */
+static struct drv_array *drv_mappings_lookup(struct drv_handle_shard *shard, uint32_t handle)
+{
+	void *mappings;
+
+	if (drmHashLookup(shard->table, handle, &mappings))
+		return NULL;
+
+	return (struct drv_array *)mappings;
+}
+
+/*
+ * Drops the mappings array of the given GEM handle from the shard once it no longer holds any
+ * mappings. Assumes the shard lock is held.
+ */
+static void drv_mappings_release(struct drv_handle_shard *shard, uint32_t handle,
+				 struct drv_array *mappings)
+{
+	if (drv_array_size(mappings))
+		return;
+
+	drmHashDelete(shard->table, handle);
+	if (shard->spare)
+		drv_array_destroy(mappings);
+	else
+		shard->spare = mappings;
+}
+
+static void drv_mapping_shards_destroy(struct driver *drv)
+{
+	unsigned long handle;
+	void *mappings;
+
+	for (uint32_t i = 0; i < DRV_NUM_HANDLE_SHARDS; i++) {
+		struct drv_handle_shard *shard = &drv->mapping_shards[i];
+
+		/* drmHashFirst() returns 1 while the table still has entries. */
+		while (drmHashFirst(shard->table, &handle, &mappings) == 1) {
+			drmHashDelete(shard->table, handle);
+			drv_array_destroy((struct drv_array *)mappings);
+		}
+
+		if (shard->spare)
+			drv_array_destroy(shard->spare);
+	}
+
+	drv_handle_shards_destroy(drv->mapping_shards, DRV_NUM_HANDLE_SHARDS);
+}
 
-	drv_array_destroy(drv->mappings);
-	pthread_mutex_destroy(&drv->mappings_lock);
+void drv_destroy(struct driver *drv)
+{
+	/* The reaper may still hand BOs to the pool and the mapping cache. */
+	if (drv->reaper.enabled)
+		drv_bo_reaper_stop(drv);
+
+	drv_mapping_cache_trim(drv, 0);
+	pthread_mutex_destroy(&drv->mapping_cache.lock);
+	drv_suballoc_destroy(drv);
+	drv_bo_pool_trim(drv, 0);
+	pthread_mutex_destroy(&drv->bo_pool.lock);
+
+	if (DRV_BACKEND(drv)->close)
+		DRV_BACKEND(drv)->close(drv);
+
+	drv_shadow_pool_destroy(drv);
+	drv_import_index_destroy(drv);
+
+	drv_modifier_policy_destroy(drv);
+	drv_layout_cache_destroy(&drv->metadata_cache);
+	free(drv->combo_index.formats);
+	free(drv->combo_index.refs);
+	drv_array_destroy(drv->combos);
 
-	drmHashDestroy(drv->buffer_table);
-	pthread_mutex_destroy(&drv->buffer_table_lock);
+	drv_mapping_shards_destroy(drv);
+	drv_handle_table_destroy(drv->handle_refs);
+	drv_stats_destroy(drv);
 
 	free(drv);
 }
@@ -192,16 +595,68 @@ int drv_get_fd(struct driver *drv)
 
 const char *drv_get_name(struct driver *drv)
 {
-	return drv->backend->name;
+	return DRV_BACKEND(drv)->name;
+}
+
+void drv_get_stats(struct driver *drv, struct drv_stats *stats)
+{
+	drv_stats_merge(drv, stats);
 }
 
 struct combination *drv_get_combination(struct driver *drv, uint32_t format, uint64_t use_flags)
 {
 	struct combination *curr, *best;
+	const struct combination_index *index = &drv->combo_index;
 
 	if (format == DRM_FORMAT_NONE || use_flags == BO_USE_NONE)
 		return 0;
 
+	/* The index is stale if combinations were added or modified after drv_create(). */
+	if (index->refs && index->generation == drv->combo_generation &&
+	    index->num_combos == drv_array_size(drv->combos)) {
+		uint32_t lo = 0, hi = index->num_formats;
+
+		while (lo < hi) {
+			uint32_t mid = lo + (hi - lo) / 2;
+			if (index->formats[mid].format < format)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		if (lo == index->num_formats || index->formats[lo].format != format)
+			return NULL;
+
+		const struct combination_format_range *range = &index->formats[lo];
+		struct combination *fallback = NULL;
+		int64_t best_score = 0, score;
+
+		best = NULL;
+		for (uint32_t i = range->start; i < range->start + range->count; i++) {
+			curr = drv_array_at_idx(drv->combos, index->refs[i].idx);
+			if (use_flags != (index->refs[i].use_flags & use_flags))
+				continue;
+
+			if (!drv->modifier_rules)
+				return curr;
+
+			/* Equal scores keep the priority order, a policy denying all is ignored. */
+			if (!fallback)
+				fallback = curr;
+
+			uint64_t modifier = curr->metadata.modifier;
+			if (!drv_modifier_policy_score(drv, format, use_flags, modifier, &score))
+				continue;
+
+			if (!best || score < best_score) {
+				best = curr;
+				best_score = score;
+			}
+		}
+
+		return best ? best : fallback;
+	}
+
 	best = NULL;
 	uint32_t i;
 	for (i = 0; i < drv_array_size(drv->combos); i++) {
@@ -231,196 +686,1691 @@ struct bo *drv_bo_new(struct driver *drv, uint32_t width, uint32_t height, uint3
 	bo->meta.use_flags = use_flags;
 	bo->meta.num_planes = drv_num_planes_from_format(format);
 	bo->is_test_buffer = is_test_buffer;
+	bo->dma_buf_fd = -1;
+
+	if (!bo->meta.num_planes) {
+		free(bo);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return bo;
+}
+
+static void drv_bo_mapping_destroy(struct bo *bo)
+{
+	struct driver *drv = bo->drv;
+	struct drv_handle_shard *shard = drv_mapping_shard(drv, bo->handle.u32);
+	struct drv_array *mappings;
+
+	/*
+	 * This function is called right before the buffer is destroyed. It will free any mappings
+	 * associated with the buffer.
+	 */
+	drv_stats_mutex_lock(drv, &shard->lock, DRV_STATS_MAPPING_LOCK_WAIT_NS);
+	mappings = drv_mappings_lookup(shard, bo->handle.u32);
+	if (!mappings) {
+		pthread_mutex_unlock(&shard->lock);
+		return;
+	}
+
+	for (uint32_t i = 0; i < drv_array_size(mappings);) {
+		struct mapping *mapping = (struct mapping *)drv_array_at_idx(mappings, i);
+
+		/* The other BOs carved out of the slab keep theirs. */
+		if (bo->slab && mapping->bo != bo) {
+			i++;
+			continue;
+		}
+
+		if (!--mapping->vma->refcount) {
+			int ret = DRV_BACKEND(drv)->bo_unmap(drv_bo_backing(bo), mapping->vma);
+			if (ret) {
+				pthread_mutex_unlock(&shard->lock);
+				assert(ret);
+				drv_loge("munmap failed\n");
+				return;
+			}
+
+			drv_memory_add(drv, DRV_MEMORY_MAPPED, -(int64_t)mapping->vma->length);
+			free(mapping->vma);
+		}
+
+		/* This shrinks and shifts the array. */
+		drv_array_remove(mappings, i);
+	}
+
+	drv_mappings_release(shard, bo->handle.u32, mappings);
+	pthread_mutex_unlock(&shard->lock);
+}
+
+/*
+ * Acquire a reference on the GEM handle of the bo. All planes share it, so a BO holds a single
+ * reference.
+ */
+static void drv_bo_acquire(struct bo *bo)
+{
+	struct drv_handle_slot *slot =
+	    drv_handle_table_slot(bo->drv->handle_refs, bo->handle.u32, true);
+
+	/* Without a slot the handle is never found referenced and closes with its first release. */
+	if (slot)
+		__atomic_add_fetch(&slot->refcount, 1, __ATOMIC_ACQ_REL);
+}
+
+/*
+ * Release the reference of the bo on its GEM handle. Return true when the handle has lost all
+ * its references. Otherwise, return false.
+ */
+static bool drv_bo_release(struct bo *bo)
+{
+	struct driver *drv = bo->drv;
+	struct drv_handle_slot *slot;
+	uint32_t num;
+
+	slot = drv_handle_table_slot(drv->handle_refs, bo->handle.u32, false);
+	num = slot ? __atomic_load_n(&slot->refcount, __ATOMIC_ACQUIRE) : 0;
+
+	if (DRV_BACKEND(drv)->bo_release)
+		DRV_BACKEND(drv)->bo_release(bo);
+
+	while (num) {
+		if (__atomic_compare_exchange_n(&slot->refcount, &num, num - 1, false,
+						__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			return num == 1;
+	}
+
+	return true;
+}
+
+struct drv_bo_pool_entry {
+	struct lru_entry entry;
+	struct bo *bo;
+	struct drv_bo_pool_entry *hash_next;
+};
+
+#define lru_entry_to_pool_entry(entry) ((struct drv_bo_pool_entry *)(void *)(entry))
+
+struct drv_bo_pool_key {
+	uint32_t width;
+	uint32_t height;
+	uint32_t format;
+	uint64_t use_flags;
+};
+
+/* The dimensions bo was allocated with, which may exceed the ones it reports. */
+static uint32_t drv_bo_alloc_width(const struct bo *bo)
+{
+	return bo->size_class_width ? bo->size_class_width : bo->meta.width;
+}
+
+static uint32_t drv_bo_alloc_height(const struct bo *bo)
+{
+	return bo->size_class_height ? bo->size_class_height : bo->meta.height;
+}
+
+static bool drv_bo_pool_key_matches(struct bo *bo, struct drv_bo_pool_key *key)
+{
+	return drv_bo_alloc_width(bo) == key->width && drv_bo_alloc_height(bo) == key->height &&
+	       bo->meta.format == key->format && bo->requested_use_flags == key->use_flags;
+}
+
+static uint32_t drv_bo_pool_bucket(uint32_t width, uint32_t height, uint32_t format,
+				   uint64_t use_flags)
+{
+	uint32_t hash = width * 31 + height;
+
+	hash = hash * 31 + format;
+	hash = hash * 31 + (uint32_t)(use_flags ^ (use_flags >> 32));
+	return hash & (DRV_BO_POOL_BUCKETS - 1);
+}
+
+static uint32_t drv_bo_pool_key_bucket(const struct drv_bo_pool_key *key)
+{
+	return drv_bo_pool_bucket(key->width, key->height, key->format, key->use_flags);
+}
+
+/* Use flags whose users cope with buffers bigger than they asked for, and ones that don't. */
+#define DRV_SIZE_CLASS_USE_FLAGS                                                                  \
+	(BO_USE_RENDERING | BO_USE_TEXTURE | BO_USE_CAMERA_READ | BO_USE_CAMERA_WRITE |           \
+	 BO_USE_HW_VIDEO_DECODER | BO_USE_HW_VIDEO_ENCODER)
+#define DRV_SIZE_CLASS_EXCLUDED_USE_FLAGS                                                         \
+	(BO_USE_SCANOUT | BO_USE_CURSOR | BO_USE_PROTECTED | BO_USE_FRONT_RENDERING |             \
+	 BO_USE_GPU_DATA_BUFFER | BO_USE_SENSOR_DIRECT_DATA)
+/* Smaller dimensions aren't rounded, the padding would be most of the buffer. */
+#define DRV_SIZE_CLASS_MIN_DIMENSION 64
+
+static uint32_t drv_size_class(uint32_t value, uint32_t steps)
+{
+	uint32_t step = (1u << (31 - __builtin_clz(value))) / steps;
+
+	step = MAX(step, 16u);
+	return DIV_ROUND_UP(value, step) * step;
+}
+
+static int drv_bo_compute_metadata(struct bo *bo, uint32_t width, uint32_t height,
+				   uint32_t format, uint64_t use_flags);
+
+/*
+ * Rounds the dimensions of an allocation up to its size class, so that recycled BOs serve
+ * nearby sizes too. Only done while the BO pool is enabled; the rounding is pure overhead
+ * otherwise. Only single-planar formats are rounded: the offsets of the other planes would
+ * follow from the rounded height, which users compute from the one they asked for.
+ *
+ * The layout of the rounded dimensions must also hold width x height, which linear layouts do
+ * with the larger stride; tiled layouts may place data by the dimensions they were computed
+ * for. That is decided here, before anything is allocated or looked up in the pool, so only
+ * backends that compute the layout apart from creating the BO are rounded.
+ */
+static void drv_size_class_round(struct driver *drv, uint32_t format, uint64_t use_flags,
+				 uint32_t *width, uint32_t *height)
+{
+	struct bo layout = { .drv = drv };
+	uint32_t rounded_width, rounded_height;
+
+	if (!drv->size_class_steps || !__atomic_load_n(&drv->bo_pool.max_size, __ATOMIC_RELAXED))
+		return;
+
+	if (!DRV_BACKEND(drv)->bo_compute_metadata || drv_num_planes_from_format(format) != 1)
+		return;
+
+	if (!(use_flags & DRV_SIZE_CLASS_USE_FLAGS) ||
+	    (use_flags & DRV_SIZE_CLASS_EXCLUDED_USE_FLAGS))
+		return;
+
+	if (*width < DRV_SIZE_CLASS_MIN_DIMENSION || *height < DRV_SIZE_CLASS_MIN_DIMENSION)
+		return;
+
+	rounded_width = drv_size_class(*width, drv->size_class_steps);
+	rounded_height = drv_size_class(*height, drv->size_class_steps);
+
+	/* Goes through the metadata cache, which the allocation then hits. */
+	layout.meta.width = rounded_width;
+	layout.meta.height = rounded_height;
+	layout.meta.format = format;
+	layout.meta.use_flags = use_flags;
+	layout.meta.num_planes = 1;
+	if (drv_bo_compute_metadata(&layout, rounded_width, rounded_height, format, use_flags) ||
+	    layout.meta.num_planes != 1 || layout.meta.format_modifier != DRM_FORMAT_MOD_LINEAR)
+		return;
+
+	*width = rounded_width;
+	*height = rounded_height;
+}
+
+/*
+ * Makes bo, allocated with larger dimensions, report width x height. The strides and sizes stay
+ * those of the allocation, which the smaller image fits in.
+ */
+static void drv_bo_set_logical_size(struct bo *bo, uint32_t width, uint32_t height)
+{
+	uint32_t alloc_width = drv_bo_alloc_width(bo), alloc_height = drv_bo_alloc_height(bo);
+	uint64_t alloc_area = (uint64_t)alloc_width * alloc_height;
+
+	bo->size_class_width = width != alloc_width || height != alloc_height ? alloc_width : 0;
+	bo->size_class_height = bo->size_class_width ? alloc_height : 0;
+	bo->meta.width = width;
+	bo->meta.height = height;
+
+	/* Estimated from the share of the area that goes unused. */
+	bo->size_class_padding =
+	    bo->meta.total_size - bo->meta.total_size * ((uint64_t)width * height) / alloc_area;
+}
+
+/* Adds pool_entry to the LRU and to its bucket. Assumes the pool lock is held. */
+static void drv_bo_pool_link(struct drv_bo_pool *pool, struct drv_bo_pool_entry *pool_entry)
+{
+	struct bo *bo = pool_entry->bo;
+	uint32_t bucket = drv_bo_pool_bucket(drv_bo_alloc_width(bo), drv_bo_alloc_height(bo),
+					     bo->meta.format, bo->requested_use_flags);
+
+	lru_insert(&pool->lru, &pool_entry->entry);
+	pool_entry->hash_next = pool->buckets[bucket];
+	pool->buckets[bucket] = pool_entry;
+	pool->size += bo->meta.total_size;
+}
+
+/* Assumes the pool lock is held. */
+static void drv_bo_pool_unlink(struct drv_bo_pool *pool, struct drv_bo_pool_entry *pool_entry)
+{
+	struct bo *bo = pool_entry->bo;
+	uint32_t bucket = drv_bo_pool_bucket(drv_bo_alloc_width(bo), drv_bo_alloc_height(bo),
+					     bo->meta.format, bo->requested_use_flags);
+	struct drv_bo_pool_entry **link = &pool->buckets[bucket];
+
+	while (*link != pool_entry)
+		link = &(*link)->hash_next;
+
+	*link = pool_entry->hash_next;
+	lru_remove(&pool->lru, &pool_entry->entry);
+	pool->size -= bo->meta.total_size;
+}
+
+/*
+ * Returns the most recently pooled entry matching key, buckets are kept in insertion order.
+ * Assumes the pool lock is held.
+ */
+static struct drv_bo_pool_entry *drv_bo_pool_find(struct drv_bo_pool *pool,
+						  struct drv_bo_pool_key *key)
+{
+	struct drv_bo_pool_entry *pool_entry = pool->buckets[drv_bo_pool_key_bucket(key)];
+
+	while (pool_entry && !drv_bo_pool_key_matches(pool_entry->bo, key))
+		pool_entry = pool_entry->hash_next;
+
+	return pool_entry;
+}
+
+static struct bo *drv_bo_reaper_reclaim(struct driver *drv, struct drv_bo_pool_key *key);
+
+/*
+ * Unlinks least recently used entries until the pool holds at most max_size bytes. The
+ * unlinked entries are chained through entry.next and returned so that the caller can free the
+ * buffers without holding the pool lock. Assumes the pool lock is held.
+ */
+static struct lru_entry *drv_bo_pool_evict(struct drv_bo_pool *pool, size_t max_size)
+{
+	struct lru_entry *evicted = NULL;
+
+	while (pool->size > max_size && pool->lru.count) {
+		struct lru_entry *oldest = pool->lru.head.prev;
+
+		drv_bo_pool_unlink(pool, lru_entry_to_pool_entry(oldest));
+
+		oldest->next = evicted;
+		evicted = oldest;
+	}
+
+	return evicted;
+}
+
+static void drv_bo_pool_free(struct lru_entry *evicted)
+{
+	while (evicted) {
+		struct drv_bo_pool_entry *pool_entry = lru_entry_to_pool_entry(evicted);
+		struct bo *bo = pool_entry->bo;
+
+		evicted = evicted->next;
+		DRV_BACKEND(bo->drv)->bo_destroy(bo);
+		free(bo);
+		free(pool_entry);
+	}
+}
+
+/* alloc_width x alloc_height are the dimensions after drv_size_class_round(). */
+static struct bo *drv_bo_pool_get(struct driver *drv, uint32_t width, uint32_t height,
+				  uint32_t alloc_width, uint32_t alloc_height, uint32_t format,
+				  uint64_t use_flags)
+{
+	struct drv_bo_pool *pool = &drv->bo_pool;
+	struct drv_bo_pool_key key = { .width = alloc_width,
+				       .height = alloc_height,
+				       .format = format,
+				       .use_flags = use_flags };
+	struct drv_bo_pool_entry *pool_entry;
+	struct bo *bo;
+
+	pthread_mutex_lock(&pool->lock);
+	pool_entry = drv_bo_pool_find(pool, &key);
+	if (pool_entry) {
+		drv_bo_pool_unlink(pool, pool_entry);
+		bo = pool_entry->bo;
+		pthread_mutex_unlock(&pool->lock);
+		free(pool_entry);
+	} else {
+		pthread_mutex_unlock(&pool->lock);
+
+		/* A BO waiting for the reaper is as good as a pooled one. */
+		bo = drv->reaper.enabled ? drv_bo_reaper_reclaim(drv, &key) : NULL;
+		if (!bo)
+			return NULL;
+	}
+
+	if (width != bo->meta.width || height != bo->meta.height) {
+		drv_stats_add(drv, DRV_STATS_SIZE_CLASS_REUSES, 1);
+		drv_bo_set_logical_size(bo, width, height);
+	}
+
+	/* The key matched the requested flags, so the layout and resolved flags already fit. */
+	return bo;
+}
+
+/*
+ * Takes ownership of a BO that lost its last reference. Returns false if the BO can't be
+ * pooled, in which case the caller destroys it. Without evict, a BO that only fits by evicting
+ * others isn't pooled either.
+ */
+static bool drv_bo_pool_insert(struct bo *bo, bool evict)
+{
+	struct drv_bo_pool *pool = &bo->drv->bo_pool;
+	struct drv_bo_pool_entry *pool_entry;
+	struct lru_entry *evicted;
+
+	if (!bo->recyclable)
+		return false;
+
+	pool_entry = calloc(1, sizeof(*pool_entry));
+	if (!pool_entry)
+		return false;
+
+	pool_entry->bo = bo;
+
+	pthread_mutex_lock(&pool->lock);
+	if (bo->meta.total_size > pool->max_size ||
+	    (!evict && pool->size + bo->meta.total_size > pool->max_size)) {
+		pthread_mutex_unlock(&pool->lock);
+		free(pool_entry);
+		return false;
+	}
+
+	drv_bo_pool_link(pool, pool_entry);
+	evicted = drv_bo_pool_evict(pool, pool->max_size);
+	pthread_mutex_unlock(&pool->lock);
+
+	drv_bo_pool_free(evicted);
+	return true;
+}
+
+static bool drv_bo_pool_put(struct bo *bo)
+{
+	return drv_bo_pool_insert(bo, true);
+}
+
+void drv_bo_pool_set_max_size(struct driver *drv, size_t max_size)
+{
+	struct drv_bo_pool *pool = &drv->bo_pool;
+	struct lru_entry *evicted;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->max_size = max_size;
+	evicted = drv_bo_pool_evict(pool, max_size);
+	pthread_mutex_unlock(&pool->lock);
+
+	drv_bo_pool_free(evicted);
+}
+
+void drv_bo_pool_trim(struct driver *drv, size_t max_size)
+{
+	struct drv_bo_pool *pool = &drv->bo_pool;
+	struct lru_entry *evicted;
+
+	pthread_mutex_lock(&pool->lock);
+	evicted = drv_bo_pool_evict(pool, max_size);
+	pthread_mutex_unlock(&pool->lock);
+
+	drv_bo_pool_free(evicted);
+}
+
+/* Largest BO that is carved out of a slab, and smallest block a slab hands out. */
+#define DRV_SUBALLOC_MAX_SIZE (64 * 1024)
+#define DRV_SUBALLOC_MIN_BLOCK 64
+#define DRV_SUBALLOC_SLAB_BLOCKS 64
+
+/* Assumes the suballocator lock is held. */
+static struct drv_suballoc_slab *drv_suballoc_slab_create(struct bo *template_bo,
+							  uint32_t block_size)
+{
+	int ret;
+	struct driver *drv = template_bo->drv;
+	struct drv_suballoc_slab *slab;
+
+	slab = calloc(1, sizeof(*slab));
+	if (!slab)
+		return NULL;
+
+	slab->bo = drv_bo_new(drv, template_bo->meta.width, template_bo->meta.height,
+			      template_bo->meta.format, template_bo->meta.use_flags, false);
+	if (!slab->bo)
+		goto free_slab;
+
+	slab->bo->meta = template_bo->meta;
+	slab->bo->meta.total_size = (uint64_t)block_size * DRV_SUBALLOC_SLAB_BLOCKS;
+	slab->bo->requested_use_flags = template_bo->requested_use_flags;
+
+	drv_trace_begin("drv_suballoc_slab_create", slab->bo);
+	ret = DRV_BACKEND(drv)->bo_create_from_metadata(slab->bo);
+	drv_trace_end();
+	if (ret)
+		goto free_bo;
+
+	drv_bo_acquire(slab->bo);
+
+	slab->requested_use_flags = template_bo->requested_use_flags;
+	slab->block_size = block_size;
+	slab->refcount = 1;
+	slab->free_mask = ~0ull;
+	slab->next = drv->suballoc.slabs;
+	drv->suballoc.slabs = slab;
+	return slab;
+
+free_bo:
+	free(slab->bo);
+free_slab:
+	free(slab);
+	return NULL;
+}
+
+/*
+ * Carves bo, whose metadata has been computed, out of a slab if the backend allows it. Returns
+ * false if bo needs a GEM object of its own.
+ */
+static bool drv_bo_suballoc(struct bo *bo)
+{
+	struct driver *drv = bo->drv;
+	struct drv_suballocator *suballoc = &drv->suballoc;
+	struct drv_suballoc_slab *slab;
+	uint32_t alignment, block_size, block;
+	uint64_t size = 0;
+	size_t plane;
+
+	if (!suballoc->enabled)
+		return false;
+
+	/* The page alignment of total_size only matters for BOs of their own. */
+	for (plane = 0; plane < bo->meta.num_planes; plane++)
+		size = MAX(size, (uint64_t)bo->meta.offsets[plane] + bo->meta.sizes[plane]);
+
+	if (!size || size > DRV_SUBALLOC_MAX_SIZE)
+		return false;
+
+	alignment = DRV_BACKEND(drv)->bo_suballoc_alignment(bo);
+	if (!alignment)
+		return false;
+
+	/* Blocks are aligned to their size. */
+	block_size = DRV_SUBALLOC_MIN_BLOCK;
+	while (block_size < size || block_size < alignment)
+		block_size *= 2;
+
+	if (block_size > DRV_SUBALLOC_MAX_SIZE)
+		return false;
+
+	pthread_mutex_lock(&suballoc->lock);
+	for (slab = suballoc->slabs; slab; slab = slab->next) {
+		if (slab->block_size == block_size &&
+		    slab->requested_use_flags == bo->requested_use_flags && slab->free_mask)
+			break;
+	}
+
+	if (!slab)
+		slab = drv_suballoc_slab_create(bo, block_size);
+
+	if (!slab) {
+		pthread_mutex_unlock(&suballoc->lock);
+		return false;
+	}
+
+	block = __builtin_ctzll(slab->free_mask);
+	slab->free_mask &= ~(1ull << block);
+	slab->refcount++;
+	pthread_mutex_unlock(&suballoc->lock);
+
+	bo->handle = slab->bo->handle;
+	for (plane = 0; plane < bo->meta.num_planes; plane++)
+		bo->meta.offsets[plane] += block * block_size;
+
+	bo->meta.total_size = size;
+	bo->slab = slab;
+	bo->slab_block = block;
+	return true;
+}
+
+/* Drops a reference on slab, returning whether it was the last. Assumes the lock is held. */
+static bool drv_suballoc_slab_unref(struct drv_suballoc_slab *slab)
+{
+	return !--slab->refcount;
+}
+
+static void drv_suballoc_slab_free(struct drv_suballoc_slab *slab)
+{
+	drv_bo_destroy(slab->bo);
+	free(slab);
+}
+
+/*
+ * Returns the block of a carved BO to its slab, unless the BO was exported. A slab no BO is
+ * carved out of any more is kept while it is the only one of its kind with free blocks, so that
+ * a create and destroy in a loop doesn't churn slabs, unless blocks of it were lost to exports.
+ */
+static void drv_bo_suballoc_free(struct bo *bo)
+{
+	struct drv_suballocator *suballoc = &bo->drv->suballoc;
+	struct drv_suballoc_slab *slab = bo->slab;
+	struct drv_suballoc_slab **link, *other;
+	bool release, last;
+
+	pthread_mutex_lock(&suballoc->lock);
+	if (!(slab->exported_mask & (1ull << bo->slab_block)))
+		slab->free_mask |= 1ull << bo->slab_block;
+
+	/* This BO and the list hold the last references, unless drv_suballoc_destroy() ran. */
+	for (link = &suballoc->slabs; *link && *link != slab; link = &(*link)->next)
+		;
+
+	if (*link && slab->refcount == 2) {
+		release = slab->exported_mask != 0;
+		for (other = suballoc->slabs; other && !release; other = other->next) {
+			if (other != slab && other->block_size == slab->block_size &&
+			    other->requested_use_flags == slab->requested_use_flags &&
+			    other->free_mask)
+				release = true;
+		}
+
+		if (release) {
+			*link = slab->next;
+			drv_suballoc_slab_unref(slab);
+		}
+	}
+
+	last = drv_suballoc_slab_unref(slab);
+	pthread_mutex_unlock(&suballoc->lock);
+
+	if (last)
+		drv_suballoc_slab_free(slab);
+}
+
+/*
+ * Returns the BO that owns the GEM handle of bo. Mappings of a carved BO cover the whole slab,
+ * which its plane offsets are relative to, and are shared with the other BOs in the slab.
+ */
+static struct bo *drv_bo_backing(struct bo *bo)
+{
+	return bo->slab ? bo->slab->bo : bo;
+}
+
+/* Drops the list's references on the slabs, those BOs are still carved out of stay with them. */
+static void drv_suballoc_destroy(struct driver *drv)
+{
+	struct drv_suballoc_slab *slab, *next, *last = NULL;
+
+	pthread_mutex_lock(&drv->suballoc.lock);
+	for (slab = drv->suballoc.slabs; slab; slab = next) {
+		next = slab->next;
+		slab->next = NULL;
+		if (drv_suballoc_slab_unref(slab)) {
+			slab->next = last;
+			last = slab;
+		}
+	}
+	drv->suballoc.slabs = NULL;
+	pthread_mutex_unlock(&drv->suballoc.lock);
+
+	for (slab = last; slab; slab = next) {
+		next = slab->next;
+		drv_suballoc_slab_free(slab);
+	}
+
+	pthread_mutex_destroy(&drv->suballoc.lock);
+}
+
+struct drv_mapping_cache_entry {
+	struct lru_entry entry;
+	struct bo *bo;
+	struct mapping *mapping;
+};
+
+#define lru_entry_to_mapping_cache_entry(entry)                                                    \
+	((struct drv_mapping_cache_entry *)(void *)(entry))
+
+/*
+ * Unlinks least recently used entries until the cache holds at most max_size bytes, chaining
+ * them through entry.next like drv_bo_pool_evict(). Assumes the cache lock is held.
+ */
+static struct lru_entry *drv_mapping_cache_evict(struct drv_mapping_cache *cache, size_t max_size)
+{
+	struct lru_entry *evicted = NULL;
+
+	while (cache->size > max_size && cache->lru.count) {
+		struct lru_entry *oldest = cache->lru.head.prev;
+		struct drv_mapping_cache_entry *cache_entry =
+		    lru_entry_to_mapping_cache_entry(oldest);
+
+		lru_remove(&cache->lru, oldest);
+		cache_entry->mapping->cached = false;
+		__atomic_sub_fetch(&cache_entry->bo->num_cached_mappings, 1, __ATOMIC_RELEASE);
+		cache->size -= cache_entry->mapping->vma->length;
+
+		oldest->next = evicted;
+		evicted = oldest;
+	}
+
+	return evicted;
+}
+
+/* Drops the references the evicted entries held, unmapping the mappings nobody else uses. */
+static void drv_mapping_cache_free(struct lru_entry *evicted)
+{
+	while (evicted) {
+		struct drv_mapping_cache_entry *cache_entry =
+		    lru_entry_to_mapping_cache_entry(evicted);
+
+		evicted = evicted->next;
+		drv_bo_unmap(cache_entry->bo, cache_entry->mapping);
+		free(cache_entry);
+	}
+}
+
+/*
+ * Takes over the caller's reference on a mapping that is done with, instead of unmapping it.
+ * A mapping that is already cached only moves to the front, and the caller's reference is
+ * dropped. Returns false if the mapping can't be cached, in which case the caller unmaps it.
+ */
+static bool drv_mapping_cache_put(struct bo *bo, struct mapping *mapping)
+{
+	struct drv_mapping_cache *cache = &bo->drv->mapping_cache;
+	struct drv_mapping_cache_entry *cache_entry;
+	struct lru_entry *evicted;
+
+	if (mapping->vma->length > cache->max_size)
+		return false;
+
+	cache_entry = calloc(1, sizeof(*cache_entry));
+	if (!cache_entry)
+		return false;
+
+	cache_entry->bo = bo;
+	cache_entry->mapping = mapping;
+
+	pthread_mutex_lock(&cache->lock);
+	if (mapping->cached) {
+		pthread_mutex_unlock(&cache->lock);
+		free(cache_entry);
+		drv_bo_unmap(bo, mapping);
+		return true;
+	}
+
+	mapping->cached = true;
+	__atomic_add_fetch(&bo->num_cached_mappings, 1, __ATOMIC_RELEASE);
+	lru_insert(&cache->lru, &cache_entry->entry);
+	cache->size += mapping->vma->length;
+	evicted = drv_mapping_cache_evict(cache, cache->max_size);
+	pthread_mutex_unlock(&cache->lock);
+
+	drv_mapping_cache_free(evicted);
+	return true;
+}
+
+/* Drops the cached mappings taken through bo, which is about to be freed. */
+static void drv_mapping_cache_purge(struct bo *bo)
+{
+	struct drv_mapping_cache *cache = &bo->drv->mapping_cache;
+	struct lru_entry *evicted = NULL;
+	struct lru_entry *cur;
+
+	pthread_mutex_lock(&cache->lock);
+	cur = cache->lru.head.next;
+	while (cur != &cache->lru.head) {
+		struct lru_entry *next = cur->next;
+		struct drv_mapping_cache_entry *cache_entry = lru_entry_to_mapping_cache_entry(cur);
+
+		if (cache_entry->bo == bo) {
+			lru_remove(&cache->lru, cur);
+			cache_entry->mapping->cached = false;
+			__atomic_sub_fetch(&bo->num_cached_mappings, 1, __ATOMIC_RELEASE);
+			cache->size -= cache_entry->mapping->vma->length;
+			cur->next = evicted;
+			evicted = cur;
+		}
+
+		cur = next;
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	drv_mapping_cache_free(evicted);
+}
+
+void drv_mapping_cache_trim(struct driver *drv, size_t max_size)
+{
+	struct drv_mapping_cache *cache = &drv->mapping_cache;
+	struct lru_entry *evicted;
+
+	pthread_mutex_lock(&cache->lock);
+	evicted = drv_mapping_cache_evict(cache, max_size);
+	pthread_mutex_unlock(&cache->lock);
+
+	drv_mapping_cache_free(evicted);
+}
+
+/* Frees the slabs no BO is carved out of. */
+static void drv_suballoc_trim(struct driver *drv)
+{
+	struct drv_suballocator *suballoc = &drv->suballoc;
+	struct drv_suballoc_slab **link, *slab, *empty = NULL;
+
+	pthread_mutex_lock(&suballoc->lock);
+	link = &suballoc->slabs;
+	while ((slab = *link)) {
+		if (slab->refcount == 1) {
+			*link = slab->next;
+			slab->next = empty;
+			empty = slab;
+		} else {
+			link = &slab->next;
+		}
+	}
+	pthread_mutex_unlock(&suballoc->lock);
+
+	while (empty) {
+		slab = empty->next;
+		drv_suballoc_slab_free(empty);
+		empty = slab;
+	}
+}
+
+void drv_trim(struct driver *drv, enum drv_trim_level level)
+{
+	size_t mapping_cache_size, bo_pool_size;
+
+	drv_trace_begin("drv_trim", NULL);
+	if (level == DRV_TRIM_MODERATE) {
+		/* The reaper gets to the queued BOs soon enough. */
+		pthread_mutex_lock(&drv->mapping_cache.lock);
+		mapping_cache_size = drv->mapping_cache.size;
+		pthread_mutex_unlock(&drv->mapping_cache.lock);
+
+		pthread_mutex_lock(&drv->bo_pool.lock);
+		bo_pool_size = drv->bo_pool.size;
+		pthread_mutex_unlock(&drv->bo_pool.lock);
+
+		drv_mapping_cache_trim(drv, mapping_cache_size / 2);
+		drv_bo_pool_trim(drv, bo_pool_size / 2);
+	} else {
+		/* BOs the reaper hands to the pool are trimmed along with it. */
+		if (drv->reaper.enabled)
+			drv_bo_reaper_flush(drv);
+
+		drv_mapping_cache_trim(drv, 0);
+		drv_bo_pool_trim(drv, 0);
+		drv_suballoc_trim(drv);
+		drv_shadow_pool_trim(drv);
+	}
+
+	if (DRV_BACKEND(drv)->trim)
+		DRV_BACKEND(drv)->trim(drv, level);
+	drv_trace_end();
+}
+
+void drv_get_memory_info(struct driver *drv, struct drv_memory_info *info)
+{
+	struct drv_suballoc_slab *slab;
+
+	memset(info, 0, sizeof(*info));
+	for (uint32_t kind = 0; kind < DRV_MEMORY_NUM_KINDS; kind++)
+		info->bytes[kind] = __atomic_load_n(&drv->memory.bytes[kind], __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&drv->bo_pool.lock);
+	info->bytes[DRV_MEMORY_BO_POOL] = drv->bo_pool.size;
+	pthread_mutex_unlock(&drv->bo_pool.lock);
+
+	pthread_mutex_lock(&drv->mapping_cache.lock);
+	info->bytes[DRV_MEMORY_MAPPING_CACHE] = drv->mapping_cache.size;
+	pthread_mutex_unlock(&drv->mapping_cache.lock);
+
+	/* Carved BOs are counted as allocated, only the free blocks are extra. */
+	pthread_mutex_lock(&drv->suballoc.lock);
+	for (slab = drv->suballoc.slabs; slab; slab = slab->next)
+		info->bytes[DRV_MEMORY_SUBALLOC_SLABS] +=
+		    (uint64_t)__builtin_popcountll(slab->free_mask) * slab->block_size;
+	pthread_mutex_unlock(&drv->suballoc.lock);
+
+	if (drv->metadata_cache.buckets)
+		info->bytes[DRV_MEMORY_BACKEND_CACHES] +=
+		    drv_layout_cache_get_size(&drv->metadata_cache);
+
+	info->budget = __atomic_load_n(&drv->memory.budget, __ATOMIC_RELAXED);
+
+	if (DRV_BACKEND(drv)->get_memory_info)
+		DRV_BACKEND(drv)->get_memory_info(drv, info);
+}
+
+/*
+ * Returns the usage slot of format and use_flags, claiming a free one if create is set. NULL if
+ * there is none and the table is full, or create isn't set.
+ */
+static struct drv_memory_usage_slot *drv_memory_usage_slot(struct driver *drv, uint32_t format,
+							   uint64_t use_flags, bool create)
+{
+	struct drv_memory_usage_slot *slot;
+	uint32_t hash, state;
+
+	hash = (uint32_t)((format ^ use_flags ^ (use_flags >> 32)) * 0x9e3779b1u);
+	for (uint32_t i = 0; i < DRV_MEMORY_USAGE_SLOTS; i++) {
+		slot = &drv->memory.usage[(hash + i) % DRV_MEMORY_USAGE_SLOTS];
+
+		state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+		if (state == DRV_MEMORY_USAGE_SLOT_EMPTY) {
+			if (!create)
+				return NULL;
+
+			if (__atomic_compare_exchange_n(&slot->state, &state,
+							DRV_MEMORY_USAGE_SLOT_CLAIMED, false,
+							__ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+				slot->format = format;
+				slot->use_flags = use_flags;
+				__atomic_store_n(&slot->state, DRV_MEMORY_USAGE_SLOT_READY,
+						 __ATOMIC_RELEASE);
+				return slot;
+			}
+		}
+
+		/* Another thread is filling in the key, which takes no time. */
+		while (state == DRV_MEMORY_USAGE_SLOT_CLAIMED)
+			state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+
+		if (slot->format == format && slot->use_flags == use_flags)
+			return slot;
+	}
+
+	return NULL;
+}
+
+uint32_t drv_get_memory_usage(struct driver *drv, struct drv_memory_usage *usage,
+			      uint32_t max_count)
+{
+	struct drv_memory_usage_slot *slot;
+	struct drv_memory_usage entry;
+	uint32_t count = 0;
+
+	for (uint32_t i = 0; i < DRV_MEMORY_USAGE_SLOTS; i++) {
+		slot = &drv->memory.usage[i];
+		if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) != DRV_MEMORY_USAGE_SLOT_READY)
+			continue;
+
+		entry.format = slot->format;
+		entry.use_flags = slot->use_flags;
+		entry.num_allocated = __atomic_load_n(&slot->num_allocated, __ATOMIC_RELAXED);
+		entry.allocated_bytes = __atomic_load_n(&slot->allocated_bytes, __ATOMIC_RELAXED);
+		entry.num_imported = __atomic_load_n(&slot->num_imported, __ATOMIC_RELAXED);
+		entry.imported_bytes = __atomic_load_n(&slot->imported_bytes, __ATOMIC_RELAXED);
+		if (!entry.num_allocated && !entry.num_imported)
+			continue;
+
+		if (count < max_count)
+			usage[count] = entry;
+		count++;
+	}
+
+	return count;
+}
+
+void drv_set_memory_budget(struct driver *drv, uint64_t budget)
+{
+	__atomic_store_n(&drv->memory.budget, budget, __ATOMIC_RELAXED);
+}
+
+/* The memory counted against the budget. */
+static uint64_t drv_memory_held(const struct drv_memory_info *info)
+{
+	return info->bytes[DRV_MEMORY_ALLOCATED] + info->bytes[DRV_MEMORY_BO_POOL] +
+	       info->bytes[DRV_MEMORY_PENDING_DESTROY] + info->bytes[DRV_MEMORY_SUBALLOC_SLABS] +
+	       info->bytes[DRV_MEMORY_SHADOW] + info->bytes[DRV_MEMORY_STAGING] +
+	       info->bytes[DRV_MEMORY_BACKEND_CACHES] +
+	       info->bytes[DRV_MEMORY_LARGE_PAGE_PADDING];
+}
+
+/* Whether size more bytes can be held without reaching the budget, if one is set. */
+static bool drv_memory_fits_budget(struct driver *drv, uint64_t size)
+{
+	struct drv_memory_info info;
+
+	if (!__atomic_load_n(&drv->memory.budget, __ATOMIC_RELAXED))
+		return true;
+
+	drv_get_memory_info(drv, &info);
+	return drv_memory_held(&info) + size < info.budget;
+}
+
+/*
+ * Called before a new allocation. Trims once the memory held exceeds the budget, and returns
+ * -ENOMEM if the allocated BOs alone still do.
+ */
+static int drv_memory_check_budget(struct driver *drv)
+{
+	uint64_t budget;
+
+	if (drv_memory_fits_budget(drv, 0))
+		return 0;
+
+	drv_trim(drv, DRV_TRIM_COMPLETE);
+
+	budget = __atomic_load_n(&drv->memory.budget, __ATOMIC_RELAXED);
+	if (__atomic_load_n(&drv->memory.bytes[DRV_MEMORY_ALLOCATED], __ATOMIC_RELAXED) < budget)
+		return 0;
+
+	drv_loge("memory budget of %" PRIu64 " bytes exhausted\n", budget);
+	return -ENOMEM;
+}
+
+/* Adds bo, whose layout is final, to the accounting. */
+static void drv_memory_track(struct bo *bo, bool imported)
+{
+	struct drv_memory_usage_slot *slot;
+
+	drv_memory_add(bo->drv, imported ? DRV_MEMORY_IMPORTED : DRV_MEMORY_ALLOCATED,
+		       bo->meta.total_size);
+	drv_memory_add(bo->drv, DRV_MEMORY_LARGE_PAGE_PADDING, bo->large_page_padding);
+	drv_memory_add(bo->drv, DRV_MEMORY_SIZE_CLASS_PADDING, bo->size_class_padding);
+	bo->accounted = true;
+	bo->imported = imported;
+
+	/* Only the breakdown is lost if the table is full. */
+	slot = drv_memory_usage_slot(bo->drv, bo->meta.format, bo->meta.use_flags, true);
+	if (slot && imported) {
+		__atomic_add_fetch(&slot->num_imported, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&slot->imported_bytes, bo->meta.total_size, __ATOMIC_RELAXED);
+	} else if (slot) {
+		__atomic_add_fetch(&slot->num_allocated, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&slot->allocated_bytes, bo->meta.total_size, __ATOMIC_RELAXED);
+	}
+}
+
+static void drv_memory_untrack(struct bo *bo)
+{
+	struct drv_memory_usage_slot *slot;
+
+	if (!bo->accounted)
+		return;
+
+	drv_memory_add(bo->drv, bo->imported ? DRV_MEMORY_IMPORTED : DRV_MEMORY_ALLOCATED,
+		       -(int64_t)bo->meta.total_size);
+	drv_memory_add(bo->drv, DRV_MEMORY_LARGE_PAGE_PADDING, -(int64_t)bo->large_page_padding);
+	drv_memory_add(bo->drv, DRV_MEMORY_SIZE_CLASS_PADDING, -(int64_t)bo->size_class_padding);
+	bo->accounted = false;
+
+	slot = drv_memory_usage_slot(bo->drv, bo->meta.format, bo->meta.use_flags, false);
+	if (slot && bo->imported) {
+		__atomic_sub_fetch(&slot->num_imported, 1, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&slot->imported_bytes, bo->meta.total_size, __ATOMIC_RELAXED);
+	} else if (slot) {
+		__atomic_sub_fetch(&slot->num_allocated, 1, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&slot->allocated_bytes, bo->meta.total_size, __ATOMIC_RELAXED);
+	}
+}
+
+/* bo_compute_metadata without a modifier list, through the metadata cache. */
+static int drv_bo_compute_metadata(struct bo *bo, uint32_t width, uint32_t height,
+				   uint32_t format, uint64_t use_flags)
+{
+	struct driver *drv = bo->drv;
+	int ret;
+
+	if (!drv->metadata_cache.buckets)
+		return DRV_BACKEND(drv)->bo_compute_metadata(bo, width, height, format, use_flags,
+							     NULL, 0);
+
+	if (drv_layout_cache_lookup(&drv->metadata_cache, width, height, format, use_flags,
+				    &bo->meta)) {
+		drv_stats_add(drv, DRV_STATS_METADATA_CACHE_HITS, 1);
+		return 0;
+	}
+
+	drv_stats_add(drv, DRV_STATS_METADATA_CACHE_MISSES, 1);
+	ret = DRV_BACKEND(drv)->bo_compute_metadata(bo, width, height, format, use_flags, NULL, 0);
+	if (!ret)
+		drv_layout_cache_insert(&drv->metadata_cache, width, height, format, use_flags,
+					&bo->meta);
+
+	return ret;
+}
+
+/*
+ * Creates a BO from the backend, bypassing the BO pool. alloc_width x alloc_height are the
+ * dimensions after drv_size_class_round().
+ */
+static struct bo *drv_bo_create_new(struct driver *drv, uint32_t width, uint32_t height,
+				    uint32_t alloc_width, uint32_t alloc_height, uint32_t format,
+				    uint64_t use_flags, bool is_test_alloc)
+{
+	int ret;
+	struct bo *bo;
+	bool suballocated = false;
+	uint64_t start;
+
+	if (!is_test_alloc) {
+		ret = drv_memory_check_budget(drv);
+		if (ret) {
+			errno = -ret;
+			return NULL;
+		}
+	}
+
+	bo = drv_bo_new(drv, alloc_width, alloc_height, format, use_flags, is_test_alloc);
+
+	if (!bo)
+		return NULL;
+
+	/* Backends with a bo_release hook free per-BO state there, so their BOs can't be reused. */
+	bo->recyclable = !is_test_alloc && !DRV_BACKEND(drv)->bo_release;
+	bo->requested_use_flags = use_flags;
+
+	start = drv_stats_now();
+	drv_trace_begin("drv_bo_create", bo);
+	ret = -EINVAL;
+	if (DRV_BACKEND(drv)->bo_compute_metadata) {
+		ret = drv_bo_compute_metadata(bo, alloc_width, alloc_height, format, use_flags);
+		if (!is_test_alloc && ret == 0) {
+			suballocated = drv_bo_suballoc(bo);
+			if (!suballocated)
+				ret = DRV_BACKEND(drv)->bo_create_from_metadata(bo);
+		}
+	} else if (!is_test_alloc) {
+		ret = DRV_BACKEND(drv)->bo_create(bo, alloc_width, alloc_height, format, use_flags);
+	}
+
+	drv_trace_end();
+	if (!is_test_alloc)
+		drv_stats_record(drv, DRV_STATS_CREATE, start);
+
+	if (ret) {
+		errno = -ret;
+		free(bo);
+		return NULL;
+	}
+
+	/* The block goes back to its slab on destroy, the BO pool has no use for it. */
+	if (suballocated)
+		bo->recyclable = false;
+
+	if (alloc_width != width || alloc_height != height) {
+		drv_stats_add(drv, DRV_STATS_SIZE_CLASS_ROUNDED, 1);
+		drv_bo_set_logical_size(bo, width, height);
+	}
+
+	drv_bo_acquire(bo);
+	if (!is_test_alloc)
+		drv_memory_track(bo, false);
+
+	if (drv->log_bos)
+		drv_bo_log_info(bo, suballocated ? "suballocated" : "legacy created");
+
+	return bo;
+}
+
+struct bo *drv_bo_create(struct driver *drv, uint32_t width, uint32_t height, uint32_t format,
+			 uint64_t use_flags)
+{
+	struct bo *bo;
+	bool is_test_alloc;
+	uint32_t alloc_width = width, alloc_height = height;
+
+	is_test_alloc = use_flags & BO_USE_TEST_ALLOC;
+	use_flags &= ~BO_USE_TEST_ALLOC;
+
+	if (!is_test_alloc) {
+		drv_size_class_round(drv, format, use_flags, &alloc_width, &alloc_height);
+		bo = drv_bo_pool_get(drv, width, height, alloc_width, alloc_height, format,
+				     use_flags);
+		if (bo) {
+			drv_bo_acquire(bo);
+			drv_memory_track(bo, false);
+
+			if (drv->log_bos)
+				drv_bo_log_info(bo, "recycled");
+
+			return bo;
+		}
+	}
+
+	return drv_bo_create_new(drv, width, height, alloc_width, alloc_height, format, use_flags,
+				 is_test_alloc);
+}
+
+/*
+ * Creates a BO with the same layout as template_bo without recomputing the metadata. Only valid
+ * for backends that separate bo_compute_metadata and bo_create_from_metadata.
+ */
+static struct bo *drv_bo_create_from_template(const struct bo *template_bo)
+{
+	int ret;
+	struct bo *bo;
+	struct driver *drv = template_bo->drv;
+	uint64_t start;
+
+	ret = drv_memory_check_budget(drv);
+	if (ret) {
+		errno = -ret;
+		return NULL;
+	}
+
+	bo = drv_bo_new(drv, template_bo->meta.width, template_bo->meta.height,
+			template_bo->meta.format, template_bo->meta.use_flags, false);
+	if (!bo)
+		return NULL;
+
+	bo->meta = template_bo->meta;
+	/* The template may have been exported since, the new BO hasn't. */
+	bo->recyclable = !DRV_BACKEND(drv)->bo_release;
+	bo->requested_use_flags = template_bo->requested_use_flags;
+	bo->size_class_width = template_bo->size_class_width;
+	bo->size_class_height = template_bo->size_class_height;
+	bo->size_class_padding = template_bo->size_class_padding;
+
+	start = drv_stats_now();
+	drv_trace_begin("drv_bo_create", bo);
+	ret = DRV_BACKEND(drv)->bo_create_from_metadata(bo);
+	drv_trace_end();
+	drv_stats_record(drv, DRV_STATS_CREATE, start);
+	if (ret) {
+		errno = -ret;
+		free(bo);
+		return NULL;
+	}
+
+	drv_bo_acquire(bo);
+	drv_memory_track(bo, false);
+
+	if (drv->log_bos)
+		drv_bo_log_info(bo, "batch created");
+
+	return bo;
+}
+
+struct bo *drv_bo_create_like(struct bo *first)
+{
+	struct driver *drv = first->drv;
+	struct bo *bo;
+
+	bo = drv_bo_pool_get(drv, first->meta.width, first->meta.height, drv_bo_alloc_width(first),
+			     drv_bo_alloc_height(first), first->meta.format,
+			     first->requested_use_flags);
+	if (bo) {
+		drv_bo_acquire(bo);
+		drv_memory_track(bo, false);
+		return bo;
+	}
+
+	/* A carved BO's metadata has its block offset folded in. */
+	if (DRV_BACKEND(drv)->bo_compute_metadata && !first->slab)
+		return drv_bo_create_from_template(first);
+
+	return drv_bo_create(drv, first->meta.width, first->meta.height, first->meta.format,
+			     first->requested_use_flags);
+}
+
+int drv_bo_create_batch(struct driver *drv, uint32_t width, uint32_t height, uint32_t format,
+			uint64_t use_flags, uint32_t count, struct bo **bos)
+{
+	uint32_t i;
+
+	if (!count || (use_flags & BO_USE_TEST_ALLOC))
+		return -EINVAL;
+
+	bos[0] = drv_bo_create(drv, width, height, format, use_flags);
+	if (!bos[0])
+		return -errno;
+
+	for (i = 1; i < count; i++) {
+		bos[i] = drv_bo_create_like(bos[0]);
+		if (!bos[i]) {
+			int ret = -errno;
+
+			while (i--)
+				drv_bo_destroy(bos[i]);
+
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+/* Assumes the pool lock is held. */
+static uint32_t drv_bo_pool_count(struct drv_bo_pool *pool, struct drv_bo_pool_key *key)
+{
+	struct drv_bo_pool_entry *pool_entry = pool->buckets[drv_bo_pool_key_bucket(key)];
+	uint32_t count = 0;
+
+	for (; pool_entry; pool_entry = pool_entry->hash_next) {
+		if (drv_bo_pool_key_matches(pool_entry->bo, key))
+			count++;
+	}
+
+	return count;
+}
+
+int drv_bo_pool_prefill(struct driver *drv, uint32_t width, uint32_t height, uint32_t format,
+			uint64_t use_flags, uint32_t count)
+{
+	struct drv_bo_pool *pool = &drv->bo_pool;
+	struct drv_bo_pool_key key = { .width = width,
+				       .height = height,
+				       .format = format,
+				       .use_flags = use_flags };
+	uint32_t pooled, added = 0;
+	uint64_t size = 0;
+	size_t max_size;
+	struct bo *bo;
+	bool fits;
+	int ret = 0;
+
+	if ((use_flags & BO_USE_TEST_ALLOC) ||
+	    !__atomic_load_n(&pool->max_size, __ATOMIC_RELAXED))
+		return 0;
+
+	drv_size_class_round(drv, format, use_flags, &key.width, &key.height);
+
+	pthread_mutex_lock(&pool->lock);
+	pooled = drv_bo_pool_count(pool, &key);
+	pthread_mutex_unlock(&pool->lock);
+
+	/*
+	 * One BO at a time, each pooled before the next is created, so that no BO is created that
+	 * the pool cap or the memory budget leaves no room for. The size is known after the first.
+	 */
+	while (pooled + added < count) {
+		pthread_mutex_lock(&pool->lock);
+		max_size = __atomic_load_n(&pool->max_size, __ATOMIC_RELAXED);
+		fits = pool->size + size <= max_size && (size || pool->size < max_size);
+		pthread_mutex_unlock(&pool->lock);
+
+		if (!fits || !drv_memory_fits_budget(drv, size))
+			break;
+
+		/* Going through the pool would only hand back the BOs that are already in it. */
+		bo = drv_bo_create_new(drv, width, height, key.width, key.height, format, use_flags,
+				       false);
+		if (!bo) {
+			ret = -errno;
+			break;
+		}
+
+		/* Carved BOs, for one, go back to their slab. */
+		if (!bo->recyclable) {
+			drv_bo_destroy(bo);
+			break;
+		}
+
+		size = bo->meta.total_size;
+		drv_memory_untrack(bo);
+		drv_bo_release(bo);
+
+		/* Pooling it must not evict BOs that are already waiting to be reused. */
+		if (!drv_bo_pool_insert(bo, false)) {
+			DRV_BACKEND(drv)->bo_destroy(bo);
+			free(bo);
+			break;
+		}
+
+		added++;
+	}
+
+	drv_stats_add(drv, DRV_STATS_POOL_PREFILLS, added);
+	return added ? (int)added : ret;
+}
+
+struct bo *drv_bo_create_with_modifiers(struct driver *drv, uint32_t width, uint32_t height,
+					uint32_t format, const uint64_t *modifiers, uint32_t count,
+					uint64_t use_flags)
+{
+	int ret;
+	struct bo *bo;
+	uint64_t start;
+
+	if (!DRV_BACKEND(drv)->bo_create_with_modifiers && !DRV_BACKEND(drv)->bo_compute_metadata) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	ret = drv_memory_check_budget(drv);
+	if (ret) {
+		errno = -ret;
+		return NULL;
+	}
+
+	bo = drv_bo_new(drv, width, height, format, use_flags, false);
+
+	if (!bo)
+		return NULL;
+
+	start = drv_stats_now();
+	drv_trace_begin("drv_bo_create", bo);
+	ret = -EINVAL;
+	if (DRV_BACKEND(drv)->bo_compute_metadata) {
+		ret = DRV_BACKEND(drv)->bo_compute_metadata(bo, width, height, format, use_flags,
+							    modifiers, count);
+		if (ret == 0)
+			ret = DRV_BACKEND(drv)->bo_create_from_metadata(bo);
+	} else {
+		ret = DRV_BACKEND(drv)->bo_create_with_modifiers(bo, width, height, format,
+								 modifiers, count);
+	}
+	drv_trace_end();
+	drv_stats_record(drv, DRV_STATS_CREATE, start);
+
+	if (ret) {
+		free(bo);
+		return NULL;
+	}
+
+	drv_bo_acquire(bo);
+	drv_memory_track(bo, false);
+
+	if (drv->log_bos)
+		drv_bo_log_info(bo, "created");
+
+	return bo;
+}
+
+/* Drops the entry of |handle|, if any. Called with the index lock held. */
+static void drv_import_index_drop(struct drv_import_index *index, uint32_t handle)
+{
+	struct drv_import_entry *entry;
+
+	if (drmHashLookup(index->handles, handle, (void **)&entry))
+		return;
+
+	drmHashDelete(index->handles, handle);
+	drmHashDelete(index->table, entry->ino);
+	free(entry);
+}
+
+static void drv_import_index_remove(struct bo *bo)
+{
+	struct drv_import_index *index = &bo->drv->import_index;
+
+	pthread_mutex_lock(&index->lock);
+	drv_import_index_drop(index, bo->handle.u32);
+	pthread_mutex_unlock(&index->lock);
+}
+
+/* The part of drv_bo_destroy() that may be deferred to the reaper thread. */
+static void drv_bo_teardown(struct bo *bo)
+{
+	if (!bo->is_test_buffer && drv_bo_release(bo)) {
+		/*
+		 * The GEM handle is about to be closed, imports must not find it anymore. That
+		 * holds whoever dropped the last reference, a BO created here and imported as well
+		 * included.
+		 */
+		if (bo->drv->import_index.table)
+			drv_import_index_remove(bo);
 
-	if (!bo->meta.num_planes) {
-		free(bo);
-		errno = EINVAL;
-		return NULL;
+		drv_bo_mapping_destroy(bo);
+		if (drv_bo_pool_put(bo))
+			return;
+
+		DRV_BACKEND(bo->drv)->bo_destroy(bo);
 	}
 
-	return bo;
+	free(bo);
 }
 
-static void drv_bo_mapping_destroy(struct bo *bo)
+/* How long the reaper lets BOs queue up, so that a whole swapchain is torn down in one batch. */
+#define DRV_REAPER_BATCH_DELAY_NS (16 * 1000 * 1000)
+
+static void drv_bo_reaper_run(struct bo *batch)
 {
-	struct driver *drv = bo->drv;
-	uint32_t idx = 0;
+	while (batch) {
+		struct bo *bo = batch;
 
-	/*
-	 * This function is called right before the buffer is destroyed. It will free any mappings
-	 * associated with the buffer.
-	 */
-	pthread_mutex_lock(&drv->mappings_lock);
-	for (size_t plane = 0; plane < bo->meta.num_planes; plane++) {
-		while (idx < drv_array_size(drv->mappings)) {
-			struct mapping *mapping =
-			    (struct mapping *)drv_array_at_idx(drv->mappings, idx);
-			if (mapping->vma->handle != bo->handle.u32) {
-				idx++;
-				continue;
-			}
+		batch = bo->reap_next;
+		drv_memory_add(bo->drv, DRV_MEMORY_PENDING_DESTROY, -(int64_t)bo->meta.total_size);
+		drv_bo_teardown(bo);
+	}
+}
+
+static void *drv_bo_reaper_main(void *data)
+{
+	struct drv_bo_reaper *reaper = data;
+	struct timespec delay = { .tv_sec = 0, .tv_nsec = DRV_REAPER_BATCH_DELAY_NS };
+	struct bo *batch;
 
-			if (!--mapping->vma->refcount) {
-				int ret = drv->backend->bo_unmap(bo, mapping->vma);
-				if (ret) {
-					pthread_mutex_unlock(&drv->mappings_lock);
-					assert(ret);
-					drv_loge("munmap failed\n");
-					return;
-				}
+	pthread_mutex_lock(&reaper->lock);
+	for (;;) {
+		while (!reaper->queue && !reaper->stopping)
+			pthread_cond_wait(&reaper->cond, &reaper->lock);
 
-				free(mapping->vma);
-			}
+		/* Whatever is still queued when stopping is torn down before exiting. */
+		if (!reaper->queue)
+			break;
 
-			/* This shrinks and shifts the array, so don't increment idx. */
-			drv_array_remove(drv->mappings, idx);
+		if (!reaper->stopping) {
+			pthread_mutex_unlock(&reaper->lock);
+			nanosleep(&delay, NULL);
+			pthread_mutex_lock(&reaper->lock);
 		}
+
+		batch = reaper->queue;
+		reaper->queue = NULL;
+		pthread_mutex_unlock(&reaper->lock);
+
+		drv_trace_begin("drv_bo_reap", NULL);
+		drv_bo_reaper_run(batch);
+		drv_trace_end();
+
+		pthread_mutex_lock(&reaper->lock);
 	}
-	pthread_mutex_unlock(&drv->mappings_lock);
+	pthread_mutex_unlock(&reaper->lock);
+
+	return NULL;
 }
 
-/*
- * Acquire a reference on plane buffers of the bo.
- */
-static void drv_bo_acquire(struct bo *bo)
+static int drv_bo_reaper_start(struct driver *drv)
 {
-	struct driver *drv = bo->drv;
+	struct drv_bo_reaper *reaper = &drv->reaper;
+	int ret;
+
+	ret = pthread_mutex_init(&reaper->lock, NULL);
+	if (ret)
+		return -ret;
 
-	pthread_mutex_lock(&drv->buffer_table_lock);
-	for (size_t plane = 0; plane < bo->meta.num_planes; plane++) {
-		uintptr_t num = 0;
+	ret = pthread_cond_init(&reaper->cond, NULL);
+	if (ret)
+		goto destroy_lock;
 
-		if (!drmHashLookup(drv->buffer_table, bo->handle.u32, (void **)&num))
-			drmHashDelete(drv->buffer_table, bo->handle.u32);
+	ret = pthread_create(&reaper->thread, NULL, drv_bo_reaper_main, reaper);
+	if (ret)
+		goto destroy_cond;
 
-		drmHashInsert(drv->buffer_table, bo->handle.u32, (void *)(num + 1));
-	}
-	pthread_mutex_unlock(&drv->buffer_table_lock);
+	reaper->enabled = true;
+	return 0;
+
+destroy_cond:
+	pthread_cond_destroy(&reaper->cond);
+destroy_lock:
+	pthread_mutex_destroy(&reaper->lock);
+	return -ret;
 }
 
-/*
- * Release a reference on plane buffers of the bo. Return true when the bo has lost all its
- * references. Otherwise, return false.
- */
-static bool drv_bo_release(struct bo *bo)
+static void drv_bo_reaper_stop(struct driver *drv)
 {
-	struct driver *drv = bo->drv;
-	uintptr_t num;
+	struct drv_bo_reaper *reaper = &drv->reaper;
 
-	if (drv->backend->bo_release)
-		drv->backend->bo_release(bo);
+	pthread_mutex_lock(&reaper->lock);
+	reaper->stopping = true;
+	pthread_cond_signal(&reaper->cond);
+	pthread_mutex_unlock(&reaper->lock);
 
-	pthread_mutex_lock(&drv->buffer_table_lock);
-	for (size_t plane = 0; plane < bo->meta.num_planes; plane++) {
-		if (!drmHashLookup(drv->buffer_table, bo->handle.u32, (void **)&num)) {
-			drmHashDelete(drv->buffer_table, bo->handle.u32);
+	pthread_join(reaper->thread, NULL);
+	reaper->enabled = false;
+	pthread_cond_destroy(&reaper->cond);
+	pthread_mutex_destroy(&reaper->lock);
+}
 
-			if (num > 1) {
-				drmHashInsert(drv->buffer_table, bo->handle.u32, (void *)(num - 1));
-			}
-		}
-	}
+/* Tears the queued BOs down on the calling thread. */
+static void drv_bo_reaper_flush(struct driver *drv)
+{
+	struct drv_bo_reaper *reaper = &drv->reaper;
+	struct bo *batch;
 
-	/* The same buffer can back multiple planes with different offsets. */
-	for (size_t plane = 0; plane < bo->meta.num_planes; plane++) {
-		if (!drmHashLookup(drv->buffer_table, bo->handle.u32, (void **)&num)) {
-			/* num is positive if found in the hashmap. */
-			pthread_mutex_unlock(&drv->buffer_table_lock);
-			return false;
-		}
-	}
-	pthread_mutex_unlock(&drv->buffer_table_lock);
+	pthread_mutex_lock(&reaper->lock);
+	batch = reaper->queue;
+	reaper->queue = NULL;
+	pthread_mutex_unlock(&reaper->lock);
 
-	return true;
+	drv_bo_reaper_run(batch);
 }
 
-struct bo *drv_bo_create(struct driver *drv, uint32_t width, uint32_t height, uint32_t format,
-			 uint64_t use_flags)
+static void drv_bo_reaper_queue(struct bo *bo)
 {
-	int ret;
-	struct bo *bo;
-	bool is_test_alloc;
+	struct drv_bo_reaper *reaper = &bo->drv->reaper;
 
-	is_test_alloc = use_flags & BO_USE_TEST_ALLOC;
-	use_flags &= ~BO_USE_TEST_ALLOC;
+	drv_memory_add(bo->drv, DRV_MEMORY_PENDING_DESTROY, bo->meta.total_size);
+
+	pthread_mutex_lock(&reaper->lock);
+	bo->reap_next = reaper->queue;
+	reaper->queue = bo;
+	pthread_cond_signal(&reaper->cond);
+	pthread_mutex_unlock(&reaper->lock);
+}
 
-	bo = drv_bo_new(drv, width, height, format, use_flags, is_test_alloc);
+/*
+ * Takes a recyclable BO matching key back out of the reaper's queue and releases it, leaving it
+ * in the state of a pooled BO. Returns NULL if there is none, or if the GEM handle was imported
+ * again while the BO was queued.
+ */
+static struct bo *drv_bo_reaper_reclaim(struct driver *drv, struct drv_bo_pool_key *key)
+{
+	struct drv_bo_reaper *reaper = &drv->reaper;
+	struct bo **link;
+	struct bo *bo = NULL;
+
+	pthread_mutex_lock(&reaper->lock);
+	for (link = &reaper->queue; *link; link = &(*link)->reap_next) {
+		if ((*link)->recyclable && drv_bo_pool_key_matches(*link, key)) {
+			bo = *link;
+			*link = bo->reap_next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&reaper->lock);
 
 	if (!bo)
 		return NULL;
 
-	ret = -EINVAL;
-	if (drv->backend->bo_compute_metadata) {
-		ret = drv->backend->bo_compute_metadata(bo, width, height, format, use_flags, NULL,
-							0);
-		if (!is_test_alloc && ret == 0)
-			ret = drv->backend->bo_create_from_metadata(bo);
-	} else if (!is_test_alloc) {
-		ret = drv->backend->bo_create(bo, width, height, format, use_flags);
-	}
-
-	if (ret) {
-		errno = -ret;
+	drv_memory_add(drv, DRV_MEMORY_PENDING_DESTROY, -(int64_t)bo->meta.total_size);
+	if (!drv_bo_release(bo)) {
 		free(bo);
 		return NULL;
 	}
 
-	drv_bo_acquire(bo);
-
-	if (drv->log_bos)
-		drv_bo_log_info(bo, "legacy created");
-
+	drv_bo_mapping_destroy(bo);
 	return bo;
 }
 
-struct bo *drv_bo_create_with_modifiers(struct driver *drv, uint32_t width, uint32_t height,
-					uint32_t format, const uint64_t *modifiers, uint32_t count)
+void drv_bo_destroy(struct bo *bo)
 {
-	int ret;
-	struct bo *bo;
+	/* Dead bos must not linger in the cache, even while the GEM handle lives on. */
+	if (__atomic_load_n(&bo->num_cached_mappings, __ATOMIC_ACQUIRE))
+		drv_mapping_cache_purge(bo);
 
-	if (!drv->backend->bo_create_with_modifiers && !drv->backend->bo_compute_metadata) {
-		errno = ENOENT;
-		return NULL;
+	if (bo->dma_buf_fd >= 0) {
+		close(bo->dma_buf_fd);
+		bo->dma_buf_fd = -1;
 	}
 
-	bo = drv_bo_new(drv, width, height, format, BO_USE_NONE, false);
-
-	if (!bo)
-		return NULL;
+	drv_memory_untrack(bo);
 
-	ret = -EINVAL;
-	if (drv->backend->bo_compute_metadata) {
-		ret = drv->backend->bo_compute_metadata(bo, width, height, format, BO_USE_NONE,
-							modifiers, count);
-		if (ret == 0)
-			ret = drv->backend->bo_create_from_metadata(bo);
-	} else {
-		ret = drv->backend->bo_create_with_modifiers(bo, width, height, format, modifiers,
-							     count);
+	/* The slab holds a reference on the shared GEM handle, so this never is the last one. */
+	if (bo->slab) {
+		drv_bo_mapping_destroy(bo);
+		drv_bo_release(bo);
+		drv_bo_suballoc_free(bo);
+		free(bo);
+		return;
 	}
 
-	if (ret) {
-		free(bo);
-		return NULL;
+	/* The GEM handle stays referenced while queued, so imports of it keep working. */
+	if (bo->drv->reaper.enabled && !bo->is_test_buffer) {
+		drv_bo_reaper_queue(bo);
+		return;
 	}
 
-	drv_bo_acquire(bo);
+	drv_bo_teardown(bo);
+}
 
-	if (drv->log_bos)
-		drv_bo_log_info(bo, "created");
+/* Only imports with every plane in the same dma-buf are indexed. */
+static bool drv_import_fds_shared(struct drv_import_fd_data *data, size_t num_planes)
+{
+	size_t plane;
 
-	return bo;
+	for (plane = 1; plane < num_planes; plane++)
+		if (data->fds[plane] != data->fds[0])
+			return false;
+
+	return true;
 }
 
-void drv_bo_destroy(struct bo *bo)
+/*
+ * Whether |fd| is a dma-buf with an inode of its own. Before Linux 5.3 dma-bufs were anonymous
+ * inode files, which all share one inode, so the inode doesn't identify the buffer.
+ */
+static bool drv_import_fd_is_dma_buf(int fd)
 {
-	if (!bo->is_test_buffer && drv_bo_release(bo)) {
-		drv_bo_mapping_destroy(bo);
-		bo->drv->backend->bo_destroy(bo);
+	/* DMA_BUF_MAGIC from linux/magic.h. */
+	const long dma_buf_magic = 0x444d4142;
+	struct statfs fs;
+
+	return !fstatfs(fd, &fs) && fs.f_type == dma_buf_magic;
+}
+
+/*
+ * Takes another reference on the GEM handle of an import of the same dma-buf that is still
+ * alive, skipping the PRIME import and the size query. Returns false if there is none.
+ */
+static bool drv_import_index_lookup(struct bo *bo, struct drv_import_fd_data *data,
+				    const struct stat *st, off_t *size)
+{
+	struct drv_import_index *index = &bo->drv->import_index;
+	struct drv_import_entry *entry;
+	struct drv_handle_slot *slot;
+	uint32_t num;
+	bool found = false;
+
+	pthread_mutex_lock(&index->lock);
+	if (drmHashLookup(index->table, st->st_ino, (void **)&entry) ||
+	    entry->ino != st->st_ino || entry->dev != st->st_dev || entry->size != st->st_size ||
+	    entry->format_modifier != data->format_modifier ||
+	    !drv_import_fds_shared(data, entry->num_planes))
+		goto out;
+
+	/* The last reference may just have been dropped, in which case the handle is closing. */
+	slot = drv_handle_table_slot(bo->drv->handle_refs, entry->handle, false);
+	num = slot ? __atomic_load_n(&slot->refcount, __ATOMIC_ACQUIRE) : 0;
+	while (num && !found)
+		found = __atomic_compare_exchange_n(&slot->refcount, &num, num + 1, false,
+						    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+
+	if (found) {
+		bo->handle.u32 = entry->handle;
+		bo->meta.tiling = entry->tiling;
+		bo->meta.num_planes = entry->num_planes;
+		*size = entry->size;
 	}
 
-	free(bo);
+out:
+	pthread_mutex_unlock(&index->lock);
+	return found;
+}
+
+static void drv_import_index_insert(struct bo *bo, const struct stat *st, off_t size)
+{
+	struct drv_import_index *index = &bo->drv->import_index;
+	struct drv_import_entry *entry, *prior;
+
+	/* The size is what tells two dma-bufs apart should inode numbers ever be reused. */
+	if (size != st->st_size)
+		return;
+
+	entry = calloc(1, sizeof(*entry));
+	if (!entry)
+		return;
+
+	entry->dev = st->st_dev;
+	entry->ino = st->st_ino;
+	entry->handle = bo->handle.u32;
+	entry->tiling = bo->meta.tiling;
+	entry->num_planes = bo->meta.num_planes;
+	entry->format_modifier = bo->meta.format_modifier;
+	entry->size = size;
+
+	pthread_mutex_lock(&index->lock);
+	drv_import_index_drop(index, entry->handle);
+	if (!drmHashLookup(index->table, entry->ino, (void **)&prior))
+		drv_import_index_drop(index, prior->handle);
+	drmHashInsert(index->table, entry->ino, entry);
+	drmHashInsert(index->handles, entry->handle, entry);
+	pthread_mutex_unlock(&index->lock);
 }
 
 struct bo *drv_bo_import(struct driver *drv, struct drv_import_fd_data *data)
@@ -428,33 +2378,52 @@ struct bo *drv_bo_import(struct driver *drv, struct drv_import_fd_data *data)
 	int ret;
 	size_t plane;
 	struct bo *bo;
-	off_t seek_end;
+	struct stat st;
+	bool indexable = false;
+	off_t seek_end = 0;
+	bool indexed = false;
 
 	bo = drv_bo_new(drv, data->width, data->height, data->format, data->use_flags, false);
 
 	if (!bo)
 		return NULL;
 
-	ret = drv->backend->bo_import(bo, data);
-	if (ret) {
-		free(bo);
-		return NULL;
+	if (drv->import_index.table && drv_import_fds_shared(data, bo->meta.num_planes) &&
+	    drv_import_fd_is_dma_buf(data->fds[0]) && !fstat(data->fds[0], &st)) {
+		indexable = true;
+		indexed = drv_import_index_lookup(bo, data, &st, &seek_end);
 	}
 
-	drv_bo_acquire(bo);
+	if (!indexed) {
+		uint64_t start = drv_stats_now();
+
+		drv_trace_begin("drv_bo_import", bo);
+		ret = DRV_BACKEND(drv)->bo_import(bo, data);
+		drv_trace_end();
+		drv_stats_record(drv, DRV_STATS_IMPORT, start);
+		if (ret) {
+			free(bo);
+			return NULL;
+		}
+
+		drv_bo_acquire(bo);
+	}
 
 	bo->meta.format_modifier = data->format_modifier;
 	for (plane = 0; plane < bo->meta.num_planes; plane++) {
 		bo->meta.strides[plane] = data->strides[plane];
 		bo->meta.offsets[plane] = data->offsets[plane];
 
-		seek_end = lseek(data->fds[plane], 0, SEEK_END);
-		if (seek_end == (off_t)(-1)) {
-			drv_loge("lseek() failed with %s\n", strerror(errno));
-			goto destroy_bo;
+		if (!indexed && (plane == 0 || data->fds[plane] != data->fds[plane - 1])) {
+			seek_end = lseek(data->fds[plane], 0, SEEK_END);
+			if (seek_end == (off_t)(-1)) {
+				drv_loge("lseek() failed with %s\n", strerror(errno));
+				goto destroy_bo;
+			}
+
+			lseek(data->fds[plane], 0, SEEK_SET);
 		}
 
-		lseek(data->fds[plane], 0, SEEK_SET);
 		if (plane == bo->meta.num_planes - 1 || data->offsets[plane + 1] == 0)
 			bo->meta.sizes[plane] = seek_end - data->offsets[plane];
 		else
@@ -468,6 +2437,11 @@ struct bo *drv_bo_import(struct driver *drv, struct drv_import_fd_data *data)
 		bo->meta.total_size += bo->meta.sizes[plane];
 	}
 
+	if (indexable && !indexed && !bo->priv)
+		drv_import_index_insert(bo, &st, seek_end);
+
+	drv_memory_track(bo, true);
+
 	if (drv->log_bos)
 		drv_bo_log_info(bo, "imported");
 
@@ -484,7 +2458,15 @@ void *drv_bo_map(struct bo *bo, const struct rectangle *rect, uint32_t map_flags
 	struct driver *drv = bo->drv;
 	uint32_t i;
 	uint8_t *addr;
+	struct drv_handle_shard *shard;
+	struct drv_array *mappings;
 	struct mapping mapping = { 0 };
+	uint64_t start;
+	/* Not part of the mapping's identity, only of this call. */
+	uint32_t defer_invalidate = map_flags & BO_MAP_DEFER_INVALIDATE;
+	uint32_t hints = map_flags & (BO_MAP_POPULATE | BO_MAP_SEQUENTIAL | BO_MAP_RANDOM);
+
+	map_flags &= ~(BO_MAP_DEFER_INVALIDATE | hints);
 
 	assert(rect->width >= 0);
 	assert(rect->height >= 0);
@@ -499,12 +2481,27 @@ void *drv_bo_map(struct bo *bo, const struct rectangle *rect, uint32_t map_flags
 
 	mapping.rect = *rect;
 	mapping.refcount = 1;
+	mapping.bo = bo;
+
+	shard = drv_mapping_shard(drv, bo->handle.u32);
+	drv_stats_mutex_lock(drv, &shard->lock, DRV_STATS_MAPPING_LOCK_WAIT_NS);
+
+	mappings = drv_mappings_lookup(shard, bo->handle.u32);
+	if (!mappings) {
+		mappings = shard->spare ? shard->spare : drv_array_init(sizeof(struct mapping));
+		shard->spare = NULL;
+		if (!mappings) {
+			*map_data = NULL;
+			pthread_mutex_unlock(&shard->lock);
+			return MAP_FAILED;
+		}
 
-	pthread_mutex_lock(&drv->mappings_lock);
+		drmHashInsert(shard->table, bo->handle.u32, mappings);
+	}
 
-	for (i = 0; i < drv_array_size(drv->mappings); i++) {
-		struct mapping *prior = (struct mapping *)drv_array_at_idx(drv->mappings, i);
-		if (prior->vma->handle != bo->handle.u32 || prior->vma->map_flags != map_flags)
+	for (i = 0; i < drv_array_size(mappings); i++) {
+		struct mapping *prior = (struct mapping *)drv_array_at_idx(mappings, i);
+		if (prior->vma->map_flags != map_flags || (bo->slab && prior->bo != bo))
 			continue;
 
 		if (rect->x != prior->rect.x || rect->y != prior->rect.y ||
@@ -516,9 +2513,16 @@ void *drv_bo_map(struct bo *bo, const struct rectangle *rect, uint32_t map_flags
 		goto exact_match;
 	}
 
-	for (i = 0; i < drv_array_size(drv->mappings); i++) {
-		struct mapping *prior = (struct mapping *)drv_array_at_idx(drv->mappings, i);
-		if (prior->vma->handle != bo->handle.u32 || prior->vma->map_flags != map_flags)
+	for (i = 0; i < drv_array_size(mappings); i++) {
+		struct mapping *prior = (struct mapping *)drv_array_at_idx(mappings, i);
+		struct rectangle *covered = &prior->vma->rect;
+		if (prior->vma->map_flags != map_flags || (bo->slab && prior->bo != bo))
+			continue;
+
+		if (prior->vma->partial &&
+		    (rect->x < covered->x || rect->y < covered->y ||
+		     rect->x + rect->width > covered->x + covered->width ||
+		     rect->y + rect->height > covered->y + covered->height))
 			continue;
 
 		prior->vma->refcount++;
@@ -529,59 +2533,154 @@ void *drv_bo_map(struct bo *bo, const struct rectangle *rect, uint32_t map_flags
 	mapping.vma = calloc(1, sizeof(*mapping.vma));
 	if (!mapping.vma) {
 		*map_data = NULL;
-		pthread_mutex_unlock(&drv->mappings_lock);
+		drv_mappings_release(shard, bo->handle.u32, mappings);
+		pthread_mutex_unlock(&shard->lock);
 		return MAP_FAILED;
 	}
 
 	memcpy(mapping.vma->map_strides, bo->meta.strides, sizeof(mapping.vma->map_strides));
-	addr = drv->backend->bo_map(bo, mapping.vma, map_flags);
+	mapping.vma->rect = *rect;
+	start = drv_stats_now();
+	drv_trace_begin("drv_bo_map", bo);
+	addr = DRV_BACKEND(drv)->bo_map(drv_bo_backing(bo), mapping.vma,
+					map_flags | defer_invalidate | hints);
+	drv_trace_end();
+	drv_stats_record(drv, DRV_STATS_MAP, start);
 	if (addr == MAP_FAILED) {
 		*map_data = NULL;
 		free(mapping.vma);
-		pthread_mutex_unlock(&drv->mappings_lock);
+		drv_mappings_release(shard, bo->handle.u32, mappings);
+		pthread_mutex_unlock(&shard->lock);
 		return MAP_FAILED;
 	}
 
+	drv_advise_mapping(addr, mapping.vma->length, hints);
+
+	drv_memory_add(drv, DRV_MEMORY_MAPPED, mapping.vma->length);
 	mapping.vma->refcount = 1;
 	mapping.vma->addr = addr;
 	mapping.vma->handle = bo->handle.u32;
 	mapping.vma->map_flags = map_flags;
 
 success:
-	*map_data = drv_array_append(drv->mappings, &mapping);
+	*map_data = drv_array_append(mappings, &mapping);
 exact_match:
-	drv_bo_invalidate(bo, *map_data);
 	addr = (uint8_t *)((*map_data)->vma->addr);
 	addr += drv_bo_get_plane_offset(bo, plane);
-	pthread_mutex_unlock(&drv->mappings_lock);
+	pthread_mutex_unlock(&shard->lock);
+
+	/*
+	 * The reference taken above keeps the mapping alive, so the backend's (potentially slow)
+	 * cache maintenance runs without holding the shard lock.
+	 */
+	if (!defer_invalidate)
+		drv_bo_invalidate(bo, *map_data);
+
 	return (void *)addr;
 }
 
+void *drv_bo_map_fenced(struct bo *bo, const struct rectangle *rect, uint32_t map_flags,
+			struct mapping **map_data, size_t plane, int acquire_fence)
+{
+	void *addr;
+	int ret;
+
+	if (acquire_fence < 0)
+		return drv_bo_map(bo, rect, map_flags, map_data, plane);
+
+	/* The mmap and any staging setup overlap the producer; only the invalidate waits. */
+	addr = drv_bo_map(bo, rect, map_flags | BO_MAP_DEFER_INVALIDATE, map_data, plane);
+	if (addr == MAP_FAILED) {
+		close(acquire_fence);
+		return MAP_FAILED;
+	}
+
+	drv_trace_begin("drv_bo_map_fenced wait", bo);
+	ret = drv_sync_file_wait(acquire_fence);
+	drv_trace_end();
+	close(acquire_fence);
+
+	if (!ret)
+		ret = drv_bo_invalidate(bo, *map_data);
+
+	if (ret) {
+		drv_bo_unmap(bo, *map_data);
+		*map_data = NULL;
+		return MAP_FAILED;
+	}
+
+	return addr;
+}
+
+int drv_bo_map_planes(struct bo *bo, const struct rectangle *rect, uint32_t map_flags,
+		      struct mapping **map_data, void *addrs[DRV_MAX_PLANES],
+		      uint32_t strides[DRV_MAX_PLANES])
+{
+	uint8_t *base;
+	size_t plane;
+
+	if (drv_bo_map(bo, rect, map_flags, map_data, 0) == MAP_FAILED)
+		return -EFAULT;
+
+	/*
+	 * Backends mapping through a staging copy with a stride of their own (DRI) only lay out
+	 * plane 0, where the other planes are in such a copy is unknown.
+	 */
+	if (bo->meta.num_planes > 1 &&
+	    memcmp((*map_data)->vma->map_strides, bo->meta.strides,
+		   bo->meta.num_planes * sizeof(bo->meta.strides[0]))) {
+		drv_bo_unmap(bo, *map_data);
+		*map_data = NULL;
+		return -EINVAL;
+	}
+
+	base = (uint8_t *)(*map_data)->vma->addr;
+	for (plane = 0; plane < bo->meta.num_planes; plane++) {
+		addrs[plane] = base + bo->meta.offsets[plane];
+		strides[plane] = (*map_data)->vma->map_strides[plane];
+	}
+
+	return 0;
+}
+
 int drv_bo_unmap(struct bo *bo, struct mapping *mapping)
 {
 	struct driver *drv = bo->drv;
+	struct drv_handle_shard *shard = drv_mapping_shard(drv, bo->handle.u32);
+	struct drv_array *mappings;
 	uint32_t i;
 	int ret = 0;
 
-	pthread_mutex_lock(&drv->mappings_lock);
+	drv_stats_mutex_lock(drv, &shard->lock, DRV_STATS_MAPPING_LOCK_WAIT_NS);
 
 	if (--mapping->refcount)
 		goto out;
 
 	if (!--mapping->vma->refcount) {
-		ret = drv->backend->bo_unmap(bo, mapping->vma);
+		uint64_t start = drv_stats_now();
+
+		drv_trace_begin("drv_bo_unmap", bo);
+		ret = DRV_BACKEND(drv)->bo_unmap(drv_bo_backing(bo), mapping->vma);
+		drv_trace_end();
+		drv_stats_record(drv, DRV_STATS_UNMAP, start);
+		drv_memory_add(drv, DRV_MEMORY_MAPPED, -(int64_t)mapping->vma->length);
 		free(mapping->vma);
 	}
 
-	for (i = 0; i < drv_array_size(drv->mappings); i++) {
-		if (mapping == (struct mapping *)drv_array_at_idx(drv->mappings, i)) {
-			drv_array_remove(drv->mappings, i);
+	mappings = drv_mappings_lookup(shard, bo->handle.u32);
+	assert(mappings);
+
+	for (i = 0; i < drv_array_size(mappings); i++) {
+		if (mapping == (struct mapping *)drv_array_at_idx(mappings, i)) {
+			drv_array_remove(mappings, i);
 			break;
 		}
 	}
 
+	drv_mappings_release(shard, bo->handle.u32, mappings);
+
 out:
-	pthread_mutex_unlock(&drv->mappings_lock);
+	pthread_mutex_unlock(&shard->lock);
 	return ret;
 }
 
@@ -594,8 +2693,14 @@ int drv_bo_invalidate(struct bo *bo, struct mapping *mapping)
 	assert(mapping->refcount > 0);
 	assert(mapping->vma->refcount > 0);
 
-	if (bo->drv->backend->bo_invalidate)
-		ret = bo->drv->backend->bo_invalidate(bo, mapping);
+	if (DRV_BACKEND(bo->drv)->bo_invalidate) {
+		uint64_t start = drv_stats_now();
+
+		drv_trace_begin("drv_bo_invalidate", bo);
+		ret = DRV_BACKEND(bo->drv)->bo_invalidate(bo, mapping);
+		drv_trace_end();
+		drv_stats_record(bo->drv, DRV_STATS_INVALIDATE, start);
+	}
 
 	return ret;
 }
@@ -609,9 +2714,147 @@ int drv_bo_flush(struct bo *bo, struct mapping *mapping)
 	assert(mapping->refcount > 0);
 	assert(mapping->vma->refcount > 0);
 
-	if (bo->drv->backend->bo_flush)
-		ret = bo->drv->backend->bo_flush(bo, mapping);
+	if (DRV_BACKEND(bo->drv)->bo_flush) {
+		uint64_t start = drv_stats_now();
+
+		drv_trace_begin("drv_bo_flush", bo);
+		ret = DRV_BACKEND(bo->drv)->bo_flush(bo, mapping);
+		drv_trace_end();
+		drv_stats_record(bo->drv, DRV_STATS_FLUSH, start);
+	}
+
+	return ret;
+}
+
+static int drv_bo_sync_run(const struct drv_sync_op *ops, uint32_t count)
+{
+	struct driver *drv = ops[0].bo->drv;
+	int ret = 0, op_ret;
+	uint32_t i;
+
+	if (DRV_BACKEND(drv)->bo_sync_batch) {
+		uint64_t start = drv_stats_now();
+
+		drv_trace_begin("drv_bo_sync_batch", NULL);
+		ret = DRV_BACKEND(drv)->bo_sync_batch(drv, ops, count);
+		drv_trace_end();
+
+		/* Every op completes with the batch, so each is recorded with its latency. */
+		for (i = 0; i < count; i++)
+			drv_stats_record(drv, ops[i].flush ? DRV_STATS_FLUSH : DRV_STATS_INVALIDATE,
+					 start);
+		return ret;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (ops[i].flush)
+			op_ret = drv_bo_flush(ops[i].bo, ops[i].mapping);
+		else
+			op_ret = drv_bo_invalidate(ops[i].bo, ops[i].mapping);
+
+		if (op_ret && !ret)
+			ret = op_ret;
+	}
+
+	return ret;
+}
+
+int drv_bo_sync_batch(const struct drv_sync_op *ops, uint32_t count)
+{
+	struct drv_sync_op batch[DRV_SYNC_BATCH_MAX];
+	uint32_t num = 0;
+	int ret = 0, run_ret;
+	uint32_t i, j;
+
+	/* Ops are handed to the backend in runs of the same driver. */
+	for (i = 0; i < count; i++) {
+		assert(ops[i].mapping && ops[i].mapping->refcount > 0);
+
+		for (j = 0; j < num; j++) {
+			if (batch[j].mapping == ops[i].mapping && batch[j].flush == ops[i].flush)
+				break;
+		}
+
+		if (j < num)
+			continue;
+
+		if (num == DRV_SYNC_BATCH_MAX || (num && batch[0].bo->drv != ops[i].bo->drv)) {
+			run_ret = drv_bo_sync_run(batch, num);
+			if (run_ret && !ret)
+				ret = run_ret;
+			num = 0;
+		}
+
+		batch[num++] = ops[i];
+	}
+
+	if (num) {
+		run_ret = drv_bo_sync_run(batch, num);
+		if (run_ret && !ret)
+			ret = run_ret;
+	}
+
+	return ret;
+}
+
+void drv_bo_mapping_mark_dirty(struct mapping *mapping, const struct rectangle *rect)
+{
+	uint32_t x0, y0, x1, y1;
+	struct rectangle *dirty = &mapping->dirty_rect;
+
+	/* Clip to the mapped rectangle. */
+	x0 = MAX(rect->x, mapping->rect.x);
+	y0 = MAX(rect->y, mapping->rect.y);
+	x1 = MIN(rect->x + rect->width, mapping->rect.x + mapping->rect.width);
+	y1 = MIN(rect->y + rect->height, mapping->rect.y + mapping->rect.height);
+	if (x0 >= x1 || y0 >= y1)
+		return;
+
+	if (dirty->width && dirty->height) {
+		x0 = MIN(x0, dirty->x);
+		y0 = MIN(y0, dirty->y);
+		x1 = MAX(x1, dirty->x + dirty->width);
+		y1 = MAX(y1, dirty->y + dirty->height);
+	}
+
+	dirty->x = x0;
+	dirty->y = y0;
+	dirty->width = x1 - x0;
+	dirty->height = y1 - y0;
+}
+
+struct rectangle drv_bo_mapping_take_dirty(struct mapping *mapping)
+{
+	struct rectangle rect = mapping->rect;
+
+	if (mapping->dirty_rect.width && mapping->dirty_rect.height)
+		rect = mapping->dirty_rect;
+
+	memset(&mapping->dirty_rect, 0, sizeof(mapping->dirty_rect));
+	return rect;
+}
+
+int drv_bo_flush_or_unmap_fenced(struct bo *bo, struct mapping *mapping, int *out_fence)
+{
+	uint64_t start;
+	int ret;
+
+	*out_fence = -1;
+
+	if (!DRV_BACKEND(bo->drv)->bo_flush_fenced)
+		return drv_bo_flush_or_unmap(bo, mapping);
+
+	assert(mapping);
+	assert(mapping->vma);
+	assert(mapping->refcount > 0);
+	assert(mapping->vma->refcount > 0);
+	assert(!(bo->meta.use_flags & BO_USE_PROTECTED));
 
+	start = drv_stats_now();
+	drv_trace_begin("drv_bo_flush", bo);
+	ret = DRV_BACKEND(bo->drv)->bo_flush_fenced(bo, mapping, out_fence);
+	drv_trace_end();
+	drv_stats_record(bo->drv, DRV_STATS_FLUSH, start);
 	return ret;
 }
 
@@ -625,9 +2868,9 @@ int drv_bo_flush_or_unmap(struct bo *bo, struct mapping *mapping)
 	assert(mapping->vma->refcount > 0);
 	assert(!(bo->meta.use_flags & BO_USE_PROTECTED));
 
-	if (bo->drv->backend->bo_flush)
-		ret = bo->drv->backend->bo_flush(bo, mapping);
-	else
+	if (DRV_BACKEND(bo->drv)->bo_flush)
+		ret = drv_bo_flush(bo, mapping);
+	else if (!drv_mapping_cache_put(bo, mapping))
 		ret = drv_bo_unmap(bo, mapping);
 
 	return ret;
@@ -653,6 +2896,18 @@ union bo_handle drv_bo_get_plane_handle(struct bo *bo, size_t plane)
 	return bo->handle;
 }
 
+size_t drv_bo_get_num_fds(struct bo *bo)
+{
+	size_t plane;
+
+	/* Planes backed by the same GEM handle are described by one dma-buf and their offsets. */
+	for (plane = 1; plane < bo->meta.num_planes; plane++)
+		if (drv_bo_get_plane_handle(bo, plane).u64 != drv_bo_get_plane_handle(bo, 0).u64)
+			return bo->meta.num_planes;
+
+	return 1;
+}
+
 #ifndef DRM_RDWR
 #define DRM_RDWR O_RDWR
 #endif
@@ -666,6 +2921,31 @@ int drv_bo_get_plane_fd(struct bo *bo, size_t plane)
 	if (bo->is_test_buffer)
 		return -EINVAL;
 
+	/*
+	 * A carved BO is exported as the slab's dma-buf, which its plane offsets are relative to.
+	 * The importer can reach the block for as long as it holds on to that, so the block isn't
+	 * handed out again.
+	 */
+	if (bo->slab) {
+		pthread_mutex_lock(&bo->drv->suballoc.lock);
+		bo->slab->exported_mask |= 1ull << bo->slab_block;
+		pthread_mutex_unlock(&bo->drv->suballoc.lock);
+	}
+
+	/*
+	 * Whoever holds the dma-buf keeps the memory, and importing it again would alias the GEM
+	 * handle, so an exported BO must not be handed out again by the pool.
+	 */
+	bo->recyclable = false;
+
+	/* Duplicating an fd that was already exported is cheaper than another PRIME export. */
+	fd = __atomic_load_n(&bo->dma_buf_fd, __ATOMIC_ACQUIRE);
+	if (fd >= 0) {
+		fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+		if (fd >= 0)
+			return fd;
+	}
+
 	ret = drmPrimeHandleToFD(bo->drv->fd, bo->handle.u32, DRM_CLOEXEC | DRM_RDWR, &fd);
 
 	// Older DRM implementations blocked DRM_RDWR, but gave a read/write mapping anyways
@@ -726,7 +3006,7 @@ void drv_bo_log_info(const struct bo *bo, const char *prefix)
 	const struct bo_metadata *meta = &bo->meta;
 
 	drv_logd("%s %s bo %p: %dx%d '%c%c%c%c' tiling %d plane %zu mod 0x%" PRIx64 " use 0x%" PRIx64 " size %zu\n",
-		 prefix, bo->drv->backend->name, bo,
+		 prefix, DRV_BACKEND(bo->drv)->name, bo,
 		 meta->width, meta->height,
 		 meta->format & 0xff,
 		 (meta->format >> 8) & 0xff,
@@ -752,10 +3032,10 @@ uint32_t drv_get_standard_fourcc(uint32_t fourcc_internal)
 void drv_resolve_format_and_use_flags(struct driver *drv, uint32_t format, uint64_t use_flags,
 				      uint32_t *out_format, uint64_t *out_use_flags)
 {
-	assert(drv->backend->resolve_format_and_use_flags);
+	assert(DRV_BACKEND(drv)->resolve_format_and_use_flags);
 
-	drv->backend->resolve_format_and_use_flags(drv, format, use_flags, out_format,
-						   out_use_flags);
+	DRV_BACKEND(drv)->resolve_format_and_use_flags(drv, format, use_flags, out_format,
+						       out_use_flags);
 }
 
 void drv_log_prefix(enum drv_log_level level, const char *prefix, const char *file, int line,
@@ -799,16 +3079,16 @@ int drv_resource_info(struct bo *bo, uint32_t strides[DRV_MAX_PLANES],
 	}
 	*format_modifier = bo->meta.format_modifier;
 
-	if (bo->drv->backend->resource_info)
-		return bo->drv->backend->resource_info(bo, strides, offsets, format_modifier);
+	if (DRV_BACKEND(bo->drv)->resource_info)
+		return DRV_BACKEND(bo->drv)->resource_info(bo, strides, offsets, format_modifier);
 
 	return 0;
 }
 
 uint32_t drv_get_max_texture_2d_size(struct driver *drv)
 {
-	if (drv->backend->get_max_texture_2d_size)
-		return drv->backend->get_max_texture_2d_size(drv);
+	if (DRV_BACKEND(drv)->get_max_texture_2d_size)
+		return DRV_BACKEND(drv)->get_max_texture_2d_size(drv);
 
 	return UINT32_MAX;
 }
@@ -54,6 +54,24 @@ extern "C" {
 #define BO_MAP_READ (1 << 0)
 #define BO_MAP_WRITE (1 << 1)
 #define BO_MAP_READ_WRITE (BO_MAP_READ | BO_MAP_WRITE)
+/*
+ * Explicit hint that the whole mapped rectangle gets overwritten, so its contents need not be
+ * read. Never implied by write-only access, which may write only part of the rectangle.
+ */
+#define BO_MAP_DISCARD (1 << 2)
+/*
+ * drv_bo_map() only sets up the mapping and leaves fetching the contents to the caller's
+ * drv_bo_invalidate(), so that the setup can overlap with waiting for the buffer's producer.
+ */
+#define BO_MAP_DEFER_INVALIDATE (1 << 3)
+/*
+ * Faults the whole BO in when the mapping is created, instead of one page at a time on first
+ * touch. Only applies to new mappings, like the access hints below.
+ */
+#define BO_MAP_POPULATE (1 << 4)
+/* Access pattern hints for the mapping, passed on to madvise(). */
+#define BO_MAP_SEQUENTIAL (1 << 5)
+#define BO_MAP_RANDOM (1 << 6)
 
 /* This is our extension to <drm_fourcc.h>.  We need to make sure we don't step
  * on the namespace of already defined formats, which can be done by using invalid
@@ -123,6 +141,13 @@ struct drv_import_fd_data {
 	uint64_t use_flags;
 };
 
+struct rectangle {
+	uint32_t x;
+	uint32_t y;
+	uint32_t width;
+	uint32_t height;
+};
+
 struct vma {
 	void *addr;
 	size_t length;
@@ -130,20 +155,130 @@ struct vma {
 	uint32_t map_flags;
 	int32_t refcount;
 	uint32_t map_strides[DRV_MAX_PLANES];
+	/* Rectangle of the mapping that created the vma. */
+	struct rectangle rect;
+	/* Set by backends that only keep |rect| coherent; other rectangles get their own vma. */
+	bool partial;
 	void *priv;
 };
 
-struct rectangle {
-	uint32_t x;
-	uint32_t y;
-	uint32_t width;
-	uint32_t height;
-};
-
 struct mapping {
 	struct vma *vma;
 	struct rectangle rect;
+	/* Bounding box of the damage reported since the last flush; empty if none was. */
+	struct rectangle dirty_rect;
 	uint32_t refcount;
+	/* The BO mapped, which tells apart the carved BOs sharing the GEM handle of a slab. */
+	struct bo *bo;
+	/* Whether the mapping cache holds a reference, only accessed under the cache lock. */
+	bool cached;
+};
+
+/* Backend entry points whose latency is recorded in struct drv_stats. */
+enum drv_stats_op {
+	DRV_STATS_CREATE,
+	DRV_STATS_IMPORT,
+	DRV_STATS_MAP,
+	DRV_STATS_INVALIDATE,
+	DRV_STATS_FLUSH,
+	DRV_STATS_UNMAP,
+	DRV_STATS_NUM_OPS,
+};
+
+enum drv_stats_counter {
+	/* Submissions and waits that round-trip to the host (virtgpu). */
+	DRV_STATS_HOST_ROUND_TRIPS,
+	/* Staging copies run on the SDMA engine (amdgpu). */
+	DRV_STATS_SDMA_COPIES,
+	/* Bytes flushed from the CPU caches by hand (i915). */
+	DRV_STATS_CLFLUSH_BYTES,
+	/* Bytes copied between a BO and its CPU shadow buffer (rockchip, mediatek). */
+	DRV_STATS_SHADOW_COPY_BYTES,
+	/*
+	 * Time spent waiting for contended mapping table locks. The *_LOCK_WAIT_NS counters only
+	 * add up how long acquirers were blocked, lock hold times aren't recorded.
+	 */
+	DRV_STATS_MAPPING_LOCK_WAIT_NS,
+	/* Time spent waiting for contended backend locks (host format and ring locks). */
+	DRV_STATS_BACKEND_LOCK_WAIT_NS,
+	/* Time spent waiting for contended locks of the layers above (cros_gralloc). */
+	DRV_STATS_LOCK_WAIT_NS,
+	/* Acquisitions of those locks, and how many of them had to wait. */
+	DRV_STATS_LOCK_ACQUISITIONS,
+	DRV_STATS_LOCK_CONTENTIONS,
+	/* Allocations whose layout came out of, or had to be added to, the metadata cache. */
+	DRV_STATS_METADATA_CACHE_HITS,
+	DRV_STATS_METADATA_CACHE_MISSES,
+	/* Allocations rounded up to a size class, and recycled BOs that served a different size. */
+	DRV_STATS_SIZE_CLASS_ROUNDED,
+	DRV_STATS_SIZE_CLASS_REUSES,
+	/* BOs created ahead of time by drv_bo_pool_prefill(). */
+	DRV_STATS_POOL_PREFILLS,
+	DRV_STATS_NUM_COUNTERS,
+};
+
+/* Bucket 0 counts calls under 1us, bucket i > 0 calls taking [2^(i-1), 2^i) us. */
+#define DRV_STATS_NUM_BUCKETS 24
+
+struct drv_stats {
+	uint64_t latency[DRV_STATS_NUM_OPS][DRV_STATS_NUM_BUCKETS];
+	uint64_t total_ns[DRV_STATS_NUM_OPS];
+	uint64_t counters[DRV_STATS_NUM_COUNTERS];
+};
+
+/* Memory held on behalf of the process, see drv_get_memory_info(). */
+enum drv_memory_kind {
+	/* BOs created through this driver and not yet destroyed. */
+	DRV_MEMORY_ALLOCATED,
+	/* BOs imported from dma-bufs, counted once per imported BO. */
+	DRV_MEMORY_IMPORTED,
+	/* Virtual size of the CPU mappings, including the ones kept by the mapping cache. */
+	DRV_MEMORY_MAPPED,
+	/* Destroyed BOs kept by the BO pool. */
+	DRV_MEMORY_BO_POOL,
+	/* Destroyed BOs queued for the reaper thread in deferred-destroy mode. */
+	DRV_MEMORY_PENDING_DESTROY,
+	/* Virtual size of the mappings kept by the mapping cache. */
+	DRV_MEMORY_MAPPING_CACHE,
+	/* Free blocks of the slabs small BOs are carved out of; carved BOs count as allocated. */
+	DRV_MEMORY_SUBALLOC_SLABS,
+	/* CPU shadow buffers of mappings, in use or pooled (rockchip, mediatek). */
+	DRV_MEMORY_SHADOW,
+	/* Staging BOs the contents of mapped BOs are copied through (amdgpu, i915). */
+	DRV_MEMORY_STAGING,
+	/* Caches kept by the backend, such as the host layout caches of virtgpu. */
+	DRV_MEMORY_BACKEND_CACHES,
+	/* Padding the large page policy added to allocated BOs, on top of their sizes. */
+	DRV_MEMORY_LARGE_PAGE_PADDING,
+	/*
+	 * Estimated part of the allocated BOs past the sizes asked for, due to size classes.
+	 * Already included in DRV_MEMORY_ALLOCATED, unlike the large page padding.
+	 */
+	DRV_MEMORY_SIZE_CLASS_PADDING,
+	DRV_MEMORY_NUM_KINDS,
+};
+
+struct drv_memory_info {
+	uint64_t bytes[DRV_MEMORY_NUM_KINDS];
+	/* 0 if no budget is set. */
+	uint64_t budget;
+};
+
+/* Live BOs of one format and set of use flags. */
+struct drv_memory_usage {
+	uint32_t format;
+	uint64_t use_flags;
+	uint32_t num_allocated;
+	uint64_t allocated_bytes;
+	uint32_t num_imported;
+	uint64_t imported_bytes;
+};
+
+enum drv_trim_level {
+	/* Halves the BO pool and the mapping cache. */
+	DRV_TRIM_MODERATE,
+	/* Frees everything that isn't backing a live BO or mapping. */
+	DRV_TRIM_COMPLETE,
 };
 
 void drv_preload(bool load);
@@ -164,24 +299,142 @@ struct bo *drv_bo_new(struct driver *drv, uint32_t width, uint32_t height, uint3
 struct bo *drv_bo_create(struct driver *drv, uint32_t width, uint32_t height, uint32_t format,
 			 uint64_t use_flags);
 
+/*
+ * Creates count BOs with identical properties. The layout is computed once and shared by all of
+ * them. Returns 0 on success, or a negative errno and no BOs on failure.
+ */
+int drv_bo_create_batch(struct driver *drv, uint32_t width, uint32_t height, uint32_t format,
+			uint64_t use_flags, uint32_t count, struct bo **bos);
+
+/*
+ * Creates another BO like first, which drv_bo_create() returned, reusing its layout like
+ * drv_bo_create_batch() does. For spreading the rest of a batch over several threads.
+ */
+struct bo *drv_bo_create_like(struct bo *first);
+
+/*
+ * use_flags only steer the choice among the modifiers, such as through the modifier policy, and
+ * may be BO_USE_NONE if the caller doesn't know them.
+ */
 struct bo *drv_bo_create_with_modifiers(struct driver *drv, uint32_t width, uint32_t height,
-					uint32_t format, const uint64_t *modifiers, uint32_t count);
+					uint32_t format, const uint64_t *modifiers, uint32_t count,
+					uint64_t use_flags);
 
 void drv_bo_destroy(struct bo *bo);
 
+/*
+ * The BO pool keeps buffers freed with drv_bo_destroy() and hands them back out from
+ * drv_bo_create() for the same size, format and use flags, skipping the kernel allocation. It is
+ * disabled (max_size == 0) by default. Buffers whose fds were exported are never pooled, other
+ * processes may still be using them.
+ */
+void drv_bo_pool_set_max_size(struct driver *drv, size_t max_size);
+
+/* Frees pooled buffers, least recently used first, until at most max_size bytes are pooled. */
+void drv_bo_pool_trim(struct driver *drv, size_t max_size);
+
+/*
+ * Creates BOs ahead of time, straight into the BO pool, until it holds count of them for the
+ * given parameters. Stops early rather than evicting other pooled BOs. Meant to be called off
+ * the critical path, before an allocation burst that is expected. Returns the number of BOs
+ * added, or a negative errno if none could be created.
+ */
+int drv_bo_pool_prefill(struct driver *drv, uint32_t width, uint32_t height, uint32_t format,
+			uint64_t use_flags, uint32_t count);
+
+/*
+ * Unmaps mappings kept by the mapping cache, least recently used first, until their total
+ * virtual size is at most max_size bytes.
+ */
+void drv_mapping_cache_trim(struct driver *drv, size_t max_size);
+
+/*
+ * Returns the statistics recorded since drv_create(). Threads record into their own copy, these
+ * are summed up here, so the result is only consistent per counter.
+ */
+void drv_get_stats(struct driver *drv, struct drv_stats *stats);
+
+void drv_get_memory_info(struct driver *drv, struct drv_memory_info *info);
+
+/*
+ * Fills usage with up to max_count entries of the breakdown of allocated and imported BOs by
+ * format and use flags. Returns the number of entries there are, which may be more.
+ */
+uint32_t drv_get_memory_usage(struct driver *drv, struct drv_memory_usage *usage,
+			      uint32_t max_count);
+
+/*
+ * Sets the number of bytes the driver may hold. Past it, allocations first trim the caches and
+ * pools, then fail with ENOMEM while the allocated BOs alone exceed it. 0 disables the budget.
+ */
+void drv_set_memory_budget(struct driver *drv, uint64_t budget);
+
+/* Releases cached and pooled memory, for when the system runs low on memory. */
+void drv_trim(struct driver *drv, enum drv_trim_level level);
+
 struct bo *drv_bo_import(struct driver *drv, struct drv_import_fd_data *data);
 
 void *drv_bo_map(struct bo *bo, const struct rectangle *rect, uint32_t map_flags,
 		 struct mapping **map_data, size_t plane);
 
+/*
+ * Same as drv_bo_map(), but the contents are only read once acquire_fence, a sync_file fd, has
+ * signaled. The mapping itself is set up before waiting. Takes ownership of acquire_fence; -1
+ * means there is nothing to wait for.
+ */
+void *drv_bo_map_fenced(struct bo *bo, const struct rectangle *rect, uint32_t map_flags,
+			struct mapping **map_data, size_t plane, int acquire_fence);
+
+/*
+ * Maps all planes of the BO through a single mapping, taking the mapping locks and invalidating
+ * once. Fills addrs and strides for each of the drv_bo_get_num_planes() planes; like drv_bo_map()
+ * the addresses are those of the plane starts, not of rect. Returns 0 or a negative errno,
+ * -EINVAL for multi-planar BOs the backend maps through a copy with strides of its own.
+ */
+int drv_bo_map_planes(struct bo *bo, const struct rectangle *rect, uint32_t map_flags,
+		      struct mapping **map_data, void *addrs[DRV_MAX_PLANES],
+		      uint32_t strides[DRV_MAX_PLANES]);
+
 int drv_bo_unmap(struct bo *bo, struct mapping *mapping);
 
 int drv_bo_invalidate(struct bo *bo, struct mapping *mapping);
 
 int drv_bo_flush(struct bo *bo, struct mapping *mapping);
 
+/* One mapping of a drv_bo_sync_batch() call. */
+struct drv_sync_op {
+	struct bo *bo;
+	struct mapping *mapping;
+	/* Flushes the CPU writes through mapping if set, invalidates it otherwise. */
+	bool flush;
+};
+
+/*
+ * Flushes or invalidates several mappings at once, for pipelines syncing many planes and streams
+ * per frame. Backends that can submit the transfers of all ops before waiting do so and wait once.
+ * Repeated ops are only done once. Every op is attempted; the first error is returned.
+ */
+int drv_bo_sync_batch(const struct drv_sync_op *ops, uint32_t count);
+
+/*
+ * Reports that only rect (in buffer coordinates) was written through the mapping. Backends that
+ * copy to the host on flush limit the copy to the union of the reported rectangles. Without any
+ * report the whole mapped rectangle is flushed.
+ */
+void drv_bo_mapping_mark_dirty(struct mapping *mapping, const struct rectangle *rect);
+
+/* Returns the rectangle the next flush of mapping must cover and resets the reported damage. */
+struct rectangle drv_bo_mapping_take_dirty(struct mapping *mapping);
+
 int drv_bo_flush_or_unmap(struct bo *bo, struct mapping *mapping);
 
+/*
+ * Same as drv_bo_flush_or_unmap(), except that the backend may return a sync_file fd in
+ * out_fence rather than waiting for the flush to complete. The caller owns the fd. out_fence is
+ * -1 if no wait is needed.
+ */
+int drv_bo_flush_or_unmap_fenced(struct bo *bo, struct mapping *mapping, int *out_fence);
+
 uint32_t drv_bo_get_width(struct bo *bo);
 
 uint32_t drv_bo_get_height(struct bo *bo);
@@ -190,6 +443,8 @@ size_t drv_bo_get_num_planes(struct bo *bo);
 
 union bo_handle drv_bo_get_plane_handle(struct bo *bo, size_t plane);
 
+size_t drv_bo_get_num_fds(struct bo *bo);
+
 int drv_bo_get_plane_fd(struct bo *bo, size_t plane);
 
 uint32_t drv_bo_get_plane_offset(struct bo *bo, size_t plane);
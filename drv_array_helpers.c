@@ -6,52 +6,146 @@
 #include "drv_array_helpers.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "util.h"
 
+/* Number of item pointers and item slots that live in the array allocation itself. */
+#define DRV_ARRAY_INLINE_ITEMS 2
+/* Slabs double in size up to this many items. */
+#define DRV_ARRAY_MAX_SLAB_ITEMS 64
+
+/*
+ * Items are stored in slabs that are only freed with the array, so that pointers to items stay
+ * valid until they are removed. Removed items are put on a free list threaded through the items
+ * themselves and reused by the next append.
+ */
+struct drv_array_slab {
+	struct drv_array_slab *next;
+	uint32_t num_items;
+	uint64_t data[];
+};
+
 struct drv_array {
 	void **items;
 	uint32_t size;
 	uint32_t item_size;
 	uint32_t allocations;
+	/* Size of a slab item, large enough to hold the free list link. */
+	uint32_t slot_size;
+	uint32_t next_slab_items;
+	struct drv_array_slab *slabs;
+	/* Unused slab items; the first bytes of each point to the next one. */
+	void *free_items;
+	/* Slab space not handed out yet at the end of slabs. */
+	char *slab_cursor;
+	char *slab_end;
+	void *inline_items[DRV_ARRAY_INLINE_ITEMS];
 };
 
 struct drv_array *drv_array_init(uint32_t item_size)
 {
 	struct drv_array *array;
+	uint32_t slot_size = ALIGN(MAX(item_size, sizeof(void *)), sizeof(uint64_t));
 
-	array = calloc(1, sizeof(*array));
+	/* The first slab is allocated together with the array. */
+	array = calloc(1, sizeof(*array) + sizeof(struct drv_array_slab) +
+			      DRV_ARRAY_INLINE_ITEMS * slot_size);
 	if (!array)
 		return NULL;
 
-	/* Start with a power of 2 number of allocations. */
-	array->allocations = 2;
-	array->items = calloc(array->allocations, sizeof(*array->items));
-	if (!array->items) {
-		free(array);
-		return NULL;
-	}
-
+	array->items = array->inline_items;
+	array->allocations = DRV_ARRAY_INLINE_ITEMS;
 	array->item_size = item_size;
+	array->slot_size = slot_size;
+	array->next_slab_items = DRV_ARRAY_INLINE_ITEMS * 2;
+
+	array->slabs = (struct drv_array_slab *)(array + 1);
+	array->slabs->num_items = DRV_ARRAY_INLINE_ITEMS;
+	array->slab_cursor = (char *)array->slabs->data;
+	array->slab_end = array->slab_cursor + DRV_ARRAY_INLINE_ITEMS * slot_size;
 	return array;
 }
 
+static void *drv_array_alloc_item(struct drv_array *array)
+{
+	struct drv_array_slab *slab;
+	void *item;
+
+	if (array->free_items) {
+		item = array->free_items;
+		memcpy(&array->free_items, item, sizeof(void *));
+		return item;
+	}
+
+	if (array->slab_cursor == array->slab_end) {
+		slab = malloc(sizeof(*slab) + (size_t)array->next_slab_items * array->slot_size);
+		if (!slab)
+			return NULL;
+
+		slab->num_items = array->next_slab_items;
+		slab->next = array->slabs;
+		array->slabs = slab;
+		array->slab_cursor = (char *)slab->data;
+		array->slab_end = array->slab_cursor + (size_t)slab->num_items * array->slot_size;
+		array->next_slab_items = MIN(array->next_slab_items * 2, DRV_ARRAY_MAX_SLAB_ITEMS);
+	}
+
+	item = array->slab_cursor;
+	array->slab_cursor += array->slot_size;
+	return item;
+}
+
+static int drv_array_resize(struct drv_array *array, uint32_t allocations)
+{
+	void **new_items;
+
+	if (allocations <= DRV_ARRAY_INLINE_ITEMS) {
+		if (array->items == array->inline_items)
+			return 0;
+
+		memcpy(array->inline_items, array->items, array->size * sizeof(*array->items));
+		free(array->items);
+		array->items = array->inline_items;
+		array->allocations = DRV_ARRAY_INLINE_ITEMS;
+		return 0;
+	}
+
+	if (array->items == array->inline_items) {
+		new_items = malloc(allocations * sizeof(*array->items));
+		if (new_items)
+			memcpy(new_items, array->items, array->size * sizeof(*array->items));
+	} else {
+		new_items = realloc(array->items, allocations * sizeof(*array->items));
+	}
+
+	if (!new_items)
+		return -ENOMEM;
+
+	array->items = new_items;
+	array->allocations = allocations;
+	return 0;
+}
+
 void *drv_array_append(struct drv_array *array, void *data)
 {
 	void *item;
 
 	if (array->size >= array->allocations) {
-		void **new_items = NULL;
-		array->allocations *= 2;
-		new_items = realloc(array->items, array->allocations * sizeof(*array->items));
-		assert(new_items);
-		array->items = new_items;
+		int ret = drv_array_resize(array, array->allocations * 2);
+		assert(!ret);
+		if (ret)
+			return NULL;
 	}
 
-	item = calloc(1, array->item_size);
+	item = drv_array_alloc_item(array);
+	assert(item);
+	if (!item)
+		return NULL;
+
 	memcpy(item, data, array->item_size);
 	array->items[array->size] = item;
 	array->size++;
@@ -60,25 +154,22 @@ void *drv_array_append(struct drv_array *array, void *data)
 
 void drv_array_remove(struct drv_array *array, uint32_t idx)
 {
-	uint32_t i;
+	void *item;
 
 	assert(array);
 	assert(idx < array->size);
 
-	free(array->items[idx]);
-	array->items[idx] = NULL;
-
-	for (i = idx + 1; i < array->size; i++)
-		array->items[i - 1] = array->items[i];
+	item = array->items[idx];
+	memcpy(item, &array->free_items, sizeof(void *));
+	array->free_items = item;
 
+	memmove(&array->items[idx], &array->items[idx + 1],
+		(array->size - idx - 1) * sizeof(*array->items));
 	array->size--;
-	if ((DIV_ROUND_UP(array->allocations, 2) > array->size) && array->allocations > 2) {
-		void **new_items = NULL;
-		array->allocations = DIV_ROUND_UP(array->allocations, 2);
-		new_items = realloc(array->items, array->allocations * sizeof(*array->items));
-		assert(new_items);
-		array->items = new_items;
-	}
+
+	/* Only shrink once a quarter is used, so that append/remove pairs don't reallocate. */
+	if (array->allocations > DRV_ARRAY_INLINE_ITEMS && array->size <= array->allocations / 4)
+		drv_array_resize(array, array->allocations / 2);
 }
 
 void *drv_array_at_idx(struct drv_array *array, uint32_t idx)
@@ -94,11 +185,17 @@ uint32_t drv_array_size(struct drv_array *array)
 
 void drv_array_destroy(struct drv_array *array)
 {
-	uint32_t i;
+	struct drv_array_slab *first = (struct drv_array_slab *)(array + 1);
+
+	while (array->slabs != first) {
+		struct drv_array_slab *slab = array->slabs;
+
+		array->slabs = slab->next;
+		free(slab);
+	}
 
-	for (i = 0; i < array->size; i++)
-		free(array->items[i]);
+	if (array->items != array->inline_items)
+		free(array->items);
 
-	free(array->items);
 	free(array);
 }
@@ -8,16 +8,26 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <linux/dma-buf.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #include <xf86drm.h>
 
 #ifdef __ANDROID__
+#define ATRACE_TAG ATRACE_TAG_GRAPHICS
 #include <cutils/properties.h>
+#include <cutils/trace.h>
 #endif
 
 #include "drv_priv.h"
@@ -194,9 +204,9 @@ size_t drv_num_planes_from_modifier(struct driver *drv, uint32_t format, uint64_
 	if (!planes)
 		return 0;
 
-	if (drv->backend->num_planes_from_modifier && modifier != DRM_FORMAT_MOD_INVALID &&
+	if (DRV_BACKEND(drv)->num_planes_from_modifier && modifier != DRM_FORMAT_MOD_INVALID &&
 	    modifier != DRM_FORMAT_MOD_LINEAR)
-		return drv->backend->num_planes_from_modifier(drv, format, modifier);
+		return DRV_BACKEND(drv)->num_planes_from_modifier(drv, format, modifier);
 
 	return planes;
 }
@@ -210,6 +220,15 @@ uint32_t drv_height_from_format(uint32_t format, uint32_t height, size_t plane)
 	return DIV_ROUND_UP(height, layout->vertical_subsampling[plane]);
 }
 
+uint32_t drv_horizontal_subsampling_from_format(uint32_t format, size_t plane)
+{
+	const struct planar_layout *layout = layout_from_format(format);
+
+	assert(plane < layout->num_planes);
+
+	return layout->horizontal_subsampling[plane];
+}
+
 uint32_t drv_vertical_subsampling_from_format(uint32_t format, size_t plane)
 {
 	const struct planar_layout *layout = layout_from_format(format);
@@ -254,6 +273,173 @@ uint32_t drv_size_from_format(uint32_t format, uint32_t stride, uint32_t height,
 	return stride * drv_height_from_format(format, height, plane);
 }
 
+/*
+ * Computes the byte ranges of a linear BO holding the rows of |rect|, one per plane, merging
+ * planes that follow each other. |ranges| must have room for DRV_MAX_PLANES entries. Returns
+ * the number of ranges written.
+ */
+uint32_t drv_bo_rect_ranges(struct bo *bo, const struct rectangle *rect, struct drv_range *ranges)
+{
+	uint32_t num_ranges = 0;
+
+	for (size_t plane = 0; plane < bo->meta.num_planes; plane++) {
+		uint32_t subsample = drv_vertical_subsampling_from_format(bo->meta.format, plane);
+		uint64_t plane_end = bo->meta.offsets[plane] + bo->meta.sizes[plane];
+		uint64_t start = bo->meta.offsets[plane] +
+				 (uint64_t)(rect->y / subsample) * bo->meta.strides[plane];
+		uint64_t end = bo->meta.offsets[plane] +
+			       (uint64_t)DIV_ROUND_UP(rect->y + rect->height, subsample) *
+				   bo->meta.strides[plane];
+
+		end = MIN(end, plane_end);
+		if (end <= start)
+			continue;
+
+		if (num_ranges &&
+		    ranges[num_ranges - 1].offset + ranges[num_ranges - 1].size >= start) {
+			struct drv_range *prev = &ranges[num_ranges - 1];
+			prev->size = MAX(prev->offset + prev->size, end) - prev->offset;
+			continue;
+		}
+
+		ranges[num_ranges].offset = start;
+		ranges[num_ranges].size = end - start;
+		num_ranges++;
+	}
+
+	return num_ranges;
+}
+
+/*
+ * Rows narrower than the stride by less than this are copied as one range with their
+ * neighbours, fewer and longer copies beat skipping the bytes outside the rectangle.
+ */
+#define DRV_COPY_ROW_SLACK 256
+
+/*
+ * __builtin_nontemporal_store() is clang's. Other compilers get plain stores, which still copy
+ * in aligned 64-byte blocks.
+ */
+#if defined(__has_builtin)
+#if __has_builtin(__builtin_nontemporal_store)
+#define DRV_STORE_STREAMING(value, addr) __builtin_nontemporal_store(value, addr)
+#endif
+#endif
+#ifndef DRV_STORE_STREAMING
+#define DRV_STORE_STREAMING(value, addr) (*(addr) = (value))
+#endif
+
+/*
+ * memcpy() to memory the CPU won't read back, such as a write-combined BO mapping. With
+ * non-temporal stores the data neither goes through nor evicts the CPU caches. The stores
+ * are only ordered by the fence in drv_bo_copy_rect().
+ */
+static void drv_copy_streaming(void *dst, const void *src, size_t size)
+{
+	typedef uint64_t drv_copy_vec __attribute__((vector_size(16)));
+	uint8_t *d = dst;
+	const uint8_t *s = src;
+	size_t head = (16 - ((uintptr_t)d & 15)) & 15;
+
+	if (size < head + 64) {
+		memcpy(dst, src, size);
+		return;
+	}
+
+	memcpy(d, s, head);
+	d += head;
+	s += head;
+	size -= head;
+
+	for (; size >= 64; d += 64, s += 64, size -= 64) {
+		drv_copy_vec v[4];
+
+		memcpy(v, s, sizeof(v));
+		DRV_STORE_STREAMING(v[0], (drv_copy_vec *)(void *)d);
+		DRV_STORE_STREAMING(v[1], (drv_copy_vec *)(void *)(d + 16));
+		DRV_STORE_STREAMING(v[2], (drv_copy_vec *)(void *)(d + 32));
+		DRV_STORE_STREAMING(v[3], (drv_copy_vec *)(void *)(d + 48));
+	}
+
+	memcpy(d, s, size);
+}
+
+static void drv_copy_span(void *dst, const void *src, size_t size, bool streaming)
+{
+	if (streaming)
+		drv_copy_streaming(dst, src, size);
+	else
+		memcpy(dst, src, size);
+}
+
+/*
+ * Copies the pixels of |rect| between two linear copies of a BO's contents, e.g. a BO mapping
+ * and a shadow buffer. Rectangles spanning (nearly) whole rows are copied a plane at a time,
+ * others a row at a time using the plane subsampling of the format. Set |streaming| if |dst|
+ * is write-combined or otherwise not read back by the CPU. Set |exact| if the bytes of |src|
+ * around |rect| are stale, e.g. a shadow never filled from the BO, so that only whole rows
+ * are ever copied as a plane.
+ */
+void drv_bo_copy_rect(struct bo *bo, const struct rectangle *rect, void *dst, const void *src,
+		      bool streaming, bool exact)
+{
+	const struct planar_layout *layout = layout_from_format(bo->meta.format);
+	struct drv_range ranges[DRV_MAX_PLANES];
+	uint32_t num_ranges;
+	uint64_t copied = 0;
+	bool by_row = false;
+
+	if (layout && layout->num_planes == bo->meta.num_planes) {
+		uint64_t row_size = (uint64_t)DIV_ROUND_UP(rect->width,
+							   layout->horizontal_subsampling[0]) *
+				    layout->bytes_per_pixel[0];
+		if (exact)
+			by_row = rect->x || rect->width < bo->meta.width;
+		else
+			by_row = row_size + DRV_COPY_ROW_SLACK < bo->meta.strides[0];
+	}
+
+	if (by_row) {
+		for (size_t plane = 0; plane < bo->meta.num_planes; plane++) {
+			uint32_t hsub = layout->horizontal_subsampling[plane];
+			uint32_t vsub = layout->vertical_subsampling[plane];
+			uint32_t stride = bo->meta.strides[plane];
+			uint64_t x0 = (uint64_t)(rect->x / hsub) * layout->bytes_per_pixel[plane];
+			uint64_t x1 = (uint64_t)DIV_ROUND_UP(rect->x + rect->width, hsub) *
+				      layout->bytes_per_pixel[plane];
+			uint32_t y1 = DIV_ROUND_UP(rect->y + rect->height, vsub);
+
+			if (!stride)
+				continue;
+
+			x1 = MIN(x1, stride);
+			y1 = MIN(y1, bo->meta.sizes[plane] / stride);
+			for (uint32_t y = rect->y / vsub; x0 < x1 && y < y1; y++) {
+				uint64_t offset = bo->meta.offsets[plane] + x0;
+
+				offset += (uint64_t)y * stride;
+				drv_copy_span((uint8_t *)dst + offset,
+					      (const uint8_t *)src + offset, x1 - x0, streaming);
+				copied += x1 - x0;
+			}
+		}
+	} else {
+		num_ranges = drv_bo_rect_ranges(bo, rect, ranges);
+		for (uint32_t i = 0; i < num_ranges; i++) {
+			drv_copy_span((uint8_t *)dst + ranges[i].offset,
+				      (const uint8_t *)src + ranges[i].offset, ranges[i].size,
+				      streaming);
+			copied += ranges[i].size;
+		}
+	}
+
+	/* Non-temporal stores are weakly ordered, even on x86. */
+	if (streaming)
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	drv_stats_add(bo->drv, DRV_STATS_SHADOW_COPY_BYTES, copied);
+}
+
 static uint32_t subsample_stride(uint32_t stride, uint32_t stride_align, uint32_t format,
 				 size_t plane)
 {
@@ -329,11 +515,43 @@ int drv_bo_from_format_and_padding(struct bo *bo, uint32_t stride, uint32_t stri
 	return 0;
 }
 
+/*
+ * Large pages are only used for BOs at least this many pages big, which keeps the padding below
+ * a sixteenth of the BO.
+ */
+#define DRV_LARGE_PAGE_MIN_PAGES 16
+
+/*
+ * Returns the page size a buffer of |size| bytes is rounded to under the large page policy, or
+ * 0 if the policy is off or the buffer is too small to be worth the padding.
+ */
+uint32_t drv_large_page_size(struct driver *drv, uint64_t size)
+{
+	if (!drv->large_pages)
+		return 0;
+
+	if (size >= (uint64_t)DRV_LARGE_PAGE_2M * DRV_LARGE_PAGE_MIN_PAGES)
+		return DRV_LARGE_PAGE_2M;
+
+	if (size >= (uint64_t)DRV_LARGE_PAGE_64K * DRV_LARGE_PAGE_MIN_PAGES)
+		return DRV_LARGE_PAGE_64K;
+
+	return 0;
+}
+
+uint64_t drv_large_page_align(struct driver *drv, uint64_t size)
+{
+	uint64_t page_size = drv_large_page_size(drv, size);
+
+	return page_size ? ALIGN(size, page_size) : size;
+}
+
 int drv_dumb_bo_create_ex(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
 			  uint64_t use_flags, uint64_t quirks)
 {
 	int ret;
-	uint32_t aligned_width, aligned_height;
+	uint32_t aligned_width, aligned_height, unpadded_height;
+	uint64_t size, padded_size;
 	struct drm_mode_create_dumb create_dumb = { 0 };
 
 	aligned_width = width;
@@ -378,6 +596,17 @@ int drv_dumb_bo_create_ex(struct bo *bo, uint32_t width, uint32_t height, uint32
 		aligned_height = ALIGN(aligned_height, MESA_LLVMPIPE_TILE_SIZE);
 		create_dumb.bpp = layout_from_format(format)->bytes_per_pixel[0] * 8;
 	}
+
+	/*
+	 * Dumb buffers are sized by the kernel, so large pages are reached with extra rows. The
+	 * pitch is estimated, a kernel aligning it further only adds to the size.
+	 */
+	unpadded_height = aligned_height;
+	size = (uint64_t)aligned_width * create_dumb.bpp / 8 * aligned_height;
+	padded_size = drv_large_page_align(bo->drv, size);
+	if (padded_size != size)
+		aligned_height = DIV_ROUND_UP(padded_size, size / aligned_height);
+
 	create_dumb.width = aligned_width;
 	create_dumb.height = aligned_height;
 	create_dumb.flags = 0;
@@ -389,10 +618,12 @@ int drv_dumb_bo_create_ex(struct bo *bo, uint32_t width, uint32_t height, uint32
 	}
 
 	drv_bo_from_format(bo, create_dumb.pitch, 1, height, format);
+	bo->large_page_padding = (uint64_t)(aligned_height - unpadded_height) * create_dumb.pitch;
 
 	bo->handle.u32 = create_dumb.handle;
 
-	bo->meta.total_size = create_dumb.size;
+	/* Like the other backends, the padding is accounted apart from the size of the BO. */
+	bo->meta.total_size = create_dumb.size - bo->large_page_padding;
 	return 0;
 }
 
@@ -446,6 +677,10 @@ int drv_prime_bo_import(struct bo *bo, struct drv_import_fd_data *data)
 	struct drm_prime_handle prime_handle;
 
 	for (plane = 0; plane < bo->meta.num_planes; plane++) {
+		/* Planes sharing one dma-buf resolve to the same handle. */
+		if (plane > 0 && data->fds[plane] == data->fds[plane - 1])
+			continue;
+
 		memset(&prime_handle, 0, sizeof(prime_handle));
 		prime_handle.fd = data->fds[plane];
 
@@ -471,197 +706,1019 @@ int drv_prime_bo_import(struct bo *bo, struct drv_import_fd_data *data)
 	return 0;
 }
 
-void *drv_dumb_bo_map(struct bo *bo, struct vma *vma, uint32_t map_flags)
+/*
+ * Returns a dma-buf fd for the BO. It is exported on first use and owned by the BO until
+ * drv_bo_destroy(), so callers must not close it.
+ */
+int drv_bo_get_dma_buf_fd(struct bo *bo)
 {
-	int ret;
-	size_t i;
-	struct drm_mode_map_dumb map_dumb;
+	int expected = -1;
+	int fd;
 
-	memset(&map_dumb, 0, sizeof(map_dumb));
-	map_dumb.handle = bo->handle.u32;
+	fd = __atomic_load_n(&bo->dma_buf_fd, __ATOMIC_ACQUIRE);
+	if (fd >= 0)
+		return fd;
 
-	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_MODE_MAP_DUMB, &map_dumb);
-	if (ret) {
-		drv_loge("DRM_IOCTL_MODE_MAP_DUMB failed\n");
-		return MAP_FAILED;
-	}
+	/* Not drv_bo_get_plane_fd(), the fd stays private and the BO recyclable. */
+	if (bo->is_test_buffer)
+		return -EINVAL;
 
-	for (i = 0; i < bo->meta.num_planes; i++)
-		vma->length += bo->meta.sizes[i];
+	if (drmPrimeHandleToFD(bo->drv->fd, bo->handle.u32, DRM_CLOEXEC | DRM_RDWR, &fd) &&
+	    drmPrimeHandleToFD(bo->drv->fd, bo->handle.u32, DRM_CLOEXEC, &fd))
+		return -errno;
 
-	return mmap(0, vma->length, drv_get_prot(map_flags), MAP_SHARED, bo->drv->fd,
-		    map_dumb.offset);
+	/* Keep the fd of a concurrent caller that got there first. */
+	if (!__atomic_compare_exchange_n(&bo->dma_buf_fd, &expected, fd, false, __ATOMIC_ACQ_REL,
+					 __ATOMIC_ACQUIRE)) {
+		close(fd);
+		return expected;
+	}
+
+	return fd;
 }
 
-int drv_bo_munmap(struct bo *bo, struct vma *vma)
+static int drv_bo_dma_buf_sync(struct bo *bo, uint32_t map_flags, uint64_t dir)
 {
-	return munmap(vma->addr, vma->length);
+	struct dma_buf_sync sync = { 0 };
+	int fd, ret;
+
+	fd = drv_bo_get_dma_buf_fd(bo);
+	if (fd < 0) {
+		drv_loge("Failed to get a dma-buf fd\n");
+		return fd;
+	}
+
+	sync.flags = dir;
+	if (map_flags & BO_MAP_READ)
+		sync.flags |= DMA_BUF_SYNC_READ;
+	if (map_flags & BO_MAP_WRITE)
+		sync.flags |= DMA_BUF_SYNC_WRITE;
+
+	ret = drmIoctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
+	if (ret) {
+		drv_loge("DMA_BUF_IOCTL_SYNC failed: %s\n", strerror(errno));
+		return -errno;
+	}
+
+	return 0;
 }
 
-int drv_get_prot(uint32_t map_flags)
+/*
+ * Begins CPU access in the direction(s) of map_flags: waits for the implicit fences of the BO
+ * and lets the exporter do the cache maintenance. Meant for bo_invalidate.
+ */
+int drv_bo_dma_buf_sync_start(struct bo *bo, uint32_t map_flags)
 {
-	return (BO_MAP_WRITE & map_flags) ? PROT_WRITE | PROT_READ : PROT_READ;
+	return drv_bo_dma_buf_sync(bo, map_flags, DMA_BUF_SYNC_START);
 }
 
-void drv_add_combination(struct driver *drv, const uint32_t format,
-			 struct format_metadata *metadata, uint64_t use_flags)
+/* Ends the CPU access begun by drv_bo_dma_buf_sync_start(). Meant for bo_flush. */
+int drv_bo_dma_buf_sync_end(struct bo *bo, uint32_t map_flags)
 {
-	struct combination combo = { .format = format,
-				     .metadata = *metadata,
-				     .use_flags = use_flags };
-
-	drv_array_append(drv->combos, &combo);
+	return drv_bo_dma_buf_sync(bo, map_flags, DMA_BUF_SYNC_END);
 }
 
-void drv_add_combinations(struct driver *drv, const uint32_t *formats, uint32_t num_formats,
-			  struct format_metadata *metadata, uint64_t use_flags)
+/* Blocks until the sync_file fd signals. Does not close it. */
+int drv_sync_file_wait(int fence)
 {
-	uint32_t i;
+	struct pollfd fds = { .fd = fence, .events = POLLIN };
+	int ret;
 
-	for (i = 0; i < num_formats; i++) {
-		struct combination combo = { .format = formats[i],
-					     .metadata = *metadata,
-					     .use_flags = use_flags };
+	if (fence < 0)
+		return 0;
 
-		drv_array_append(drv->combos, &combo);
+	do {
+		ret = poll(&fds, 1, -1);
+	} while (ret < 0 && (errno == EINTR || errno == EAGAIN));
+
+	if (ret < 0 || (fds.revents & (POLLERR | POLLNVAL))) {
+		drv_loge("waiting for a fence failed\n");
+		return ret < 0 ? -errno : -EINVAL;
 	}
+
+	return 0;
 }
 
-void drv_modify_combination(struct driver *drv, uint32_t format, struct format_metadata *metadata,
-			    uint64_t use_flags)
+/*
+ * Returns a shadow buffer of at least |size| bytes, reusing one handed back with
+ * drv_shadow_put() when possible. Only the first |size| bytes are zeroed, so nothing of the buffer
+ * a pooled shadow last held shows through rows that aren't copied in. The size actually available
+ * is returned in |out_capacity|, which has to be passed back to drv_shadow_put().
+ */
+void *drv_shadow_get(struct driver *drv, size_t size, size_t *out_capacity)
 {
-	uint32_t i;
-	struct combination *combo;
-	/* Attempts to add the specified flags to an existing combination. */
-	for (i = 0; i < drv_array_size(drv->combos); i++) {
-		combo = (struct combination *)drv_array_at_idx(drv->combos, i);
-		if (combo->format == format && combo->metadata.tiling == metadata->tiling &&
-		    combo->metadata.modifier == metadata->modifier)
-			combo->use_flags |= use_flags;
+	struct drv_shadow_pool *pool = &drv->shadow_pool;
+	void *addr = NULL;
+	size_t alignment = 64;
+	int best = -1;
+
+	pthread_mutex_lock(&pool->lock);
+	for (int i = 0; i < DRV_SHADOW_POOL_SLOTS; i++) {
+		if (pool->addrs[i] && pool->sizes[i] >= size &&
+		    (best < 0 || pool->sizes[i] < pool->sizes[best]))
+			best = i;
+	}
+
+	if (best >= 0) {
+		addr = pool->addrs[best];
+		*out_capacity = pool->sizes[best];
+		pool->addrs[best] = NULL;
+		pool->sizes[best] = 0;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	if (addr) {
+		memset(addr, 0, size);
+		return addr;
 	}
-}
 
-int drv_modify_linear_combinations(struct driver *drv)
-{
 	/*
-	 * All current drivers can scanout linear XRGB8888/ARGB8888 as a primary
-	 * plane and as a cursor.
+	 * Cacheline aligned, so that copies of the BO's rows start on the same boundaries. Big ones
+	 * are backed by transparent huge pages if the policy allows.
 	 */
-	drv_modify_combination(drv, DRM_FORMAT_XRGB8888, &LINEAR_METADATA,
-			       BO_USE_CURSOR | BO_USE_SCANOUT);
-	drv_modify_combination(drv, DRM_FORMAT_ARGB8888, &LINEAR_METADATA,
-			       BO_USE_CURSOR | BO_USE_SCANOUT);
-	return 0;
+	if (drv_large_page_size(drv, size) == DRV_LARGE_PAGE_2M)
+		alignment = DRV_LARGE_PAGE_2M;
+
+	size = ALIGN(size, alignment);
+	if (posix_memalign(&addr, alignment, size))
+		return NULL;
+
+#ifdef MADV_HUGEPAGE
+	if (alignment == DRV_LARGE_PAGE_2M)
+		madvise(addr, size, MADV_HUGEPAGE);
+#endif
+
+	memset(addr, 0, size);
+	drv_memory_add(drv, DRV_MEMORY_SHADOW, size);
+	*out_capacity = size;
+	return addr;
 }
 
-/*
- * Pick the best modifier from modifiers, according to the ordering
- * given by modifier_order.
- */
-uint64_t drv_pick_modifier(const uint64_t *modifiers, uint32_t count,
-			   const uint64_t *modifier_order, uint32_t order_count)
+/* Keeps a shadow buffer for reuse, in place of the smallest pooled one if the pool is full. */
+void drv_shadow_put(struct driver *drv, void *addr, size_t capacity)
 {
-	uint32_t i, j;
+	struct drv_shadow_pool *pool = &drv->shadow_pool;
+	int slot = 0;
 
-	for (i = 0; i < order_count; i++) {
-		for (j = 0; j < count; j++) {
-			if (modifiers[j] == modifier_order[i]) {
-				return modifiers[j];
-			}
+	pthread_mutex_lock(&pool->lock);
+	for (int i = 0; i < DRV_SHADOW_POOL_SLOTS; i++) {
+		if (!pool->addrs[i]) {
+			slot = i;
+			break;
 		}
+
+		if (pool->sizes[i] < pool->sizes[slot])
+			slot = i;
 	}
 
-	return DRM_FORMAT_MOD_LINEAR;
+	if (!pool->addrs[slot] || pool->sizes[slot] < capacity) {
+		void *old = pool->addrs[slot];
+		size_t old_capacity = pool->sizes[slot];
+
+		pool->addrs[slot] = addr;
+		pool->sizes[slot] = capacity;
+		addr = old;
+		capacity = old_capacity;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	if (addr)
+		drv_memory_add(drv, DRV_MEMORY_SHADOW, -(int64_t)capacity);
+	free(addr);
 }
 
-/*
- * Search a list of modifiers to see if a given modifier is present
- */
-bool drv_has_modifier(const uint64_t *list, uint32_t count, uint64_t modifier)
+void drv_shadow_pool_trim(struct driver *drv)
 {
-	uint32_t i;
-	for (i = 0; i < count; i++)
-		if (list[i] == modifier)
-			return true;
+	struct drv_shadow_pool *pool = &drv->shadow_pool;
+	void *addrs[DRV_SHADOW_POOL_SLOTS];
+	size_t size = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	for (int i = 0; i < DRV_SHADOW_POOL_SLOTS; i++) {
+		addrs[i] = pool->addrs[i];
+		size += pool->sizes[i];
+		pool->addrs[i] = NULL;
+		pool->sizes[i] = 0;
+	}
+	pthread_mutex_unlock(&pool->lock);
 
-	return false;
+	for (int i = 0; i < DRV_SHADOW_POOL_SLOTS; i++)
+		free(addrs[i]);
+
+	drv_memory_add(drv, DRV_MEMORY_SHADOW, -(int64_t)size);
 }
 
-void drv_resolve_format_and_use_flags_helper(struct driver *drv, uint32_t format,
-					     uint64_t use_flags, uint32_t *out_format,
-					     uint64_t *out_use_flags)
+void drv_shadow_pool_destroy(struct driver *drv)
 {
-	*out_format = format;
-	*out_use_flags = use_flags;
-	switch (format) {
-	case DRM_FORMAT_FLEX_IMPLEMENTATION_DEFINED:
-		/* Common camera implementation defined format. */
-		if (use_flags & (BO_USE_CAMERA_READ | BO_USE_CAMERA_WRITE)) {
-			*out_format = DRM_FORMAT_NV12;
-		} else {
-			/* HACK: See b/28671744 */
-			*out_format = DRM_FORMAT_XBGR8888;
-			*out_use_flags &= ~BO_USE_HW_VIDEO_ENCODER;
-		}
-		break;
-	case DRM_FORMAT_FLEX_YCbCr_420_888:
-		/* Common flexible video format. */
-		*out_format = DRM_FORMAT_NV12;
-		break;
-	case DRM_FORMAT_YVU420_ANDROID:
-		*out_use_flags &= ~BO_USE_SCANOUT;
-		break;
-	default:
-		break;
-	}
+	drv_shadow_pool_trim(drv);
+	pthread_mutex_destroy(&drv->shadow_pool.lock);
 }
 
-const char *drv_get_os_option(const char *name)
+void drv_trace_begin(const char *name, struct bo *bo)
 {
-	const char *ret = getenv(name);
 #ifdef __ANDROID__
-	if (!ret) {
-		static char prop[PROPERTY_VALUE_MAX];
-		return property_get(name, prop, NULL) > 1 ? prop : NULL;
+	char label[128];
+
+	if (!atrace_is_tag_enabled(ATRACE_TAG))
+		return;
+
+	if (!bo) {
+		atrace_begin(ATRACE_TAG, name);
+		return;
 	}
+
+	snprintf(label, sizeof(label), "%s handle=%u %ux%u %c%c%c%c size=%zu", name,
+		 bo->handle.u32, bo->meta.width, bo->meta.height, bo->meta.format & 0xff,
+		 (bo->meta.format >> 8) & 0xff, (bo->meta.format >> 16) & 0xff,
+		 (bo->meta.format >> 24) & 0xff, bo->meta.total_size);
+	atrace_begin(ATRACE_TAG, label);
 #endif
-	return ret;
 }
 
-static void lru_remove_entry(struct lru_entry *entry)
+void drv_trace_end(void)
 {
-	entry->prev->next = entry->next;
-	entry->next->prev = entry->prev;
+#ifdef __ANDROID__
+	atrace_end(ATRACE_TAG);
+#endif
 }
 
-static void lru_link_entry(struct lru *lru, struct lru_entry *entry)
+/*
+ * A thread's stats for one driver. Blocks are linked into their registry under its lock, and
+ * into a list per thread that only the thread itself touches.
+ */
+struct drv_stats_block {
+	struct drv_stats stats;
+	struct drv_stats_registry *registry;
+	struct drv_stats_block *next;
+	struct drv_stats_block *thread_next;
+};
+
+/*
+ * One key for the whole process, never deleted, so that the destructor of every thread that
+ * recorded stats runs however the drivers come and go.
+ */
+static pthread_once_t drv_stats_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t drv_stats_key;
+static bool drv_stats_key_valid;
+
+static void drv_stats_sum(struct drv_stats *dst, const struct drv_stats *src)
 {
-	struct lru_entry *head = &lru->head;
-	entry->prev = head;
-	entry->next = head->next;
+	const uint64_t *s = (const uint64_t *)src;
+	uint64_t *d = (uint64_t *)dst;
 
-	head->next->prev = entry;
-	head->next = entry;
+	for (size_t i = 0; i < sizeof(*src) / sizeof(uint64_t); i++)
+		d[i] += __atomic_load_n(&s[i], __ATOMIC_RELAXED);
 }
 
-struct lru_entry *lru_find(struct lru *lru, bool (*eq)(struct lru_entry *e, void *data), void *data)
+static void drv_stats_registry_unref(struct drv_stats_registry *stats)
 {
-	struct lru_entry *head = &lru->head;
-	struct lru_entry *cur = head->next;
+	bool last;
 
-	while (cur != head) {
-		if (eq(cur, data)) {
-			lru_remove_entry(cur);
-			lru_link_entry(lru, cur);
-			return cur;
+	pthread_mutex_lock(&stats->lock);
+	last = !--stats->refcount;
+	pthread_mutex_unlock(&stats->lock);
+
+	if (last) {
+		pthread_mutex_destroy(&stats->lock);
+		free(stats);
+	}
+}
+
+/* Unlinks the blocks of an exiting thread, keeping what they recorded. */
+static void drv_stats_thread_exit(void *data)
+{
+	struct drv_stats_block *block = data;
+
+	while (block) {
+		struct drv_stats_block *next = block->thread_next;
+		struct drv_stats_registry *stats = block->registry;
+		struct drv_stats_block **link;
+
+		pthread_mutex_lock(&stats->lock);
+		for (link = &stats->blocks; *link; link = &(*link)->next) {
+			if (*link == block) {
+				*link = block->next;
+				break;
+			}
 		}
-		cur = cur->next;
+
+		drv_stats_sum(&stats->retired, &block->stats);
+		pthread_mutex_unlock(&stats->lock);
+
+		free(block);
+		drv_stats_registry_unref(stats);
+		block = next;
 	}
+}
 
-	return NULL;
+static void drv_stats_key_create(void)
+{
+	/* Running out of keys only costs the statistics. */
+	drv_stats_key_valid = !pthread_key_create(&drv_stats_key, drv_stats_thread_exit);
 }
 
-void lru_insert(struct lru *lru, struct lru_entry *entry)
+int drv_stats_init(struct driver *drv)
+{
+	struct drv_stats_registry *stats;
+
+	pthread_once(&drv_stats_key_once, drv_stats_key_create);
+
+	stats = calloc(1, sizeof(*stats));
+	if (!stats)
+		return -ENOMEM;
+
+	if (pthread_mutex_init(&stats->lock, NULL)) {
+		free(stats);
+		return -ENOMEM;
+	}
+
+	stats->refcount = 1;
+	drv->stats = stats;
+	return 0;
+}
+
+/* Threads may still be exiting, their blocks go away with them. */
+void drv_stats_destroy(struct driver *drv)
+{
+	drv_stats_registry_unref(drv->stats);
+	drv->stats = NULL;
+}
+
+static struct drv_stats *drv_stats_get(struct driver *drv)
+{
+	struct drv_stats_registry *stats = drv->stats;
+	struct drv_stats_block *head, *block;
+
+	if (!stats || !drv_stats_key_valid)
+		return NULL;
+
+	head = pthread_getspecific(drv_stats_key);
+	for (block = head; block; block = block->thread_next) {
+		if (block->registry == stats)
+			return &block->stats;
+	}
+
+	block = calloc(1, sizeof(*block));
+	if (!block)
+		return NULL;
+
+	block->registry = stats;
+	block->thread_next = head;
+	if (pthread_setspecific(drv_stats_key, block)) {
+		free(block);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&stats->lock);
+	stats->refcount++;
+	block->next = stats->blocks;
+	stats->blocks = block;
+	pthread_mutex_unlock(&stats->lock);
+
+	return &block->stats;
+}
+
+/* Only the owning thread writes a block, so a relaxed load and store is enough. */
+static void drv_stats_inc(uint64_t *counter, uint64_t value)
+{
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value,
+			 __ATOMIC_RELAXED);
+}
+
+uint64_t drv_stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void drv_stats_add(struct driver *drv, enum drv_stats_counter counter, uint64_t value)
+{
+	struct drv_stats *stats = drv_stats_get(drv);
+
+	if (stats)
+		drv_stats_inc(&stats->counters[counter], value);
+}
+
+void drv_stats_record(struct driver *drv, enum drv_stats_op op, uint64_t start)
+{
+	struct drv_stats *stats = drv_stats_get(drv);
+	uint64_t elapsed = drv_stats_now() - start;
+	uint64_t us = elapsed / 1000;
+	uint32_t bucket = us ? 64 - __builtin_clzll(us) : 0;
+
+	if (!stats)
+		return;
+
+	drv_stats_inc(&stats->latency[op][MIN(bucket, DRV_STATS_NUM_BUCKETS - 1)], 1);
+	drv_stats_inc(&stats->total_ns[op], elapsed);
+}
+
+void drv_stats_merge(struct driver *drv, struct drv_stats *out)
+{
+	struct drv_stats_registry *stats = drv->stats;
+	struct drv_stats_block *block;
+
+	pthread_mutex_lock(&stats->lock);
+	*out = stats->retired;
+	for (block = stats->blocks; block; block = block->next)
+		drv_stats_sum(out, &block->stats);
+	pthread_mutex_unlock(&stats->lock);
+}
+
+void drv_stats_mutex_lock(struct driver *drv, pthread_mutex_t *mutex,
+			  enum drv_stats_counter counter)
+{
+	uint64_t start;
+
+	if (!pthread_mutex_trylock(mutex))
+		return;
+
+	start = drv_stats_now();
+	pthread_mutex_lock(mutex);
+	drv_stats_add(drv, counter, drv_stats_now() - start);
+}
+
+void drv_memory_add(struct driver *drv, enum drv_memory_kind kind, int64_t bytes)
+{
+	__atomic_fetch_add(&drv->memory.bytes[kind], (uint64_t)bytes, __ATOMIC_RELAXED);
+}
+
+void *drv_dumb_bo_map(struct bo *bo, struct vma *vma, uint32_t map_flags)
+{
+	int ret;
+	size_t i;
+	struct drm_mode_map_dumb map_dumb;
+
+	memset(&map_dumb, 0, sizeof(map_dumb));
+	map_dumb.handle = bo->handle.u32;
+
+	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_MODE_MAP_DUMB, &map_dumb);
+	if (ret) {
+		drv_loge("DRM_IOCTL_MODE_MAP_DUMB failed\n");
+		return MAP_FAILED;
+	}
+
+	for (i = 0; i < bo->meta.num_planes; i++)
+		vma->length += bo->meta.sizes[i];
+
+	return mmap(0, vma->length, drv_get_prot(map_flags), drv_get_mmap_flags(map_flags),
+		    bo->drv->fd, map_dumb.offset);
+}
+
+int drv_bo_munmap(struct bo *bo, struct vma *vma)
+{
+	return munmap(vma->addr, vma->length);
+}
+
+int drv_get_prot(uint32_t map_flags)
+{
+	return (BO_MAP_WRITE & map_flags) ? PROT_WRITE | PROT_READ : PROT_READ;
+}
+
+int drv_get_mmap_flags(uint32_t map_flags)
+{
+	return (BO_MAP_POPULATE & map_flags) ? MAP_SHARED | MAP_POPULATE : MAP_SHARED;
+}
+
+/*
+ * Passes the access pattern hints of map_flags on to the kernel. Mappings that are CPU shadows
+ * need not be page aligned, so the range is widened to whole pages. Failing is harmless.
+ */
+void drv_advise_mapping(void *addr, size_t length, uint32_t map_flags)
+{
+	uintptr_t start, end;
+	int advice;
+
+	if (map_flags & BO_MAP_SEQUENTIAL)
+		advice = MADV_SEQUENTIAL;
+	else if (map_flags & BO_MAP_RANDOM)
+		advice = MADV_RANDOM;
+	else
+		return;
+
+	start = (uintptr_t)addr & ~((uintptr_t)PAGE_SIZE - 1);
+	end = ALIGN((uintptr_t)addr + length, PAGE_SIZE);
+	madvise((void *)start, end - start, advice);
+}
+
+void drv_add_combination(struct driver *drv, const uint32_t format,
+			 struct format_metadata *metadata, uint64_t use_flags)
+{
+	struct combination combo = { .format = format,
+				     .metadata = *metadata,
+				     .use_flags = use_flags };
+
+	drv_array_append(drv->combos, &combo);
+	drv->combo_generation++;
+}
+
+void drv_add_combinations(struct driver *drv, const uint32_t *formats, uint32_t num_formats,
+			  struct format_metadata *metadata, uint64_t use_flags)
+{
+	uint32_t i;
+
+	for (i = 0; i < num_formats; i++) {
+		struct combination combo = { .format = formats[i],
+					     .metadata = *metadata,
+					     .use_flags = use_flags };
+
+		drv_array_append(drv->combos, &combo);
+	}
+
+	drv->combo_generation++;
+}
+
+void drv_modify_combination(struct driver *drv, uint32_t format, struct format_metadata *metadata,
+			    uint64_t use_flags)
+{
+	uint32_t i;
+	struct combination *combo;
+	/* Attempts to add the specified flags to an existing combination. */
+	for (i = 0; i < drv_array_size(drv->combos); i++) {
+		combo = (struct combination *)drv_array_at_idx(drv->combos, i);
+		if (combo->format == format && combo->metadata.tiling == metadata->tiling &&
+		    combo->metadata.modifier == metadata->modifier)
+			combo->use_flags |= use_flags;
+	}
+
+	drv->combo_generation++;
+}
+
+int drv_modify_linear_combinations(struct driver *drv)
+{
+	/*
+	 * All current drivers can scanout linear XRGB8888/ARGB8888 as a primary
+	 * plane and as a cursor.
+	 */
+	drv_modify_combination(drv, DRM_FORMAT_XRGB8888, &LINEAR_METADATA,
+			       BO_USE_CURSOR | BO_USE_SCANOUT);
+	drv_modify_combination(drv, DRM_FORMAT_ARGB8888, &LINEAR_METADATA,
+			       BO_USE_CURSOR | BO_USE_SCANOUT);
+	return 0;
+}
+
+enum drv_modifier_class {
+	DRV_MODIFIER_CLASS_LINEAR,
+	DRV_MODIFIER_CLASS_TILED,
+	DRV_MODIFIER_CLASS_COMPRESSED,
+	DRV_MODIFIER_NUM_CLASSES,
+};
+
+static const char *const drv_modifier_class_names[DRV_MODIFIER_NUM_CLASSES] = {
+	"linear",
+	"tiled",
+	"compressed",
+};
+
+/* AMD_FMT_MOD_DCC_SHIFT, not every drm_fourcc.h has the AMD modifier layout. */
+#define DRV_AMD_MOD_DCC (1ull << 13)
+
+static enum drv_modifier_class drv_modifier_get_class(uint64_t modifier)
+{
+	uint64_t vendor = modifier >> 56;
+
+	if (modifier == DRM_FORMAT_MOD_LINEAR || modifier == DRM_FORMAT_MOD_INVALID)
+		return DRV_MODIFIER_CLASS_LINEAR;
+
+	switch (modifier) {
+	case I915_FORMAT_MOD_Y_TILED_CCS:
+	case I915_FORMAT_MOD_Y_TILED_GEN12_RC_CCS:
+	case I915_FORMAT_MOD_Y_TILED_GEN12_MC_CCS:
+	case I915_FORMAT_MOD_4_TILED_MTL_RC_CCS:
+	case DRM_FORMAT_MOD_QCOM_COMPRESSED:
+		return DRV_MODIFIER_CLASS_COMPRESSED;
+	}
+
+	/* AFBC is ARM modifier type 0. */
+	if (vendor == DRM_FORMAT_MOD_VENDOR_ARM && !((modifier >> 52) & 0xf))
+		return DRV_MODIFIER_CLASS_COMPRESSED;
+
+	if (vendor == DRM_FORMAT_MOD_VENDOR_AMD && (modifier & DRV_AMD_MOD_DCC))
+		return DRV_MODIFIER_CLASS_COMPRESSED;
+
+	return DRV_MODIFIER_CLASS_TILED;
+}
+
+/*
+ * Rough memory traffic of each use of a BO, relative between the modifier classes. Tiling keeps
+ * GPU and display accesses within fewer pages and compression saves bandwidth on top, while
+ * the CPU needs detiling (and resolving) copies. Returns false if the class must not be used.
+ */
+static bool drv_modifier_bandwidth_cost(enum drv_modifier_class class, uint64_t use_flags,
+					int64_t *cost)
+{
+	static const int64_t gpu_cost[DRV_MODIFIER_NUM_CLASSES] = { 4, 2, 1 };
+	static const int64_t hw_cost[DRV_MODIFIER_NUM_CLASSES] = { 2, 1, 1 };
+	static const int64_t sw_often_cost[DRV_MODIFIER_NUM_CLASSES] = { 1, 4, 8 };
+	static const int64_t sw_rarely_cost[DRV_MODIFIER_NUM_CLASSES] = { 1, 2, 4 };
+
+	/* The compression metadata is out of sync with the pixels while the GPU writes. */
+	if ((use_flags & BO_USE_FRONT_RENDERING) && class == DRV_MODIFIER_CLASS_COMPRESSED)
+		return false;
+
+	if (use_flags & BO_USE_GPU_HW)
+		*cost += gpu_cost[class];
+	if (use_flags & BO_USE_NON_GPU_HW)
+		*cost += hw_cost[class];
+	if (use_flags & (BO_USE_SW_READ_OFTEN | BO_USE_SW_WRITE_OFTEN))
+		*cost += sw_often_cost[class];
+	if (use_flags & (BO_USE_SW_READ_RARELY | BO_USE_SW_WRITE_RARELY))
+		*cost += sw_rarely_cost[class];
+
+	return true;
+}
+
+enum drv_modifier_action {
+	/* Ranks the candidates by drv_modifier_bandwidth_cost(). */
+	DRV_MODIFIER_RANK,
+	DRV_MODIFIER_PREFER,
+	DRV_MODIFIER_DENY,
+};
+
+/* One line of the policy table, see drv_modifier_policy_init(). */
+struct drv_modifier_rule {
+	uint32_t format;
+	uint64_t use_flags;
+	enum drv_modifier_action action;
+	/* The modifier the rule is about, or any of class if by_class is set. */
+	bool by_class;
+	enum drv_modifier_class class;
+	uint64_t modifier;
+};
+
+/* Prefer outweighs any sum of bandwidth costs. */
+#define DRV_MODIFIER_PREFER_BONUS 1000
+
+static const struct {
+	const char *name;
+	uint64_t use_flag;
+} drv_use_flag_names[] = {
+	{ "scanout", BO_USE_SCANOUT },
+	{ "cursor", BO_USE_CURSOR },
+	{ "rendering", BO_USE_RENDERING },
+	{ "linear", BO_USE_LINEAR },
+	{ "texture", BO_USE_TEXTURE },
+	{ "camera_write", BO_USE_CAMERA_WRITE },
+	{ "camera_read", BO_USE_CAMERA_READ },
+	{ "protected", BO_USE_PROTECTED },
+	{ "sw_read_often", BO_USE_SW_READ_OFTEN },
+	{ "sw_read_rarely", BO_USE_SW_READ_RARELY },
+	{ "sw_write_often", BO_USE_SW_WRITE_OFTEN },
+	{ "sw_write_rarely", BO_USE_SW_WRITE_RARELY },
+	{ "video_decoder", BO_USE_HW_VIDEO_DECODER },
+	{ "video_encoder", BO_USE_HW_VIDEO_ENCODER },
+	{ "front_rendering", BO_USE_FRONT_RENDERING },
+	{ "renderscript", BO_USE_RENDERSCRIPT },
+	{ "gpu_data_buffer", BO_USE_GPU_DATA_BUFFER },
+	{ "sensor_direct_data", BO_USE_SENSOR_DIRECT_DATA },
+};
+
+static bool drv_modifier_parse_use_flags(char *names, uint64_t *use_flags)
+{
+	char *saveptr;
+
+	*use_flags = 0;
+	if (!strcmp(names, "*"))
+		return true;
+
+	for (char *name = strtok_r(names, ",", &saveptr); name;
+	     name = strtok_r(NULL, ",", &saveptr)) {
+		size_t i;
+
+		for (i = 0; i < ARRAY_SIZE(drv_use_flag_names); i++) {
+			if (!strcmp(name, drv_use_flag_names[i].name))
+				break;
+		}
+
+		if (i == ARRAY_SIZE(drv_use_flag_names))
+			return false;
+
+		*use_flags |= drv_use_flag_names[i].use_flag;
+	}
+
+	return true;
+}
+
+static bool drv_modifier_parse_target(const char *target, struct drv_modifier_rule *rule)
+{
+	char *end;
+
+	for (uint32_t class = 0; class < DRV_MODIFIER_NUM_CLASSES; class++) {
+		if (!strcmp(target, drv_modifier_class_names[class])) {
+			rule->by_class = true;
+			rule->class = class;
+			return true;
+		}
+	}
+
+	errno = 0;
+	rule->modifier = strtoull(target, &end, 0);
+	return !errno && end != target && !*end;
+}
+
+/* Matches the device against the backend name, its PCI vendor and device ID or DT compatibles. */
+static bool drv_modifier_device_matches(struct driver *drv, drmDevicePtr dev, const char *device)
+{
+	char pci_id[16];
+
+	if (!strcmp(device, "*") || !strcmp(device, drv->backend->name))
+		return true;
+
+	if (!dev)
+		return false;
+
+	if (dev->bustype == DRM_BUS_PCI) {
+		snprintf(pci_id, sizeof(pci_id), "pci:%04x:%04x", dev->deviceinfo.pci->vendor_id,
+			 dev->deviceinfo.pci->device_id);
+		return !strcmp(device, pci_id);
+	}
+
+	if (dev->bustype == DRM_BUS_PLATFORM && dev->deviceinfo.platform->compatible) {
+		for (char **compatible = dev->deviceinfo.platform->compatible; *compatible;
+		     compatible++) {
+			if (!strcmp(device, *compatible))
+				return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Loads the rules of the modifier policy table at path which apply to this device. Each line
+ * holds a rule, '#' starts a comment:
+ *
+ *   <device> <format> <use flags> rank
+ *   <device> <format> <use flags> prefer|deny <modifier>
+ *
+ * device is '*', a backend name, "pci:<vendor>:<device>" in lowercase hex or a device tree
+ * compatible string. format is '*' or a fourcc like NV12. use flags is '*' or a comma separated
+ * list like "rendering,texture", which matches requests with any of them. modifier is a value
+ * like 0x100000000000004 or one of linear, tiled and compressed.
+ *
+ * rank orders the candidates by the memory bandwidth they are expected to cost for the use
+ * flags rather than by the backend's priorities. prefer puts the modifier first, deny rules it
+ * out as long as there's another candidate.
+ */
+int drv_modifier_policy_init(struct driver *drv, const char *path)
+{
+	drmDevicePtr dev = NULL;
+	char *line = NULL;
+	size_t line_size = 0;
+	uint32_t line_num = 0;
+	FILE *file;
+
+	file = fopen(path, "re");
+	if (!file) {
+		drv_loge("failed to open modifier policy %s: %s\n", path, strerror(errno));
+		return -errno;
+	}
+
+	drv->modifier_rules = drv_array_init(sizeof(struct drv_modifier_rule));
+	if (!drv->modifier_rules) {
+		fclose(file);
+		return -ENOMEM;
+	}
+
+	if (drmGetDevice2(drv->fd, 0, &dev))
+		dev = NULL;
+
+	while (getline(&line, &line_size, file) >= 0) {
+		struct drv_modifier_rule rule = { 0 };
+		char *fields[5] = { NULL };
+		char *saveptr, *comment;
+		uint32_t num_fields = 0;
+		bool valid;
+
+		line_num++;
+		comment = strchr(line, '#');
+		if (comment)
+			*comment = '\0';
+
+		for (char *field = strtok_r(line, " \t\n", &saveptr); field;
+		     field = strtok_r(NULL, " \t\n", &saveptr)) {
+			if (num_fields == ARRAY_SIZE(fields)) {
+				num_fields++;
+				break;
+			}
+			fields[num_fields++] = field;
+		}
+
+		if (!num_fields)
+			continue;
+
+		valid = (num_fields == 4 || num_fields == 5) &&
+			(!strcmp(fields[1], "*") || strlen(fields[1]) == 4) &&
+			drv_modifier_parse_use_flags(fields[2], &rule.use_flags);
+		if (valid && strcmp(fields[1], "*"))
+			rule.format = fourcc_code(fields[1][0], fields[1][1], fields[1][2],
+						  fields[1][3]);
+
+		if (valid && !strcmp(fields[3], "rank") && num_fields == 4)
+			rule.action = DRV_MODIFIER_RANK;
+		else if (valid && !strcmp(fields[3], "prefer") && num_fields == 5)
+			rule.action = DRV_MODIFIER_PREFER;
+		else if (valid && !strcmp(fields[3], "deny") && num_fields == 5)
+			rule.action = DRV_MODIFIER_DENY;
+		else
+			valid = false;
+
+		if (valid && num_fields == 5)
+			valid = drv_modifier_parse_target(fields[4], &rule);
+
+		if (!valid) {
+			drv_loge("%s:%u: invalid modifier policy rule\n", path, line_num);
+			continue;
+		}
+
+		if (drv_modifier_device_matches(drv, dev, fields[0]))
+			drv_array_append(drv->modifier_rules, &rule);
+	}
+
+	free(line);
+	fclose(file);
+	if (dev)
+		drmFreeDevice(&dev);
+
+	drv_logi("%u modifier policy rules apply\n", drv_array_size(drv->modifier_rules));
+	return 0;
+}
+
+void drv_modifier_policy_destroy(struct driver *drv)
+{
+	if (drv->modifier_rules)
+		drv_array_destroy(drv->modifier_rules);
+	drv->modifier_rules = NULL;
+}
+
+bool drv_modifier_policy_score(struct driver *drv, uint32_t format, uint64_t use_flags,
+			       uint64_t modifier, int64_t *score)
+{
+	enum drv_modifier_class class = drv_modifier_get_class(modifier);
+	bool ranked = false;
+
+	*score = 0;
+	for (uint32_t i = 0; i < drv_array_size(drv->modifier_rules); i++) {
+		const struct drv_modifier_rule *rule = drv_array_at_idx(drv->modifier_rules, i);
+
+		if (rule->format && rule->format != format)
+			continue;
+
+		if (rule->use_flags && !(rule->use_flags & use_flags))
+			continue;
+
+		if (rule->action == DRV_MODIFIER_RANK) {
+			if (!ranked && !drv_modifier_bandwidth_cost(class, use_flags, score))
+				return false;
+			ranked = true;
+			continue;
+		}
+
+		if (rule->by_class ? rule->class != class : rule->modifier != modifier)
+			continue;
+
+		if (rule->action == DRV_MODIFIER_DENY)
+			return false;
+
+		*score -= DRV_MODIFIER_PREFER_BONUS;
+	}
+
+	return true;
+}
+
+/*
+ * Pick the best modifier from modifiers, according to the ordering given by modifier_order
+ * and, where rules apply, the modifier policy.
+ */
+uint64_t drv_pick_modifier(struct driver *drv, uint32_t format, uint64_t use_flags,
+			   const uint64_t *modifiers, uint32_t count,
+			   const uint64_t *modifier_order, uint32_t order_count)
+{
+	uint64_t best = DRM_FORMAT_MOD_LINEAR, fallback = DRM_FORMAT_MOD_LINEAR;
+	int64_t best_score = 0, score;
+	uint32_t i, j, candidates = 0;
+	bool found = false;
+
+	for (i = 0; i < order_count; i++) {
+		for (j = 0; j < count; j++) {
+			if (modifiers[j] == modifier_order[i])
+				break;
+		}
+
+		if (j == count)
+			continue;
+
+		if (!drv->modifier_rules)
+			return modifiers[j];
+
+		/* A policy denying every candidate is ignored. */
+		if (!candidates++)
+			fallback = modifiers[j];
+
+		/* Equal scores keep the backend's order. */
+		if (!drv_modifier_policy_score(drv, format, use_flags, modifiers[j], &score))
+			continue;
+
+		if (!found || score < best_score) {
+			best = modifiers[j];
+			best_score = score;
+			found = true;
+		}
+	}
+
+	return found ? best : fallback;
+}
+
+/*
+ * Search a list of modifiers to see if a given modifier is present
+ */
+bool drv_has_modifier(const uint64_t *list, uint32_t count, uint64_t modifier)
+{
+	uint32_t i;
+	for (i = 0; i < count; i++)
+		if (list[i] == modifier)
+			return true;
+
+	return false;
+}
+
+void drv_resolve_format_and_use_flags_helper(struct driver *drv, uint32_t format,
+					     uint64_t use_flags, uint32_t *out_format,
+					     uint64_t *out_use_flags)
+{
+	*out_format = format;
+	*out_use_flags = use_flags;
+	switch (format) {
+	case DRM_FORMAT_FLEX_IMPLEMENTATION_DEFINED:
+		/* Common camera implementation defined format. */
+		if (use_flags & (BO_USE_CAMERA_READ | BO_USE_CAMERA_WRITE)) {
+			*out_format = DRM_FORMAT_NV12;
+		} else {
+			/* HACK: See b/28671744 */
+			*out_format = DRM_FORMAT_XBGR8888;
+			*out_use_flags &= ~BO_USE_HW_VIDEO_ENCODER;
+		}
+		break;
+	case DRM_FORMAT_FLEX_YCbCr_420_888:
+		/* Common flexible video format. */
+		*out_format = DRM_FORMAT_NV12;
+		break;
+	case DRM_FORMAT_YVU420_ANDROID:
+		*out_use_flags &= ~BO_USE_SCANOUT;
+		break;
+	default:
+		break;
+	}
+}
+
+const char *drv_get_os_option(const char *name)
+{
+	const char *ret = getenv(name);
+#ifdef __ANDROID__
+	if (!ret) {
+		static char prop[PROPERTY_VALUE_MAX];
+		return property_get(name, prop, NULL) > 1 ? prop : NULL;
+	}
+#endif
+	return ret;
+}
+
+static void lru_remove_entry(struct lru_entry *entry)
+{
+	entry->prev->next = entry->next;
+	entry->next->prev = entry->prev;
+}
+
+static void lru_link_entry(struct lru *lru, struct lru_entry *entry)
+{
+	struct lru_entry *head = &lru->head;
+	entry->prev = head;
+	entry->next = head->next;
+
+	head->next->prev = entry;
+	head->next = entry;
+}
+
+struct lru_entry *lru_find(struct lru *lru, bool (*eq)(struct lru_entry *e, void *data), void *data)
+{
+	struct lru_entry *head = &lru->head;
+	struct lru_entry *cur = head->next;
+
+	while (cur != head) {
+		if (eq(cur, data)) {
+			lru_remove_entry(cur);
+			lru_link_entry(lru, cur);
+			return cur;
+		}
+		cur = cur->next;
+	}
+
+	return NULL;
+}
+
+void lru_insert(struct lru *lru, struct lru_entry *entry)
 {
 	if (lru->count == lru->max) {
 		lru_remove_entry(lru->head.prev);
@@ -671,6 +1728,12 @@ void lru_insert(struct lru *lru, struct lru_entry *entry)
 	lru_link_entry(lru, entry);
 }
 
+void lru_remove(struct lru *lru, struct lru_entry *entry)
+{
+	lru_remove_entry(entry);
+	lru->count--;
+}
+
 void lru_init(struct lru *lru, int max)
 {
 	lru->head.next = &lru->head;
@@ -678,3 +1741,617 @@ void lru_init(struct lru *lru, int max)
 	lru->count = 0;
 	lru->max = max;
 }
+
+struct drv_layout_cache_entry {
+	/* Must be first, entries are recovered from the LRU list by casting. */
+	struct lru_entry entry;
+	struct drv_layout_cache_entry *hash_next;
+	uint32_t width;
+	uint32_t height;
+	uint32_t format;
+	uint64_t use_flags;
+	struct bo_metadata meta;
+};
+
+static uint32_t drv_layout_cache_hash(uint32_t width, uint32_t height, uint32_t format,
+				      uint64_t use_flags)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	/* FNV-1a over the key words. */
+	h = (h ^ width) * 0x100000001b3ULL;
+	h = (h ^ height) * 0x100000001b3ULL;
+	h = (h ^ format) * 0x100000001b3ULL;
+	h = (h ^ (use_flags & 0xffffffff)) * 0x100000001b3ULL;
+	h = (h ^ (use_flags >> 32)) * 0x100000001b3ULL;
+
+	return (uint32_t)(h ^ (h >> 32));
+}
+
+static struct drv_layout_cache_entry **
+drv_layout_cache_find(struct drv_layout_cache *cache, uint32_t width, uint32_t height,
+		      uint32_t format, uint64_t use_flags)
+{
+	uint32_t bucket = drv_layout_cache_hash(width, height, format, use_flags) &
+			  (cache->num_buckets - 1);
+	struct drv_layout_cache_entry **link =
+	    (struct drv_layout_cache_entry **)&cache->buckets[bucket];
+
+	while (*link) {
+		struct drv_layout_cache_entry *e = *link;
+		if (e->width == width && e->height == height && e->format == format &&
+		    e->use_flags == use_flags)
+			break;
+		link = &e->hash_next;
+	}
+
+	return link;
+}
+
+int drv_layout_cache_init(struct drv_layout_cache *cache, uint32_t max_entries)
+{
+	int ret;
+
+	memset(cache, 0, sizeof(*cache));
+	if (!max_entries)
+		return -EINVAL;
+
+	cache->num_buckets = 1;
+	while (cache->num_buckets < max_entries)
+		cache->num_buckets <<= 1;
+
+	cache->buckets = calloc(cache->num_buckets, sizeof(*cache->buckets));
+	if (!cache->buckets)
+		return -ENOMEM;
+
+	ret = pthread_mutex_init(&cache->lock, NULL);
+	if (ret) {
+		free(cache->buckets);
+		return -ret;
+	}
+
+	cache->max_entries = max_entries;
+	cache->file_fd = -1;
+	lru_init(&cache->lru, max_entries);
+	return 0;
+}
+
+void drv_layout_cache_destroy(struct drv_layout_cache *cache)
+{
+	struct lru_entry *cur;
+
+	if (!cache->buckets)
+		return;
+
+	drv_logd("layout cache: %" PRIu64 " hits, %" PRIu64 " misses\n", cache->hits,
+		 cache->misses);
+
+	cur = cache->lru.head.next;
+	while (cur != &cache->lru.head) {
+		struct lru_entry *next = cur->next;
+		free(cur);
+		cur = next;
+	}
+
+	free(cache->buckets);
+	cache->buckets = NULL;
+	pthread_mutex_destroy(&cache->lock);
+
+	if (cache->file_fd >= 0)
+		close(cache->file_fd);
+	cache->file_fd = -1;
+}
+
+bool drv_layout_cache_lookup(struct drv_layout_cache *cache, uint32_t width, uint32_t height,
+			     uint32_t format, uint64_t use_flags, struct bo_metadata *out_meta)
+{
+	struct drv_layout_cache_entry *e;
+
+	pthread_mutex_lock(&cache->lock);
+	e = *drv_layout_cache_find(cache, width, height, format, use_flags);
+	if (e) {
+		lru_remove(&cache->lru, &e->entry);
+		lru_insert(&cache->lru, &e->entry);
+		*out_meta = e->meta;
+		cache->hits++;
+	} else {
+		cache->misses++;
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	return e != NULL;
+}
+
+/* Returns true if a new entry was added for the key. */
+static bool drv_layout_cache_insert_locked(struct drv_layout_cache *cache, uint32_t width,
+					   uint32_t height, uint32_t format, uint64_t use_flags,
+					   const struct bo_metadata *meta)
+{
+	struct drv_layout_cache_entry **link;
+	struct drv_layout_cache_entry *e, *victim = NULL;
+
+	link = drv_layout_cache_find(cache, width, height, format, use_flags);
+	if (*link) {
+		/* Raced with another insert of the same key; keep the newer layout. */
+		(*link)->meta = *meta;
+		return false;
+	}
+
+	e = calloc(1, sizeof(*e));
+	if (!e)
+		return false;
+
+	e->width = width;
+	e->height = height;
+	e->format = format;
+	e->use_flags = use_flags;
+	e->meta = *meta;
+
+	if ((uint32_t)cache->lru.count == cache->max_entries) {
+		struct drv_layout_cache_entry **victim_link;
+
+		victim = (struct drv_layout_cache_entry *)(void *)cache->lru.head.prev;
+		victim_link = drv_layout_cache_find(cache, victim->width, victim->height,
+						    victim->format, victim->use_flags);
+		*victim_link = victim->hash_next;
+		lru_remove(&cache->lru, &victim->entry);
+		free(victim);
+
+		/* The victim may have preceded the new key in the same chain. */
+		link = drv_layout_cache_find(cache, width, height, format, use_flags);
+	}
+
+	*link = e;
+	lru_insert(&cache->lru, &e->entry);
+	return true;
+}
+
+/* FNV-1a, for fingerprinting the configuration persisted files were written for. */
+#define DRV_HASH_SEED 0xcbf29ce484222325ULL
+
+static uint64_t drv_hash_bytes(uint64_t hash, const void *data, size_t size)
+{
+	const uint8_t *bytes = data;
+
+	for (size_t i = 0; i < size; i++)
+		hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+
+	return hash;
+}
+
+#define DRV_LAYOUT_CACHE_FILE_MAGIC 0x4d474c43 /* "MGLC" */
+#define DRV_LAYOUT_CACHE_FILE_VERSION 2
+
+struct drv_layout_cache_file_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t pad;
+	uint64_t host_key;
+};
+
+struct drv_layout_cache_file_record {
+	uint32_t width;
+	uint32_t height;
+	uint32_t format;
+	/* Hash of the record with check set to 0, which catches torn and foreign records. */
+	uint32_t check;
+	uint64_t use_flags;
+	uint32_t offsets[DRV_MAX_PLANES];
+	uint32_t sizes[DRV_MAX_PLANES];
+	uint32_t strides[DRV_MAX_PLANES];
+	uint64_t format_modifier;
+	uint64_t total_size;
+};
+
+static uint32_t drv_layout_cache_record_check(const struct drv_layout_cache_file_record *record)
+{
+	struct drv_layout_cache_file_record copy = *record;
+
+	copy.check = 0;
+	return (uint32_t)drv_hash_bytes(DRV_HASH_SEED, &copy, sizeof(copy));
+}
+
+static bool drv_layout_cache_record_valid(const struct drv_layout_cache_file_record *record)
+{
+	if (record->check != drv_layout_cache_record_check(record))
+		return false;
+
+	/* format is in the key space of the cache's owner (virgl formats for virgl), unchecked. */
+	if (!record->width || !record->height || !record->total_size)
+		return false;
+
+	for (size_t plane = 0; plane < DRV_MAX_PLANES; plane++) {
+		if ((uint64_t)record->offsets[plane] + record->sizes[plane] > record->total_size)
+			return false;
+	}
+
+	return true;
+}
+
+static void drv_layout_cache_record_from_meta(struct drv_layout_cache_file_record *record,
+					      uint32_t width, uint32_t height, uint32_t format,
+					      uint64_t use_flags, const struct bo_metadata *meta)
+{
+	memset(record, 0, sizeof(*record));
+	record->width = width;
+	record->height = height;
+	record->format = format;
+	record->use_flags = use_flags;
+	memcpy(record->offsets, meta->offsets, sizeof(record->offsets));
+	memcpy(record->sizes, meta->sizes, sizeof(record->sizes));
+	memcpy(record->strides, meta->strides, sizeof(record->strides));
+	record->format_modifier = meta->format_modifier;
+	record->total_size = meta->total_size;
+	record->check = drv_layout_cache_record_check(record);
+}
+
+static void drv_layout_cache_meta_from_record(struct bo_metadata *meta,
+					      const struct drv_layout_cache_file_record *record)
+{
+	memset(meta, 0, sizeof(*meta));
+	meta->width = record->width;
+	meta->height = record->height;
+	meta->use_flags = record->use_flags;
+	memcpy(meta->offsets, record->offsets, sizeof(meta->offsets));
+	memcpy(meta->sizes, record->sizes, sizeof(meta->sizes));
+	memcpy(meta->strides, record->strides, sizeof(meta->strides));
+	meta->format_modifier = record->format_modifier;
+	meta->total_size = record->total_size;
+}
+
+void drv_layout_cache_insert(struct drv_layout_cache *cache, uint32_t width, uint32_t height,
+			     uint32_t format, uint64_t use_flags, const struct bo_metadata *meta)
+{
+	bool added;
+	struct drv_layout_cache_file_record record;
+
+	pthread_mutex_lock(&cache->lock);
+	added = drv_layout_cache_insert_locked(cache, width, height, format, use_flags, meta);
+	pthread_mutex_unlock(&cache->lock);
+
+	if (!added || cache->file_fd < 0)
+		return;
+
+	/* Readers take the lock shared, so they never see half a record. */
+	drv_layout_cache_record_from_meta(&record, width, height, format, use_flags, meta);
+	if (flock(cache->file_fd, LOCK_EX))
+		return;
+
+	if (write(cache->file_fd, &record, sizeof(record)) != sizeof(record))
+		drv_logd("layout cache: failed to persist record: %s\n", strerror(errno));
+
+	flock(cache->file_fd, LOCK_UN);
+}
+
+/*
+ * Reads the records of the file at fd if it was written for header. Returns the number of
+ * records, 0 for a file to start over with, or a negative errno.
+ */
+static ssize_t drv_layout_cache_read_file(int fd,
+					  const struct drv_layout_cache_file_header *header,
+					  struct drv_layout_cache_file_record **out_records)
+{
+	struct drv_layout_cache_file_header file_header;
+	struct drv_layout_cache_file_record *records;
+	size_t num_records;
+	ssize_t size;
+	struct stat st;
+
+	*out_records = NULL;
+	if (fstat(fd, &st))
+		return -errno;
+
+	if ((size_t)st.st_size < sizeof(file_header) ||
+	    pread(fd, &file_header, sizeof(file_header), 0) != sizeof(file_header) ||
+	    memcmp(&file_header, header, sizeof(file_header)))
+		return 0;
+
+	num_records = (st.st_size - sizeof(file_header)) / sizeof(*records);
+	if (!num_records)
+		return 0;
+
+	records = calloc(num_records, sizeof(*records));
+	if (!records)
+		return -ENOMEM;
+
+	/* Plain reads, a mapping would fault if another process truncated the file. */
+	size = pread(fd, records, num_records * sizeof(*records), sizeof(file_header));
+	if (size < 0) {
+		free(records);
+		return -errno;
+	}
+
+	*out_records = records;
+	return size / sizeof(*records);
+}
+
+/*
+ * Writes header and the cached layouts to a new file, renamed over path when complete so that
+ * other processes reading or appending to the old file are unaffected. Returns an fd for
+ * appending to the new file, or a negative errno.
+ */
+static int drv_layout_cache_rewrite_file(struct drv_layout_cache *cache, const char *path,
+					 const struct drv_layout_cache_file_header *header)
+{
+	int fd, ret = 0;
+	char tmp_path[PATH_MAX];
+	struct lru_entry *cur;
+
+	if (snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, getpid()) >= (int)sizeof(tmp_path))
+		return -ENAMETOOLONG;
+
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return -errno;
+
+	if (write(fd, header, sizeof(*header)) != sizeof(*header)) {
+		ret = -EIO;
+		goto unlink_tmp;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	for (cur = cache->lru.head.prev; cur != &cache->lru.head; cur = cur->prev) {
+		struct drv_layout_cache_entry *e = (struct drv_layout_cache_entry *)(void *)cur;
+		struct drv_layout_cache_file_record record;
+
+		drv_layout_cache_record_from_meta(&record, e->width, e->height, e->format,
+						  e->use_flags, &e->meta);
+		if (write(fd, &record, sizeof(record)) != sizeof(record)) {
+			ret = -EIO;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	if (ret)
+		goto unlink_tmp;
+
+	if (rename(tmp_path, path)) {
+		ret = -errno;
+		goto unlink_tmp;
+	}
+
+	return fd;
+
+unlink_tmp:
+	close(fd);
+	unlink(tmp_path);
+	return ret;
+}
+
+int drv_layout_cache_attach_file(struct drv_layout_cache *cache, const char *path,
+				 const void *host_key, size_t host_key_size)
+{
+	int fd;
+	ssize_t num_records;
+	size_t num_valid = 0;
+	struct drv_layout_cache_file_record *records;
+	struct drv_layout_cache_file_header header = { 0 };
+	struct bo_metadata meta;
+
+	header.magic = DRV_LAYOUT_CACHE_FILE_MAGIC;
+	header.version = DRV_LAYOUT_CACHE_FILE_VERSION;
+	header.record_size = sizeof(struct drv_layout_cache_file_record);
+	header.host_key = drv_hash_bytes(DRV_HASH_SEED, host_key, host_key_size);
+
+	fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return -errno;
+
+	/* Appends take the lock exclusively. */
+	if (flock(fd, LOCK_SH)) {
+		close(fd);
+		return -errno;
+	}
+
+	num_records = drv_layout_cache_read_file(fd, &header, &records);
+	flock(fd, LOCK_UN);
+	if (num_records < 0) {
+		close(fd);
+		return num_records;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	for (ssize_t i = 0; i < num_records; i++) {
+		if (!drv_layout_cache_record_valid(&records[i]))
+			continue;
+
+		drv_layout_cache_meta_from_record(&meta, &records[i]);
+		drv_layout_cache_insert_locked(cache, records[i].width, records[i].height,
+					       records[i].format, records[i].use_flags, &meta);
+		num_valid++;
+	}
+	pthread_mutex_unlock(&cache->lock);
+	free(records);
+
+	/*
+	 * Start over when the file is for another host or build, or holds damaged records, and
+	 * compact it once it has accumulated more records than the cache keeps.
+	 */
+	if (!num_valid || num_valid != (size_t)num_records ||
+	    (size_t)num_records > cache->max_entries) {
+		int new_fd = drv_layout_cache_rewrite_file(cache, path, &header);
+		close(fd);
+		if (new_fd < 0)
+			return new_fd;
+
+		fd = new_fd;
+	}
+
+	cache->file_fd = fd;
+	return 0;
+}
+
+void drv_layout_cache_get_stats(struct drv_layout_cache *cache, uint64_t *hits, uint64_t *misses)
+{
+	pthread_mutex_lock(&cache->lock);
+	*hits = cache->hits;
+	*misses = cache->misses;
+	pthread_mutex_unlock(&cache->lock);
+}
+
+size_t drv_layout_cache_get_size(struct drv_layout_cache *cache)
+{
+	size_t size;
+
+	if (!cache->buckets)
+		return 0;
+
+	pthread_mutex_lock(&cache->lock);
+	size = cache->lru.count * sizeof(struct drv_layout_cache_entry) +
+	       cache->num_buckets * sizeof(*cache->buckets);
+	pthread_mutex_unlock(&cache->lock);
+
+	return size;
+}
+
+#define DRV_CAPS_SNAPSHOT_MAGIC 0x4d474353 /* "MGCS" */
+#define DRV_CAPS_SNAPSHOT_VERSION 1
+#define DRV_BOOT_ID_PATH "/proc/sys/kernel/random/boot_id"
+
+struct drv_caps_snapshot_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t caps_size;
+	uint32_t num_combos;
+	uint64_t key;
+};
+
+/*
+ * The host can't change under a running guest, so the boot and the device stand in for the host
+ * capset versions, which can only be learned by asking the host.
+ */
+static int drv_caps_snapshot_key(struct driver *drv, const void *host_key, size_t host_key_size,
+				 uint64_t *key)
+{
+	int fd;
+	ssize_t len;
+	struct stat st;
+	char boot_id[64];
+
+	if (fstat(drv->fd, &st))
+		return -errno;
+
+	fd = open(DRV_BOOT_ID_PATH, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	len = read(fd, boot_id, sizeof(boot_id));
+	close(fd);
+	if (len <= 0)
+		return len ? -errno : -ENOENT;
+
+	*key = drv_hash_bytes(DRV_HASH_SEED, boot_id, len);
+	*key = drv_hash_bytes(*key, &st.st_rdev, sizeof(st.st_rdev));
+	*key = drv_hash_bytes(*key, host_key, host_key_size);
+	return 0;
+}
+
+int drv_caps_snapshot_load(struct driver *drv, const char *path, const void *host_key,
+			   size_t host_key_size, void *caps, size_t caps_size)
+{
+	int fd, ret;
+	struct stat st;
+	uint64_t key;
+	struct combination *combos = NULL;
+	struct drv_caps_snapshot_header header;
+
+	ret = drv_caps_snapshot_key(drv, host_key, host_key_size, &key);
+	if (ret)
+		return ret;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &st)) {
+		ret = -errno;
+		goto close_fd;
+	}
+
+	if (read(fd, &header, sizeof(header)) != sizeof(header) ||
+	    header.magic != DRV_CAPS_SNAPSHOT_MAGIC ||
+	    header.version != DRV_CAPS_SNAPSHOT_VERSION || header.key != key ||
+	    header.caps_size != caps_size ||
+	    (size_t)st.st_size !=
+		sizeof(header) + caps_size + header.num_combos * sizeof(*combos)) {
+		ret = -ESTALE;
+		goto close_fd;
+	}
+
+	combos = calloc(header.num_combos, sizeof(*combos));
+	if (!combos) {
+		ret = -ENOMEM;
+		goto close_fd;
+	}
+
+	if (read(fd, caps, caps_size) != (ssize_t)caps_size ||
+	    read(fd, combos, header.num_combos * sizeof(*combos)) !=
+		(ssize_t)(header.num_combos * sizeof(*combos))) {
+		ret = -EIO;
+		goto free_combos;
+	}
+
+	for (uint32_t i = 0; i < header.num_combos; i++)
+		drv_array_append(drv->combos, &combos[i]);
+	drv->combo_generation++;
+
+free_combos:
+	free(combos);
+close_fd:
+	close(fd);
+	return ret;
+}
+
+int drv_caps_snapshot_store(struct driver *drv, const char *path, const void *host_key,
+			    size_t host_key_size, const void *caps, size_t caps_size)
+{
+	int fd, ret;
+	char tmp_path[PATH_MAX];
+	struct drv_caps_snapshot_header header = { 0 };
+
+	header.magic = DRV_CAPS_SNAPSHOT_MAGIC;
+	header.version = DRV_CAPS_SNAPSHOT_VERSION;
+	header.caps_size = caps_size;
+	header.num_combos = drv_array_size(drv->combos);
+
+	ret = drv_caps_snapshot_key(drv, host_key, host_key_size, &header.key);
+	if (ret)
+		return ret;
+
+	/* Renaming a complete file into place keeps readers from seeing a partial snapshot. */
+	if (snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, getpid()) >= (int)sizeof(tmp_path))
+		return -ENAMETOOLONG;
+
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return -errno;
+
+	if (write(fd, &header, sizeof(header)) != sizeof(header) ||
+	    write(fd, caps, caps_size) != (ssize_t)caps_size) {
+		ret = -EIO;
+		goto unlink_tmp;
+	}
+
+	for (uint32_t i = 0; i < header.num_combos; i++) {
+		const struct combination *combo = drv_array_at_idx(drv->combos, i);
+		if (write(fd, combo, sizeof(*combo)) != sizeof(*combo)) {
+			ret = -EIO;
+			goto unlink_tmp;
+		}
+	}
+
+	close(fd);
+	if (rename(tmp_path, path)) {
+		ret = -errno;
+		unlink(tmp_path);
+	}
+
+	return ret;
+
+unlink_tmp:
+	close(fd);
+	unlink(tmp_path);
+	return ret;
+}
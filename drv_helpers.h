@@ -7,7 +7,9 @@
 #ifndef DRV_HELPERS_H
 #define DRV_HELPERS_H
 
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "drv.h"
 #include "drv_array_helpers.h"
@@ -16,16 +18,33 @@
 #define PAGE_SIZE 0x1000
 #endif
 
+/* Page sizes of the large page policy, see drv_large_page_size(). */
+#define DRV_LARGE_PAGE_64K (64 * 1024)
+#define DRV_LARGE_PAGE_2M (2 * 1024 * 1024)
+
+struct bo_metadata;
+struct drv_stats_block;
 struct format_metadata;
 
+struct drv_range {
+	uint64_t offset;
+	uint64_t size;
+};
+
 uint32_t drv_height_from_format(uint32_t format, uint32_t height, size_t plane);
+uint32_t drv_horizontal_subsampling_from_format(uint32_t format, size_t plane);
 uint32_t drv_vertical_subsampling_from_format(uint32_t format, size_t plane);
 uint32_t drv_size_from_format(uint32_t format, uint32_t stride, uint32_t height, size_t plane);
+uint32_t drv_bo_rect_ranges(struct bo *bo, const struct rectangle *rect, struct drv_range *ranges);
+void drv_bo_copy_rect(struct bo *bo, const struct rectangle *rect, void *dst, const void *src,
+		      bool streaming, bool exact);
 int drv_bo_from_format(struct bo *bo, uint32_t stride, uint32_t stride_align,
 		       uint32_t aligned_height, uint32_t format);
 int drv_bo_from_format_and_padding(struct bo *bo, uint32_t stride, uint32_t stride_align,
 				   uint32_t aligned_height, uint32_t format,
 				   uint32_t padding[DRV_MAX_PLANES]);
+uint32_t drv_large_page_size(struct driver *drv, uint64_t size);
+uint64_t drv_large_page_align(struct driver *drv, uint64_t size);
 int drv_dumb_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
 		       uint64_t use_flags);
 int drv_dumb_bo_create_ex(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
@@ -34,9 +53,20 @@ int drv_dumb_bo_destroy(struct bo *bo);
 int drv_gem_close(struct driver *drv, uint32_t gem_handle);
 int drv_gem_bo_destroy(struct bo *bo);
 int drv_prime_bo_import(struct bo *bo, struct drv_import_fd_data *data);
+int drv_bo_get_dma_buf_fd(struct bo *bo);
+int drv_bo_dma_buf_sync_start(struct bo *bo, uint32_t map_flags);
+int drv_bo_dma_buf_sync_end(struct bo *bo, uint32_t map_flags);
+int drv_sync_file_wait(int fence);
+void *drv_shadow_get(struct driver *drv, size_t size, size_t *out_capacity);
+void drv_shadow_put(struct driver *drv, void *addr, size_t capacity);
+/* Frees the pooled shadow buffers. */
+void drv_shadow_pool_trim(struct driver *drv);
+void drv_shadow_pool_destroy(struct driver *drv);
 void *drv_dumb_bo_map(struct bo *bo, struct vma *vma, uint32_t map_flags);
 int drv_bo_munmap(struct bo *bo, struct vma *vma);
 int drv_get_prot(uint32_t map_flags);
+int drv_get_mmap_flags(uint32_t map_flags);
+void drv_advise_mapping(void *addr, size_t length, uint32_t map_flags);
 void drv_add_combination(struct driver *drv, uint32_t format, struct format_metadata *metadata,
 			 uint64_t usage);
 void drv_add_combinations(struct driver *drv, const uint32_t *formats, uint32_t num_formats,
@@ -44,7 +74,16 @@ void drv_add_combinations(struct driver *drv, const uint32_t *formats, uint32_t
 void drv_modify_combination(struct driver *drv, uint32_t format, struct format_metadata *metadata,
 			    uint64_t usage);
 int drv_modify_linear_combinations(struct driver *drv);
-uint64_t drv_pick_modifier(const uint64_t *modifiers, uint32_t count,
+int drv_modifier_policy_init(struct driver *drv, const char *path);
+void drv_modifier_policy_destroy(struct driver *drv);
+/*
+ * Scores modifier for a BO of format and use_flags under the modifier policy, lower is better.
+ * Returns false if the policy rules it out.
+ */
+bool drv_modifier_policy_score(struct driver *drv, uint32_t format, uint64_t use_flags,
+			       uint64_t modifier, int64_t *score);
+uint64_t drv_pick_modifier(struct driver *drv, uint32_t format, uint64_t use_flags,
+			   const uint64_t *modifiers, uint32_t count,
 			   const uint64_t *modifier_order, uint32_t order_count);
 bool drv_has_modifier(const uint64_t *list, uint32_t count, uint64_t modifier);
 void drv_resolve_format_and_use_flags_helper(struct driver *drv, uint32_t format,
@@ -56,6 +95,38 @@ void drv_resolve_format_and_use_flags_helper(struct driver *drv, uint32_t format
  */
 const char *drv_get_os_option(const char *name);
 
+/*
+ * Per-thread struct drv_stats, so that recording never contends. Blocks of exited threads are
+ * folded into retired. Each block holds a reference, so the registry outlives drv_destroy()
+ * until every thread that recorded into it has exited.
+ */
+struct drv_stats_registry {
+	pthread_mutex_t lock;
+	uint32_t refcount;
+	struct drv_stats_block *blocks;
+	struct drv_stats retired;
+};
+
+/*
+ * Android trace spans, tagged with the handle, size and format of bo if it isn't NULL. No-ops
+ * elsewhere.
+ */
+void drv_trace_begin(const char *name, struct bo *bo);
+void drv_trace_end(void);
+
+int drv_stats_init(struct driver *drv);
+void drv_stats_destroy(struct driver *drv);
+uint64_t drv_stats_now(void);
+void drv_stats_add(struct driver *drv, enum drv_stats_counter counter, uint64_t value);
+/* Records the latency of an op which started at start, as returned by drv_stats_now(). */
+void drv_stats_record(struct driver *drv, enum drv_stats_op op, uint64_t start);
+void drv_stats_merge(struct driver *drv, struct drv_stats *stats);
+/* Adds bytes, which may be negative, to the given kind of held memory. */
+void drv_memory_add(struct driver *drv, enum drv_memory_kind kind, int64_t bytes);
+/* pthread_mutex_lock() which adds the time spent blocked to the given *_LOCK_WAIT_NS counter. */
+void drv_stats_mutex_lock(struct driver *drv, pthread_mutex_t *mutex,
+			  enum drv_stats_counter counter);
+
 struct lru_entry {
 	struct lru_entry *next;
 	struct lru_entry *prev;
@@ -70,6 +141,57 @@ struct lru {
 struct lru_entry *lru_find(struct lru *lru, bool (*eq)(struct lru_entry *e, void *data),
 			   void *data);
 void lru_insert(struct lru *lru, struct lru_entry *entry);
+void lru_remove(struct lru *lru, struct lru_entry *entry);
 void lru_init(struct lru *lru, int max);
 
+/*
+ * Bounded LRU cache of buffer layouts, keyed on (width, height, format, use_flags), for backends
+ * which have to ask the host for the layout of each new buffer configuration.
+ */
+struct drv_layout_cache {
+	pthread_mutex_t lock;
+	struct lru lru;
+	/* Hash chains of struct drv_layout_cache_entry, num_buckets is a power of two. */
+	void **buckets;
+	uint32_t num_buckets;
+	uint32_t max_entries;
+	/* Lookup counters, for judging whether max_entries fits the workload. */
+	uint64_t hits;
+	uint64_t misses;
+	/* Optional file new layouts are appended to, -1 if none is attached. */
+	int file_fd;
+};
+
+int drv_layout_cache_init(struct drv_layout_cache *cache, uint32_t max_entries);
+void drv_layout_cache_destroy(struct drv_layout_cache *cache);
+/* Copies the cached layout into out_meta and returns true on a hit. */
+bool drv_layout_cache_lookup(struct drv_layout_cache *cache, uint32_t width, uint32_t height,
+			     uint32_t format, uint64_t use_flags, struct bo_metadata *out_meta);
+/* Caches meta for the key, replacing any existing entry and evicting the oldest when full. */
+void drv_layout_cache_insert(struct drv_layout_cache *cache, uint32_t width, uint32_t height,
+			     uint32_t format, uint64_t use_flags, const struct bo_metadata *meta);
+void drv_layout_cache_get_stats(struct drv_layout_cache *cache, uint64_t *hits, uint64_t *misses);
+/* Returns the number of bytes the cached layouts take. */
+size_t drv_layout_cache_get_size(struct drv_layout_cache *cache);
+/*
+ * Loads the layouts persisted at path and appends layouts inserted from then on, so that later
+ * processes start with a warm cache. Only the plane layout, modifier and total size are persisted.
+ * host_key identifies the host configuration the layouts are valid for; a file written for a
+ * different key, or by an incompatible build, is discarded.
+ */
+int drv_layout_cache_attach_file(struct drv_layout_cache *cache, const char *path,
+				 const void *host_key, size_t host_key_size);
+
+/*
+ * Capability snapshots let backends whose init queries the host skip the queries, and rebuilding
+ * the combinations, in later processes of the same boot. caps is the backend's own state and
+ * host_key the host configuration it was derived from; the combinations are those added so far.
+ * Loading restores both and fails unless the snapshot at path was stored for the same key, boot
+ * and device.
+ */
+int drv_caps_snapshot_load(struct driver *drv, const char *path, const void *host_key,
+			   size_t host_key_size, void *caps, size_t caps_size);
+int drv_caps_snapshot_store(struct driver *drv, const char *path, const void *host_key,
+			    size_t host_key_size, const void *caps, size_t caps_size);
+
 #endif
@@ -14,6 +14,7 @@
 #include <sys/types.h>
 
 #include "drv.h"
+#include "drv_helpers.h"
 
 struct bo_metadata {
 	uint32_t width;
@@ -46,8 +47,40 @@ struct bo {
 	bool is_test_buffer;
 	union bo_handle handle;
 	void *priv;
+
+	/* Set for BOs from drv_bo_create() which may be handed back out by the BO pool. */
+	bool recyclable;
+	/* The use flags drv_bo_create() was called with; backends may modify meta.use_flags. */
+	uint64_t requested_use_flags;
+	/* dma-buf fd exported by drv_bo_get_dma_buf_fd(), or -1. */
+	int dma_buf_fd;
+	/* Mappings taken through the BO that the mapping cache holds. */
+	uint32_t num_cached_mappings;
+	/* Set for BOs carved out of a shared backing BO, see struct drv_suballoc_slab. */
+	struct drv_suballoc_slab *slab;
+	uint32_t slab_block;
+	/* Set once the BO is counted in drv->memory, imported tells under which kind. */
+	bool accounted;
+	bool imported;
+	/* Next BO in drv->reaper's queue. */
+	struct bo *reap_next;
+	/* Bytes the backend allocated beyond meta.total_size for the large page policy. */
+	uint64_t large_page_padding;
+	/*
+	 * Dimensions the BO was allocated with when rounded up to a size class, 0 otherwise. meta
+	 * holds the ones it was asked for; its strides and sizes are those of the allocation.
+	 */
+	uint32_t size_class_width;
+	uint32_t size_class_height;
+	/* Estimated part of meta.total_size past the requested dimensions. */
+	uint64_t size_class_padding;
 };
 
+#define DRV_SIZE_CLASS_MAX_STEPS 16
+
+/* Largest number of ops drv_bo_sync_batch() hands to a backend at once. */
+#define DRV_SYNC_BATCH_MAX 32
+
 struct format_metadata {
 	uint32_t priority;
 	uint32_t tiling;
@@ -60,17 +93,226 @@ struct combination {
 	uint64_t use_flags;
 };
 
+/*
+ * Per-handle state is split across lock shards, selected by GEM handle, so that threads working
+ * on unrelated buffers don't contend on a single lock.
+ */
+#define DRV_NUM_HANDLE_SHARDS 16
+
+struct drv_handle_shard {
+	pthread_mutex_t lock;
+	void *table;
+	/* Mapping shards keep the last emptied mappings array here for the next first map. */
+	struct drv_array *spare;
+};
+
+/*
+ * Reference counts of the GEM handles held by BOs, one slot per unique handle, updated without
+ * locks. The table uses open addressing without deletion: a claimed slot keeps its handle, with a
+ * count of 0 while the handle is closed. The kernel hands out the lowest free handles, so slots
+ * are reused and the table stays about as big as the peak number of live handles. A handle whose
+ * probe window is full goes to the next table, which is twice as large.
+ */
+#define DRV_HANDLE_TABLE_SLOTS 1024
+#define DRV_HANDLE_TABLE_PROBES 16
+
+struct drv_handle_slot {
+	uint32_t handle; /* 0 while the slot is free, GEM handles are never 0. */
+	uint32_t refcount;
+};
+
+struct drv_handle_table {
+	uint32_t num_slots;
+	struct drv_handle_table *next;
+	struct drv_handle_slot slots[];
+};
+
+struct combination_ref {
+	uint64_t use_flags;
+	uint32_t format;
+	uint32_t priority;
+	/* Index of the combination in drv->combos. */
+	uint32_t idx;
+};
+
+struct combination_format_range {
+	uint32_t format;
+	uint32_t start;
+	uint32_t count;
+};
+
+/*
+ * Read-only view of drv->combos built once the backend is initialized. Combinations are grouped
+ * by format in ascending format order, and in descending priority within a format, so the first
+ * one supporting the requested use flags is the best one. The index is stale once
+ * drv->combo_generation moved past generation.
+ */
+struct combination_index {
+	struct combination_format_range *formats;
+	uint32_t num_formats;
+	struct combination_ref *refs;
+	uint32_t num_combos;
+	uint32_t generation;
+};
+
+/*
+ * A backing BO that small linear BOs are carved out of, in DRV_SUBALLOC_SLAB_BLOCKS blocks of a
+ * single power of two block_size, a set bit in free_mask per free block. Carved BOs share the GEM
+ * handle of the slab and have the block offset added to their plane offsets, so an export is the
+ * slab's dma-buf plus those offsets. The suballocator's list holds one reference and every carved
+ * BO another, all under the suballocator lock. Blocks of exported BOs stay in exported_mask
+ * instead of going back to free_mask, as the importer can still reach them.
+ */
+struct drv_suballoc_slab {
+	struct drv_suballoc_slab *next;
+	struct bo *bo;
+	uint64_t requested_use_flags;
+	uint32_t block_size;
+	uint32_t refcount;
+	uint64_t free_mask;
+	uint64_t exported_mask;
+};
+
+struct drv_suballocator {
+	pthread_mutex_t lock;
+	bool enabled;
+	struct drv_suballoc_slab *slabs;
+};
+
+/* Recently freed BOs kept for reuse by drv_bo_create(), in LRU order. */
+#define DRV_BO_POOL_BUCKETS 64
+
+struct drv_bo_pool_entry;
+
+struct drv_bo_pool {
+	pthread_mutex_t lock;
+	struct lru lru;
+	/* The entries again, chained by key through hash_next for lookups. */
+	struct drv_bo_pool_entry *buckets[DRV_BO_POOL_BUCKETS];
+	size_t size;
+	size_t max_size;
+};
+
+/*
+ * BOs that lost their last reference in deferred-destroy mode, queued for the reaper thread to
+ * release and destroy in batches. queue is linked through bo->reap_next.
+ */
+struct drv_bo_reaper {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	struct bo *queue;
+	bool enabled;
+	bool stopping;
+};
+
+/*
+ * Mappings kept resident after their last unlock, in LRU order, so that locking the same buffer
+ * again doesn't have to mmap it again. size is the total virtual size of the cached mappings.
+ */
+struct drv_mapping_cache {
+	pthread_mutex_t lock;
+	struct lru lru;
+	size_t size;
+	size_t max_size;
+};
+
+/*
+ * What drv_bo_import() learned from importing a dma-buf that is still imported, keyed by the
+ * dma-buf inode, so that importing it again only needs to take a reference on the GEM handle.
+ */
+struct drv_import_entry {
+	dev_t dev;
+	ino_t ino;
+	uint32_t handle;
+	uint32_t tiling;
+	size_t num_planes;
+	uint64_t format_modifier;
+	off_t size;
+};
+
+/*
+ * table is NULL when the backend keeps per-BO state that a fast-path import would miss. handles
+ * maps the GEM handle of each entry back to it, for removal when the handle is closed.
+ */
+struct drv_import_index {
+	pthread_mutex_t lock;
+	void *table;
+	void *handles;
+};
+
+#define DRV_SHADOW_POOL_SLOTS 4
+
+/* Freed shadow buffers of backends that map through a CPU copy of the BO, kept for reuse. */
+struct drv_shadow_pool {
+	pthread_mutex_t lock;
+	void *addrs[DRV_SHADOW_POOL_SLOTS];
+	size_t sizes[DRV_SHADOW_POOL_SLOTS];
+};
+
+/* Distinct format and use flags combinations drv_get_memory_usage() breaks memory down by. */
+#define DRV_MEMORY_USAGE_SLOTS 128
+
+enum drv_memory_usage_slot_state {
+	DRV_MEMORY_USAGE_SLOT_EMPTY,
+	/* Being filled in with a key. */
+	DRV_MEMORY_USAGE_SLOT_CLAIMED,
+	DRV_MEMORY_USAGE_SLOT_READY,
+};
+
+/*
+ * Entry of the open-addressed usage table. The key is written once, when the slot is claimed,
+ * and the slot stays with it when its counts drop to 0. The counts are updated atomically.
+ */
+struct drv_memory_usage_slot {
+	uint32_t state;
+	uint32_t format;
+	uint64_t use_flags;
+	uint32_t num_allocated;
+	uint32_t num_imported;
+	uint64_t allocated_bytes;
+	uint64_t imported_bytes;
+};
+
+/*
+ * Process-wide memory accounting. bytes holds the kinds that have no owner to read them from.
+ * Everything is updated atomically, so creating and destroying BOs takes no lock for it.
+ */
+struct drv_memory_accounting {
+	struct drv_memory_usage_slot usage[DRV_MEMORY_USAGE_SLOTS];
+	uint64_t bytes[DRV_MEMORY_NUM_KINDS];
+	uint64_t budget;
+};
+
 struct driver {
 	int fd;
 	const struct backend *backend;
 	void *priv;
-	pthread_mutex_t buffer_table_lock;
-	void *buffer_table;
-	pthread_mutex_t mappings_lock;
-	struct drv_array *mappings;
+	struct drv_handle_table *handle_refs;
+	/* Each table maps a GEM handle to a drv_array of the struct mappings referencing it. */
+	struct drv_handle_shard mapping_shards[DRV_NUM_HANDLE_SHARDS];
+	struct drv_bo_pool bo_pool;
+	struct drv_bo_reaper reaper;
+	struct drv_suballocator suballoc;
+	struct drv_mapping_cache mapping_cache;
+	struct drv_shadow_pool shadow_pool;
+	struct drv_import_index import_index;
+	struct drv_stats_registry *stats;
+	struct drv_memory_accounting memory;
+	/* Results of bo_compute_metadata without a modifier list, unused if buckets is NULL. */
+	struct drv_layout_cache metadata_cache;
 	struct drv_array *combos;
+	/* Bumped whenever combinations are added or modified. */
+	uint32_t combo_generation;
+	struct combination_index combo_index;
 	bool compression;
 	bool log_bos;
+	/* Big BOs, shadow and staging buffers are rounded to large pages. */
+	bool large_pages;
+	/* Size classes per doubling of a dimension, BOs are not rounded if 0. */
+	uint32_t size_class_steps;
+	/* struct drv_modifier_rule entries of the modifier policy for the device, or NULL. */
+	struct drv_array *modifier_rules;
 };
 
 struct backend {
@@ -80,6 +322,7 @@ struct backend {
 	void (*close)(struct driver *drv);
 	int (*bo_create)(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
 			 uint64_t use_flags);
+	/* The use flags the caller passed, possibly none, are in bo->meta.use_flags. */
 	int (*bo_create_with_modifiers)(struct bo *bo, uint32_t width, uint32_t height,
 					uint32_t format, const uint64_t *modifiers, uint32_t count);
 	// Either both or neither _metadata functions must be implemented.
@@ -87,6 +330,12 @@ struct backend {
 	int (*bo_compute_metadata)(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
 				   uint64_t use_flags, const uint64_t *modifiers, uint32_t count);
 	int (*bo_create_from_metadata)(struct bo *bo);
+	/*
+	 * Optional. Returns the offset alignment bo needs when it is carved out of a shared backing
+	 * BO created from the same metadata with a bigger total_size, or 0 if it needs a GEM
+	 * object of its own. Called after bo_compute_metadata.
+	 */
+	uint32_t (*bo_suballoc_alignment)(struct bo *bo);
 	/* Called for every non-test-buffer BO on free */
 	int (*bo_release)(struct bo *bo);
 	/* Called on free if this bo is the last object referencing the contained GEM BOs */
@@ -96,6 +345,16 @@ struct backend {
 	int (*bo_unmap)(struct bo *bo, struct vma *vma);
 	int (*bo_invalidate)(struct bo *bo, struct mapping *mapping);
 	int (*bo_flush)(struct bo *bo, struct mapping *mapping);
+	/*
+	 * Like bo_flush, but instead of blocking until the flush completes the backend may return
+	 * a sync_file fd in out_fence which signals once it has. out_fence is -1 otherwise.
+	 */
+	int (*bo_flush_fenced)(struct bo *bo, struct mapping *mapping, int *out_fence);
+	/*
+	 * Optional. Flushes or invalidates the mappings of up to DRV_SYNC_BATCH_MAX distinct ops
+	 * of this driver, see drv_bo_sync_batch(). Returns the first error.
+	 */
+	int (*bo_sync_batch)(struct driver *drv, const struct drv_sync_op *ops, uint32_t count);
 	void (*resolve_format_and_use_flags)(struct driver *drv, uint32_t format,
 					     uint64_t use_flags, uint32_t *out_format,
 					     uint64_t *out_use_flags);
@@ -103,8 +362,23 @@ struct backend {
 	int (*resource_info)(struct bo *bo, uint32_t strides[DRV_MAX_PLANES],
 			     uint32_t offsets[DRV_MAX_PLANES], uint64_t *format_modifier);
 	uint32_t (*get_max_texture_2d_size)(struct driver *drv);
+	/* Optional. Adds the memory held by the backend itself to info. */
+	void (*get_memory_info)(struct driver *drv, struct drv_memory_info *info);
+	/* Optional. Releases memory held by the backend itself, see drv_trim(). */
+	void (*trim)(struct driver *drv, enum drv_trim_level level);
 };
 
+/*
+ * Builds with DRV_SINGLE_BACKEND defined to a backend (such as backend_i915) only contain that
+ * one, and the core calls it directly. With LTO its entry points inline into the core.
+ */
+#ifdef DRV_SINGLE_BACKEND
+extern const struct backend DRV_SINGLE_BACKEND;
+#define DRV_BACKEND(drv) ((void)(drv), &DRV_SINGLE_BACKEND)
+#else
+#define DRV_BACKEND(drv) ((drv)->backend)
+#endif
+
 // clang-format off
 #define BO_USE_RENDER_MASK (BO_USE_LINEAR | BO_USE_RENDERING | BO_USE_RENDERSCRIPT | \
 			    BO_USE_SW_READ_OFTEN | BO_USE_SW_WRITE_OFTEN | BO_USE_SW_READ_RARELY | \
@@ -5,15 +5,18 @@
  */
 
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <unistd.h>
 #include <xf86drm.h>
 
 #include "drv.h"
+#include "drv_helpers.h"
 #include "gbm_helpers.h"
 #include "gbm_priv.h"
 #include "util.h"
@@ -71,44 +74,191 @@ PUBLIC void gbm_device_destroy(struct gbm_device *gbm)
 	free(gbm);
 }
 
-PUBLIC struct gbm_surface *gbm_surface_create(struct gbm_device *gbm, uint32_t width,
-					      uint32_t height, uint32_t format, uint32_t usage)
+static struct gbm_surface *gbm_surface_new(uint32_t count)
+{
+	struct gbm_surface *surface;
+
+	if (count < 2 || count > GBM_SURFACE_MAX_BUFFERS)
+		return NULL;
+
+	surface = (struct gbm_surface *)calloc(1, sizeof(*surface));
+	if (!surface)
+		return NULL;
+
+	if (pthread_mutex_init(&surface->lock, NULL)) {
+		free(surface);
+		return NULL;
+	}
+
+	surface->num_buffers = count;
+	return surface;
+}
+
+PUBLIC struct gbm_surface *gbm_surface_create_with_buffer_count(struct gbm_device *gbm,
+								uint32_t width, uint32_t height,
+								uint32_t format, uint32_t usage,
+								uint32_t count)
 {
-	struct gbm_surface *surface = (struct gbm_surface *)malloc(sizeof(*surface));
+	struct gbm_surface *surface = gbm_surface_new(count);
+	struct gbm_bo *bos[GBM_SURFACE_MAX_BUFFERS];
 
 	if (!surface)
 		return NULL;
 
+	if (gbm_bo_create_array(gbm, width, height, format, usage, count, bos)) {
+		gbm_surface_destroy(surface);
+		return NULL;
+	}
+
+	memcpy(surface->bos, bos, count * sizeof(*bos));
 	return surface;
 }
 
+PUBLIC struct gbm_surface *gbm_surface_create(struct gbm_device *gbm, uint32_t width,
+					      uint32_t height, uint32_t format, uint32_t usage)
+{
+	return gbm_surface_create_with_buffer_count(gbm, width, height, format, usage,
+						    GBM_SURFACE_DEFAULT_BUFFERS);
+}
+
 PUBLIC struct gbm_surface *gbm_surface_create_with_modifiers(struct gbm_device *gbm, uint32_t width,
 							     uint32_t height, uint32_t format,
 							     const uint64_t *modifiers,
 							     const unsigned int count)
 {
-	if (count != 0 || modifiers != NULL)
+	return gbm_surface_create_with_modifiers2(gbm, width, height, format, modifiers, count, 0);
+}
+
+PUBLIC struct gbm_surface *gbm_surface_create_with_modifiers2(struct gbm_device *gbm,
+							      uint32_t width, uint32_t height,
+							      uint32_t format,
+							      const uint64_t *modifiers,
+							      const unsigned int count,
+							      uint32_t flags)
+{
+	struct gbm_surface *surface;
+
+	if (!count || !modifiers)
+		return gbm_surface_create(gbm, width, height, format, flags);
+
+	surface = gbm_surface_new(GBM_SURFACE_DEFAULT_BUFFERS);
+	if (!surface)
 		return NULL;
 
-	return gbm_surface_create(gbm, width, height, format, 0);
+	for (uint32_t i = 0; i < surface->num_buffers; i++) {
+		surface->bos[i] =
+		    gbm_bo_create_with_modifiers2(gbm, width, height, format, modifiers, count,
+						  flags);
+		if (!surface->bos[i]) {
+			gbm_surface_destroy(surface);
+			return NULL;
+		}
+	}
+
+	return surface;
+}
+
+/* Returns the index of bo in the surface, or -1 if the surface doesn't own it. */
+static int gbm_surface_find(struct gbm_surface *surface, struct gbm_bo *bo)
+{
+	for (uint32_t i = 0; i < surface->num_buffers; i++) {
+		if (surface->bos[i] == bo)
+			return i;
+	}
+
+	return -1;
+}
+
+PUBLIC struct gbm_bo *gbm_surface_get_back_buffer(struct gbm_surface *surface)
+{
+	struct gbm_bo *bo = NULL;
+
+	pthread_mutex_lock(&surface->lock);
+	for (uint32_t i = 0; i < surface->num_buffers; i++) {
+		if (surface->states[i] == GBM_SURFACE_BUFFER_FREE) {
+			surface->states[i] = GBM_SURFACE_BUFFER_BACK;
+			bo = surface->bos[i];
+			break;
+		}
+	}
+	pthread_mutex_unlock(&surface->lock);
+
+	return bo;
+}
+
+PUBLIC int gbm_surface_swap_buffer(struct gbm_surface *surface, struct gbm_bo *bo)
+{
+	int idx;
+
+	pthread_mutex_lock(&surface->lock);
+	idx = gbm_surface_find(surface, bo);
+	if (idx < 0 || surface->states[idx] != GBM_SURFACE_BUFFER_BACK) {
+		pthread_mutex_unlock(&surface->lock);
+		return -EINVAL;
+	}
+
+	/* A frame that was never locked is superseded by the new one. */
+	for (uint32_t i = 0; i < surface->num_buffers; i++) {
+		if (surface->states[i] == GBM_SURFACE_BUFFER_QUEUED)
+			surface->states[i] = GBM_SURFACE_BUFFER_FREE;
+	}
+
+	surface->states[idx] = GBM_SURFACE_BUFFER_QUEUED;
+	pthread_mutex_unlock(&surface->lock);
+
+	return 0;
 }
 
 PUBLIC struct gbm_bo *gbm_surface_lock_front_buffer(struct gbm_surface *surface)
 {
-	return NULL;
+	struct gbm_bo *bo = NULL;
+
+	pthread_mutex_lock(&surface->lock);
+	for (uint32_t i = 0; i < surface->num_buffers; i++) {
+		if (surface->states[i] == GBM_SURFACE_BUFFER_QUEUED) {
+			surface->states[i] = GBM_SURFACE_BUFFER_LOCKED;
+			bo = surface->bos[i];
+			break;
+		}
+	}
+	pthread_mutex_unlock(&surface->lock);
+
+	return bo;
 }
 
 PUBLIC void gbm_surface_release_buffer(struct gbm_surface *surface, struct gbm_bo *bo)
 {
+	int idx;
+
+	pthread_mutex_lock(&surface->lock);
+	idx = gbm_surface_find(surface, bo);
+	if (idx >= 0 && surface->states[idx] == GBM_SURFACE_BUFFER_LOCKED)
+		surface->states[idx] = GBM_SURFACE_BUFFER_FREE;
+	pthread_mutex_unlock(&surface->lock);
 }
 
 PUBLIC int gbm_surface_has_free_buffers(struct gbm_surface *surface)
 {
-	return 0;
+	int has_free = 0;
+
+	pthread_mutex_lock(&surface->lock);
+	for (uint32_t i = 0; i < surface->num_buffers; i++) {
+		if (surface->states[i] == GBM_SURFACE_BUFFER_FREE)
+			has_free = 1;
+	}
+	pthread_mutex_unlock(&surface->lock);
+
+	return has_free;
 }
 
 PUBLIC void gbm_surface_destroy(struct gbm_surface *surface)
 {
+	for (uint32_t i = 0; i < surface->num_buffers; i++) {
+		if (surface->bos[i])
+			gbm_bo_destroy(surface->bos[i]);
+	}
+
+	pthread_mutex_destroy(&surface->lock);
 	free(surface);
 }
 
@@ -157,9 +307,66 @@ PUBLIC struct gbm_bo *gbm_bo_create(struct gbm_device *gbm, uint32_t width, uint
 	return bo;
 }
 
+PUBLIC int gbm_bo_create_array(struct gbm_device *gbm, uint32_t width, uint32_t height,
+			       uint32_t format, uint32_t usage, uint32_t count,
+			       struct gbm_bo **bos)
+{
+	int ret;
+	uint32_t i;
+	uint32_t drv_format = format;
+	struct bo **drv_bos;
+
+	if (!count)
+		return -EINVAL;
+
+	if (!gbm_device_is_format_supported(gbm, format, usage))
+		return -EINVAL;
+
+	/* Same YV12 HACK as gbm_bo_create(). */
+	if (format == GBM_FORMAT_YVU420 && (usage & GBM_BO_USE_LINEAR))
+		drv_format = DRM_FORMAT_YVU420_ANDROID;
+
+	drv_bos = calloc(count, sizeof(*drv_bos));
+	if (!drv_bos)
+		return -ENOMEM;
+
+	for (i = 0; i < count; i++) {
+		bos[i] = gbm_bo_new(gbm, format);
+		if (!bos[i]) {
+			ret = -ENOMEM;
+			goto free_gbm_bos;
+		}
+	}
+
+	ret = drv_bo_create_batch(gbm->drv, width, height, drv_format, gbm_convert_usage(usage),
+				  count, drv_bos);
+	if (ret)
+		goto free_gbm_bos;
+
+	for (i = 0; i < count; i++)
+		bos[i]->bo = drv_bos[i];
+
+	free(drv_bos);
+	return 0;
+
+free_gbm_bos:
+	while (i--)
+		free(bos[i]);
+	free(drv_bos);
+	return ret;
+}
+
 PUBLIC struct gbm_bo *gbm_bo_create_with_modifiers(struct gbm_device *gbm, uint32_t width,
 						   uint32_t height, uint32_t format,
 						   const uint64_t *modifiers, uint32_t count)
+{
+	return gbm_bo_create_with_modifiers2(gbm, width, height, format, modifiers, count, 0);
+}
+
+PUBLIC struct gbm_bo *gbm_bo_create_with_modifiers2(struct gbm_device *gbm, uint32_t width,
+						    uint32_t height, uint32_t format,
+						    const uint64_t *modifiers,
+						    const unsigned int count, uint32_t flags)
 {
 	struct gbm_bo *bo;
 
@@ -168,7 +375,8 @@ PUBLIC struct gbm_bo *gbm_bo_create_with_modifiers(struct gbm_device *gbm, uint3
 	if (!bo)
 		return NULL;
 
-	bo->bo = drv_bo_create_with_modifiers(gbm->drv, width, height, format, modifiers, count);
+	bo->bo = drv_bo_create_with_modifiers(gbm->drv, width, height, format, modifiers, count,
+					      gbm_convert_usage(flags));
 
 	if (!bo->bo) {
 		free(bo);
@@ -371,6 +579,23 @@ static uint32_t gbm_format_canonicalize(uint32_t gbm_format)
 	}
 }
 
+static uint32_t gbm_convert_transfer_flags(uint32_t transfer_flags)
+{
+	uint32_t map_flags;
+
+	map_flags = (transfer_flags & GBM_BO_TRANSFER_READ) ? BO_MAP_READ : BO_MAP_NONE;
+	map_flags |= (transfer_flags & GBM_BO_TRANSFER_WRITE) ? BO_MAP_WRITE : BO_MAP_NONE;
+	map_flags |= (transfer_flags & GBM_BO_TRANSFER_POPULATE) ? BO_MAP_POPULATE : BO_MAP_NONE;
+	map_flags |=
+	    (transfer_flags & GBM_BO_TRANSFER_SEQUENTIAL) ? BO_MAP_SEQUENTIAL : BO_MAP_NONE;
+	map_flags |= (transfer_flags & GBM_BO_TRANSFER_RANDOM) ? BO_MAP_RANDOM : BO_MAP_NONE;
+	/* Nothing to discard when the contents are read. */
+	if ((transfer_flags & GBM_BO_TRANSFER_DISCARD) && !(transfer_flags & GBM_BO_TRANSFER_READ))
+		map_flags |= BO_MAP_DISCARD;
+
+	return map_flags;
+}
+
 /**
  * Returns a string representing the fourcc format name.
  */
@@ -413,8 +638,7 @@ PUBLIC void *gbm_bo_map2(struct gbm_bo *bo, uint32_t x, uint32_t y, uint32_t wid
 	if (!bo || width == 0 || height == 0 || !stride || !map_data)
 		return NULL;
 
-	map_flags = (transfer_flags & GBM_BO_TRANSFER_READ) ? BO_MAP_READ : BO_MAP_NONE;
-	map_flags |= (transfer_flags & GBM_BO_TRANSFER_WRITE) ? BO_MAP_WRITE : BO_MAP_NONE;
+	map_flags = gbm_convert_transfer_flags(transfer_flags);
 
 	addr = drv_bo_map(bo->bo, &rect, map_flags, (struct mapping **)map_data, plane);
 	if (addr == MAP_FAILED)
@@ -426,3 +650,114 @@ PUBLIC void *gbm_bo_map2(struct gbm_bo *bo, uint32_t x, uint32_t y, uint32_t wid
 	offset += rect.x * drv_bytes_per_pixel_from_format(bo->gbm_format, plane);
 	return (void *)((uint8_t *)addr + offset);
 }
+
+PUBLIC void *gbm_bo_map_fenced(struct gbm_bo *bo, uint32_t x, uint32_t y, uint32_t width,
+			       uint32_t height, uint32_t transfer_flags, uint32_t *stride,
+			       void **map_data, int plane, int acquire_fence)
+{
+	void *addr;
+	off_t offset;
+	uint32_t map_flags;
+	struct rectangle rect = { .x = x, .y = y, .width = width, .height = height };
+	if (!bo || width == 0 || height == 0 || !stride || !map_data) {
+		if (acquire_fence >= 0)
+			close(acquire_fence);
+		return NULL;
+	}
+
+	map_flags = gbm_convert_transfer_flags(transfer_flags);
+
+	addr = drv_bo_map_fenced(bo->bo, &rect, map_flags, (struct mapping **)map_data, plane,
+				 acquire_fence);
+	if (addr == MAP_FAILED)
+		return MAP_FAILED;
+
+	*stride = ((struct mapping *)*map_data)->vma->map_strides[plane];
+
+	offset = *stride * rect.y;
+	offset += rect.x * drv_bytes_per_pixel_from_format(bo->gbm_format, plane);
+	return (void *)((uint8_t *)addr + offset);
+}
+
+PUBLIC int gbm_bo_unmap_fenced(struct gbm_bo *bo, void *map_data, int *release_fence)
+{
+	assert(bo);
+	if (!release_fence)
+		return -EINVAL;
+
+	return drv_bo_flush_or_unmap_fenced(bo->bo, map_data, release_fence);
+}
+
+PUBLIC void gbm_bo_unmap_damaged(struct gbm_bo *bo, void *map_data, uint32_t x, uint32_t y,
+				 uint32_t width, uint32_t height)
+{
+	struct rectangle rect = { .x = x, .y = y, .width = width, .height = height };
+
+	assert(bo);
+	drv_bo_mapping_mark_dirty(map_data, &rect);
+	drv_bo_flush_or_unmap(bo->bo, map_data);
+}
+
+PUBLIC int gbm_bo_sync_mappings(const struct gbm_bo_sync_op *ops, uint32_t count)
+{
+	struct drv_sync_op *drv_ops;
+	uint32_t i;
+	int ret;
+
+	if (!count)
+		return 0;
+
+	if (!ops)
+		return -EINVAL;
+
+	drv_ops = calloc(count, sizeof(*drv_ops));
+	if (!drv_ops)
+		return -ENOMEM;
+
+	for (i = 0; i < count; i++) {
+		if (!ops[i].bo || !ops[i].map_data) {
+			free(drv_ops);
+			return -EINVAL;
+		}
+
+		drv_ops[i].bo = ops[i].bo->bo;
+		drv_ops[i].mapping = ops[i].map_data;
+		drv_ops[i].flush = ops[i].flush != 0;
+	}
+
+	ret = drv_bo_sync_batch(drv_ops, count);
+	free(drv_ops);
+	return ret;
+}
+
+PUBLIC int gbm_bo_map_planes(struct gbm_bo *bo, uint32_t x, uint32_t y, uint32_t width,
+			     uint32_t height, uint32_t transfer_flags, uint32_t strides[4],
+			     void *addrs[4], void **map_data)
+{
+	int ret;
+	size_t plane, num_planes;
+	uint32_t map_flags, format;
+	struct rectangle rect = { .x = x, .y = y, .width = width, .height = height };
+	if (!bo || width == 0 || height == 0 || !strides || !addrs || !map_data)
+		return -EINVAL;
+
+	map_flags = gbm_convert_transfer_flags(transfer_flags);
+
+	ret = drv_bo_map_planes(bo->bo, &rect, map_flags, (struct mapping **)map_data, addrs,
+				strides);
+	if (ret)
+		return ret;
+
+	format = drv_bo_get_format(bo->bo);
+	num_planes = drv_bo_get_num_planes(bo->bo);
+	for (plane = 0; plane < num_planes; plane++) {
+		off_t offset = (off_t)strides[plane] *
+			       (y / drv_vertical_subsampling_from_format(format, plane));
+
+		offset += (x / drv_horizontal_subsampling_from_format(format, plane)) *
+			  drv_bytes_per_pixel_from_format(format, plane);
+		addrs[plane] = (uint8_t *)addrs[plane] + offset;
+	}
+
+	return 0;
+}
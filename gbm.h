@@ -333,12 +333,34 @@ gbm_bo_create(struct gbm_device *gbm,
               uint32_t width, uint32_t height,
               uint32_t format, uint32_t flags);
 
+/*
+ * Creates count buffers with the same properties as gbm_bo_create() would, computing the buffer
+ * layout once. Returns 0 and fills bos on success, or a negative errno and no buffers.
+ */
+int
+gbm_bo_create_array(struct gbm_device *gbm,
+                    uint32_t width, uint32_t height,
+                    uint32_t format, uint32_t flags,
+                    uint32_t count, struct gbm_bo **bos);
+
 struct gbm_bo *
 gbm_bo_create_with_modifiers(struct gbm_device *gbm,
                              uint32_t width, uint32_t height,
                              uint32_t format,
                              const uint64_t *modifiers,
                              const unsigned int count);
+
+/*
+ * Like gbm_bo_create_with_modifiers(), with the gbm_bo_flags the buffer will be used with, which
+ * help pick among the modifiers.
+ */
+struct gbm_bo *
+gbm_bo_create_with_modifiers2(struct gbm_device *gbm,
+                              uint32_t width, uint32_t height,
+                              uint32_t format,
+                              const uint64_t *modifiers,
+                              const unsigned int count,
+                              uint32_t flags);
 #define GBM_BO_IMPORT_WL_BUFFER         0x5501
 #define GBM_BO_IMPORT_EGL_IMAGE         0x5502
 #define GBM_BO_IMPORT_FD                0x5503
@@ -396,6 +418,21 @@ enum gbm_bo_transfer_flags {
     * Read/modify/write
     */
    GBM_BO_TRANSFER_READ_WRITE = (GBM_BO_TRANSFER_READ | GBM_BO_TRANSFER_WRITE),
+   /**
+    * Fault the whole buffer in at map time instead of page by page
+    * on first access. Only applies when a new mapping is created.
+    */
+   GBM_BO_TRANSFER_POPULATE   = (1 << 2),
+   /**
+    * The mapping is accessed sequentially, or randomly. Hints only.
+    */
+   GBM_BO_TRANSFER_SEQUENTIAL = (1 << 3),
+   GBM_BO_TRANSFER_RANDOM     = (1 << 4),
+   /**
+    * The whole mapped rectangle is overwritten, so its previous contents
+    * need not be read back. Only meaningful without GBM_BO_TRANSFER_READ.
+    */
+   GBM_BO_TRANSFER_DISCARD    = (1 << 5),
 };
 
 void *
@@ -473,6 +510,14 @@ gbm_surface_create_with_modifiers(struct gbm_device *gbm,
                                   const uint64_t *modifiers,
                                   const unsigned int count);
 
+struct gbm_surface *
+gbm_surface_create_with_modifiers2(struct gbm_device *gbm,
+                                   uint32_t width, uint32_t height,
+                                   uint32_t format,
+                                   const uint64_t *modifiers,
+                                   const unsigned int count,
+                                   uint32_t flags);
+
 struct gbm_bo *
 gbm_surface_lock_front_buffer(struct gbm_surface *surface);
 
@@ -485,6 +530,29 @@ gbm_surface_has_free_buffers(struct gbm_surface *surface);
 void
 gbm_surface_destroy(struct gbm_surface *surface);
 
+/*
+ * Like gbm_surface_create(), but with count (2 to 4) buffers instead of the default three.
+ * Returns NULL if count is out of range.
+ */
+struct gbm_surface *
+gbm_surface_create_with_buffer_count(struct gbm_device *gbm,
+                                     uint32_t width, uint32_t height,
+                                     uint32_t format, uint32_t flags,
+                                     uint32_t count);
+
+/*
+ * minigbm has no EGL platform to render into a surface, so clients render into its buffers
+ * themselves: gbm_surface_get_back_buffer() hands out a free buffer to render into, and
+ * gbm_surface_swap_buffer() queues it for gbm_surface_lock_front_buffer(). Queueing a buffer
+ * replaces one that was queued but not locked yet, so with three or more buffers the surface
+ * behaves like a mailbox. Returns NULL, or a negative errno, on failure.
+ */
+struct gbm_bo *
+gbm_surface_get_back_buffer(struct gbm_surface *surface);
+
+int
+gbm_surface_swap_buffer(struct gbm_surface *surface, struct gbm_bo *bo);
+
 char *
 gbm_format_get_name(uint32_t gbm_format, struct gbm_format_name_desc *desc);
 
@@ -508,6 +576,70 @@ gbm_bo_map2(struct gbm_bo *bo,
 	   uint32_t x, uint32_t y, uint32_t width, uint32_t height,
 	   uint32_t flags, uint32_t *stride, void **map_data, int plane);
 
+/**
+ * Maps every plane of the buffer object with a single mapping, which costs
+ * the same as mapping one plane with gbm_bo_map2().
+ *
+ * On success, addrs[i] and strides[i] are set for each of the
+ * gbm_bo_get_plane_count() planes, with addrs[i] pointing at the pixel (x, y)
+ * of plane i, and map_data is set for gbm_bo_unmap(). Returns 0 on success
+ * or a negative errno.
+ */
+int
+gbm_bo_map_planes(struct gbm_bo *bo,
+		  uint32_t x, uint32_t y, uint32_t width, uint32_t height,
+		  uint32_t flags, uint32_t strides[4], void *addrs[4],
+		  void **map_data);
+
+/**
+ * Explicit-sync variant of gbm_bo_map2(). The mapping is set up right away,
+ * but its contents are only read back once acquire_fence, a sync_file fd, has
+ * signaled. Takes ownership of acquire_fence; pass -1 to not wait at all.
+ */
+void *
+gbm_bo_map_fenced(struct gbm_bo *bo,
+		  uint32_t x, uint32_t y, uint32_t width, uint32_t height,
+		  uint32_t flags, uint32_t *stride, void **map_data, int plane,
+		  int acquire_fence);
+
+/**
+ * Explicit-sync variant of gbm_bo_unmap(). Where the backend can write the
+ * mapping back asynchronously, *release_fence is set to a sync_file fd owned
+ * by the caller that signals once the GPU can use the new contents. Otherwise
+ * the write back is done before returning and *release_fence is set to -1.
+ * Returns 0 on success or a negative errno.
+ */
+int
+gbm_bo_unmap_fenced(struct gbm_bo *bo, void *map_data, int *release_fence);
+
+/**
+ * Like gbm_bo_unmap(), for callers that only wrote the given rectangle (in
+ * buffer coordinates) through the mapping, such as a clock or a cursor drawn
+ * into a mapping of the whole buffer. Backends that copy the mapping back to
+ * the GPU limit the copy to it.
+ */
+void
+gbm_bo_unmap_damaged(struct gbm_bo *bo, void *map_data,
+		     uint32_t x, uint32_t y, uint32_t width, uint32_t height);
+
+/* One mapping of a gbm_bo_sync_mappings() call. */
+struct gbm_bo_sync_op {
+   struct gbm_bo *bo;
+   /* As returned by one of the map functions. */
+   void *map_data;
+   /* Non-zero to make the CPU writes visible to the GPU, zero to read back the GPU writes. */
+   int flush;
+};
+
+/**
+ * Flushes or invalidates several mappings, which stay mapped, at once. Backends
+ * that can wait for all the copies together do so, which saves a round trip
+ * per mapping on virtio-gpu. Meant for pipelines syncing many planes and
+ * streams per frame. Returns 0 on success or the first negative errno.
+ */
+int
+gbm_bo_sync_mappings(const struct gbm_bo_sync_op *ops, uint32_t count);
+
 #ifdef __cplusplus
 }
 #endif
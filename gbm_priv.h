@@ -7,6 +7,7 @@
 #ifndef GBM_PRIV_H
 #define GBM_PRIV_H
 
+#include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -18,7 +19,25 @@ struct gbm_device {
 	struct driver *drv;
 };
 
+#define GBM_SURFACE_DEFAULT_BUFFERS 3
+#define GBM_SURFACE_MAX_BUFFERS 4
+
+enum gbm_surface_buffer_state {
+	GBM_SURFACE_BUFFER_FREE,
+	/* Handed out by gbm_surface_get_back_buffer(). */
+	GBM_SURFACE_BUFFER_BACK,
+	/* Swapped, waiting for gbm_surface_lock_front_buffer(). */
+	GBM_SURFACE_BUFFER_QUEUED,
+	/* Locked as front buffer until gbm_surface_release_buffer(). */
+	GBM_SURFACE_BUFFER_LOCKED,
+};
+
+/* A fixed ring of buffers allocated once at creation and recycled between frames. */
 struct gbm_surface {
+	pthread_mutex_t lock;
+	uint32_t num_buffers;
+	struct gbm_bo *bos[GBM_SURFACE_MAX_BUFFERS];
+	enum gbm_surface_buffer_state states[GBM_SURFACE_MAX_BUFFERS];
 };
 
 struct gbm_bo {
@@ -7,9 +7,12 @@
 #ifdef DRV_I915
 
 #include <assert.h>
+#include <cpuid.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <unistd.h>
@@ -23,6 +26,37 @@
 #define I915_CACHELINE_SIZE 64
 #define I915_CACHELINE_MASK (I915_CACHELINE_SIZE - 1)
 
+#define XY_FAST_COPY_BLT ((2 << 29) | (0x42 << 22) | (10 - 2))
+#define XY_FAST_COPY_SRC_TILING(t) ((t) << 20)
+#define XY_FAST_COPY_DST_TILING(t) ((t) << 13)
+#define XY_FAST_COPY_SRC_TYPE_Y (1u << 31)
+#define XY_FAST_COPY_DST_TYPE_Y (1u << 30)
+#define XY_FAST_COPY_COLOR_DEPTH(d) ((d) << 24)
+#define MI_BATCH_BUFFER_END (0xa << 23)
+#define MI_NOOP 0
+
+/*
+ * Soft-pinned GPU addresses of the objects of a staging blit. Every staging mapping gets a slot
+ * of its own, so that concurrent blits don't fight over addresses. Within a slot the batch, the
+ * tiled BO and its staging copy are 4 GiB apart, the BOs being at most 4 GiB each. The slots
+ * start at 1 TiB, far from where Mesa's allocators place their objects.
+ */
+#define I915_BLIT_NUM_SLOTS 64
+#define I915_BLIT_SLOTS_BASE (1ull << 40)
+#define I915_BLIT_SLOT_SIZE (4ull << 32)
+#define I915_BLIT_BATCH_OFFSET 0
+#define I915_BLIT_BO_OFFSET (1ull << 32)
+#define I915_BLIT_STAGING_OFFSET (2ull << 32)
+
+#ifndef I915_GEM_DOMAIN_WC
+#define I915_GEM_DOMAIN_WC 0x80
+#endif
+
+/* CPU locks observed before a BO's own access pattern overrides the use flag heuristic. */
+#define I915_ACCESS_WARMUP_LOCKS 4
+/* The access counters are halved at this many locks, so that newer locks weigh more. */
+#define I915_ACCESS_DECAY_LOCKS 64
+
 static const uint32_t scanout_render_formats[] = { DRM_FORMAT_ABGR2101010, DRM_FORMAT_ABGR8888,
 						   DRM_FORMAT_ARGB2101010, DRM_FORMAT_ARGB8888,
 						   DRM_FORMAT_RGB565,	   DRM_FORMAT_XBGR2101010,
@@ -71,6 +105,45 @@ struct i915_device {
 	int32_t num_fences_avail;
 	bool has_mmap_offset;
 	bool is_media_compression_enabled;
+	bool has_clflushopt;
+	/* Cleared once the kernel refuses DRM_IOCTL_I915_GEM_SET_DOMAIN as a flush. */
+	bool has_set_domain_flush;
+	/* Tiled BOs can be mapped through a linear staging BO filled by the blitter. */
+	bool has_blit_staging;
+	/* Bit i is set while soft-pin slot i is used by a staging mapping. */
+	uint64_t blit_slots;
+	/* struct i915_access of each GEM handle mapped on a non-LLC platform, NULL with LLC. */
+	pthread_mutex_t access_lock;
+	void *access;
+};
+
+struct i915_vma_priv {
+	/*
+	 * Set once a flush handed the BO back to the GTT domain. The kernel doesn't track CPU
+	 * writes through the mapping after that, so later flushes use clflush until the next
+	 * invalidate.
+	 */
+	bool left_cpu_domain;
+	/* Linear copy of a tiled BO that the mapping points at instead, 0 if mapped directly. */
+	uint32_t staging_handle;
+	/* Soft-pin slot of the staging blits. */
+	uint32_t blit_slot;
+	/* The next invalidate doesn't fill the staging BO, as it is about to be overwritten. */
+	bool skip_fetch;
+	/* Mapped write-combined, so there are no CPU cachelines to flush or invalidate. */
+	bool wc;
+};
+
+/*
+ * CPU access pattern of a linear BO on a non-LLC platform, used to pick the caching of its next
+ * mapping. Kept per GEM handle, so that every import of the buffer shares it, and freed when the
+ * handle is closed. Updated with relaxed atomics since flushes and invalidates run without drv
+ * locks.
+ */
+struct i915_access {
+	uint32_t locks;
+	uint32_t read_locks;
+	uint64_t flushed_bytes;
 };
 
 static void i915_info_from_device_id(struct i915_device *i915)
@@ -222,6 +295,27 @@ static uint64_t unset_flags(uint64_t current_flags, uint64_t mask)
 	return value;
 }
 
+/*
+ * XY_FAST_COPY_BLT handles X tiling up to Gen11, legacy Y tiling until Gen12 and Tile4 from
+ * Xe_LPG on. It copies compressed surfaces as is, so CCS modifiers can't be staged.
+ */
+static bool i915_blit_supports_modifier(struct i915_device *i915, uint64_t modifier)
+{
+	if (!i915->has_blit_staging)
+		return false;
+
+	switch (modifier) {
+	case I915_FORMAT_MOD_X_TILED:
+		return i915->graphics_version < 12;
+	case I915_FORMAT_MOD_Y_TILED:
+		return !i915->is_mtl;
+	case I915_FORMAT_MOD_4_TILED:
+		return i915->is_mtl;
+	default:
+		return false;
+	}
+}
+
 static int i915_add_combinations(struct driver *drv)
 {
 	struct i915_device *i915 = drv->priv;
@@ -236,6 +330,8 @@ static int i915_add_combinations(struct driver *drv)
 	const uint64_t linear_mask = BO_USE_RENDERSCRIPT | BO_USE_LINEAR | BO_USE_SW_READ_OFTEN |
 				     BO_USE_SW_WRITE_OFTEN | BO_USE_SW_READ_RARELY |
 				     BO_USE_SW_WRITE_RARELY;
+	/* Occasional CPU access to tiled BOs goes through a blit to linear where supported. */
+	const uint64_t sw_rarely = BO_USE_SW_READ_RARELY | BO_USE_SW_WRITE_RARELY;
 
 	struct format_metadata metadata_linear = { .tiling = I915_TILING_NONE,
 						   .priority = 1,
@@ -276,20 +372,24 @@ static int i915_add_combinations(struct driver *drv)
 
 	const uint64_t render_not_linear = unset_flags(render, linear_mask);
 	const uint64_t scanout_and_render_not_linear = render_not_linear | BO_USE_SCANOUT;
+	const uint64_t staged_x = i915_blit_supports_modifier(i915, I915_FORMAT_MOD_X_TILED) ?
+				      sw_rarely : 0;
 
 	struct format_metadata metadata_x_tiled = { .tiling = I915_TILING_X,
 						    .priority = 2,
 						    .modifier = I915_FORMAT_MOD_X_TILED };
 
 	drv_add_combinations(drv, render_formats, ARRAY_SIZE(render_formats), &metadata_x_tiled,
-			     render_not_linear);
+			     render_not_linear | staged_x);
 	drv_add_combinations(drv, scanout_render_formats, ARRAY_SIZE(scanout_render_formats),
-			     &metadata_x_tiled, scanout_and_render_not_linear);
+			     &metadata_x_tiled, scanout_and_render_not_linear | staged_x);
 
 	if (i915->is_mtl) {
 		struct format_metadata metadata_4_tiled = { .tiling = I915_TILING_4,
 							    .priority = 3,
 							    .modifier = I915_FORMAT_MOD_4_TILED };
+		const uint64_t staged_4 =
+		    i915_blit_supports_modifier(i915, I915_FORMAT_MOD_4_TILED) ? sw_rarely : 0;
 /* Support tile4 NV12 and P010 for libva */
 #ifdef I915_SCANOUT_4_TILED
 		const uint64_t nv12_usage =
@@ -303,14 +403,16 @@ static int i915_add_combinations(struct driver *drv)
 		drv_add_combination(drv, DRM_FORMAT_NV12, &metadata_4_tiled, nv12_usage);
 		drv_add_combination(drv, DRM_FORMAT_P010, &metadata_4_tiled, p010_usage);
 		drv_add_combinations(drv, render_formats, ARRAY_SIZE(render_formats),
-				     &metadata_4_tiled, render_not_linear);
+				     &metadata_4_tiled, render_not_linear | staged_4);
 		drv_add_combinations(drv, scanout_render_formats,
 				     ARRAY_SIZE(scanout_render_formats), &metadata_4_tiled,
-				     scanout_and_render_not_linear);
+				     scanout_and_render_not_linear | staged_4);
 	} else {
 		struct format_metadata metadata_y_tiled = { .tiling = I915_TILING_Y,
 							    .priority = 3,
 							    .modifier = I915_FORMAT_MOD_Y_TILED };
+		const uint64_t staged_y =
+		    i915_blit_supports_modifier(i915, I915_FORMAT_MOD_Y_TILED) ? sw_rarely : 0;
 
 /* Support y-tiled NV12 and P010 for libva */
 #ifdef I915_SCANOUT_Y_TILED
@@ -324,13 +426,13 @@ static int i915_add_combinations(struct driver *drv)
 		const uint64_t p010_usage = nv12_usage;
 #endif
 		drv_add_combinations(drv, render_formats, ARRAY_SIZE(render_formats),
-				     &metadata_y_tiled, render_not_linear);
+				     &metadata_y_tiled, render_not_linear | staged_y);
 		/* Y-tiled scanout isn't available on old platforms so we add
 		 * |scanout_render_formats| without that USE flag.
 		 */
 		drv_add_combinations(drv, scanout_render_formats,
 				     ARRAY_SIZE(scanout_render_formats), &metadata_y_tiled,
-				     render_not_linear);
+				     render_not_linear | staged_y);
 		drv_add_combination(drv, DRM_FORMAT_NV12, &metadata_y_tiled, nv12_usage);
 		drv_add_combination(drv, DRM_FORMAT_P010, &metadata_y_tiled, p010_usage);
 
@@ -437,21 +539,40 @@ static int i915_align_dimensions(struct bo *bo, uint32_t format, uint32_t tiling
 	return 0;
 }
 
+static bool i915_cpu_has_clflushopt(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		return false;
+
+	return ebx & bit_CLFLUSHOPT;
+}
+
 static void i915_clflush(void *start, size_t size)
 {
-	void *p = (void *)(((uintptr_t)start) & ~I915_CACHELINE_MASK);
-	void *end = (void *)((uintptr_t)start + size);
+	uintptr_t p = ((uintptr_t)start) & ~I915_CACHELINE_MASK;
+	uintptr_t end = (uintptr_t)start + size;
 
-	__builtin_ia32_mfence();
-	while (p < end) {
-#if defined(__CLFLUSHOPT__)
-		__builtin_ia32_clflushopt(p);
-#else
-		__builtin_ia32_clflush(p);
-#endif
-		p = (void *)((uintptr_t)p + I915_CACHELINE_SIZE);
+	for (; p < end; p += I915_CACHELINE_SIZE)
+		__builtin_ia32_clflush((void *)p);
+}
+
+/* Unlike clflush, clflushopt isn't serializing, so batches of it can be in flight at once. */
+__attribute__((target("clflushopt"))) static void i915_clflushopt(void *start, size_t size)
+{
+	uintptr_t p = ((uintptr_t)start) & ~I915_CACHELINE_MASK;
+	uintptr_t end = (uintptr_t)start + size;
+
+	for (; p + 4 * I915_CACHELINE_SIZE <= end; p += 4 * I915_CACHELINE_SIZE) {
+		__builtin_ia32_clflushopt((void *)p);
+		__builtin_ia32_clflushopt((void *)(p + I915_CACHELINE_SIZE));
+		__builtin_ia32_clflushopt((void *)(p + 2 * I915_CACHELINE_SIZE));
+		__builtin_ia32_clflushopt((void *)(p + 3 * I915_CACHELINE_SIZE));
 	}
-	__builtin_ia32_mfence();
+
+	for (; p < end; p += I915_CACHELINE_SIZE)
+		__builtin_ia32_clflushopt((void *)p);
 }
 
 static int i915_init(struct driver *drv)
@@ -525,6 +646,33 @@ static int i915_init(struct driver *drv)
 	if (i915->graphics_version >= 12)
 		i915->has_hw_protection = 1;
 
+	if (!i915->has_llc) {
+		i915->has_clflushopt = i915_cpu_has_clflushopt();
+		i915->has_set_domain_flush = true;
+		/* Without the table every mapping keeps the default caching. */
+		if (!pthread_mutex_init(&i915->access_lock, NULL))
+			i915->access = drmHashCreate();
+	}
+
+	/* Staging blits soft-pin their objects at fixed addresses in a full 48 bit PPGTT. */
+	if (i915->graphics_version >= 9) {
+		int has_softpin = 0, ppgtt = 0;
+
+		memset(&get_param, 0, sizeof(get_param));
+		get_param.param = I915_PARAM_HAS_EXEC_SOFTPIN;
+		get_param.value = &has_softpin;
+		if (drmIoctl(drv->fd, DRM_IOCTL_I915_GETPARAM, &get_param))
+			has_softpin = 0;
+
+		memset(&get_param, 0, sizeof(get_param));
+		get_param.param = I915_PARAM_HAS_ALIASING_PPGTT;
+		get_param.value = &ppgtt;
+		if (drmIoctl(drv->fd, DRM_IOCTL_I915_GETPARAM, &get_param))
+			ppgtt = 0;
+
+		i915->has_blit_staging = has_softpin && ppgtt >= 3;
+	}
+
 	drv->priv = i915;
 	return i915_add_combinations(drv);
 }
@@ -616,8 +764,8 @@ static int i915_bo_compute_metadata(struct bo *bo, uint32_t width, uint32_t heig
 	bool huge_bo = (i915->graphics_version < 11) && (width > 4096);
 
 	if (modifiers) {
-		modifier =
-		    drv_pick_modifier(modifiers, count, i915->modifier.order, i915->modifier.count);
+		modifier = drv_pick_modifier(bo->drv, format, use_flags, modifiers, count,
+					     i915->modifier.order, i915->modifier.count);
 	} else {
 		struct combination *combo = drv_get_combination(bo->drv, format, use_flags);
 		if (!combo)
@@ -857,7 +1005,7 @@ static int i915_bo_create_from_metadata(struct bo *bo)
 		};
 
 		struct drm_i915_gem_create_ext create_ext = {
-			.size = bo->meta.total_size,
+			.size = drv_large_page_align(bo->drv, bo->meta.total_size),
 			.extensions = (uintptr_t)&protected_content,
 		};
 
@@ -871,7 +1019,8 @@ static int i915_bo_create_from_metadata(struct bo *bo)
 		gem_handle = create_ext.handle;
 	} else {
 		struct drm_i915_gem_create gem_create = { 0 };
-		gem_create.size = bo->meta.total_size;
+		/* Rounded objects can be backed by huge pages in the GTT and CPU mappings. */
+		gem_create.size = drv_large_page_align(bo->drv, bo->meta.total_size);
 		ret = drmIoctl(bo->drv->fd, DRM_IOCTL_I915_GEM_CREATE, &gem_create);
 		if (ret) {
 			drv_loge("DRM_IOCTL_I915_GEM_CREATE failed (size=%llu)\n", gem_create.size);
@@ -882,6 +1031,8 @@ static int i915_bo_create_from_metadata(struct bo *bo)
 	}
 
 	bo->handle.u32 = gem_handle;
+	bo->large_page_padding =
+	    drv_large_page_align(bo->drv, bo->meta.total_size) - bo->meta.total_size;
 
 	/* Set/Get tiling ioctl not supported  based on fence availability
 	   Refer : "https://patchwork.freedesktop.org/patch/325343/"
@@ -904,12 +1055,67 @@ static int i915_bo_create_from_metadata(struct bo *bo)
 	return 0;
 }
 
+/*
+ * Small linear buffers that are never scanned out or handed to fixed-function blocks can share a
+ * GEM object. Sampling and rendering need surface base addresses aligned to a page, plain
+ * buffers only to a cache line.
+ */
+static uint32_t i915_bo_suballoc_alignment(struct bo *bo)
+{
+	const uint64_t buffer_flags =
+	    BO_USE_GPU_DATA_BUFFER | BO_USE_SENSOR_DIRECT_DATA | BO_USE_SW_MASK | BO_USE_LINEAR;
+	const uint64_t surface_flags = BO_USE_TEXTURE | BO_USE_RENDERING;
+
+	if (bo->meta.tiling != I915_TILING_NONE ||
+	    bo->meta.format_modifier != DRM_FORMAT_MOD_LINEAR)
+		return 0;
+
+	if (bo->meta.use_flags & ~(buffer_flags | surface_flags))
+		return 0;
+
+	return (bo->meta.use_flags & surface_flags) ? 4096 : 64;
+}
+
 static void i915_close(struct driver *drv)
 {
-	free(drv->priv);
+	struct i915_device *i915 = drv->priv;
+	unsigned long handle;
+	void *access;
+
+	if (i915->access) {
+		while (drmHashFirst(i915->access, &handle, &access) == 1) {
+			drmHashDelete(i915->access, handle);
+			free(access);
+		}
+
+		drmHashDestroy(i915->access);
+		pthread_mutex_destroy(&i915->access_lock);
+	}
+
+	free(i915);
 	drv->priv = NULL;
 }
 
+/* Returns the access pattern of the BO's GEM handle, creating it if asked to, or NULL. */
+static struct i915_access *i915_bo_access(struct bo *bo, bool create)
+{
+	struct i915_device *i915 = bo->drv->priv;
+	struct i915_access *access = NULL;
+
+	if (!i915->access)
+		return NULL;
+
+	pthread_mutex_lock(&i915->access_lock);
+	if (drmHashLookup(i915->access, bo->handle.u32, (void **)&access) && create) {
+		access = calloc(1, sizeof(*access));
+		if (access)
+			drmHashInsert(i915->access, bo->handle.u32, access);
+	}
+	pthread_mutex_unlock(&i915->access_lock);
+
+	return access;
+}
+
 static int i915_bo_import(struct bo *bo, struct drv_import_fd_data *data)
 {
 	int ret;
@@ -941,12 +1147,335 @@ static int i915_bo_import(struct bo *bo, struct drv_import_fd_data *data)
 	return 0;
 }
 
+static int i915_bo_destroy(struct bo *bo)
+{
+	struct i915_device *i915 = bo->drv->priv;
+	struct i915_access *access;
+
+	/* The handle is about to be closed, and may be reused by another buffer. */
+	if (i915->access) {
+		pthread_mutex_lock(&i915->access_lock);
+		if (!drmHashLookup(i915->access, bo->handle.u32, (void **)&access)) {
+			drmHashDelete(i915->access, bo->handle.u32);
+			free(access);
+		}
+		pthread_mutex_unlock(&i915->access_lock);
+	}
+
+	return drv_gem_bo_destroy(bo);
+}
+
+static bool i915_bo_can_stage(struct bo *bo)
+{
+	struct i915_device *i915 = bo->drv->priv;
+
+	if (!i915_blit_supports_modifier(i915, bo->meta.format_modifier))
+		return false;
+
+	/* Pitches and coordinates are 16 bits wide, and each object gets a 4 GiB slot. */
+	if (bo->meta.width > UINT16_MAX || bo->meta.height > UINT16_MAX ||
+	    bo->meta.total_size > I915_BLIT_STAGING_OFFSET - I915_BLIT_BO_OFFSET)
+		return false;
+
+	for (size_t plane = 0; plane < bo->meta.num_planes; plane++) {
+		if (bo->meta.strides[plane] > UINT16_MAX)
+			return false;
+	}
+
+	return true;
+}
+
+static void *i915_gem_mmap_wb(struct driver *drv, uint32_t handle, size_t size, uint32_t prot)
+{
+	struct i915_device *i915 = drv->priv;
+
+	if (i915->has_mmap_offset) {
+		struct drm_i915_gem_mmap_offset gem_map = { 0 };
+
+		gem_map.handle = handle;
+		gem_map.flags = i915->has_llc ? I915_MMAP_OFFSET_WB : I915_MMAP_OFFSET_WC;
+		if (drmIoctl(drv->fd, DRM_IOCTL_I915_GEM_MMAP_OFFSET, &gem_map))
+			return MAP_FAILED;
+
+		return mmap(0, size, prot, MAP_SHARED, drv->fd, gem_map.offset);
+	} else {
+		struct drm_i915_gem_mmap gem_map = { 0 };
+
+		gem_map.handle = handle;
+		gem_map.size = size;
+		gem_map.flags = i915->has_llc ? 0 : I915_MMAP_WC;
+		if (drmIoctl(drv->fd, DRM_IOCTL_I915_GEM_MMAP, &gem_map))
+			return MAP_FAILED;
+
+		return (void *)(uintptr_t)gem_map.addr_ptr;
+	}
+}
+
+static uint32_t i915_blit_color_depth(uint32_t bytes_per_pixel)
+{
+	switch (bytes_per_pixel) {
+	case 1:
+		return 0;
+	case 2:
+		return 1;
+	case 4:
+		return 2;
+	case 8:
+		return 3;
+	default:
+		return 4;
+	}
+}
+
+/*
+ * Copies rect of every plane between the tiled BO and its linear staging BO with the blitter.
+ * The staging BO has the tiled BO's plane offsets and strides, only the layout inside the
+ * planes differs. Ordering against other users of the BOs is left to the kernel's implicit sync.
+ */
+static int i915_blit_staging(struct bo *bo, const struct i915_vma_priv *priv,
+			     const struct rectangle *rect, bool to_staging)
+{
+	int ret;
+	size_t plane;
+	uint32_t len = 0;
+	uint32_t batch[DRV_MAX_PLANES * 10 + 2];
+	struct i915_device *i915 = bo->drv->priv;
+	struct drm_i915_gem_create gem_create = { 0 };
+	struct drm_i915_gem_exec_object2 objects[3] = { { 0 } };
+	struct drm_i915_gem_execbuffer2 execbuf = { 0 };
+	uint32_t tiling = bo->meta.tiling == I915_TILING_X ? 1 : 2;
+	bool type_y = bo->meta.tiling == I915_TILING_4;
+	uint32_t src_tiling = to_staging ? tiling : 0;
+	uint32_t dst_tiling = to_staging ? 0 : tiling;
+	uint64_t slot_address = I915_BLIT_SLOTS_BASE + priv->blit_slot * I915_BLIT_SLOT_SIZE;
+
+	for (plane = 0; plane < bo->meta.num_planes; plane++) {
+		uint32_t format = bo->meta.format;
+		uint32_t hsub = drv_horizontal_subsampling_from_format(format, plane);
+		uint32_t vsub = drv_vertical_subsampling_from_format(format, plane);
+		uint32_t x1 = rect->x / hsub;
+		uint32_t y1 = rect->y / vsub;
+		uint32_t x2 = DIV_ROUND_UP(rect->x + rect->width, hsub);
+		uint32_t y2 = DIV_ROUND_UP(rect->y + rect->height, vsub);
+		/* Tiled pitches are programmed in dwords, linear ones in bytes. */
+		uint32_t tiled_pitch = bo->meta.strides[plane] / 4;
+		uint32_t linear_pitch = bo->meta.strides[plane];
+		uint64_t tiled_address =
+		    slot_address + I915_BLIT_BO_OFFSET + bo->meta.offsets[plane];
+		uint64_t linear_address =
+		    slot_address + I915_BLIT_STAGING_OFFSET + bo->meta.offsets[plane];
+		uint64_t src_address = to_staging ? tiled_address : linear_address;
+		uint64_t dst_address = to_staging ? linear_address : tiled_address;
+
+		batch[len++] = XY_FAST_COPY_BLT | XY_FAST_COPY_SRC_TILING(src_tiling) |
+			       XY_FAST_COPY_DST_TILING(dst_tiling);
+		batch[len++] = (type_y ? (to_staging ? XY_FAST_COPY_SRC_TYPE_Y
+						     : XY_FAST_COPY_DST_TYPE_Y)
+				       : 0) |
+			       XY_FAST_COPY_COLOR_DEPTH(i915_blit_color_depth(
+				   drv_bytes_per_pixel_from_format(format, plane))) |
+			       (to_staging ? linear_pitch : tiled_pitch);
+		batch[len++] = (y1 << 16) | x1;
+		batch[len++] = (y2 << 16) | x2;
+		batch[len++] = (uint32_t)dst_address;
+		batch[len++] = (uint32_t)(dst_address >> 32);
+		batch[len++] = (y1 << 16) | x1;
+		batch[len++] = to_staging ? tiled_pitch : linear_pitch;
+		batch[len++] = (uint32_t)src_address;
+		batch[len++] = (uint32_t)(src_address >> 32);
+	}
+
+	batch[len++] = MI_BATCH_BUFFER_END;
+	if (len % 2)
+		batch[len++] = MI_NOOP;
+
+	gem_create.size = sizeof(batch);
+	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_I915_GEM_CREATE, &gem_create);
+	if (ret) {
+		drv_loge("DRM_IOCTL_I915_GEM_CREATE failed (size=%llu)\n", gem_create.size);
+		return -errno;
+	}
+
+	void *batch_map = i915_gem_mmap_wb(bo->drv, gem_create.handle, gem_create.size,
+					   PROT_READ | PROT_WRITE);
+	if (batch_map == MAP_FAILED) {
+		ret = -errno;
+		goto close_batch;
+	}
+
+	memcpy(batch_map, batch, len * sizeof(*batch));
+	if (!i915->has_llc)
+		i915_clflush(batch_map, len * sizeof(*batch));
+	munmap(batch_map, gem_create.size);
+
+	objects[0].handle = bo->handle.u32;
+	objects[0].offset = slot_address + I915_BLIT_BO_OFFSET;
+	objects[0].flags = EXEC_OBJECT_PINNED | EXEC_OBJECT_SUPPORTS_48B_ADDRESS |
+			   (to_staging ? 0 : EXEC_OBJECT_WRITE);
+	objects[1].handle = priv->staging_handle;
+	objects[1].offset = slot_address + I915_BLIT_STAGING_OFFSET;
+	objects[1].flags = EXEC_OBJECT_PINNED | EXEC_OBJECT_SUPPORTS_48B_ADDRESS |
+			   (to_staging ? EXEC_OBJECT_WRITE : 0);
+	objects[2].handle = gem_create.handle;
+	objects[2].offset = slot_address + I915_BLIT_BATCH_OFFSET;
+	objects[2].flags = EXEC_OBJECT_PINNED | EXEC_OBJECT_SUPPORTS_48B_ADDRESS;
+
+	execbuf.buffers_ptr = (uintptr_t)objects;
+	execbuf.buffer_count = ARRAY_SIZE(objects);
+	execbuf.batch_len = len * sizeof(*batch);
+	execbuf.flags = I915_EXEC_BLT | I915_EXEC_NO_RELOC;
+
+	drv_trace_begin("i915 staging blit", bo);
+	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_I915_GEM_EXECBUFFER2, &execbuf);
+	drv_trace_end();
+	if (ret) {
+		drv_loge("DRM_IOCTL_I915_GEM_EXECBUFFER2 failed with %s\n", strerror(errno));
+		ret = -errno;
+	}
+
+close_batch:
+	/* The kernel keeps the batch alive until the blit retires. */
+	drv_gem_close(bo->drv, gem_create.handle);
+	return ret;
+}
+
+/* Takes a free soft-pin slot for staging blits, returns -1 if all are in use. */
+static int i915_blit_slot_get(struct i915_device *i915)
+{
+	uint64_t slots = __atomic_load_n(&i915->blit_slots, __ATOMIC_RELAXED);
+	int slot;
+
+	do {
+		if (!~slots)
+			return -1;
+
+		slot = __builtin_ctzll(~slots);
+	} while (!__atomic_compare_exchange_n(&i915->blit_slots, &slots, slots | (1ull << slot),
+					      false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+	return slot;
+}
+
+static void i915_blit_slot_put(struct i915_device *i915, uint32_t slot)
+{
+	__atomic_fetch_and(&i915->blit_slots, ~(1ull << slot), __ATOMIC_RELEASE);
+}
+
+static void *i915_bo_map_staging(struct bo *bo, struct vma *vma, uint32_t map_flags)
+{
+	struct i915_device *i915 = bo->drv->priv;
+	struct drm_i915_gem_create gem_create = { 0 };
+	struct i915_vma_priv *priv;
+	void *addr;
+	int slot;
+
+	slot = i915_blit_slot_get(i915);
+	if (slot < 0)
+		return MAP_FAILED;
+
+	priv = calloc(1, sizeof(*priv));
+	if (!priv)
+		goto put_slot;
+
+	gem_create.size = drv_large_page_align(bo->drv, bo->meta.total_size);
+	if (drmIoctl(bo->drv->fd, DRM_IOCTL_I915_GEM_CREATE, &gem_create)) {
+		drv_loge("DRM_IOCTL_I915_GEM_CREATE failed (size=%llu)\n", gem_create.size);
+		goto free_priv;
+	}
+
+	addr = i915_gem_mmap_wb(bo->drv, gem_create.handle, bo->meta.total_size,
+				drv_get_prot(map_flags));
+	if (addr == MAP_FAILED) {
+		drv_loge("i915 staging mmap failed\n");
+		drv_gem_close(bo->drv, gem_create.handle);
+		goto free_priv;
+	}
+
+	drv_memory_add(bo->drv, DRV_MEMORY_STAGING, gem_create.size);
+
+	/* The contents are copied by the invalidate, which drv_bo_map() runs next. */
+	priv->staging_handle = gem_create.handle;
+	priv->blit_slot = slot;
+	priv->skip_fetch = map_flags & BO_MAP_DISCARD;
+	/* i915_gem_mmap_wb() maps WC without LLC. */
+	priv->wc = !i915->has_llc;
+	vma->priv = priv;
+	vma->length = bo->meta.total_size;
+	/* Only the mapped rectangle is copied in either direction. */
+	vma->partial = true;
+	return addr;
+
+free_priv:
+	free(priv);
+put_slot:
+	i915_blit_slot_put(i915, slot);
+	return MAP_FAILED;
+}
+
+/*
+ * CPU reads through a WC mapping are uncached and slow, so any buffer that is read back a fair
+ * share of the time is mapped WB. Buffers that are only written are mapped WC when most of the
+ * buffer is written per lock, as clflushing it all would then cost more than the WC writes.
+ * Writes to small parts of a buffer stay WB and get those lines flushed.
+ */
+static bool i915_bo_use_wc(struct bo *bo, uint32_t map_flags)
+{
+	struct i915_device *i915 = bo->drv->priv;
+	struct i915_access *priv;
+	uint32_t locks = 0, read_locks = 0;
+	uint64_t flushed_bytes = 0;
+
+	if (i915->has_llc || bo->meta.tiling != I915_TILING_NONE)
+		return false;
+
+	priv = i915_bo_access(bo, true);
+	if (priv) {
+		locks = __atomic_load_n(&priv->locks, __ATOMIC_RELAXED);
+		read_locks = __atomic_load_n(&priv->read_locks, __ATOMIC_RELAXED);
+		flushed_bytes = __atomic_load_n(&priv->flushed_bytes, __ATOMIC_RELAXED);
+	}
+
+	if (locks < I915_ACCESS_WARMUP_LOCKS) {
+		/*
+		 * Until there is history, keep the old defaults: WB through mmap_offset, and
+		 * WC for scanout buffers through the legacy ioctl, except for the
+		 * performance-sensitive Renderscript and camera uses.
+		 */
+		if (i915->has_mmap_offset)
+			return false;
+
+		return (bo->meta.use_flags & BO_USE_SCANOUT) &&
+		       !(bo->meta.use_flags &
+			 (BO_USE_RENDERSCRIPT | BO_USE_CAMERA_READ | BO_USE_CAMERA_WRITE));
+	}
+
+	/* Halving keeps the ratios while aging out old locks; a lost race only skews them. */
+	if (locks >= I915_ACCESS_DECAY_LOCKS) {
+		__atomic_store_n(&priv->locks, locks / 2, __ATOMIC_RELAXED);
+		__atomic_store_n(&priv->read_locks, read_locks / 2, __ATOMIC_RELAXED);
+		__atomic_store_n(&priv->flushed_bytes, flushed_bytes / 2, __ATOMIC_RELAXED);
+	}
+
+	if (read_locks * 4 >= locks || ((map_flags & BO_MAP_READ) && read_locks))
+		return false;
+
+	return flushed_bytes / locks >= bo->meta.total_size / 2;
+}
+
 static void *i915_bo_map(struct bo *bo, struct vma *vma, uint32_t map_flags)
 {
 	int ret;
+	bool wc;
 	void *addr = MAP_FAILED;
 	struct i915_device *i915 = bo->drv->priv;
 
+	/* With every soft-pin slot taken, X and Y tiled BOs fall back to a GTT map. */
+	if (i915_bo_can_stage(bo)) {
+		addr = i915_bo_map_staging(bo, vma, map_flags);
+		if (addr != MAP_FAILED)
+			return addr;
+	}
+
 	if ((bo->meta.format_modifier == I915_FORMAT_MOD_Y_TILED_CCS) ||
 	    (bo->meta.format_modifier == I915_FORMAT_MOD_Y_TILED_GEN12_RC_CCS) ||
 	    (bo->meta.format_modifier == I915_FORMAT_MOD_Y_TILED_GEN12_MC_CCS) ||
@@ -954,30 +1483,23 @@ static void *i915_bo_map(struct bo *bo, struct vma *vma, uint32_t map_flags)
 	    (bo->meta.format_modifier == I915_FORMAT_MOD_4_TILED_MTL_RC_CCS))
 		return MAP_FAILED;
 
+	wc = i915_bo_use_wc(bo, map_flags);
+
 	if (bo->meta.tiling == I915_TILING_NONE) {
 		if (i915->has_mmap_offset) {
 			struct drm_i915_gem_mmap_offset gem_map = { 0 };
 			gem_map.handle = bo->handle.u32;
-			gem_map.flags = I915_MMAP_OFFSET_WB;
+			gem_map.flags = wc ? I915_MMAP_OFFSET_WC : I915_MMAP_OFFSET_WB;
 
 			/* Get the fake offset back */
 			ret = drmIoctl(bo->drv->fd, DRM_IOCTL_I915_GEM_MMAP_OFFSET, &gem_map);
 			if (ret == 0)
 				addr = mmap(0, bo->meta.total_size, drv_get_prot(map_flags),
-					    MAP_SHARED, bo->drv->fd, gem_map.offset);
+					    drv_get_mmap_flags(map_flags), bo->drv->fd,
+					    gem_map.offset);
 		} else {
 			struct drm_i915_gem_mmap gem_map = { 0 };
-			/* TODO(b/118799155): We don't seem to have a good way to
-			 * detect the use cases for which WC mapping is really needed.
-			 * The current heuristic seems overly coarse and may be slowing
-			 * down some other use cases unnecessarily.
-			 *
-			 * For now, care must be taken not to use WC mappings for
-			 * Renderscript and camera use cases, as they're
-			 * performance-sensitive. */
-			if ((bo->meta.use_flags & BO_USE_SCANOUT) &&
-			    !(bo->meta.use_flags &
-			      (BO_USE_RENDERSCRIPT | BO_USE_CAMERA_READ | BO_USE_CAMERA_WRITE)))
+			if (wc)
 				gem_map.flags = I915_MMAP_WC;
 
 			gem_map.handle = bo->handle.u32;
@@ -1007,8 +1529,8 @@ static void *i915_bo_map(struct bo *bo, struct vma *vma, uint32_t map_flags)
 			return MAP_FAILED;
 		}
 
-		addr = mmap(0, bo->meta.total_size, drv_get_prot(map_flags), MAP_SHARED,
-			    bo->drv->fd, gem_map.offset);
+		addr = mmap(0, bo->meta.total_size, drv_get_prot(map_flags),
+			    drv_get_mmap_flags(map_flags), bo->drv->fd, gem_map.offset);
 	}
 
 	if (addr == MAP_FAILED) {
@@ -1017,16 +1539,105 @@ static void *i915_bo_map(struct bo *bo, struct vma *vma, uint32_t map_flags)
 	}
 
 	vma->length = bo->meta.total_size;
+
+	if (!i915->has_llc && bo->meta.tiling == I915_TILING_NONE) {
+		struct i915_vma_priv *priv = calloc(1, sizeof(*priv));
+		if (!priv) {
+			munmap(addr, vma->length);
+			return MAP_FAILED;
+		}
+
+		priv->wc = wc;
+		vma->priv = priv;
+	}
+
 	return addr;
 }
 
+static int i915_bo_unmap(struct bo *bo, struct vma *vma)
+{
+	struct i915_vma_priv *priv = vma->priv;
+	int ret = drv_bo_munmap(bo, vma);
+
+	/* Writes were copied back by the flush, so the staging BO can just go. */
+	if (priv && priv->staging_handle) {
+		drv_gem_close(bo->drv, priv->staging_handle);
+		drv_memory_add(bo->drv, DRV_MEMORY_STAGING,
+			       -(int64_t)drv_large_page_align(bo->drv, bo->meta.total_size));
+		i915_blit_slot_put(bo->drv->priv, priv->blit_slot);
+	}
+
+	free(priv);
+	vma->priv = NULL;
+	return ret;
+}
+
+static int i915_bo_invalidate_staging(struct bo *bo, struct mapping *mapping)
+{
+	int ret;
+	struct i915_vma_priv *priv = mapping->vma->priv;
+	struct drm_i915_gem_set_domain set_domain = { 0 };
+
+	if (priv->skip_fetch) {
+		priv->skip_fetch = false;
+	} else {
+		ret = i915_blit_staging(bo, priv, &mapping->vma->rect, true);
+		if (ret)
+			return ret;
+	}
+
+	/*
+	 * Waits for the blit and makes the CPU view of the staging BO coherent, in the domain of
+	 * the mapping's caching mode.
+	 */
+	set_domain.handle = priv->staging_handle;
+	set_domain.read_domains = priv->wc ? I915_GEM_DOMAIN_WC : I915_GEM_DOMAIN_CPU;
+	if (mapping->vma->map_flags & BO_MAP_WRITE)
+		set_domain.write_domain = set_domain.read_domains;
+
+	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_I915_GEM_SET_DOMAIN, &set_domain);
+	if (ret && priv->wc) {
+		/* Kernels without the WC domain keep WC mappings coherent in the GTT domain. */
+		set_domain.read_domains = I915_GEM_DOMAIN_GTT;
+		if (set_domain.write_domain)
+			set_domain.write_domain = I915_GEM_DOMAIN_GTT;
+
+		ret = drmIoctl(bo->drv->fd, DRM_IOCTL_I915_GEM_SET_DOMAIN, &set_domain);
+	}
+	if (ret) {
+		drv_loge("DRM_IOCTL_I915_GEM_SET_DOMAIN with %d\n", ret);
+		return ret;
+	}
+
+	return 0;
+}
+
 static int i915_bo_invalidate(struct bo *bo, struct mapping *mapping)
 {
 	int ret;
 	struct drm_i915_gem_set_domain set_domain = { 0 };
+	struct i915_vma_priv *priv = mapping->vma->priv;
+
+	if (priv && priv->staging_handle)
+		return i915_bo_invalidate_staging(bo, mapping);
+
+	/* Linear mappings without LLC have a vma priv, and their access pattern is tracked. */
+	if (priv) {
+		struct i915_access *access = i915_bo_access(bo, false);
+
+		if (access) {
+			__atomic_fetch_add(&access->locks, 1, __ATOMIC_RELAXED);
+			if (mapping->vma->map_flags & BO_MAP_READ)
+				__atomic_fetch_add(&access->read_locks, 1, __ATOMIC_RELAXED);
+		}
+	}
 
 	set_domain.handle = bo->handle.u32;
-	if (bo->meta.tiling == I915_TILING_NONE) {
+	if (priv && priv->wc) {
+		set_domain.read_domains = I915_GEM_DOMAIN_WC;
+		if (mapping->vma->map_flags & BO_MAP_WRITE)
+			set_domain.write_domain = I915_GEM_DOMAIN_WC;
+	} else if (bo->meta.tiling == I915_TILING_NONE) {
 		set_domain.read_domains = I915_GEM_DOMAIN_CPU;
 		if (mapping->vma->map_flags & BO_MAP_WRITE)
 			set_domain.write_domain = I915_GEM_DOMAIN_CPU;
@@ -1037,19 +1648,111 @@ static int i915_bo_invalidate(struct bo *bo, struct mapping *mapping)
 	}
 
 	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_I915_GEM_SET_DOMAIN, &set_domain);
+	if (ret && priv && priv->wc) {
+		/* Kernels without the WC domain keep WC mappings coherent in the GTT domain. */
+		set_domain.read_domains = I915_GEM_DOMAIN_GTT;
+		if (set_domain.write_domain)
+			set_domain.write_domain = I915_GEM_DOMAIN_GTT;
+
+		ret = drmIoctl(bo->drv->fd, DRM_IOCTL_I915_GEM_SET_DOMAIN, &set_domain);
+	}
+
 	if (ret) {
 		drv_loge("DRM_IOCTL_I915_GEM_SET_DOMAIN with %d\n", ret);
 		return ret;
 	}
 
+	if (mapping->vma->priv) {
+		struct i915_vma_priv *priv = mapping->vma->priv;
+		priv->left_cpu_domain = false;
+	}
+
 	return 0;
 }
 
 static int i915_bo_flush(struct bo *bo, struct mapping *mapping)
 {
 	struct i915_device *i915 = bo->drv->priv;
-	if (!i915->has_llc && bo->meta.tiling == I915_TILING_NONE)
-		i915_clflush(mapping->vma->addr, mapping->vma->length);
+	struct i915_vma_priv *priv = mapping->vma->priv;
+	struct drv_range ranges[DRV_MAX_PLANES];
+	struct rectangle rect;
+	uint32_t num_ranges;
+	uint64_t flushed = 0;
+	struct i915_access *access;
+
+	/*
+	 * The kernel flushes the CPU caches or WC buffers of the staging BO, which is in the CPU or
+	 * WC write domain, before the blit reads it.
+	 */
+	if (priv && priv->staging_handle) {
+		if (!(mapping->vma->map_flags & BO_MAP_WRITE))
+			return 0;
+
+		rect = drv_bo_mapping_take_dirty(mapping);
+		return i915_blit_staging(bo, priv, &rect, false);
+	}
+
+	if (i915->has_llc || bo->meta.tiling != I915_TILING_NONE)
+		return 0;
+
+	/* Nothing was written through a read-only mapping, so no dirty cachelines to flush. */
+	if (!(mapping->vma->map_flags & BO_MAP_WRITE))
+		return 0;
+
+	rect = drv_bo_mapping_take_dirty(mapping);
+	num_ranges = drv_bo_rect_ranges(bo, &rect, ranges);
+
+	access = i915_bo_access(bo, false);
+	if (access) {
+		uint64_t dirty = 0;
+
+		for (uint32_t i = 0; i < num_ranges; i++)
+			dirty += ranges[i].size;
+
+		__atomic_fetch_add(&access->flushed_bytes, dirty, __ATOMIC_RELAXED);
+	}
+
+	/* Only the write-combining buffers need draining, the kernel handles the rest. */
+	if (priv->wc) {
+		__builtin_ia32_sfence();
+		return 0;
+	}
+
+	/*
+	 * When every row needs flushing, let the kernel do it while moving the BO out of the CPU
+	 * domain: it flushes the whole BO either way and knows about the CPU's flush instructions.
+	 */
+	if (rect.y == 0 && rect.height == bo->meta.height && i915->has_set_domain_flush &&
+	    !priv->left_cpu_domain) {
+		struct drm_i915_gem_set_domain set_domain = { 0 };
+
+		set_domain.handle = bo->handle.u32;
+		set_domain.read_domains = I915_GEM_DOMAIN_GTT;
+		if (!drmIoctl(bo->drv->fd, DRM_IOCTL_I915_GEM_SET_DOMAIN, &set_domain)) {
+			priv->left_cpu_domain = true;
+			return 0;
+		}
+
+		drv_logi("DRM_IOCTL_I915_GEM_SET_DOMAIN flush failed, using clflush\n");
+		i915->has_set_domain_flush = false;
+	}
+
+	drv_trace_begin("i915_clflush", bo);
+	__builtin_ia32_mfence();
+	for (uint32_t i = 0; i < num_ranges; i++) {
+		void *start = (uint8_t *)mapping->vma->addr + ranges[i].offset;
+
+		if (i915->has_clflushopt)
+			i915_clflushopt(start, ranges[i].size);
+		else
+			i915_clflush(start, ranges[i].size);
+
+		flushed += ranges[i].size;
+	}
+	__builtin_ia32_mfence();
+	drv_trace_end();
+
+	drv_stats_add(bo->drv, DRV_STATS_CLFLUSH_BYTES, flushed);
 
 	return 0;
 }
@@ -1060,10 +1763,11 @@ const struct backend backend_i915 = {
 	.close = i915_close,
 	.bo_compute_metadata = i915_bo_compute_metadata,
 	.bo_create_from_metadata = i915_bo_create_from_metadata,
-	.bo_destroy = drv_gem_bo_destroy,
+	.bo_suballoc_alignment = i915_bo_suballoc_alignment,
+	.bo_destroy = i915_bo_destroy,
 	.bo_import = i915_bo_import,
 	.bo_map = i915_bo_map,
-	.bo_unmap = drv_bo_munmap,
+	.bo_unmap = i915_bo_unmap,
 	.bo_invalidate = i915_bo_invalidate,
 	.bo_flush = i915_bo_flush,
 	.resolve_format_and_use_flags = drv_resolve_format_and_use_flags_helper,
@@ -10,7 +10,6 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
-#include <poll.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/mman.h>
@@ -57,8 +56,8 @@
 
 struct mediatek_private_map_data {
 	void *cached_addr;
+	size_t cached_size;
 	void *gem_addr;
-	int prime_fd;
 };
 
 static const uint32_t render_target_formats[] = { DRM_FORMAT_ABGR8888, DRM_FORMAT_ARGB8888,
@@ -327,7 +326,7 @@ static int mediatek_bo_create(struct bo *bo, uint32_t width, uint32_t height, ui
 
 static void *mediatek_bo_map(struct bo *bo, struct vma *vma, uint32_t map_flags)
 {
-	int ret, prime_fd;
+	int ret;
 	struct drm_mtk_gem_map_off gem_map = { 0 };
 	struct mediatek_private_map_data *priv;
 	void *addr = NULL;
@@ -340,43 +339,40 @@ static void *mediatek_bo_map(struct bo *bo, struct vma *vma, uint32_t map_flags)
 		return MAP_FAILED;
 	}
 
-	prime_fd = drv_bo_get_plane_fd(bo, 0);
-	if (prime_fd < 0) {
+	/* Exported once, then kept by the BO for the DMA_BUF_IOCTL_SYNC calls. */
+	if (drv_bo_get_dma_buf_fd(bo) < 0) {
 		drv_loge("Failed to get a prime fd\n");
 		return MAP_FAILED;
 	}
 
-	addr = mmap(0, bo->meta.total_size, drv_get_prot(map_flags), MAP_SHARED, bo->drv->fd,
-		    gem_map.offset);
+	addr = mmap(0, bo->meta.total_size, drv_get_prot(map_flags),
+		    drv_get_mmap_flags(map_flags), bo->drv->fd, gem_map.offset);
 	if (addr == MAP_FAILED)
-		goto out_close_prime_fd;
+		return MAP_FAILED;
 
 	vma->length = bo->meta.total_size;
 
-	priv = calloc(1, sizeof(*priv));
-	if (!priv)
-		goto out_unmap_addr;
-
 	if (bo->meta.use_flags & BO_USE_RENDERSCRIPT) {
-		priv->cached_addr = calloc(1, bo->meta.total_size);
+		priv = calloc(1, sizeof(*priv));
+		if (!priv)
+			goto out_unmap_addr;
+
+		priv->cached_addr =
+		    drv_shadow_get(bo->drv, bo->meta.total_size, &priv->cached_size);
 		if (!priv->cached_addr)
 			goto out_free_priv;
 
 		priv->gem_addr = addr;
+		vma->priv = priv;
 		addr = priv->cached_addr;
 	}
 
-	priv->prime_fd = prime_fd;
-	vma->priv = priv;
-
 	return addr;
 
 out_free_priv:
 	free(priv);
 out_unmap_addr:
 	munmap(addr, bo->meta.total_size);
-out_close_prime_fd:
-	close(prime_fd);
 	return MAP_FAILED;
 }
 
@@ -384,13 +380,8 @@ static int mediatek_bo_unmap(struct bo *bo, struct vma *vma)
 {
 	if (vma->priv) {
 		struct mediatek_private_map_data *priv = vma->priv;
-
-		if (priv->cached_addr) {
-			vma->addr = priv->gem_addr;
-			free(priv->cached_addr);
-		}
-
-		close(priv->prime_fd);
+		vma->addr = priv->gem_addr;
+		drv_shadow_put(bo->drv, priv->cached_addr, priv->cached_size);
 		free(priv);
 		vma->priv = NULL;
 	}
@@ -401,25 +392,16 @@ static int mediatek_bo_unmap(struct bo *bo, struct vma *vma)
 static int mediatek_bo_invalidate(struct bo *bo, struct mapping *mapping)
 {
 	struct mediatek_private_map_data *priv = mapping->vma->priv;
+	int ret;
 
-	if (priv) {
-		struct pollfd fds = {
-			.fd = priv->prime_fd,
-		};
-
-		if (mapping->vma->map_flags & BO_MAP_WRITE)
-			fds.events |= POLLOUT;
-
-		if (mapping->vma->map_flags & BO_MAP_READ)
-			fds.events |= POLLIN;
+	/* Waits for the implicit fences and invalidates the CPU caches in the mapped direction. */
+	ret = drv_bo_dma_buf_sync_start(bo, mapping->vma->map_flags);
+	if (ret)
+		return ret;
 
-		poll(&fds, 1, -1);
-		if (fds.revents != fds.events)
-			drv_loge("poll prime_fd failed\n");
-
-		if (priv->cached_addr)
-			memcpy(priv->cached_addr, priv->gem_addr, bo->meta.total_size);
-	}
+	if (priv && !(mapping->vma->map_flags & BO_MAP_DISCARD))
+		drv_bo_copy_rect(bo, &mapping->rect, priv->cached_addr, priv->gem_addr, false,
+				 false);
 
 	return 0;
 }
@@ -427,10 +409,13 @@ static int mediatek_bo_invalidate(struct bo *bo, struct mapping *mapping)
 static int mediatek_bo_flush(struct bo *bo, struct mapping *mapping)
 {
 	struct mediatek_private_map_data *priv = mapping->vma->priv;
-	if (priv && priv->cached_addr && (mapping->vma->map_flags & BO_MAP_WRITE))
-		memcpy(priv->gem_addr, priv->cached_addr, bo->meta.total_size);
+	if (priv && (mapping->vma->map_flags & BO_MAP_WRITE)) {
+		struct rectangle rect = drv_bo_mapping_take_dirty(mapping);
+		drv_bo_copy_rect(bo, &rect, priv->gem_addr, priv->cached_addr, true,
+				 mapping->vma->map_flags & BO_MAP_DISCARD);
+	}
 
-	return 0;
+	return drv_bo_dma_buf_sync_end(bo, mapping->vma->map_flags);
 }
 
 static void mediatek_resolve_format_and_use_flags(struct driver *drv, uint32_t format,
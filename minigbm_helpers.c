@@ -8,11 +8,16 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <radeon_drm.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <unistd.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
@@ -39,6 +44,41 @@ static unsigned int radeon_igp_ids[] = {
 	0x9996, 0x9997, 0x9998, 0x9999, 0x999A, 0x999B, 0x999C, 0x999D, 0x99A0, 0x99A2, 0x99A4
 };
 
+/* Version of the file format written to $MINIGBM_DEVICE_CACHE. */
+#define DEVICE_CACHE_VERSION 2
+#define DEVICE_CACHE_MAX_NODES 16
+
+/*
+ * Device discovery results for this process. The device type detect_device_info() reports is
+ * fixed for the lifetime of a device node, so it is kept per node, which is told apart from a
+ * node of a device hotplugged later by its inode and change time. Connectors come and go with
+ * DP MST, so they are always read again. The node minigbm_create_default_device() settled on is
+ * reopened directly next time, unless render nodes were added or removed since.
+ */
+struct device_cache {
+	pthread_mutex_t lock;
+	struct {
+		dev_t rdev;
+		ino_t ino;
+		time_t ctime;
+		uint32_t dev_type_flags;
+	} nodes[DEVICE_CACHE_MAX_NODES];
+	unsigned int num_nodes;
+
+	bool persisted_loaded;
+	bool has_default;
+	/* Set when the default came from the persisted cache and the driver wasn't checked yet. */
+	bool default_unverified;
+	char default_path[PATH_MAX];
+	dev_t default_rdev;
+	char default_driver[64];
+	int default_version[3];
+	/* render_nodes_signature() when the default was picked. */
+	unsigned long long default_nodes;
+};
+
+static struct device_cache device_cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
 static int dri_node_num(const char *dri_node)
 {
 	long num;
@@ -211,6 +251,304 @@ done:
 	return 0;
 }
 
+static bool device_cache_lookup(const struct stat *st, struct gbm_device_info *info)
+{
+	bool found = false;
+
+	pthread_mutex_lock(&device_cache.lock);
+	for (unsigned int i = 0; i < device_cache.num_nodes; i++) {
+		if (device_cache.nodes[i].rdev == st->st_rdev &&
+		    device_cache.nodes[i].ino == st->st_ino &&
+		    device_cache.nodes[i].ctime == st->st_ctime) {
+			info->dev_type_flags = device_cache.nodes[i].dev_type_flags;
+			found = true;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&device_cache.lock);
+
+	return found;
+}
+
+static void device_cache_insert(const struct stat *st, const struct gbm_device_info *info)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&device_cache.lock);
+	/* A node of a device that went away is replaced by whatever now has its numbers. */
+	for (i = 0; i < device_cache.num_nodes; i++) {
+		if (device_cache.nodes[i].rdev == st->st_rdev)
+			break;
+	}
+
+	if (i < DEVICE_CACHE_MAX_NODES) {
+		if (i == device_cache.num_nodes)
+			device_cache.num_nodes++;
+
+		device_cache.nodes[i].rdev = st->st_rdev;
+		device_cache.nodes[i].ino = st->st_ino;
+		device_cache.nodes[i].ctime = st->st_ctime;
+		device_cache.nodes[i].dev_type_flags = info->dev_type_flags;
+	}
+	pthread_mutex_unlock(&device_cache.lock);
+}
+
+/*
+ * detect_device_info() for an opened node, with the device type answered from the cache unless
+ * connector state was asked for. The connector count is read from the device every time.
+ */
+static int detect_device_info_cached(unsigned int detect_flags, int fd,
+				     struct gbm_device_info *info)
+{
+	drmModeResPtr resources;
+	struct stat st;
+	int ret;
+
+	if ((detect_flags & GBM_DETECT_FLAG_CONNECTED) || fstat(fd, &st) || !S_ISCHR(st.st_mode))
+		return detect_device_info(detect_flags, fd, info);
+
+	if (device_cache_lookup(&st, info)) {
+		info->connectors = 0;
+		resources = drmModeGetResources(fd);
+		if (resources) {
+			info->connectors = (unsigned int)(resources->count_connectors);
+			drmModeFreeResources(resources);
+		}
+		return 0;
+	}
+
+	ret = detect_device_info(detect_flags, fd, info);
+	if (!ret)
+		device_cache_insert(&st, info);
+
+	return ret;
+}
+
+/*
+ * Identifies the set of render nodes, so that a default device picked while it was different
+ * is picked again. Nodes are recreated, with a new inode and change time, when their device is
+ * hotplugged.
+ */
+static unsigned long long render_nodes_signature(void)
+{
+	unsigned long long signature = 0;
+	struct dirent *dir_ent;
+	struct stat st;
+	DIR *dir;
+
+	dir = opendir("/dev/dri");
+	if (!dir)
+		return 0;
+
+	/* A sum, as readdir() order is arbitrary. */
+	while ((dir_ent = readdir(dir))) {
+		unsigned long long hash;
+
+		if (strncmp(dir_ent->d_name, "renderD", 7) ||
+		    fstatat(dirfd(dir), dir_ent->d_name, &st, 0) || !S_ISCHR(st.st_mode))
+			continue;
+
+		hash = ((unsigned long long)st.st_rdev * 0x9e3779b97f4a7c15ull) ^
+		       ((unsigned long long)st.st_ino << 17) ^ (unsigned long long)st.st_ctime;
+		signature += hash * 0xff51afd7ed558ccdull;
+	}
+
+	closedir(dir);
+	return signature;
+}
+
+static const char *device_cache_file(void)
+{
+	const char *path = getenv("MINIGBM_DEVICE_CACHE");
+
+	return path && path[0] ? path : NULL;
+}
+
+/* Called with device_cache.lock held. */
+static void device_cache_load_persisted(void)
+{
+	const char *path = device_cache_file();
+	unsigned int version, major_num, minor_num;
+	FILE *file;
+
+	device_cache.persisted_loaded = true;
+	if (!path)
+		return;
+
+	file = fopen(path, "re");
+	if (!file)
+		return;
+
+	if (fscanf(file, "minigbm-device-cache %u\n", &version) == 1 &&
+	    version == DEVICE_CACHE_VERSION &&
+	    fscanf(file, "%4095s %u %u %63s %d %d %d %llx\n", device_cache.default_path,
+		   &major_num, &minor_num, device_cache.default_driver,
+		   &device_cache.default_version[0], &device_cache.default_version[1],
+		   &device_cache.default_version[2], &device_cache.default_nodes) == 8) {
+		device_cache.default_rdev = makedev(major_num, minor_num);
+		device_cache.has_default = true;
+		device_cache.default_unverified = true;
+	}
+
+	fclose(file);
+}
+
+/*
+ * Called with device_cache.lock held. Written to a temporary file first so readers never see a
+ * partial cache.
+ */
+static void device_cache_store_persisted(void)
+{
+	const char *path = device_cache_file();
+	char tmp_path[PATH_MAX];
+	FILE *file;
+	int ret;
+
+	if (!path)
+		return;
+
+	ret = snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, getpid());
+	if (ret < 0 || ret >= (int)sizeof(tmp_path))
+		return;
+
+	file = fopen(tmp_path, "we");
+	if (!file)
+		return;
+
+	ret = fprintf(file, "minigbm-device-cache %u\n%s %u %u %s %d %d %d %llx\n",
+		      DEVICE_CACHE_VERSION, device_cache.default_path,
+		      major(device_cache.default_rdev), minor(device_cache.default_rdev),
+		      device_cache.default_driver, device_cache.default_version[0],
+		      device_cache.default_version[1], device_cache.default_version[2],
+		      device_cache.default_nodes);
+	if (fclose(file) || ret < 0 || rename(tmp_path, path))
+		unlink(tmp_path);
+}
+
+static bool driver_matches(int fd, const char *name, const int version[3])
+{
+	drmVersionPtr drm_version = drmGetVersion(fd);
+	bool matches;
+
+	if (!drm_version)
+		return false;
+
+	matches = !strcmp(drm_version->name, name) && drm_version->version_major == version[0] &&
+		  drm_version->version_minor == version[1] &&
+		  drm_version->version_patchlevel == version[2];
+	drmFreeVersion(drm_version);
+	return matches;
+}
+
+/* Remembers the node behind fd as the default device, in this process and on disk. */
+static void device_cache_set_default(int fd)
+{
+	char fd_path[64];
+	char node_path[PATH_MAX];
+	drmVersionPtr drm_version;
+	unsigned long long nodes;
+	ssize_t len;
+	struct stat st;
+
+	snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", fd);
+	len = readlink(fd_path, node_path, sizeof(node_path) - 1);
+	if (len <= 0 || fstat(fd, &st) || !S_ISCHR(st.st_mode))
+		return;
+	node_path[len] = '\0';
+
+	drm_version = drmGetVersion(fd);
+	if (!drm_version)
+		return;
+
+	nodes = render_nodes_signature();
+
+	pthread_mutex_lock(&device_cache.lock);
+	strcpy(device_cache.default_path, node_path);
+	device_cache.default_nodes = nodes;
+	device_cache.default_rdev = st.st_rdev;
+	snprintf(device_cache.default_driver, sizeof(device_cache.default_driver), "%s",
+		 drm_version->name);
+	device_cache.default_version[0] = drm_version->version_major;
+	device_cache.default_version[1] = drm_version->version_minor;
+	device_cache.default_version[2] = drm_version->version_patchlevel;
+	device_cache.has_default = true;
+	device_cache.default_unverified = false;
+	device_cache_store_persisted();
+	pthread_mutex_unlock(&device_cache.lock);
+
+	drmFreeVersion(drm_version);
+}
+
+/*
+ * Opens the cached default device, checking that the node still is the same device and that no
+ * render node was hotplugged since it was picked, which could make another device the default.
+ * A node from the persisted cache also needs the same driver version, as a rebuilt kernel may
+ * enumerate devices differently.
+ */
+static struct gbm_device *device_cache_open_default(int *out_fd)
+{
+	char path[PATH_MAX];
+	char driver[64];
+	int version[3];
+	bool unverified;
+	unsigned long long nodes;
+	dev_t rdev;
+	struct stat st;
+	struct gbm_device *gbm;
+	int fd;
+
+	pthread_mutex_lock(&device_cache.lock);
+	if (!device_cache.persisted_loaded)
+		device_cache_load_persisted();
+
+	if (!device_cache.has_default) {
+		pthread_mutex_unlock(&device_cache.lock);
+		return NULL;
+	}
+
+	strcpy(path, device_cache.default_path);
+	strcpy(driver, device_cache.default_driver);
+	memcpy(version, device_cache.default_version, sizeof(version));
+	unverified = device_cache.default_unverified;
+	rdev = device_cache.default_rdev;
+	nodes = device_cache.default_nodes;
+	pthread_mutex_unlock(&device_cache.lock);
+
+	if (render_nodes_signature() != nodes)
+		goto invalidate;
+
+	fd = open(path, O_RDWR | O_CLOEXEC | O_NOCTTY | O_NONBLOCK);
+	if (fd < 0)
+		goto invalidate;
+
+	if (fstat(fd, &st) || st.st_rdev != rdev ||
+	    (unverified && !driver_matches(fd, driver, version)))
+		goto close_fd;
+
+	gbm = gbm_create_device(fd);
+	if (!gbm)
+		goto close_fd;
+
+	/* Only primary nodes can hold DRM master, see try_drm_devices(). */
+	if (drmIsMaster(fd))
+		drmDropMaster(fd);
+
+	pthread_mutex_lock(&device_cache.lock);
+	device_cache.default_unverified = false;
+	pthread_mutex_unlock(&device_cache.lock);
+
+	*out_fd = fd;
+	return gbm;
+
+close_fd:
+	close(fd);
+invalidate:
+	pthread_mutex_lock(&device_cache.lock);
+	device_cache.has_default = false;
+	pthread_mutex_unlock(&device_cache.lock);
+	return NULL;
+}
+
 static int gbm_get_default_device_fd(void)
 {
 	DIR *dir;
@@ -242,7 +580,7 @@ static int gbm_get_default_device_fd(void)
 			continue;
 
 		memset(&info, 0, sizeof(info));
-		if (detect_device_info(0, fd, &info) < 0) {
+		if (detect_device_info_cached(0, fd, &info) < 0) {
 			close(fd);
 			fd = -1;
 			continue;
@@ -289,7 +627,7 @@ PUBLIC int gbm_detect_device_info(unsigned int detect_flags, int fd, struct gbm_
 		return -EINVAL;
 	memset(info, 0, sizeof(*info));
 	info->dri_node_num = fd_node_num(fd);
-	return detect_device_info(detect_flags, fd, info);
+	return detect_device_info_cached(detect_flags, fd, info);
 }
 
 PUBLIC int gbm_detect_device_info_path(unsigned int detect_flags, const char *dev_node,
@@ -309,7 +647,7 @@ PUBLIC int gbm_detect_device_info_path(unsigned int detect_flags, const char *de
 	fd = open(rendernode_name, O_RDWR | O_CLOEXEC | O_NOCTTY | O_NONBLOCK);
 	if (fd < 0)
 		return -errno;
-	ret = detect_device_info(detect_flags, fd, info);
+	ret = detect_device_info_cached(detect_flags, fd, info);
 	close(fd);
 	return ret;
 }
@@ -351,11 +689,17 @@ PUBLIC struct gbm_device *minigbm_create_default_device(int *out_fd)
 	int dev_count;
 	int fd;
 
+	/* A device found before, by this process or one sharing $MINIGBM_DEVICE_CACHE. */
+	gbm = device_cache_open_default(out_fd);
+	if (gbm)
+		return gbm;
+
 	/* try gbm_get_default_device_fd first */
 	fd = gbm_get_default_device_fd();
 	if (fd >= 0) {
 		gbm = gbm_create_device(fd);
 		if (gbm) {
+			device_cache_set_default(fd);
 			*out_fd = fd;
 			return gbm;
 		}
@@ -371,5 +715,8 @@ PUBLIC struct gbm_device *minigbm_create_default_device(int *out_fd)
 
 	drmFreeDevices(devs, dev_count);
 
+	if (gbm)
+		device_cache_set_default(*out_fd);
+
 	return gbm;
 }
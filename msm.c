@@ -323,8 +323,8 @@ static int msm_bo_create_with_modifiers(struct bo *bo, uint32_t width, uint32_t
 		DRM_FORMAT_MOD_LINEAR,
 	};
 
-	uint64_t modifier =
-	    drv_pick_modifier(modifiers, count, modifier_order, ARRAY_SIZE(modifier_order));
+	uint64_t modifier = drv_pick_modifier(bo->drv, format, bo->meta.use_flags, modifiers, count,
+					      modifier_order, ARRAY_SIZE(modifier_order));
 
 	if (!bo->drv->compression && modifier == DRM_FORMAT_MOD_QCOM_COMPRESSED)
 		modifier = DRM_FORMAT_MOD_LINEAR;
@@ -362,8 +362,8 @@ static void *msm_bo_map(struct bo *bo, struct vma *vma, uint32_t map_flags)
 	}
 	vma->length = bo->meta.total_size;
 
-	return mmap(0, bo->meta.total_size, drv_get_prot(map_flags), MAP_SHARED, bo->drv->fd,
-		    req.offset);
+	return mmap(0, bo->meta.total_size, drv_get_prot(map_flags),
+		    drv_get_mmap_flags(map_flags), bo->drv->fd, req.offset);
 }
 
 const struct backend backend_msm = {
@@ -25,6 +25,7 @@
 
 struct rockchip_private_map_data {
 	void *cached_addr;
+	size_t cached_size;
 	void *gem_addr;
 };
 
@@ -210,8 +211,8 @@ static void *rockchip_bo_map(struct bo *bo, struct vma *vma, uint32_t map_flags)
 		return MAP_FAILED;
 	}
 
-	addr = mmap(0, bo->meta.total_size, drv_get_prot(map_flags), MAP_SHARED, bo->drv->fd,
-		    gem_map.offset);
+	addr = mmap(0, bo->meta.total_size, drv_get_prot(map_flags),
+		    drv_get_mmap_flags(map_flags), bo->drv->fd, gem_map.offset);
 	if (addr == MAP_FAILED)
 		return MAP_FAILED;
 
@@ -222,7 +223,8 @@ static void *rockchip_bo_map(struct bo *bo, struct vma *vma, uint32_t map_flags)
 		if (!priv)
 			goto out_unmap_addr;
 
-		priv->cached_addr = calloc(1, bo->meta.total_size);
+		priv->cached_addr =
+		    drv_shadow_get(bo->drv, bo->meta.total_size, &priv->cached_size);
 		if (!priv->cached_addr)
 			goto out_free_priv;
 
@@ -245,7 +247,7 @@ static int rockchip_bo_unmap(struct bo *bo, struct vma *vma)
 	if (vma->priv) {
 		struct rockchip_private_map_data *priv = vma->priv;
 		vma->addr = priv->gem_addr;
-		free(priv->cached_addr);
+		drv_shadow_put(bo->drv, priv->cached_addr, priv->cached_size);
 		free(priv);
 		vma->priv = NULL;
 	}
@@ -255,10 +257,20 @@ static int rockchip_bo_unmap(struct bo *bo, struct vma *vma)
 
 static int rockchip_bo_invalidate(struct bo *bo, struct mapping *mapping)
 {
-	if (mapping->vma->priv) {
-		struct rockchip_private_map_data *priv = mapping->vma->priv;
-		memcpy(priv->cached_addr, priv->gem_addr, bo->meta.total_size);
-	}
+	struct rockchip_private_map_data *priv = mapping->vma->priv;
+	int ret;
+
+	if (!priv)
+		return 0;
+
+	/* Don't copy into the shadow while the GPU may still be writing the BO. */
+	ret = drv_bo_dma_buf_sync_start(bo, mapping->vma->map_flags);
+	if (ret)
+		return ret;
+
+	if (!(mapping->vma->map_flags & BO_MAP_DISCARD))
+		drv_bo_copy_rect(bo, &mapping->rect, priv->cached_addr, priv->gem_addr, false,
+				 false);
 
 	return 0;
 }
@@ -266,10 +278,17 @@ static int rockchip_bo_invalidate(struct bo *bo, struct mapping *mapping)
 static int rockchip_bo_flush(struct bo *bo, struct mapping *mapping)
 {
 	struct rockchip_private_map_data *priv = mapping->vma->priv;
-	if (priv && (mapping->vma->map_flags & BO_MAP_WRITE))
-		memcpy(priv->gem_addr, priv->cached_addr, bo->meta.total_size);
 
-	return 0;
+	if (!priv)
+		return 0;
+
+	if (mapping->vma->map_flags & BO_MAP_WRITE) {
+		struct rectangle rect = drv_bo_mapping_take_dirty(mapping);
+		drv_bo_copy_rect(bo, &rect, priv->gem_addr, priv->cached_addr, true,
+				 mapping->vma->map_flags & BO_MAP_DISCARD);
+	}
+
+	return drv_bo_dma_buf_sync_end(bo, mapping->vma->map_flags);
 }
 
 const struct backend backend_rockchip = {
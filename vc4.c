@@ -99,7 +99,8 @@ static int vc4_bo_create_with_modifiers(struct bo *bo, uint32_t width, uint32_t
 	};
 	uint64_t modifier;
 
-	modifier = drv_pick_modifier(modifiers, count, modifier_order, ARRAY_SIZE(modifier_order));
+	modifier = drv_pick_modifier(bo->drv, format, bo->meta.use_flags, modifiers, count,
+				     modifier_order, ARRAY_SIZE(modifier_order));
 
 	return vc4_bo_create_for_modifier(bo, width, height, format, modifier);
 }
@@ -117,8 +118,8 @@ static void *vc4_bo_map(struct bo *bo, struct vma *vma, uint32_t map_flags)
 	}
 
 	vma->length = bo->meta.total_size;
-	return mmap(NULL, bo->meta.total_size, drv_get_prot(map_flags), MAP_SHARED, bo->drv->fd,
-		    bo_map.offset);
+	return mmap(NULL, bo->meta.total_size, drv_get_prot(map_flags),
+		    drv_get_mmap_flags(map_flags), bo->drv->fd, bo_map.offset);
 }
 
 const struct backend backend_vc4 = {
@@ -30,6 +30,12 @@ struct virtgpu_param params[] = {
 	PARAM(VIRTGPU_PARAM_RESOURCE_SYNC),	   PARAM(VIRTGPU_PARAM_GUEST_VRAM),
 };
 
+void virtgpu_get_host_key(uint32_t key[param_max])
+{
+	for (uint32_t i = 0; i < param_max; i++)
+		key[i] = params[i].value;
+}
+
 extern const struct backend virtgpu_virgl;
 extern const struct backend virtgpu_cross_domain;
 
@@ -23,3 +23,13 @@ enum virtgpu_param_id {
 	param_guest_vram,
 	param_max,
 };
+
+/* Directory for host state persisted across processes, unset to disable persistence. */
+#ifdef __ANDROID__
+#define MINIGBM_LAYOUT_CACHE_DIR "vendor.minigbm.layout_cache_dir"
+#else
+#define MINIGBM_LAYOUT_CACHE_DIR "MINIGBM_LAYOUT_CACHE_DIR"
+#endif
+
+/* Copies the parameter values the host reported, which key the state persisted for it. */
+void virtgpu_get_host_key(uint32_t key[param_max]);
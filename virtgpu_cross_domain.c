@@ -5,6 +5,8 @@
  */
 
 #include <errno.h>
+#include <limits.h>
+#include <stdio.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <xf86drm.h>
@@ -19,6 +21,8 @@
 #define CAPSET_CROSS_DOMAIN 5
 #define CAPSET_CROSS_FAKE 30
 
+#define MAX_CACHED_LAYOUTS 128
+
 static const uint32_t scanout_render_formats[] = { DRM_FORMAT_ABGR8888, DRM_FORMAT_ARGB8888,
 						   DRM_FORMAT_RGB565, DRM_FORMAT_XBGR8888,
 						   DRM_FORMAT_XRGB8888 };
@@ -35,8 +39,9 @@ extern struct virtgpu_param params[];
 struct cross_domain_private {
 	uint32_t ring_handle;
 	void *ring_addr;
-	struct drv_array *metadata_cache;
-	pthread_mutex_t metadata_cache_lock;
+	struct drv_layout_cache metadata_cache;
+	/* The host writes every query reply to the start of the ring, so queries are serialized. */
+	pthread_mutex_t ring_lock;
 	bool mt8183_camera_quirk_;
 };
 
@@ -59,10 +64,8 @@ static void cross_domain_release_private(struct driver *drv)
 		}
 	}
 
-	if (priv->metadata_cache)
-		drv_array_destroy(priv->metadata_cache);
-
-	pthread_mutex_destroy(&priv->metadata_cache_lock);
+	drv_layout_cache_destroy(&priv->metadata_cache);
+	pthread_mutex_destroy(&priv->ring_lock);
 
 	free(priv);
 }
@@ -118,17 +121,22 @@ static int cross_domain_submit_cmd(struct driver *drv, uint32_t *cmd, uint32_t c
 		exec.num_bo_handles = 1;
 	}
 
+	drv_stats_add(drv, DRV_STATS_HOST_ROUND_TRIPS, 1);
+	drv_trace_begin("cross_domain submit", NULL);
 	ret = drmIoctl(drv->fd, DRM_IOCTL_VIRTGPU_EXECBUFFER, &exec);
 	if (ret < 0) {
+		drv_trace_end();
 		drv_loge("DRM_IOCTL_VIRTGPU_EXECBUFFER failed with %s\n", strerror(errno));
 		return -EINVAL;
 	}
 
+	drv_stats_add(drv, DRV_STATS_HOST_ROUND_TRIPS, 1);
 	ret = -EAGAIN;
 	while (ret == -EAGAIN) {
 		wait_3d.handle = priv->ring_handle;
 		ret = drmIoctl(drv->fd, DRM_IOCTL_VIRTGPU_WAIT, &wait_3d);
 	}
+	drv_trace_end();
 
 	if (ret < 0) {
 		drv_loge("DRM_IOCTL_VIRTGPU_WAIT failed with %s\n", strerror(errno));
@@ -138,34 +146,34 @@ static int cross_domain_submit_cmd(struct driver *drv, uint32_t *cmd, uint32_t c
 	return 0;
 }
 
-static bool metadata_equal(struct bo_metadata *current, struct bo_metadata *cached)
+static bool cross_domain_metadata_cache_lookup(struct cross_domain_private *priv,
+					       struct bo_metadata *metadata)
 {
-	if ((current->width == cached->width) && (current->height == cached->height) &&
-	    (current->format == cached->format) && (current->use_flags == cached->use_flags))
-		return true;
-	return false;
+	return drv_layout_cache_lookup(&priv->metadata_cache, metadata->width, metadata->height,
+				       metadata->format, metadata->use_flags, metadata);
 }
 
 static int cross_domain_metadata_query(struct driver *drv, struct bo_metadata *metadata)
 {
 	int ret = 0;
-	struct bo_metadata *cached_data = NULL;
 	struct cross_domain_private *priv = drv->priv;
 	struct CrossDomainGetImageRequirements cmd_get_reqs;
 	uint32_t *addr = (uint32_t *)priv->ring_addr;
 	uint32_t plane, remaining_size;
 
-	memset(&cmd_get_reqs, 0, sizeof(cmd_get_reqs));
-	pthread_mutex_lock(&priv->metadata_cache_lock);
-	for (uint32_t i = 0; i < drv_array_size(priv->metadata_cache); i++) {
-		cached_data = (struct bo_metadata *)drv_array_at_idx(priv->metadata_cache, i);
-		if (!metadata_equal(metadata, cached_data))
-			continue;
+	if (cross_domain_metadata_cache_lookup(priv, metadata))
+		return 0;
 
-		memcpy(metadata, cached_data, sizeof(*cached_data));
+	/*
+	 * No cache lock is held across the host round-trip, so cache hits for other
+	 * bo_create() calls aren't blocked by this query. Concurrent misses still queue on the
+	 * ring lock; the cache is checked again under it in case the same query just completed.
+	 */
+	drv_stats_mutex_lock(drv, &priv->ring_lock, DRV_STATS_BACKEND_LOCK_WAIT_NS);
+	if (cross_domain_metadata_cache_lookup(priv, metadata))
 		goto out_unlock;
-	}
 
+	memset(&cmd_get_reqs, 0, sizeof(cmd_get_reqs));
 	cmd_get_reqs.hdr.cmd = CROSS_DOMAIN_CMD_GET_IMAGE_REQUIREMENTS;
 	cmd_get_reqs.hdr.cmd_size = sizeof(struct CrossDomainGetImageRequirements);
 
@@ -175,13 +183,6 @@ static int cross_domain_metadata_query(struct driver *drv, struct bo_metadata *m
 	    (metadata->format == DRM_FORMAT_YVU420_ANDROID) ? DRM_FORMAT_YVU420 : metadata->format;
 	cmd_get_reqs.flags = metadata->use_flags;
 
-	/*
-	 * It is possible to avoid blocking other bo_create() calls by unlocking before
-	 * cross_domain_submit_cmd() and re-locking afterwards.  However, that would require
-	 * another scan of the metadata cache before drv_array_append in case two bo_create() calls
-	 * do the same metadata query.  Until cross_domain functionality is more widely tested,
-	 * leave this optimization out for now.
-	 */
 	ret = cross_domain_submit_cmd(drv, (uint32_t *)&cmd_get_reqs, cmd_get_reqs.hdr.cmd_size,
 				      true);
 	if (ret < 0)
@@ -206,10 +207,12 @@ static int cross_domain_metadata_query(struct driver *drv, struct bo_metadata *m
 	}
 
 	metadata->sizes[plane - 1] = remaining_size;
-	drv_array_append(priv->metadata_cache, metadata);
+
+	drv_layout_cache_insert(&priv->metadata_cache, metadata->width, metadata->height,
+				metadata->format, metadata->use_flags, metadata);
 
 out_unlock:
-	pthread_mutex_unlock(&priv->metadata_cache_lock);
+	pthread_mutex_unlock(&priv->ring_lock);
 	return ret;
 }
 
@@ -241,6 +244,10 @@ static int cross_domain_init(struct driver *drv)
 
 	struct CrossDomainInit cmd_init;
 	struct CrossDomainCapabilities cross_domain_caps;
+	uint32_t host_key[param_max];
+	char snapshot_path[PATH_MAX];
+	const char *dir;
+	bool snapshot_loaded = false;
 
 	memset(&cmd_init, 0, sizeof(cmd_init));
 	if (!params[param_context_init].value)
@@ -260,29 +267,45 @@ static int cross_domain_init(struct driver *drv)
 	if (!priv)
 		return -ENOMEM;
 
-	ret = pthread_mutex_init(&priv->metadata_cache_lock, NULL);
+	ret = pthread_mutex_init(&priv->ring_lock, NULL);
 	if (ret) {
 		free(priv);
 		return ret;
 	}
 
-	priv->metadata_cache = drv_array_init(sizeof(struct bo_metadata));
-	if (!priv->metadata_cache) {
-		ret = -ENOMEM;
-		goto free_private;
+	ret = drv_layout_cache_init(&priv->metadata_cache, MAX_CACHED_LAYOUTS);
+	if (ret) {
+		pthread_mutex_destroy(&priv->ring_lock);
+		free(priv);
+		return ret;
 	}
 
 	priv->ring_addr = MAP_FAILED;
 	drv->priv = priv;
 
-	args.cap_set_id = CAPSET_CROSS_DOMAIN;
-	args.size = sizeof(struct CrossDomainCapabilities);
-	args.addr = (unsigned long long)&cross_domain_caps;
+	/*
+	 * The capset and the combinations only depend on the host, so they are optionally
+	 * snapshotted for later processes. The context and the ring are per process.
+	 */
+	virtgpu_get_host_key(host_key);
+	dir = drv_get_os_option(MINIGBM_LAYOUT_CACHE_DIR);
+	if (dir) {
+		snprintf(snapshot_path, sizeof(snapshot_path), "%s/cross_domain_caps", dir);
+		snapshot_loaded = !drv_caps_snapshot_load(drv, snapshot_path, host_key,
+							  sizeof(host_key), &cross_domain_caps,
+							  sizeof(cross_domain_caps));
+	}
 
-	ret = drmIoctl(drv->fd, DRM_IOCTL_VIRTGPU_GET_CAPS, &args);
-	if (ret) {
-		drv_loge("DRM_IOCTL_VIRTGPU_GET_CAPS failed with %s\n", strerror(errno));
-		goto free_private;
+	if (!snapshot_loaded) {
+		args.cap_set_id = CAPSET_CROSS_DOMAIN;
+		args.size = sizeof(struct CrossDomainCapabilities);
+		args.addr = (unsigned long long)&cross_domain_caps;
+
+		ret = drmIoctl(drv->fd, DRM_IOCTL_VIRTGPU_GET_CAPS, &args);
+		if (ret) {
+			drv_loge("DRM_IOCTL_VIRTGPU_GET_CAPS failed with %s\n", strerror(errno));
+			goto free_private;
+		}
 	}
 
 	// When 3D features are avilable, but the host does not support external memory, fall back
@@ -350,10 +373,26 @@ static int cross_domain_init(struct driver *drv)
 	priv->mt8183_camera_quirk_ = name && !strcmp(name, "kukui");
 
 	// minigbm bookkeeping
-	add_combinations(drv);
+	if (!snapshot_loaded) {
+		add_combinations(drv);
+
+		if (dir) {
+			ret = drv_caps_snapshot_store(drv, snapshot_path, host_key,
+						      sizeof(host_key), &cross_domain_caps,
+						      sizeof(cross_domain_caps));
+			if (ret)
+				drv_logi("Not snapshotting caps to %s: %s\n", snapshot_path,
+					 strerror(-ret));
+		}
+	}
+
 	return 0;
 
 free_private:
+	/* Leave no restored combinations behind for the next backend that is tried. */
+	while (drv_array_size(drv->combos))
+		drv_array_remove(drv->combos, drv_array_size(drv->combos) - 1);
+
 	cross_domain_release_private(drv);
 	return ret;
 }
@@ -427,8 +466,8 @@ static void *cross_domain_bo_map(struct bo *bo, struct vma *vma, uint32_t map_fl
 	}
 
 	vma->length = bo->meta.total_size;
-	return mmap(0, bo->meta.total_size, drv_get_prot(map_flags), MAP_SHARED, bo->drv->fd,
-		    gem_map.offset);
+	return mmap(0, bo->meta.total_size, drv_get_prot(map_flags),
+		    drv_get_mmap_flags(map_flags), bo->drv->fd, gem_map.offset);
 }
 
 static void cross_domain_resolve_format_and_use_flags(struct driver *drv, uint32_t format,
@@ -467,6 +506,13 @@ static void cross_domain_resolve_format_and_use_flags(struct driver *drv, uint32
 	}
 }
 
+static void cross_domain_get_memory_info(struct driver *drv, struct drv_memory_info *info)
+{
+	struct cross_domain_private *priv = drv->priv;
+
+	info->bytes[DRV_MEMORY_BACKEND_CACHES] += drv_layout_cache_get_size(&priv->metadata_cache);
+}
+
 const struct backend virtgpu_cross_domain = {
 	.name = "virtgpu_cross_domain",
 	.init = cross_domain_init,
@@ -477,4 +523,5 @@ const struct backend virtgpu_cross_domain = {
 	.bo_map = cross_domain_bo_map,
 	.bo_unmap = drv_bo_munmap,
 	.resolve_format_and_use_flags = cross_domain_resolve_format_and_use_flags,
+	.get_memory_info = cross_domain_get_memory_info,
 };
@@ -7,6 +7,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
 #include <stdatomic.h>
 #include <stdint.h>
@@ -53,23 +54,32 @@ static const uint32_t texture_source_formats[] = {
 
 extern struct virtgpu_param params[];
 
-struct virgl_blob_metadata_cache {
-	struct lru_entry entry;
-	struct bo_metadata meta;
-};
-
-#define lru_entry_to_metadata(entry) ((struct virgl_blob_metadata_cache *)(void *)(entry))
-
 #define MAX_CACHED_FORMATS 128
 
+#ifdef __ANDROID__
+#define MINIGBM_VIRGL_ZERO_COPY "vendor.minigbm.virgl_zero_copy"
+#else
+#define MINIGBM_VIRGL_ZERO_COPY "MINIGBM_VIRGL_ZERO_COPY"
+#endif
+
 struct virgl_priv {
 	int caps_is_v2;
 	union virgl_caps caps;
 	int host_gbm_enabled;
+	/*
+	 * Put SW-accessed buffers in mappable blobs that the guest accesses in place. Invalidate
+	 * and flush then don't transfer, so CPU access is only ordered against the GPU and video
+	 * devices by the acquire and release fences passed to lock and unlock.
+	 */
+	bool zero_copy;
 	atomic_int next_blob_id;
 
 	pthread_mutex_t host_blob_format_lock;
-	struct lru virgl_blob_metadata_cache;
+	struct drv_layout_cache virgl_blob_metadata_cache;
+
+	/* Host resource handle of each GEM handle that transfer commands were submitted for. */
+	pthread_mutex_t res_handle_lock;
+	void *res_handles;
 };
 
 static uint32_t translate_format(uint32_t drm_fourcc)
@@ -529,8 +539,8 @@ static void *virgl_3d_bo_map(struct bo *bo, struct vma *vma, uint32_t map_flags)
 	}
 
 	vma->length = bo->meta.total_size;
-	return mmap(0, bo->meta.total_size, drv_get_prot(map_flags), MAP_SHARED, bo->drv->fd,
-		    gem_map.offset);
+	return mmap(0, bo->meta.total_size, drv_get_prot(map_flags),
+		    drv_get_mmap_flags(map_flags), bo->drv->fd, gem_map.offset);
 }
 
 static uint32_t virgl_3d_get_max_texture_2d_size(struct driver *drv)
@@ -595,22 +605,40 @@ static void virgl_init_params_and_caps(struct driver *drv)
 	}
 }
 
-static int virgl_init(struct driver *drv)
+/*
+ * Blob layouts only depend on the host renderer, so they are optionally persisted to skip the
+ * probe allocation in later processes.
+ */
+static void virgl_attach_layout_cache_file(struct driver *drv)
 {
-	struct virgl_priv *priv;
+	int ret;
+	char path[PATH_MAX];
+	const char *dir = drv_get_os_option(MINIGBM_LAYOUT_CACHE_DIR);
+	struct virgl_priv *priv = (struct virgl_priv *)drv->priv;
+	struct {
+		union virgl_caps caps;
+		int caps_is_v2;
+		int host_gbm_enabled;
+	} host_key;
 
-	priv = calloc(1, sizeof(*priv));
-	if (!priv)
-		return -ENOMEM;
+	if (!dir || !params[param_resource_blob].value)
+		return;
 
-	int ret = pthread_mutex_init(&priv->host_blob_format_lock, NULL);
-	if (ret)
-		return ret;
+	memset(&host_key, 0, sizeof(host_key));
+	host_key.caps = priv->caps;
+	host_key.caps_is_v2 = priv->caps_is_v2;
+	host_key.host_gbm_enabled = priv->host_gbm_enabled;
 
-	drv->priv = priv;
-	lru_init(&priv->virgl_blob_metadata_cache, MAX_CACHED_FORMATS);
+	snprintf(path, sizeof(path), "%s/virgl_blob_layouts", dir);
+	ret = drv_layout_cache_attach_file(&priv->virgl_blob_metadata_cache, path, &host_key,
+					   sizeof(host_key));
+	if (ret)
+		drv_logi("Not persisting blob layouts to %s: %s\n", path, strerror(-ret));
+}
 
-	virgl_init_params_and_caps(drv);
+static int virgl_init_combinations(struct driver *drv)
+{
+	struct virgl_priv *priv = (struct virgl_priv *)drv->priv;
 
 	if (params[param_3d].value) {
 		/* This doesn't mean host can scanout everything, it just means host
@@ -687,12 +715,138 @@ static int virgl_init(struct driver *drv)
 	return drv_modify_linear_combinations(drv);
 }
 
+
+/*
+ * The caps and the combinations built from them only depend on the host, so they are optionally
+ * snapshotted for later processes to skip the capset fetch and the combination checks.
+ */
+struct virgl_caps_snapshot {
+	union virgl_caps caps;
+	int caps_is_v2;
+	int host_gbm_enabled;
+};
+
+static int virgl_load_caps_snapshot(struct driver *drv, const char *path)
+{
+	int ret;
+	uint32_t host_key[param_max];
+	struct virgl_caps_snapshot snapshot;
+	struct virgl_priv *priv = (struct virgl_priv *)drv->priv;
+
+	virtgpu_get_host_key(host_key);
+	ret = drv_caps_snapshot_load(drv, path, host_key, sizeof(host_key), &snapshot,
+				     sizeof(snapshot));
+	if (ret)
+		return ret;
+
+	priv->caps = snapshot.caps;
+	priv->caps_is_v2 = snapshot.caps_is_v2;
+	priv->host_gbm_enabled = snapshot.host_gbm_enabled;
+	return 0;
+}
+
+static void virgl_store_caps_snapshot(struct driver *drv, const char *path)
+{
+	int ret;
+	uint32_t host_key[param_max];
+	struct virgl_caps_snapshot snapshot;
+	struct virgl_priv *priv = (struct virgl_priv *)drv->priv;
+
+	memset(&snapshot, 0, sizeof(snapshot));
+	snapshot.caps = priv->caps;
+	snapshot.caps_is_v2 = priv->caps_is_v2;
+	snapshot.host_gbm_enabled = priv->host_gbm_enabled;
+
+	virtgpu_get_host_key(host_key);
+	ret = drv_caps_snapshot_store(drv, path, host_key, sizeof(host_key), &snapshot,
+				      sizeof(snapshot));
+	if (ret)
+		drv_logi("Not snapshotting caps to %s: %s\n", path, strerror(-ret));
+}
+
+static int virgl_init(struct driver *drv)
+{
+	struct virgl_priv *priv;
+
+	priv = calloc(1, sizeof(*priv));
+	if (!priv)
+		return -ENOMEM;
+
+	int ret = pthread_mutex_init(&priv->host_blob_format_lock, NULL);
+	if (ret) {
+		free(priv);
+		return ret;
+	}
+
+	ret = drv_layout_cache_init(&priv->virgl_blob_metadata_cache, MAX_CACHED_FORMATS);
+	if (ret) {
+		pthread_mutex_destroy(&priv->host_blob_format_lock);
+		free(priv);
+		return ret;
+	}
+
+	priv->res_handles = drmHashCreate();
+	if (!priv->res_handles || pthread_mutex_init(&priv->res_handle_lock, NULL)) {
+		if (priv->res_handles)
+			drmHashDestroy(priv->res_handles);
+		drv_layout_cache_destroy(&priv->virgl_blob_metadata_cache);
+		pthread_mutex_destroy(&priv->host_blob_format_lock);
+		free(priv);
+		return -ENOMEM;
+	}
+
+	drv->priv = priv;
+
+	const char *zero_copy = drv_get_os_option(MINIGBM_VIRGL_ZERO_COPY);
+	priv->zero_copy = zero_copy && strtoul(zero_copy, NULL, 0);
+
+	char path[PATH_MAX];
+	const char *dir = drv_get_os_option(MINIGBM_LAYOUT_CACHE_DIR);
+	if (dir)
+		snprintf(path, sizeof(path), "%s/virgl_caps", dir);
+
+	if (!dir || virgl_load_caps_snapshot(drv, path)) {
+		virgl_init_params_and_caps(drv);
+		ret = virgl_init_combinations(drv);
+		if (ret) {
+			/* virtgpu_init() tries the next backend, which must not see this one's. */
+			drmHashDestroy(priv->res_handles);
+			pthread_mutex_destroy(&priv->res_handle_lock);
+			drv_layout_cache_destroy(&priv->virgl_blob_metadata_cache);
+			pthread_mutex_destroy(&priv->host_blob_format_lock);
+			free(priv);
+			drv->priv = NULL;
+			return ret;
+		}
+
+		if (dir)
+			virgl_store_caps_snapshot(drv, path);
+	}
+
+	virgl_attach_layout_cache_file(drv);
+	return 0;
+}
+
 static void virgl_close(struct driver *drv)
 {
+	struct virgl_priv *priv = (struct virgl_priv *)drv->priv;
+
+	drv_layout_cache_destroy(&priv->virgl_blob_metadata_cache);
+	pthread_mutex_destroy(&priv->host_blob_format_lock);
+	drmHashDestroy(priv->res_handles);
+	pthread_mutex_destroy(&priv->res_handle_lock);
 	free(drv->priv);
 	drv->priv = NULL;
 }
 
+static void virgl_get_memory_info(struct driver *drv, struct drv_memory_info *info)
+{
+	struct virgl_priv *priv = (struct virgl_priv *)drv->priv;
+
+	info->bytes[DRV_MEMORY_BACKEND_CACHES] +=
+	    drv_layout_cache_get_size(&priv->virgl_blob_metadata_cache);
+}
+
 static uint32_t blob_flags_from_use_flags(uint32_t use_flags)
 {
 	uint32_t blob_flags = VIRTGPU_BLOB_FLAG_USE_SHAREABLE;
@@ -706,17 +860,6 @@ static uint32_t blob_flags_from_use_flags(uint32_t use_flags)
 	return blob_flags;
 }
 
-static bool virgl_blob_metadata_eq(struct lru_entry *entry, void *data)
-{
-	struct virgl_blob_metadata_cache *e = lru_entry_to_metadata(entry);
-	struct bo_metadata *meta = data;
-	uint32_t virgl_format1 = translate_format(e->meta.format);
-	uint32_t virgl_format2 = translate_format(meta->format);
-
-	return e->meta.height == meta->height && e->meta.width == meta->width &&
-	       e->meta.use_flags == meta->use_flags && virgl_format1 == virgl_format2;
-}
-
 static int virgl_blob_do_create(struct driver *drv, uint32_t width, uint32_t height,
 				uint32_t use_flags, uint32_t virgl_format, uint32_t total_size,
 				uint32_t *bo_handle)
@@ -765,14 +908,20 @@ static int virgl_blob_do_create(struct driver *drv, uint32_t width, uint32_t hei
 // this value before allocating a buffer to ensure that the full host buffer is actually
 // visible to the guest.
 //
-// Note that we can't reuse these test buffers as actual allocations because our guess for
-// total_size is insufficient if width!=stride or padding!=0.
-static int virgl_blob_get_host_format(struct driver *drv, struct bo_metadata *meta)
+// The probe buffer is created with a guessed total_size, which is insufficient if
+// width!=stride or padding!=0. When the guess turns out to be large enough and out_handle is
+// given, the probe is handed back as the actual allocation instead of being closed, so that a
+// cache miss doesn't cost a second host allocation. *out_handle is 0 otherwise.
+static int virgl_blob_get_host_format(struct driver *drv, struct bo_metadata *meta,
+				      uint32_t *out_handle)
 {
 	struct virgl_priv *priv = (struct virgl_priv *)drv->priv;
 	int num_planes = drv_num_planes_from_format(meta->format);
 
-	pthread_mutex_lock(&priv->host_blob_format_lock);
+	if (out_handle)
+		*out_handle = 0;
+
+	drv_stats_mutex_lock(drv, &priv->host_blob_format_lock, DRV_STATS_BACKEND_LOCK_WAIT_NS);
 	if (meta->format == DRM_FORMAT_R8) {
 		meta->offsets[0] = 0;
 		meta->sizes[0] = meta->width;
@@ -780,12 +929,12 @@ static int virgl_blob_get_host_format(struct driver *drv, struct bo_metadata *me
 		meta->total_size = meta->width;
 	} else {
 		uint32_t virgl_format = translate_format(meta->format);
-		struct virgl_blob_metadata_cache *entry;
-
-		entry = lru_entry_to_metadata(
-		    lru_find(&priv->virgl_blob_metadata_cache, virgl_blob_metadata_eq, meta));
+		struct bo_metadata cached;
 
-		if (!entry) {
+		// Keyed on the virgl format, DRM formats sharing one have the same host layout.
+		if (!drv_layout_cache_lookup(&priv->virgl_blob_metadata_cache, meta->width,
+					     meta->height, virgl_format, meta->use_flags,
+					     &cached)) {
 			uint32_t total_size = 0;
 			for (int i = 0; i < num_planes; i++) {
 				uint32_t stride =
@@ -793,6 +942,7 @@ static int virgl_blob_get_host_format(struct driver *drv, struct bo_metadata *me
 				total_size +=
 				    drv_size_from_format(meta->format, stride, meta->height, i);
 			}
+			total_size = ALIGN(total_size, PAGE_SIZE);
 
 			uint32_t handle;
 			int ret =
@@ -809,41 +959,41 @@ static int virgl_blob_get_host_format(struct driver *drv, struct bo_metadata *me
 			int info_ret =
 			    drmIoctl(drv->fd, DRM_IOCTL_VIRTGPU_RESOURCE_INFO_CROS, &info);
 
-			struct drm_gem_close gem_close = { 0 };
-			gem_close.handle = handle;
-			int close_ret = drmIoctl(drv->fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
-			if (close_ret)
-				drv_loge("DRM_IOCTL_GEM_CLOSE failed (handle=%x) error %d\n",
-					 handle, close_ret);
-
 			if (info_ret) {
-				pthread_mutex_unlock(&priv->host_blob_format_lock);
 				drv_loge("Getting resource info failed with %s\n", strerror(errno));
+				drv_gem_close(drv, handle);
+				pthread_mutex_unlock(&priv->host_blob_format_lock);
 				return info_ret;
 			}
 
-			entry = calloc(1, sizeof(*entry));
-			entry->meta = *meta;
+			cached = *meta;
 
 			for (int i = 0; i < num_planes; i++) {
-				entry->meta.strides[i] = info.strides[i];
-				entry->meta.sizes[i] =
+				cached.strides[i] = info.strides[i];
+				cached.sizes[i] =
 				    info.strides[i] *
 				    drv_height_from_format(meta->format, meta->height, i);
-				entry->meta.offsets[i] = info.offsets[i];
+				cached.offsets[i] = info.offsets[i];
 			}
-			entry->meta.total_size =
-			    entry->meta.offsets[num_planes - 1] + entry->meta.sizes[num_planes - 1];
-			entry->meta.format_modifier = info.format_modifier;
-
-			lru_insert(&priv->virgl_blob_metadata_cache, &entry->entry);
+			cached.total_size =
+			    cached.offsets[num_planes - 1] + cached.sizes[num_planes - 1];
+			cached.format_modifier = info.format_modifier;
+
+			drv_layout_cache_insert(&priv->virgl_blob_metadata_cache, meta->width,
+						meta->height, virgl_format, meta->use_flags,
+						&cached);
+
+			if (out_handle && ALIGN(cached.total_size, PAGE_SIZE) <= total_size)
+				*out_handle = handle;
+			else
+				drv_gem_close(drv, handle);
 		}
 
-		memcpy(meta->offsets, entry->meta.offsets, sizeof(meta->offsets));
-		memcpy(meta->sizes, entry->meta.sizes, sizeof(meta->sizes));
-		memcpy(meta->strides, entry->meta.strides, sizeof(meta->strides));
-		meta->total_size = entry->meta.total_size;
-		meta->format_modifier = entry->meta.format_modifier;
+		memcpy(meta->offsets, cached.offsets, sizeof(meta->offsets));
+		memcpy(meta->sizes, cached.sizes, sizeof(meta->sizes));
+		memcpy(meta->strides, cached.strides, sizeof(meta->strides));
+		meta->total_size = cached.total_size;
+		meta->format_modifier = cached.format_modifier;
 	}
 	pthread_mutex_unlock(&priv->host_blob_format_lock);
 
@@ -859,12 +1009,18 @@ static int virgl_bo_create_blob(struct driver *drv, struct bo *bo)
 	uint32_t virgl_format = translate_format(bo->meta.format);
 	uint32_t bo_handle;
 
-	virgl_blob_get_host_format(drv, &bo->meta);
-	ret = virgl_blob_do_create(drv, bo->meta.width, bo->meta.height, bo->meta.use_flags,
-				   virgl_format, bo->meta.total_size, &bo_handle);
+	ret = virgl_blob_get_host_format(drv, &bo->meta, &bo_handle);
 	if (ret)
 		return ret;
 
+	if (!bo_handle) {
+		ret = virgl_blob_do_create(drv, bo->meta.width, bo->meta.height,
+					   bo->meta.use_flags, virgl_format, bo->meta.total_size,
+					   &bo_handle);
+		if (ret)
+			return ret;
+	}
+
 	bo->handle.u32 = bo_handle;
 
 	return 0;
@@ -876,7 +1032,8 @@ static bool should_use_blob(struct driver *drv, uint32_t format, uint64_t use_fl
 
 	// TODO(gurchetansingh): remove once all minigbm users are blob-safe
 #ifndef VIRTIO_GPU_NEXT
-	return false;
+	if (!priv->zero_copy)
+		return false;
 #endif
 
 	// Only use blob when host gbm is available
@@ -894,17 +1051,29 @@ static bool should_use_blob(struct driver *drv, uint32_t format, uint64_t use_fl
 		// Formats with strictly defined strides are supported
 		return true;
 	case DRM_FORMAT_ABGR8888:
-		// Formats used with frequent software reads are supported as long as they
-		// will not be used by non-GPU hardware.
-		return (use_flags & BO_USE_SW_READ_OFTEN) && !(use_flags & BO_USE_NON_GPU_HW);
+	case DRM_FORMAT_ARGB8888:
+	case DRM_FORMAT_XBGR8888:
+	case DRM_FORMAT_XRGB8888:
+		// Formats will not be used by non-GPU hardware, as the host layout is only
+		// known to match what the GPU expects. Without zero copy mode only formats
+		// used with frequent software reads use blobs.
+		if (use_flags & BO_USE_NON_GPU_HW)
+			return false;
+		if (priv->zero_copy)
+			return true;
+		return format == DRM_FORMAT_ABGR8888 && (use_flags & BO_USE_SW_READ_OFTEN);
+	case DRM_FORMAT_YVU420:
 	case DRM_FORMAT_YVU420_ANDROID:
 	case DRM_FORMAT_NV12:
 		// Zero copy buffers are exposed for guest software access via a persistent
 		// mapping, with no flush/invalidate messages. However, the virtio-video
 		// device relies transfers to/from the host waiting on implicit fences in
 		// the host kernel to synchronize with hardware output. As such, we can only
-		// use zero copy if the guest doesn't need software access.
-		return (use_flags & BO_USE_SW_MASK) == 0;
+		// use zero copy if the guest doesn't need software access, unless zero copy
+		// mode is enabled and the guest synchronizes through explicit fences.
+		if (priv->zero_copy)
+			return true;
+		return format != DRM_FORMAT_YVU420 && (use_flags & BO_USE_SW_MASK) == 0;
 	default:
 		return false;
 	}
@@ -940,8 +1109,15 @@ static int virgl_bo_create_with_modifiers(struct bo *bo, uint32_t width, uint32_
 
 static int virgl_bo_destroy(struct bo *bo)
 {
-	if (params[param_3d].value)
+	struct virgl_priv *priv = (struct virgl_priv *)bo->drv->priv;
+
+	if (params[param_3d].value) {
+		/* The kernel may hand the GEM handle out again for another resource. */
+		pthread_mutex_lock(&priv->res_handle_lock);
+		drmHashDelete(priv->res_handles, bo->handle.u32);
+		pthread_mutex_unlock(&priv->res_handle_lock);
 		return drv_gem_bo_destroy(bo);
+	}
 	else
 		return drv_dumb_bo_destroy(bo);
 }
@@ -984,16 +1160,131 @@ static bool is_arc_screen_capture_bo(struct bo *bo)
 	return strstr(tmp, "ARC-SCREEN-CAP");
 }
 
-static int virgl_bo_invalidate(struct bo *bo, struct mapping *mapping)
+/*
+ * Transfers with more than one box (emulated planar formats) can be encoded as TRANSFER3D
+ * commands in a single submission, instead of one transfer ioctl and host exit per box.
+ */
+static bool virgl_can_batch_transfers(struct driver *drv,
+				      const struct virtio_transfers_params *xfer_params)
+{
+	struct virgl_priv *priv = (struct virgl_priv *)drv->priv;
+
+	return xfer_params->xfers_needed > 1 && priv->caps_is_v2 &&
+	       (priv->caps.v2.capability_bits & VIRGL_CAP_TRANSFER);
+}
+
+/* Looks the host resource handle of a GEM handle up, querying the kernel only the first time. */
+static int virgl_get_res_handle(struct driver *drv, uint32_t bo_handle, uint32_t *res_handle)
+{
+	int ret;
+	void *value;
+	struct virgl_priv *priv = (struct virgl_priv *)drv->priv;
+	struct drm_virtgpu_resource_info res_info = { 0 };
+
+	pthread_mutex_lock(&priv->res_handle_lock);
+	ret = drmHashLookup(priv->res_handles, bo_handle, &value);
+	pthread_mutex_unlock(&priv->res_handle_lock);
+	if (!ret) {
+		*res_handle = (uint32_t)(uintptr_t)value;
+		return 0;
+	}
+
+	res_info.bo_handle = bo_handle;
+	ret = drmIoctl(drv->fd, DRM_IOCTL_VIRTGPU_RESOURCE_INFO, &res_info);
+	if (ret) {
+		drv_loge("DRM_IOCTL_VIRTGPU_RESOURCE_INFO failed with %s\n", strerror(errno));
+		return -errno;
+	}
+
+	pthread_mutex_lock(&priv->res_handle_lock);
+	if (drmHashLookup(priv->res_handles, bo_handle, &value))
+		drmHashInsert(priv->res_handles, bo_handle, (void *)(uintptr_t)res_info.res_handle);
+	pthread_mutex_unlock(&priv->res_handle_lock);
+
+	*res_handle = res_info.res_handle;
+	return 0;
+}
+
+static int virgl_submit_transfers(struct bo *bo, uint32_t bo_handle, uint32_t direction,
+				  uint32_t level, uint32_t offset,
+				  const struct virtio_transfers_params *xfer_params)
 {
 	int ret;
 	size_t i;
-	struct drm_virtgpu_3d_transfer_from_host xfer = { 0 };
+	uint32_t *cmd;
+	uint32_t res_handle;
+	uint32_t cmd_buf[DRV_MAX_PLANES * (VIRGL_TRANSFER3D_SIZE + 1)] = { 0 };
+	struct drm_virtgpu_execbuffer exec = { 0 };
+
+	ret = virgl_get_res_handle(bo->drv, bo_handle, &res_handle);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < xfer_params->xfers_needed; i++) {
+		// Same fields the kernel forwards for the transfer ioctls.
+		cmd = &cmd_buf[i * (VIRGL_TRANSFER3D_SIZE + 1)];
+		cmd[0] = VIRGL_CMD0(VIRGL_CCMD_TRANSFER3D, 0, VIRGL_TRANSFER3D_SIZE);
+		cmd[VIRGL_RESOURCE_IW_RES_HANDLE] = res_handle;
+		cmd[VIRGL_RESOURCE_IW_LEVEL] = level;
+		cmd[VIRGL_RESOURCE_IW_X] = xfer_params->xfer_boxes[i].x;
+		cmd[VIRGL_RESOURCE_IW_Y] = xfer_params->xfer_boxes[i].y;
+		cmd[VIRGL_RESOURCE_IW_W] = xfer_params->xfer_boxes[i].width;
+		cmd[VIRGL_RESOURCE_IW_H] = xfer_params->xfer_boxes[i].height;
+		cmd[VIRGL_RESOURCE_IW_D] = 1;
+		cmd[VIRGL_TRANSFER3D_DATA_OFFSET] = offset;
+		cmd[VIRGL_TRANSFER3D_DIRECTION] = direction;
+	}
+
+	exec.command = (uint64_t)&cmd_buf[0];
+	exec.size = xfer_params->xfers_needed * (VIRGL_TRANSFER3D_SIZE + 1) * sizeof(uint32_t);
+	exec.bo_handles = (uint64_t)&bo_handle;
+	exec.num_bo_handles = 1;
+
+	drv_stats_add(bo->drv, DRV_STATS_HOST_ROUND_TRIPS, 1);
+	drv_trace_begin("virgl transfers", bo);
+	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_EXECBUFFER, &exec);
+	drv_trace_end();
+	if (ret) {
+		drv_loge("DRM_IOCTL_VIRTGPU_EXECBUFFER failed with %s\n", strerror(errno));
+		return -errno;
+	}
+
+	return 0;
+}
+
+/* Waits for the queued host work on the resource to complete. */
+static int virgl_wait_resource(struct bo *bo, uint32_t handle)
+{
+	int ret;
 	struct drm_virtgpu_3d_wait waitcmd = { 0 };
+
+	waitcmd.handle = handle;
+	drv_stats_add(bo->drv, DRV_STATS_HOST_ROUND_TRIPS, 1);
+	drv_trace_begin("virgl WAIT", bo);
+	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_WAIT, &waitcmd);
+	drv_trace_end();
+	if (ret) {
+		drv_loge("DRM_IOCTL_VIRTGPU_WAIT failed with %s\n", strerror(errno));
+		return -errno;
+	}
+
+	return 0;
+}
+
+/*
+ * Queues the transfers that fetch the host's contents of the mapping. out_wait is set if they
+ * have to complete before the CPU reads the mapping.
+ */
+static int virgl_bo_invalidate_submit(struct bo *bo, struct mapping *mapping, bool *out_wait)
+{
+	int ret;
+	size_t i;
+	struct drm_virtgpu_3d_transfer_from_host xfer = { 0 };
 	struct virtio_transfers_params xfer_params;
 	struct virgl_priv *priv = (struct virgl_priv *)bo->drv->priv;
 	uint64_t host_write_flags;
 
+	*out_wait = false;
 	if (!params[param_3d].value)
 		return 0;
 
@@ -1057,43 +1348,92 @@ static int virgl_bo_invalidate(struct bo *bo, struct mapping *mapping)
 		virgl_get_emulated_transfers_params(bo, &mapping->rect, &xfer_params);
 	}
 
-	for (i = 0; i < xfer_params.xfers_needed; i++) {
-		xfer.box.x = xfer_params.xfer_boxes[i].x;
-		xfer.box.y = xfer_params.xfer_boxes[i].y;
-		xfer.box.w = xfer_params.xfer_boxes[i].width;
-		xfer.box.h = xfer_params.xfer_boxes[i].height;
-		xfer.box.d = 1;
-
-		ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_TRANSFER_FROM_HOST, &xfer);
-		if (ret) {
-			drv_loge("DRM_IOCTL_VIRTGPU_TRANSFER_FROM_HOST failed with %s\n",
-				 strerror(errno));
-			return -errno;
+	if (virgl_can_batch_transfers(bo->drv, &xfer_params)) {
+		ret = virgl_submit_transfers(bo, xfer.bo_handle, VIRGL_TRANSFER_FROM_HOST,
+					     xfer.level, xfer.offset, &xfer_params);
+		if (ret)
+			return ret;
+	} else {
+		for (i = 0; i < xfer_params.xfers_needed; i++) {
+			xfer.box.x = xfer_params.xfer_boxes[i].x;
+			xfer.box.y = xfer_params.xfer_boxes[i].y;
+			xfer.box.w = xfer_params.xfer_boxes[i].width;
+			xfer.box.h = xfer_params.xfer_boxes[i].height;
+			xfer.box.d = 1;
+
+			drv_stats_add(bo->drv, DRV_STATS_HOST_ROUND_TRIPS, 1);
+			drv_trace_begin("virgl TRANSFER_FROM_HOST", bo);
+			ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_TRANSFER_FROM_HOST, &xfer);
+			drv_trace_end();
+			if (ret) {
+				drv_loge("DRM_IOCTL_VIRTGPU_TRANSFER_FROM_HOST failed with %s\n",
+					 strerror(errno));
+				return -errno;
+			}
 		}
 	}
 
 	// The transfer needs to complete before invalidate returns so that any host changes
 	// are visible and to ensure the host doesn't overwrite subsequent guest changes.
 	// TODO(b/136733358): Support returning fences from transfers
-	waitcmd.handle = mapping->vma->handle;
-	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_WAIT, &waitcmd);
+	*out_wait = true;
+	return 0;
+}
+
+static int virgl_bo_invalidate(struct bo *bo, struct mapping *mapping)
+{
+	bool wait;
+	int ret;
+
+	ret = virgl_bo_invalidate_submit(bo, mapping, &wait);
+	if (ret || !wait)
+		return ret;
+
+	return virgl_wait_resource(bo, mapping->vma->handle);
+}
+
+/*
+ * Submits an empty command buffer that references the resources and returns a sync_file fd which
+ * signals once all previously queued work on them has completed.
+ */
+static int virgl_submit_fence(struct driver *drv, const uint32_t *handles, uint32_t num_handles,
+			      int *out_fence)
+{
+	int ret;
+	struct drm_virtgpu_execbuffer exec = { 0 };
+
+	exec.flags = VIRTGPU_EXECBUF_FENCE_FD_OUT;
+	exec.bo_handles = (uint64_t)handles;
+	exec.num_bo_handles = num_handles;
+	exec.fence_fd = -1;
+
+	drv_stats_add(drv, DRV_STATS_HOST_ROUND_TRIPS, 1);
+	drv_trace_begin("virgl fence", NULL);
+	ret = drmIoctl(drv->fd, DRM_IOCTL_VIRTGPU_EXECBUFFER, &exec);
+	drv_trace_end();
 	if (ret) {
-		drv_loge("DRM_IOCTL_VIRTGPU_WAIT failed with %s\n", strerror(errno));
+		drv_logd("DRM_IOCTL_VIRTGPU_EXECBUFFER fence failed with %s\n", strerror(errno));
 		return -errno;
 	}
 
+	*out_fence = exec.fence_fd;
 	return 0;
 }
 
-static int virgl_bo_flush(struct bo *bo, struct mapping *mapping)
+/*
+ * Queues the transfers that copy the writes through the mapping to the host. out_wait is set if
+ * they have to complete before the flush may return.
+ */
+static int virgl_bo_flush_submit(struct bo *bo, struct mapping *mapping, bool *out_wait)
 {
 	int ret;
 	size_t i;
 	struct drm_virtgpu_3d_transfer_to_host xfer = { 0 };
-	struct drm_virtgpu_3d_wait waitcmd = { 0 };
 	struct virtio_transfers_params xfer_params;
 	struct virgl_priv *priv = (struct virgl_priv *)bo->drv->priv;
+	struct rectangle rect;
 
+	*out_wait = false;
 	if (!params[param_3d].value)
 		return 0;
 
@@ -1103,17 +1443,20 @@ static int virgl_bo_flush(struct bo *bo, struct mapping *mapping)
 	if (params[param_resource_blob].value && (bo->meta.tiling & VIRTGPU_BLOB_FLAG_USE_MAPPABLE))
 		return 0;
 
+	// Only transfer what was reported as written, if anything was.
+	rect = drv_bo_mapping_take_dirty(mapping);
+
 	xfer.bo_handle = mapping->vma->handle;
 
-	if (mapping->rect.x || mapping->rect.y) {
+	if (rect.x || rect.y) {
 		/*
 		 * virglrenderer uses the box parameters and assumes that offset == 0 for planar
 		 * images
 		 */
 		if (bo->meta.num_planes == 1) {
 			xfer.offset =
-			    (bo->meta.strides[0] * mapping->rect.y) +
-			    drv_bytes_per_pixel_from_format(bo->meta.format, 0) * mapping->rect.x;
+			    (bo->meta.strides[0] * rect.y) +
+			    drv_bytes_per_pixel_from_format(bo->meta.format, 0) * rect.x;
 		}
 	}
 
@@ -1125,44 +1468,128 @@ static int virgl_bo_flush(struct bo *bo, struct mapping *mapping)
 
 	if (virgl_supports_combination_natively(bo->drv, bo->meta.format, bo->meta.use_flags)) {
 		xfer_params.xfers_needed = 1;
-		xfer_params.xfer_boxes[0] = mapping->rect;
+		xfer_params.xfer_boxes[0] = rect;
 	} else {
 		assert(virgl_supports_combination_through_emulation(bo->drv, bo->meta.format,
 								    bo->meta.use_flags));
 
-		virgl_get_emulated_transfers_params(bo, &mapping->rect, &xfer_params);
+		virgl_get_emulated_transfers_params(bo, &rect, &xfer_params);
 	}
 
-	for (i = 0; i < xfer_params.xfers_needed; i++) {
-		xfer.box.x = xfer_params.xfer_boxes[i].x;
-		xfer.box.y = xfer_params.xfer_boxes[i].y;
-		xfer.box.w = xfer_params.xfer_boxes[i].width;
-		xfer.box.h = xfer_params.xfer_boxes[i].height;
-		xfer.box.d = 1;
-
-		ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_TRANSFER_TO_HOST, &xfer);
-		if (ret) {
-			drv_loge("DRM_IOCTL_VIRTGPU_TRANSFER_TO_HOST failed with %s\n",
-				 strerror(errno));
-			return -errno;
+	if (virgl_can_batch_transfers(bo->drv, &xfer_params)) {
+		ret = virgl_submit_transfers(bo, xfer.bo_handle, VIRGL_TRANSFER_TO_HOST, xfer.level,
+					     xfer.offset, &xfer_params);
+		if (ret)
+			return ret;
+	} else {
+		for (i = 0; i < xfer_params.xfers_needed; i++) {
+			xfer.box.x = xfer_params.xfer_boxes[i].x;
+			xfer.box.y = xfer_params.xfer_boxes[i].y;
+			xfer.box.w = xfer_params.xfer_boxes[i].width;
+			xfer.box.h = xfer_params.xfer_boxes[i].height;
+			xfer.box.d = 1;
+
+			drv_stats_add(bo->drv, DRV_STATS_HOST_ROUND_TRIPS, 1);
+			drv_trace_begin("virgl TRANSFER_TO_HOST", bo);
+			ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_TRANSFER_TO_HOST, &xfer);
+			drv_trace_end();
+			if (ret) {
+				drv_loge("DRM_IOCTL_VIRTGPU_TRANSFER_TO_HOST failed with %s\n",
+					 strerror(errno));
+				return -errno;
+			}
 		}
 	}
 
 	// If the buffer is only accessed by the host GPU, then the flush is ordered
 	// with subsequent commands. However, if other host hardware can access the
 	// buffer, we need to wait for the transfer to complete for consistency.
-	// TODO(b/136733358): Support returning fences from transfers
-	if (bo->meta.use_flags & BO_USE_NON_GPU_HW) {
-		waitcmd.handle = mapping->vma->handle;
+	*out_wait = bo->meta.use_flags & BO_USE_NON_GPU_HW;
+	return 0;
+}
 
-		ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_WAIT, &waitcmd);
-		if (ret) {
-			drv_loge("DRM_IOCTL_VIRTGPU_WAIT failed with %s\n", strerror(errno));
-			return -errno;
+static int virgl_bo_flush_common(struct bo *bo, struct mapping *mapping, int *out_fence)
+{
+	uint32_t handle = mapping->vma->handle;
+	bool wait;
+	int ret;
+
+	ret = virgl_bo_flush_submit(bo, mapping, &wait);
+	if (ret || !wait)
+		return ret;
+
+	// The transfer ioctls can't return fences, but an empty submission referencing
+	// the resource is ordered after the transfer and can.
+	if (out_fence && virgl_submit_fence(bo->drv, &handle, 1, out_fence) == 0)
+		return 0;
+
+	return virgl_wait_resource(bo, handle);
+}
+
+static int virgl_bo_flush(struct bo *bo, struct mapping *mapping)
+{
+	return virgl_bo_flush_common(bo, mapping, NULL);
+}
+
+static int virgl_bo_flush_fenced(struct bo *bo, struct mapping *mapping, int *out_fence)
+{
+	return virgl_bo_flush_common(bo, mapping, out_fence);
+}
+
+/*
+ * Queues the transfers of every op first, then waits once on a fence covering all the
+ * resources that have to be waited for, rather than once per op.
+ */
+static int virgl_bo_sync_batch(struct driver *drv, const struct drv_sync_op *ops, uint32_t count)
+{
+	uint32_t handles[DRV_SYNC_BATCH_MAX];
+	struct bo *bos[DRV_SYNC_BATCH_MAX];
+	uint32_t num_handles = 0;
+	int ret = 0, wait_ret = 0, op_ret, fence;
+	uint32_t i, j;
+	bool wait;
+
+	for (i = 0; i < count; i++) {
+		if (ops[i].flush)
+			op_ret = virgl_bo_flush_submit(ops[i].bo, ops[i].mapping, &wait);
+		else
+			op_ret = virgl_bo_invalidate_submit(ops[i].bo, ops[i].mapping, &wait);
+
+		if (op_ret) {
+			if (!ret)
+				ret = op_ret;
+			continue;
+		}
+
+		if (!wait)
+			continue;
+
+		for (j = 0; j < num_handles; j++) {
+			if (handles[j] == ops[i].mapping->vma->handle)
+				break;
+		}
+
+		if (j == num_handles) {
+			handles[num_handles] = ops[i].mapping->vma->handle;
+			bos[num_handles++] = ops[i].bo;
 		}
 	}
 
-	return 0;
+	if (!num_handles)
+		return ret;
+
+	if (virgl_submit_fence(drv, handles, num_handles, &fence) == 0) {
+		wait_ret = drv_sync_file_wait(fence);
+		close(fence);
+	} else {
+		for (i = 0; i < num_handles; i++) {
+			op_ret = virgl_wait_resource(bos[i], handles[i]);
+			if (op_ret && !wait_ret)
+				wait_ret = op_ret;
+		}
+	}
+
+	return ret ? ret : wait_ret;
 }
 
 static void virgl_3d_resolve_format_and_use_flags(struct driver *drv, uint32_t format,
@@ -1317,7 +1744,10 @@ const struct backend virtgpu_virgl = { .name = "virtgpu_virgl",
 				       .bo_unmap = drv_bo_munmap,
 				       .bo_invalidate = virgl_bo_invalidate,
 				       .bo_flush = virgl_bo_flush,
+				       .bo_flush_fenced = virgl_bo_flush_fenced,
+				       .bo_sync_batch = virgl_bo_sync_batch,
 				       .resolve_format_and_use_flags =
 					   virgl_resolve_format_and_use_flags,
 				       .resource_info = virgl_resource_info,
-				       .get_max_texture_2d_size = virgl_get_max_texture_2d_size };
+				       .get_max_texture_2d_size = virgl_get_max_texture_2d_size,
+				       .get_memory_info = virgl_get_memory_info };